@@ -0,0 +1,571 @@
+/** Four-wide BVH functions.
+ *
+ *  @file bvh4.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Traversing the binary bounding-box tree tests one box per node and
+ *  follows a pointer for every level.  Here the tree is collapsed so that
+ *  each node has up to four children, whose boxes are stored coordinate
+ *  by coordinate so that one SSE slab test covers all of them.
+ *
+ *  When compiled with -DBVH4_QUANTIZED, the child boxes are stored as
+ *  8-bit offsets within the node's own box, which brings a node down from
+ *  112 bytes to a single 64-byte cache line.  The boxes are decoded as
+ *  they are tested.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BVH4_QUANTIZED
+#include <math.h>
+#endif
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#if defined BVH4_QUANTIZED && defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bvh4.h"
+#include "profile.h"
+#include "debug.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+/** The child index of an empty slot.  Other negative indices are leaves:
+ *  <code>-1-i</code> is the i-th leaf.
+ */
+#define BVH4_EMPTY INT32_MIN
+
+/** The factor exit times are scaled by before they are compared with
+ *  entry times, so that rounding in the slab test cannot reject a box
+ *  that the ray only grazes.
+ */
+#define BVH4_TMAX_SCALE 1.0000004f
+
+#ifndef BVH4_QUANTIZED
+/** A node with up to four children.  Children are packed into the first
+ *  slots.
+ */
+typedef struct _bvh4_node_t {
+    /** The children's boxes, one array per face.
+     */
+    float lo_x[4], hi_x[4];
+    float lo_y[4], hi_y[4];
+    float lo_z[4], hi_z[4];
+    /** For each child, its node index, leaf index or
+     *  <code>BVH4_EMPTY</code>.
+     */
+    int32_t child[4];
+} bvh4_node_t;
+#else
+/** A node with up to four children, in one 64-byte cache line.  Children
+ *  are packed into the first slots.
+ */
+typedef struct _bvh4_node_t {
+    /** The low corner of the node's box, and the length of one step of
+     *  the child boxes' offsets along each axis.
+     */
+    float origin[3], scale[3];
+    /** The children's boxes, one array per face, in steps from
+     *  <code>origin</code>.  They are rounded outwards, so a decoded box
+     *  always contains the real one.
+     */
+    uint8_t lo_x[4], hi_x[4];
+    uint8_t lo_y[4], hi_y[4];
+    uint8_t lo_z[4], hi_z[4];
+    /** For each child, its node index, leaf index or
+     *  <code>BVH4_EMPTY</code>.
+     */
+    int32_t child[4];
+} bvh4_node_t;
+#endif
+
+struct _bvh4_t {
+    /** The nodes, with the root first.
+     */
+    bvh4_node_t* nodes;
+    /** The number of nodes, and the room for them.
+     */
+    int num_nodes, capacity;
+    /** The leaf surfaces, which are shared with the binary tree.
+     */
+    surface_t** leaves;
+    /** The number of leaves, and the room for them.
+     */
+    int num_leaves, leaf_capacity;
+    /** The number of levels of nodes.
+     */
+    int depth;
+};
+
+/** Compute the surface area of a bounding box.
+ *
+ *  @param bbox the bounding box.
+ *
+ *  @return the surface area of <code>bbox</code>.
+ */
+static float area(bbox_t* bbox) {
+    float dx = bbox->right - bbox->left;
+    float dy = bbox->top - bbox->bottom;
+    float dz = bbox->far - bbox->near;
+    return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+#ifndef BVH4_QUANTIZED
+/** Store the boxes of a node's children.
+ *
+ *  @param wide the node.
+ *  @param boxes the children's boxes.
+ *  @param count the number of children.
+ */
+static void set_boxes(bvh4_node_t* wide, bbox_t* boxes, int count) {
+    for (int k=0; k<4; ++k) {
+        // Unused slots get an empty box; their child index keeps them
+        // from being hit.
+        bbox_t b = {0, 0, 0, 0, 0, 0};
+        if (k < count) b = boxes[k];
+        wide->lo_x[k] = b.left;
+        wide->hi_x[k] = b.right;
+        wide->lo_y[k] = b.bottom;
+        wide->hi_y[k] = b.top;
+        wide->lo_z[k] = b.near;
+        wide->hi_z[k] = b.far;
+    }
+}
+#else
+/** Quantize a coordinate, rounding down.
+ *
+ *  @param v the coordinate.
+ *  @param origin the low end of the range.
+ *  @param scale the length of one step.
+ *
+ *  @return the largest number of steps from <code>origin</code> that is
+ *      not beyond <code>v</code>.
+ */
+static uint8_t quantize_down(float v, float origin, float scale) {
+    if (scale == 0) return 0;
+    int q = max(0, min(255, (int)floorf((v - origin)/scale)));
+    while (q > 0 && origin + q*scale > v) --q;
+    return q;
+}
+
+/** Quantize a coordinate, rounding up.
+ *
+ *  @param v the coordinate.
+ *  @param origin the low end of the range.
+ *  @param scale the length of one step.
+ *
+ *  @return the smallest number of steps from <code>origin</code> that is
+ *      not short of <code>v</code>.
+ */
+static uint8_t quantize_up(float v, float origin, float scale) {
+    if (scale == 0) return 0;
+    int q = max(0, min(255, (int)ceilf((v - origin)/scale)));
+    while (q < 255 && origin + q*scale < v) ++q;
+    return q;
+}
+
+/** Store the boxes of a node's children.
+ *
+ *  @param wide the node.
+ *  @param boxes the children's boxes.
+ *  @param count the number of children.
+ */
+static void set_boxes(bvh4_node_t* wide, bbox_t* boxes, int count) {
+    uint8_t* qlo[3] = {wide->lo_x, wide->lo_y, wide->lo_z};
+    uint8_t* qhi[3] = {wide->hi_x, wide->hi_y, wide->hi_z};
+    for (int a=0; a<3; ++a) {
+        float lo[4], hi[4];
+        float origin = INFINITY, end = -INFINITY;
+        for (int k=0; k<count; ++k) {
+            bbox_t* b = &boxes[k];
+            lo[k] = a == 0 ? b->left : a == 1 ? b->bottom : b->near;
+            hi[k] = a == 0 ? b->right : a == 1 ? b->top : b->far;
+            origin = min(origin, lo[k]);
+            end = max(end, hi[k]);
+        }
+
+        // Make sure that 255 steps reach the far side after rounding.
+        float scale = (end - origin)/255;
+        while (origin + 255*scale < end) scale = nextafterf(scale, INFINITY);
+        wide->origin[a] = origin;
+        wide->scale[a] = scale;
+
+        for (int k=0; k<4; ++k) {
+            qlo[a][k] = k < count ? quantize_down(lo[k], origin, scale) : 0;
+            qhi[a][k] = k < count ? quantize_up(hi[k], origin, scale) : 0;
+        }
+    }
+}
+#endif
+
+/** Add a wide node for a binary node and the binary nodes it replaces.
+ *
+ *  @param bvh the BVH being built.
+ *  @param node a BBT node.
+ *  @param depth the level of the new node, with the root at 1.
+ *
+ *  @return the index of the new node.
+ */
+static int collapse(bvh4_t* bvh, surface_t* node, int depth) {
+    if (depth > bvh->depth) bvh->depth = depth;
+    if (bvh->num_nodes == bvh->capacity) {
+        bvh->capacity *= 2;
+        bvh->nodes = realloc(bvh->nodes,
+                bvh->capacity*sizeof(bvh4_node_t));
+    }
+    int index = bvh->num_nodes++;
+
+    surface_t* kids[4];
+    int count = 0;
+    surface_t *left, *right;
+    bbt_children(node, &left, &right);
+    if (left != NULL) kids[count++] = left;
+    if (right != NULL) kids[count++] = right;
+
+    // Open the largest binary child until there are four children or
+    // only leaves are left.
+    while (count < 4) {
+        int best = -1;
+        float best_area = -1.0f;
+        for (int k=0; k<count; ++k) {
+            if (sfc_is_bbt(kids[k]) && area(kids[k]->bbox) > best_area) {
+                best = k;
+                best_area = area(kids[k]->bbox);
+            }
+        }
+        if (best < 0) break;
+
+        bbt_children(kids[best], &left, &right);
+        if (left == NULL) {
+            kids[best] = right;
+        } else {
+            kids[best] = left;
+            if (right != NULL) kids[count++] = right;
+        }
+    }
+
+    // Recursion may move the nodes, so fill in the slots through the
+    // index afterwards.
+    int32_t child[4] = {BVH4_EMPTY, BVH4_EMPTY, BVH4_EMPTY, BVH4_EMPTY};
+    for (int k=0; k<count; ++k) {
+        if (sfc_is_bbt(kids[k])) {
+            child[k] = collapse(bvh, kids[k], depth+1);
+            continue;
+        }
+        if (bvh->num_leaves == bvh->leaf_capacity) {
+            bvh->leaf_capacity *= 2;
+            bvh->leaves = realloc(bvh->leaves,
+                    bvh->leaf_capacity*sizeof(surface_t*));
+        }
+        bvh->leaves[bvh->num_leaves] = kids[k];
+        child[k] = -1 - bvh->num_leaves++;
+    }
+
+    bbox_t boxes[4];
+    for (int k=0; k<count; ++k) boxes[k] = *(kids[k]->bbox);
+    bvh4_node_t* wide = &bvh->nodes[index];
+    set_boxes(wide, boxes, count);
+    memcpy(wide->child, child, sizeof(child));
+    return index;
+}
+
+bvh4_t* make_bvh4(surface_t* root) {
+    assert(sfc_is_bbt(root));
+    bvh4_t* bvh = MALLOC1(bvh4_t);
+    bvh->num_nodes = 0;
+    bvh->capacity = 16;
+    bvh->num_leaves = 0;
+    bvh->leaf_capacity = 16;
+    bvh->depth = 0;
+    bvh->nodes = malloc(bvh->capacity*sizeof(bvh4_node_t));
+    bvh->leaves = malloc(bvh->leaf_capacity*sizeof(surface_t*));
+    collapse(bvh, root, 1);
+
+    // Move the nodes to storage that starts on a cache line, so that no
+    // node straddles two.
+    void* aligned;
+    if (posix_memalign(&aligned, 64, bvh->num_nodes*sizeof(bvh4_node_t))
+            == 0) {
+        memcpy(aligned, bvh->nodes, bvh->num_nodes*sizeof(bvh4_node_t));
+        free(bvh->nodes);
+        bvh->nodes = aligned;
+        bvh->capacity = bvh->num_nodes;
+    }
+
+    debug("make_bvh4():  %d nodes of %d bytes (%d KB), %d leaves, "
+            "%d levels", bvh->num_nodes, (int)sizeof(bvh4_node_t),
+            (int)(bvh->num_nodes*sizeof(bvh4_node_t)/1024),
+            bvh->num_leaves, bvh->depth);
+    return bvh;
+}
+
+void bvh4_refit(bvh4_t* bvh) {
+    // Every node comes before its children, so going backwards finds
+    // each node's children already refitted.
+    bbox_t* node_boxes = malloc(bvh->num_nodes*sizeof(bbox_t));
+    for (int i=bvh->num_nodes-1; i>=0; --i) {
+        bvh4_node_t* wide = &bvh->nodes[i];
+        bbox_t boxes[4];
+        int count = 0;
+        while (count < 4 && wide->child[count] != BVH4_EMPTY) {
+            int32_t c = wide->child[count];
+            boxes[count++] = c < 0 ? *(bvh->leaves[-1-c]->bbox)
+                    : node_boxes[c];
+        }
+        set_boxes(wide, boxes, count);
+
+        bbox_t* b = &node_boxes[i];
+        *b = boxes[0];
+        for (int k=1; k<count; ++k) {
+            b->left = min(b->left, boxes[k].left);
+            b->right = max(b->right, boxes[k].right);
+            b->bottom = min(b->bottom, boxes[k].bottom);
+            b->top = max(b->top, boxes[k].top);
+            b->near = min(b->near, boxes[k].near);
+            b->far = max(b->far, boxes[k].far);
+        }
+    }
+    free(node_boxes);
+}
+
+void bvh4_free(bvh4_t* bvh) {
+    if (bvh == NULL) return;
+    free(bvh->nodes);
+    free(bvh->leaves);
+    free(bvh);
+}
+
+/** Find the children of a node that are used.
+ *
+ *  @param node the node.
+ *
+ *  @return a bit mask of the slots of <code>node</code> that hold
+ *      children.
+ */
+static inline int child_mask(bvh4_node_t* node) {
+    int mask = 0;
+    for (int k=0; k<4; ++k) {
+        if (node->child[k] != BVH4_EMPTY) mask |= 1 << k;
+    }
+    return mask;
+}
+
+#if defined BVH4_QUANTIZED && defined __SSE2__
+/** Decode one face of four quantized boxes.
+ *
+ *  @param q the four offsets.
+ *  @param origin the low end of the range.
+ *  @param scale the length of one step.
+ *
+ *  @return the coordinates of the four faces.
+ */
+static inline __m128 decode4(uint8_t* q, float origin, float scale) {
+    int32_t packed;
+    memcpy(&packed, q, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i b = _mm_cvtsi32_si128(packed);
+    b = _mm_unpacklo_epi16(_mm_unpacklo_epi8(b, zero), zero);
+    return _mm_add_ps(_mm_set1_ps(origin),
+            _mm_mul_ps(_mm_cvtepi32_ps(b), _mm_set1_ps(scale)));
+}
+#endif
+
+/** Test a ray against the four child boxes of a node.
+ *
+ *  @param node the node.
+ *  @param org the ray's base.
+ *  @param inv the reciprocals of the components of the ray's direction.
+ *  @param t0 the start of the interval to test.
+ *  @param t1 the end of the interval to test.
+ *  @param tnear filled with the time each box is entered.
+ *
+ *  @return a bit mask of the children whose boxes the ray passes
+ *      through in [<code>t0</code>, <code>t1</code>].
+ */
+static inline int hit_boxes(bvh4_node_t* node, float* org, float* inv,
+        float t0, float t1, float* tnear) {
+#if defined __SSE__ && (!defined BVH4_QUANTIZED || defined __SSE2__)
+    __m128 tmin = _mm_set1_ps(t0);
+    __m128 tmax = _mm_set1_ps(t1);
+    for (int a=0; a<3; ++a) {
+#ifndef BVH4_QUANTIZED
+        float* lo[3] = {node->lo_x, node->lo_y, node->lo_z};
+        float* hi[3] = {node->hi_x, node->hi_y, node->hi_z};
+        __m128 lo_a = _mm_loadu_ps(lo[a]);
+        __m128 hi_a = _mm_loadu_ps(hi[a]);
+#else
+        uint8_t* lo[3] = {node->lo_x, node->lo_y, node->lo_z};
+        uint8_t* hi[3] = {node->hi_x, node->hi_y, node->hi_z};
+        __m128 lo_a = decode4(lo[a], node->origin[a], node->scale[a]);
+        __m128 hi_a = decode4(hi[a], node->origin[a], node->scale[a]);
+#endif
+        __m128 o = _mm_set1_ps(org[a]);
+        __m128 s = _mm_set1_ps(inv[a]);
+        __m128 ta = _mm_mul_ps(_mm_sub_ps(lo_a, o), s);
+        __m128 tb = _mm_mul_ps(_mm_sub_ps(hi_a, o), s);
+        tmin = _mm_max_ps(tmin, _mm_min_ps(ta, tb));
+        tmax = _mm_min_ps(tmax, _mm_max_ps(ta, tb));
+    }
+    _mm_storeu_ps(tnear, tmin);
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(BVH4_TMAX_SCALE));
+    int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    int mask = 0;
+    for (int k=0; k<4; ++k) {
+#ifndef BVH4_QUANTIZED
+        float lo[3] = {node->lo_x[k], node->lo_y[k], node->lo_z[k]};
+        float hi[3] = {node->hi_x[k], node->hi_y[k], node->hi_z[k]};
+#else
+        uint8_t qlo[3] = {node->lo_x[k], node->lo_y[k], node->lo_z[k]};
+        uint8_t qhi[3] = {node->hi_x[k], node->hi_y[k], node->hi_z[k]};
+        float lo[3], hi[3];
+        for (int a=0; a<3; ++a) {
+            lo[a] = node->origin[a] + (float)qlo[a]*node->scale[a];
+            hi[a] = node->origin[a] + (float)qhi[a]*node->scale[a];
+        }
+#endif
+        float tmin = t0, tmax = t1;
+        for (int a=0; a<3; ++a) {
+            float ta = (lo[a] - org[a])*inv[a];
+            float tb = (hi[a] - org[a])*inv[a];
+            tmin = max(tmin, min(ta, tb));
+            tmax = min(tmax, max(ta, tb));
+        }
+        tnear[k] = tmin;
+        if (tmin <= tmax*BVH4_TMAX_SCALE) mask |= 1 << k;
+    }
+#endif
+    return mask & child_mask(node);
+}
+
+bool bvh4_hit(bvh4_t* bvh, ray3_t* ray, float t0, float t1,
+        hit_record_t* hit) {
+    return bvh4_hit_from(bvh, 0, ray, t0, t1, hit);
+}
+
+bool bvh4_hit_from(bvh4_t* bvh, int entry, ray3_t* ray, float t0, float t1,
+        hit_record_t* hit) {
+    // Entry points past the nodes are leaves.
+    if (entry >= bvh->num_nodes) {
+        surface_t* leaf = bvh->leaves[entry - bvh->num_nodes];
+        hit_record_t rec;
+        if (!sfc_hit(leaf, ray, t0, t1, &rec)) return false;
+        *hit = rec;
+        return true;
+    }
+
+    float org[3] = {ray->base.x, ray->base.y, ray->base.z};
+    float inv[3] = {1.0f/ray->dir.x, 1.0f/ray->dir.y, 1.0f/ray->dir.z};
+
+    // Nodes waiting to be visited, with the times their boxes are entered.
+    // Visiting a node pops one and pushes at most four.
+    int stack[3*bvh->depth + 1];
+    float stack_t[3*bvh->depth + 1];
+    int sp = 0;
+    stack[sp] = entry;
+    stack_t[sp++] = t0;
+
+    bool hit_something = false;
+    while (sp > 0) {
+        --sp;
+        // Skip nodes that are behind the closest hit found since they
+        // were pushed.
+        if (stack_t[sp] > t1) continue;
+        bvh4_node_t* node = &bvh->nodes[stack[sp]];
+        PROFILE_NODE("bvh4 node");
+
+        float tnear[4];
+        int mask = hit_boxes(node, org, inv, t0, t1, tnear);
+        if (mask == 0) continue;
+
+        // Sort the children that were hit, nearest first.
+        int order[4], n = 0;
+        for (int k=0; k<4; ++k) {
+            if (!(mask & (1 << k))) continue;
+            int i = n++;
+            while (i > 0 && tnear[order[i-1]] > tnear[k]) {
+                order[i] = order[i-1];
+                --i;
+            }
+            order[i] = k;
+        }
+
+        // Test leaves now, nearest first, so that t1 shrinks before any
+        // boxes are pushed.  Some hit functions write to the record even
+        // when they miss, so each gets its own.
+        for (int i=0; i<n; ++i) {
+            int k = order[i];
+            if (node->child[k] >= 0 || tnear[k] > t1) continue;
+            hit_record_t rec;
+            surface_t* leaf = bvh->leaves[-1 - node->child[k]];
+            if (sfc_hit(leaf, ray, t0, t1, &rec)) {
+                hit_something = true;
+                *hit = rec;
+                t1 = rec.t;
+            }
+        }
+
+        // Push nodes farthest first, so the nearest is visited next.
+        for (int i=n-1; i>=0; --i) {
+            int k = order[i];
+            if (node->child[k] < 0 || tnear[k] > t1) continue;
+            stack[sp] = node->child[k];
+            stack_t[sp++] = tnear[k];
+        }
+    }
+    return hit_something;
+}
+
+/** Get the box of a child of a node.
+ *
+ *  @param node the node.
+ *  @param k the child's slot.
+ *  @param box filled with the child's box.
+ */
+static void child_box(bvh4_node_t* node, int k, bbox_t* box) {
+#ifndef BVH4_QUANTIZED
+    *box = (bbox_t){node->lo_x[k], node->hi_x[k], node->lo_y[k],
+        node->hi_y[k], node->lo_z[k], node->hi_z[k]};
+#else
+    *box = (bbox_t){
+        node->origin[0] + (float)node->lo_x[k]*node->scale[0],
+        node->origin[0] + (float)node->hi_x[k]*node->scale[0],
+        node->origin[1] + (float)node->lo_y[k]*node->scale[1],
+        node->origin[1] + (float)node->hi_y[k]*node->scale[1],
+        node->origin[2] + (float)node->lo_z[k]*node->scale[2],
+        node->origin[2] + (float)node->hi_z[k]*node->scale[2],
+    };
+#endif
+}
+
+int bvh4_frustum_entry(bvh4_t* bvh, frustum_t* frustum) {
+    int index = 0;
+    while (true) {
+        bvh4_node_t* node = &bvh->nodes[index];
+        int count = 0, inside = -1;
+        for (int k=0; k<4; ++k) {
+            if (node->child[k] == BVH4_EMPTY) continue;
+            bbox_t box;
+            child_box(node, k, &box);
+            if (!bbox_in_frustum(&box, frustum)) continue;
+            ++count;
+            inside = k;
+        }
+        if (count == 0) return -1;
+        if (count > 1) return index;
+
+        int32_t child = node->child[inside];
+        if (child < 0) return bvh->num_nodes + (-1 - child);
+        index = child;
+    }
+}
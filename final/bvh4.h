@@ -0,0 +1,97 @@
+/** @file bvh4.h Four-wide bounding volume hierarchy, collapsed from a
+ *  binary bounding-box tree, for tracing single rays.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef BVH4_H
+#define BVH4_H
+
+#include <stdbool.h>
+
+#include "geom356.h"
+
+#include "surface.h"
+
+/** The type of a four-wide BVH.  The structure is private to bvh4.c.
+ */
+typedef struct _bvh4_t bvh4_t;
+
+/** Collapse a binary bounding-box tree into a four-wide BVH.  Each wide
+ *  node takes the place of up to three levels of the binary tree: its
+ *  children are found by repeatedly opening the binary child with the
+ *  largest box, until there are four.  The leaves are the binary tree's
+ *  leaves, which are shared, not copied.
+ *
+ *  @param root the root of a tree made by <code>make_bbt_node()</code>.
+ *
+ *  @return the wide BVH.  It must be refitted whenever the binary tree is
+ *      refitted, and rebuilt whenever the binary tree is changed.
+ */
+bvh4_t* make_bvh4(surface_t* root);
+
+/** Refit a wide BVH to the current boxes of its leaves, in place.  The
+ *  child boxes of each node are recomputed from the bottom up; the shape
+ *  of the tree is kept, so after large motions it may be worse than a
+ *  new one collapsed from a rebuilt binary tree.
+ *
+ *  @param bvh the BVH.
+ */
+void bvh4_refit(bvh4_t* bvh);
+
+/** Free a wide BVH.  The leaves are not freed.
+ *
+ *  @param bvh the BVH, or <code>NULL</code>.
+ */
+void bvh4_free(bvh4_t* bvh);
+
+/** Find the closest intersection of a ray with the leaves of a wide BVH.
+ *  All four child boxes of a node are tested at once, and the children
+ *  that are hit are visited nearest first; boxes beyond the closest hit
+ *  found so far are skipped.
+ *
+ *  @param bvh the BVH.
+ *  @param ray the ray.
+ *  @param t0 the minimum time for which to consider intersections valid.
+ *  @param t1 the maximum time for which to consider intersections valid.
+ *  @param hit filled in as by <code>sfc_hit()</code>.
+ *
+ *  @return <code>true</code> if <code>ray</code> hits a leaf in the
+ *      interval [<code>t0</code>, <code>t1</code>].
+ */
+bool bvh4_hit(bvh4_t* bvh, ray3_t* ray, float t0, float t1,
+        hit_record_t* hit);
+
+/** Find the deepest node of a wide BVH whose subtree holds every leaf
+ *  that a frustum may meet.  Starting from the root, the search follows
+ *  the one child whose box meets the frustum, and stops at a node with
+ *  two or more such children, or at a leaf.
+ *
+ *  @param bvh the BVH.
+ *  @param frustum the frustum.
+ *
+ *  @return <code>-1</code> if the frustum meets no leaf's box, otherwise
+ *      the entry point to pass to <code>bvh4_hit_from()</code>;
+ *      <code>0</code> is the root.
+ */
+int bvh4_frustum_entry(bvh4_t* bvh, frustum_t* frustum);
+
+/** <code>bvh4_hit()</code> for a ray inside a frustum, starting from the
+ *  entry point that <code>bvh4_frustum_entry()</code> found for the
+ *  frustum rather than from the root.
+ *
+ *  @param bvh the BVH.
+ *  @param entry the entry point, which is not <code>-1</code>.
+ *  @param ray the ray.
+ *  @param t0 the minimum time for which to consider intersections valid.
+ *  @param t1 the maximum time for which to consider intersections valid.
+ *  @param hit filled in as by <code>sfc_hit()</code>.
+ *
+ *  @return <code>true</code> if <code>ray</code> hits a leaf in the
+ *      interval [<code>t0</code>, <code>t1</code>].
+ */
+bool bvh4_hit_from(bvh4_t* bvh, int entry, ray3_t* ray, float t0, float t1,
+        hit_record_t* hit);
+
+#endif
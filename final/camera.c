@@ -0,0 +1,80 @@
+/** Primary ray generation.
+ *
+ *  @file camera.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  The old win2world() recomputed the view-plane corners and transformed a
+ *  vector from the camera frame to the world frame for every pixel.  Since that
+ *  transform is linear, the direction through any pixel is a fixed corner
+ *  vector plus multiples of two per-pixel step vectors, which are
+ *  computed once per frame here.
+ */
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "camera.h"
+#include "debug.h"
+
+void camera_setup(camera_t* cam, point3_t* eye, vector3_t* u, vector3_t* v,
+        vector3_t* w, float dist, float vp_width, float vp_height,
+        int width, int height) {
+    // Compute coordinates in eye frame of corners of view plane.
+    float left = -vp_width/2.0f;
+    float bottom = -vp_height/2.0f;
+
+    cam->eye = *eye;
+
+    // corner = left*u + bottom*v - dist*w.
+    cam->corner.x = left*u->x + bottom*v->x - dist*w->x;
+    cam->corner.y = left*u->y + bottom*v->y - dist*w->y;
+    cam->corner.z = left*u->z + bottom*v->z - dist*w->z;
+
+    multiply(u, vp_width/width, &cam->du);
+    multiply(v, vp_height/height, &cam->dv);
+
+    debug("camera_setup():  corner = (%f, %f, %f)",
+            cam->corner.x, cam->corner.y, cam->corner.z);
+}
+
+void camera_dir(camera_t* cam, float x, float y, vector3_t* dir) {
+    dir->x = cam->corner.x + x*cam->du.x + y*cam->dv.x;
+    dir->y = cam->corner.y + x*cam->du.y + y*cam->dv.y;
+    dir->z = cam->corner.z + x*cam->du.z + y*cam->dv.z;
+}
+
+void camera_row(camera_t* cam, int y, int x0, int n,
+        float* dx, float* dy, float* dz) {
+    // Direction through the left edge of the row, at the pixel centers'
+    // height, shifted half a pixel so that adding x*du lands on centers.
+    float fy = y + .5f;
+    float rx = cam->corner.x + fy*cam->dv.x + .5f*cam->du.x;
+    float ry = cam->corner.y + fy*cam->dv.y + .5f*cam->du.y;
+    float rz = cam->corner.z + fy*cam->dv.z + .5f*cam->du.z;
+
+    int i = 0;
+#ifdef __SSE__
+    __m128 row_x = _mm_set1_ps(rx);
+    __m128 row_y = _mm_set1_ps(ry);
+    __m128 row_z = _mm_set1_ps(rz);
+    __m128 du_x = _mm_set1_ps(cam->du.x);
+    __m128 du_y = _mm_set1_ps(cam->du.y);
+    __m128 du_z = _mm_set1_ps(cam->du.z);
+    __m128 xs = _mm_setr_ps(x0, x0+1, x0+2, x0+3);
+    __m128 four = _mm_set1_ps(4.0f);
+    for (; i+4 <= n; i += 4) {
+        _mm_storeu_ps(dx+i, _mm_add_ps(row_x, _mm_mul_ps(xs, du_x)));
+        _mm_storeu_ps(dy+i, _mm_add_ps(row_y, _mm_mul_ps(xs, du_y)));
+        _mm_storeu_ps(dz+i, _mm_add_ps(row_z, _mm_mul_ps(xs, du_z)));
+        xs = _mm_add_ps(xs, four);
+    }
+#endif
+    for (; i<n; ++i) {
+        float x = x0 + i;
+        dx[i] = rx + x*cam->du.x;
+        dy[i] = ry + x*cam->du.y;
+        dz[i] = rz + x*cam->du.z;
+    }
+}
@@ -0,0 +1,81 @@
+/** @file camera.h Generation of primary (viewing) rays.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "geom356.h"
+
+/** The type of a camera.  The structure is exposed below.
+ */
+typedef struct _camera_t camera_t;
+
+/** A camera, reduced to the vectors needed to step from pixel to pixel.
+ *  The direction of the viewing ray through window position
+ *  <i>(x, y)</i> (in pixels, with pixel centers at half-integers) is
+ *  <code>corner + x*du + y*dv</code>.  Directions are not normalized;
+ *  the view plane is at <i>t = 1</i>.
+ */
+struct _camera_t {
+    /** The viewpoint.
+     */
+    point3_t eye;
+    /** Direction from the eye to the bottom-left corner of the view plane.
+     */
+    vector3_t corner;
+    /** The change in direction from one pixel to the next along a row.
+     */
+    vector3_t du;
+    /** The change in direction from one row to the next.
+     */
+    vector3_t dv;
+};
+
+/** Compute the pixel-step vectors for a camera.  This should be done
+ *  once per frame (or whenever the view or window size changes).
+ *
+ *  @param cam the camera to fill in.
+ *  @param eye the viewpoint.
+ *  @param u the camera frame <i>u</i> basis vector.
+ *  @param v the camera frame <i>v</i> basis vector.
+ *  @param w the camera frame <i>w</i> basis vector.
+ *  @param dist the distance from the viewpoint to the view plane.
+ *  @param vp_width the width of the view plane.
+ *  @param vp_height the height of the view plane.
+ *  @param width the width of the window in pixels.
+ *  @param height the height of the window in pixels.
+ */
+void camera_setup(camera_t* cam, point3_t* eye, vector3_t* u, vector3_t* v,
+        vector3_t* w, float dist, float vp_width, float vp_height,
+        int width, int height);
+
+/** Compute the direction of the viewing ray through a window position.
+ *  Positions need not be pixel centers, so this can be used for
+ *  jittered sub-pixel samples.
+ *
+ *  @param cam the camera.
+ *  @param x the x-position on the window, in pixels from the left edge.
+ *  @param y the y-position on the window, in pixels from the bottom edge.
+ *  @param dir filled with the ray direction.
+ */
+void camera_dir(camera_t* cam, float x, float y, vector3_t* dir);
+
+/** Compute the directions of the viewing rays through the centers of a
+ *  run of pixels in one row.  Directions are stored in structure-of-arrays
+ *  form and computed four at a time where SSE is available.
+ *
+ *  @param cam the camera.
+ *  @param y the row.
+ *  @param x0 the first column.
+ *  @param n the number of pixels.
+ *  @param dx filled with the x-components of the directions.
+ *  @param dy filled with the y-components of the directions.
+ *  @param dz filled with the z-components of the directions.
+ */
+void camera_row(camera_t* cam, int y, int x0, int n,
+        float* dx, float* dy, float* dz);
+
+#endif
@@ -0,0 +1,279 @@
+/** Denoising functions.
+ *
+ *  @file denoise.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  The frame and g-buffer are copied into planes, one per component, with
+ *  a border wide enough for the farthest taps of the last pass.  The
+ *  border shows a surface of its own, so its weight is always 0 and the
+ *  taps need no bounds checks.  Each pass then filters a run of pixels
+ *  of a row at a time: eight with -mavx, four with SSE, and one
+ *  otherwise.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "debug.h"
+#include "denoise.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+#ifdef _OPENMP
+#define OMP(directive) _Pragma(#directive)
+#else
+#define OMP(directive)
+#endif
+
+/** The scales of the differences of normal (one minus the cosine of the
+ *  angle between normals), depth (relative to the pixel's depth and the
+ *  spacing of the taps) and brightness at which a neighbor's weight falls
+ *  to 0.  The brightness scale halves with each pass, since each pass
+ *  leaves less noise for the next.
+ */
+#define SIGMA_NORMAL .1f
+#define SIGMA_DEPTH .02f
+#define SIGMA_BRIGHTNESS 1.0f
+
+/** The id of the border around the planes.
+ */
+#define BORDER_ID -2.0f
+
+// Vector operations on LANES pixels at a time.
+#if defined __AVX__
+#define LANES 8
+typedef __m256 vec_t;
+#define vset1 _mm256_set1_ps
+#define vload _mm256_loadu_ps
+#define vstore _mm256_storeu_ps
+#define vadd _mm256_add_ps
+#define vsub _mm256_sub_ps
+#define vmul _mm256_mul_ps
+#define vdiv _mm256_div_ps
+#define vmax _mm256_max_ps
+#define vabs(a) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a)
+#define vkeep_if_eq(a, x, y) _mm256_and_ps(_mm256_cmp_ps(x, y, _CMP_EQ_OQ), a)
+#elif defined __SSE__
+#define LANES 4
+typedef __m128 vec_t;
+#define vset1 _mm_set1_ps
+#define vload _mm_loadu_ps
+#define vstore _mm_storeu_ps
+#define vadd _mm_add_ps
+#define vsub _mm_sub_ps
+#define vmul _mm_mul_ps
+#define vdiv _mm_div_ps
+#define vmax _mm_max_ps
+#define vabs(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), a)
+#define vkeep_if_eq(a, x, y) _mm_and_ps(_mm_cmpeq_ps(x, y), a)
+#else
+#define LANES 1
+typedef float vec_t;
+#define vset1(a) (a)
+#define vload(p) (*(p))
+#define vstore(p, a) (*(p) = (a))
+#define vadd(a, b) ((a) + (b))
+#define vsub(a, b) ((a) - (b))
+#define vmul(a, b) ((a) * (b))
+#define vdiv(a, b) ((a) / (b))
+#define vmax(a, b) ((a) > (b) ? (a) : (b))
+#define vabs(a) fabsf(a)
+#define vkeep_if_eq(a, x, y) ((x) == (y) ? (a) : 0.0f)
+#endif
+
+/** The planes of a frame and its g-buffer, with a border.
+ */
+typedef struct _planes_t {
+    /** The width of the border, and the distance from one row of a plane
+     *  to the next.
+     */
+    int border, stride;
+    float *nx, *ny, *nz, *depth, *id;
+    /** The color, and the color filtered by the current pass.
+     */
+    float *r, *g, *b;
+    float *r_out, *g_out, *b_out;
+} planes_t;
+
+gbuffer_t* make_gbuffer(int width, int height) {
+    gbuffer_t* g = MALLOC1(gbuffer_t);
+    g->width = width;
+    g->height = height;
+    size_t n = (size_t)width*height;
+    g->normal_x = calloc(n, sizeof(float));
+    g->normal_y = calloc(n, sizeof(float));
+    g->normal_z = calloc(n, sizeof(float));
+    g->depth = calloc(n, sizeof(float));
+    g->id = malloc(n*sizeof(float));
+    for (size_t i=0; i<n; ++i) g->id[i] = -1.0f;
+    return g;
+}
+
+void gbuffer_free(gbuffer_t* g) {
+    if (g == NULL) return;
+    free(g->normal_x);
+    free(g->normal_y);
+    free(g->normal_z);
+    free(g->depth);
+    free(g->id);
+    free(g);
+}
+
+/** Make the planes for a frame.  Pixels where no surface is seen are
+ *  given the normal (0, 0, 1), like the border, so that they match each
+ *  other and no weight is 0/0.
+ *
+ *  @param p the planes to fill in.
+ *  @param frame the frame.
+ *  @param g the frame's g-buffer.
+ *  @param border the width of the border.
+ */
+static void make_planes(planes_t* p, framebuffer_t* frame, gbuffer_t* g,
+        int border) {
+    int width = frame->width, height = frame->height;
+    p->border = border;
+    p->stride = border + (width + LANES - 1)/LANES*LANES + border;
+    size_t n = (size_t)p->stride*(height + 2*border);
+    float** planes[] = {&p->nx, &p->ny, &p->nz, &p->depth, &p->id, &p->r,
+        &p->g, &p->b, &p->r_out, &p->g_out, &p->b_out};
+    for (size_t k=0; k<sizeof(planes)/sizeof(planes[0]); ++k) {
+        *planes[k] = calloc(n, sizeof(float));
+    }
+    for (size_t i=0; i<n; ++i) {
+        p->nz[i] = 1.0f;
+        p->id[i] = BORDER_ID;
+    }
+
+    for (int y=0; y<height; ++y) {
+        size_t row = (size_t)(y + border)*p->stride + border;
+        for (int x=0; x<width; ++x) {
+            size_t i = row + x, j = (size_t)y*width + x;
+            if (g->id[j] >= 0) {
+                p->nx[i] = g->normal_x[j];
+                p->ny[i] = g->normal_y[j];
+                p->nz[i] = g->normal_z[j];
+            }
+            p->depth[i] = g->depth[j];
+            p->id[i] = g->id[j];
+            color_t* c = fb_pixel(frame, x, y);
+            p->r[i] = c->red;
+            p->g[i] = c->green;
+            p->b[i] = c->blue;
+        }
+    }
+}
+
+static void planes_free(planes_t* p) {
+    float* planes[] = {p->nx, p->ny, p->nz, p->depth, p->id, p->r, p->g,
+        p->b, p->r_out, p->g_out, p->b_out};
+    for (size_t k=0; k<sizeof(planes)/sizeof(planes[0]); ++k) {
+        free(planes[k]);
+    }
+}
+
+/** Filter one row of the planes, from the color planes into the output
+ *  color planes.
+ *
+ *  @param p the planes.
+ *  @param y the row.
+ *  @param width the width of the frame.
+ *  @param step the distance between taps.
+ *  @param inv_sigma_brightness the reciprocal of the brightness scale.
+ */
+static void filter_row(planes_t* p, int y, int width, int step,
+        float inv_sigma_brightness) {
+    // The B3-spline wavelet, by distance from the center.
+    static const float kernel[3] = {3.0f/8, 1.0f/4, 1.0f/16};
+
+    vec_t one = vset1(1.0f), zero = vset1(0.0f);
+    vec_t inv_sigma_n = vset1(1.0f/SIGMA_NORMAL);
+    vec_t inv_sigma_l = vset1(inv_sigma_brightness);
+    vec_t depth_scale = vset1(SIGMA_DEPTH*step);
+    vec_t lr = vset1(.299f), lg = vset1(.587f), lb = vset1(.114f);
+
+    size_t row = (size_t)(y + p->border)*p->stride + p->border;
+    for (int x=0; x<width; x+=LANES) {
+        size_t i = row + x;
+        vec_t nx = vload(p->nx + i), ny = vload(p->ny + i),
+              nz = vload(p->nz + i), id = vload(p->id + i);
+        vec_t depth = vload(p->depth + i);
+        vec_t inv_depth = vdiv(one, vadd(vmul(depth_scale, depth),
+                    vset1(1e-6f)));
+        vec_t lum = vadd(vadd(vmul(lr, vload(p->r + i)),
+                    vmul(lg, vload(p->g + i))), vmul(lb, vload(p->b + i)));
+
+        vec_t sum_w = zero, sum_r = zero, sum_g = zero, sum_b = zero;
+        for (int dy=-2; dy<=2; ++dy) {
+            for (int dx=-2; dx<=2; ++dx) {
+                size_t j = i + (ptrdiff_t)dy*step*p->stride + dx*step;
+                vec_t r = vload(p->r + j), g = vload(p->g + j),
+                      b = vload(p->b + j);
+
+                vec_t cosine = vadd(vadd(vmul(nx, vload(p->nx + j)),
+                            vmul(ny, vload(p->ny + j))),
+                        vmul(nz, vload(p->nz + j)));
+                vec_t d_normal = vmul(vsub(one, cosine), inv_sigma_n);
+                vec_t d_depth = vmul(vabs(vsub(depth, vload(p->depth + j))),
+                        inv_depth);
+                vec_t lum_j = vadd(vadd(vmul(lr, r), vmul(lg, g)),
+                        vmul(lb, b));
+                vec_t d_lum = vmul(vabs(vsub(lum, lum_j)), inv_sigma_l);
+
+                // (1 - d)^2 for a total difference d below 1, which falls
+                // off like exp(-2d) near 0 but reaches 0.
+                vec_t w = vmax(zero, vsub(one, vadd(vadd(d_normal, d_depth),
+                                d_lum)));
+                w = vmul(vmul(w, w), vset1(kernel[abs(dx)]*kernel[abs(dy)]));
+                w = vkeep_if_eq(w, id, vload(p->id + j));
+
+                sum_w = vadd(sum_w, w);
+                sum_r = vadd(sum_r, vmul(w, r));
+                sum_g = vadd(sum_g, vmul(w, g));
+                sum_b = vadd(sum_b, vmul(w, b));
+            }
+        }
+
+        // The center always has a weight, so sum_w > 0.
+        vstore(p->r_out + i, vdiv(sum_r, sum_w));
+        vstore(p->g_out + i, vdiv(sum_g, sum_w));
+        vstore(p->b_out + i, vdiv(sum_b, sum_w));
+    }
+}
+
+void denoise_frame(framebuffer_t* frame, gbuffer_t* g, int passes) {
+    if (passes <= 0) return;
+    int width = frame->width, height = frame->height;
+    planes_t p;
+    make_planes(&p, frame, g, 2 << (passes-1));
+
+    for (int pass=0; pass<passes; ++pass) {
+        int step = 1 << pass;
+        float inv_sigma_brightness = step/SIGMA_BRIGHTNESS;
+        OMP(omp parallel for schedule(static))
+        for (int y=0; y<height; ++y) {
+            filter_row(&p, y, width, step, inv_sigma_brightness);
+        }
+
+        float* t;
+        t = p.r; p.r = p.r_out; p.r_out = t;
+        t = p.g; p.g = p.g_out; p.g_out = t;
+        t = p.b; p.b = p.b_out; p.b_out = t;
+    }
+
+    for (int y=0; y<height; ++y) {
+        size_t row = (size_t)(y + p.border)*p.stride + p.border;
+        for (int x=0; x<width; ++x) {
+            *fb_pixel(frame, x, y) =
+                (color_t){p.r[row + x], p.g[row + x], p.b[row + x]};
+        }
+    }
+    planes_free(&p);
+}
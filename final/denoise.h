@@ -0,0 +1,76 @@
+/** @file denoise.h Edge-aware denoising of rendered frames.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Frames rendered with few samples per pixel are noisy where the samples
+ *  disagree: at edges, and in lighting that is importance-sampled.
+ *  denoise_frame() smooths the noise with an edge-avoiding a-trous
+ *  wavelet filter (Dammertz et al., "Edge-Avoiding A-Trous Wavelet
+ *  Transform for fast Global Illumination Filtering", HPG 2010).  It is
+ *  guided by a g-buffer holding the normal, depth and material of the
+ *  first surface seen through each pixel, so that it averages pixels of
+ *  the same surface and stops at the edges between surfaces.
+ */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "framebuffer.h"
+
+/** The type of a g-buffer.  The structure is exposed below.
+ */
+typedef struct _gbuffer_t gbuffer_t;
+
+/** The first surface seen through each pixel of a frame.  Each array has
+ *  a value for each pixel, in rows from the bottom, like
+ *  <code>fb_pixel()</code>.
+ */
+struct _gbuffer_t {
+    /** The width and height of the frame in pixels.
+     */
+    int width, height;
+    /** The unit surface normal, or 0 where no surface is seen.
+     */
+    float *normal_x, *normal_y, *normal_z;
+    /** The distance to the surface along the viewing ray, or 0 where no
+     *  surface is seen.
+     */
+    float* depth;
+    /** A number identifying the material of the surface, the same for
+     *  every pixel of surfaces that look alike and most likely different
+     *  for surfaces that do not, or -1 where no surface is seen.  It is a
+     *  float below 2<sup>24</sup>, so it is compared exactly.
+     */
+    float* id;
+};
+
+/** Create a g-buffer with no surface seen through any pixel.
+ *
+ *  @param width the width of the frame in pixels.
+ *  @param height the height of the frame in pixels.
+ */
+gbuffer_t* make_gbuffer(int width, int height);
+
+/** Free a g-buffer.
+ *
+ *  @param g the g-buffer.
+ */
+void gbuffer_free(gbuffer_t* g);
+
+/** Denoise a frame in place.  Each pass takes a weighted average of a 5x5
+ *  grid of pixels around each pixel, with the pixels of the grid twice as
+ *  far apart as in the pass before.  A neighbor's weight falls off with
+ *  the difference of its normal, depth and brightness from the pixel's,
+ *  and is 0 if it shows a different material.  The passes are vectorized
+ *  with SSE or AVX, and their rows are split between threads when
+ *  compiled with -fopenmp.
+ *
+ *  @param frame the frame.
+ *  @param g the g-buffer of the frame.
+ *  @param passes the number of passes; 5 passes cover a 125x125 square
+ *      around each pixel.
+ */
+void denoise_frame(framebuffer_t* frame, gbuffer_t* g, int passes);
+
+#endif
@@ -0,0 +1,173 @@
+/** A report of the error and time of denoised renders.
+ *
+ *  @file denoise_report.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Renders each scene without a window at REFERENCE_SAMPLES rays per
+ *  pixel, shading every light, as the reference.  Then, for 1, 4, 16 and
+ *  64 rays per pixel with importance-sampled lights, it renders the scene
+ *  with and without the denoiser in denoise.c, and prints the time and
+ *  the RMS error against the reference of each.  A denoised render is
+ *  good enough when its error is no more than that of a noisy render
+ *  with many more rays.  E.g.,
+ *
+ *      $ make denoise_report && ./denoise_report
+ *      $ ./denoise_report -p 4 -w /tmp chess    # 4 passes, save images
+ *
+ *  Usage:  denoise_report [-p passes] [-l light_samples] [-w dir]
+ *  [scene...].  The defaults are 5 passes and 1 shadow ray per hit.
+ *  With -w, each render is written to dir/<scene>_<n>spp.ppm and
+ *  dir/<scene>_<n>spp_denoised.ppm.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "list356.h"
+#include "geom356.h"
+
+#include "surfaces_lights.h"
+#include "tracer.h"
+#include "framebuffer.h"
+#include "timing.h"
+
+// The size of the rendered images.
+#define REPORT_WIDTH 320
+#define REPORT_HEIGHT 240
+
+// The number of rays per pixel of the reference renders.
+#define REFERENCE_SAMPLES 64
+
+// The scenes reported on by default.
+static const char* scenes[] = {"sphere3", "transcube", "rg", "spheres",
+    "chess", "boards", "walls"};
+
+#define NUM_SCENES (int)(sizeof(scenes)/sizeof(scenes[0]))
+
+/** Get the RMS difference of two frames, out of 255.
+ */
+static double rms_error(framebuffer_t* a, framebuffer_t* b) {
+    double total = 0.0;
+    for (int y=0; y<a->height; ++y) {
+        for (int x=0; x<a->width; ++x) {
+            color_t* p = fb_pixel(a, x, y);
+            color_t* q = fb_pixel(b, x, y);
+            float d[3] = {p->red - q->red, p->green - q->green,
+                p->blue - q->blue};
+            for (int c=0; c<3; ++c) total += d[c]*d[c];
+        }
+    }
+    return 255*sqrt(total/(3.0*a->width*a->height));
+}
+
+/** Write a frame as a binary PPM, if a directory was given.
+ */
+static void write_frame(const char* dir, const char* scene, int samples,
+        const char* suffix, framebuffer_t* frame) {
+    if (dir == NULL) return;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s_%dspp%s.ppm", dir, scene, samples,
+            suffix);
+    framebuffer_write_ppm(frame, path);
+}
+
+/** Render a frame, timing it.
+ *
+ *  @return the time taken, in seconds.
+ */
+static double timed_render(scene_t* scene, view_t* view,
+        framebuffer_t* frame, render_options_t* options) {
+    srand48(0);
+    struct timespec start;
+    timer_start(&start);
+    render_frame(scene, view, frame, options);
+    return seconds_since(&start);
+}
+
+/** Report on one scene.
+ *
+ *  @return <code>false</code> if the scene is unknown.
+ */
+static bool report_scene(const char* name, int passes, int light_samples,
+        const char* dir) {
+    view_t view;
+    set_view_data(&view.eye, &view.look_at, &view.up);
+    set_view_plane(&view.plane_dist, &view.plane_width, &view.plane_height);
+    list356_t* surfaces = get_scene_surfaces(name, &view.eye, &view.look_at);
+    if (surfaces == NULL) return false;
+    color_t ambient_light;
+    get_ambient_light(&ambient_light);
+    scene_t* scene = make_scene(surfaces, get_lights(), ambient_light);
+
+    render_options_t options;
+    render_options_init(&options);
+    framebuffer_t* ref = make_framebuffer(REPORT_WIDTH, REPORT_HEIGHT);
+    framebuffer_t* frame = make_framebuffer(REPORT_WIDTH, REPORT_HEIGHT);
+
+    options.pixel_samples = REFERENCE_SAMPLES;
+    double ref_time = timed_render(scene, &view, ref, &options);
+    printf("%-10s reference %d spp, all lights: %.3f s\n", name,
+            REFERENCE_SAMPLES, ref_time);
+    write_frame(dir, name, REFERENCE_SAMPLES, "_reference", ref);
+
+    options.light_samples = light_samples;
+    for (int samples=1; samples<=64; samples*=4) {
+        options.pixel_samples = samples;
+        options.denoise_passes = 0;
+        double time = timed_render(scene, &view, frame, &options);
+        double error = rms_error(frame, ref);
+        write_frame(dir, name, samples, "", frame);
+
+        options.denoise_passes = passes;
+        double denoised_time = timed_render(scene, &view, frame, &options);
+        double denoised_error = rms_error(frame, ref);
+        write_frame(dir, name, samples, "_denoised", frame);
+
+        printf("%-10s %9d %9.3f %9.3f %9.3f %9.3f\n", "", samples, error,
+                time, denoised_error, denoised_time);
+    }
+
+    fb_free(frame);
+    fb_free(ref);
+    scene_free(scene);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int passes = 5, light_samples = 1;
+    const char* dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:l:w:")) != -1) {
+        switch (opt) {
+            case 'p': passes = atoi(optarg); break;
+            case 'l': light_samples = atoi(optarg); break;
+            case 'w': dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-p passes] [-l light_samples] "
+                        "[-w dir] [scene...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    printf("%dx%d, %d denoising passes, %d shadow rays per hit; "
+            "rms error out of 255.\n", REPORT_WIDTH, REPORT_HEIGHT, passes,
+            light_samples);
+    printf("%-10s %9s %9s %9s %9s %9s\n", "scene", "spp", "error", "time",
+            "denoised", "time");
+    int failures = 0;
+    int num_scenes = optind < argc ? argc - optind : NUM_SCENES;
+    for (int k=0; k<num_scenes; ++k) {
+        const char* name = optind < argc ? argv[optind + k] : scenes[k];
+        if (!report_scene(name, passes, light_samples, dir)) {
+            printf("%-10s unknown scene\n", name);
+            ++failures;
+        }
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,103 @@
+/** Display functions.
+ *
+ *  @file display.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Frames used to be drawn with glDrawPixels() straight from the float
+ *  framebuffer, which copies 12 bytes per pixel and blocks until the copy
+ *  is done.  Here frames are quantized to 4 bytes per pixel and, when the
+ *  driver supports pixel buffer objects, handed over in a buffer that the
+ *  driver can upload asynchronously.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define GL_GLEXT_PROTOTYPES
+
+#ifdef __MACOSX__
+#include <OpenGL/gl.h>
+#include <OpenGL/glu.h>
+#include <GLUT/glut.h>
+#elif defined __LINUX__ || defined __CYGWIN__
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <GL/glut.h>
+#endif
+
+#include "debug.h"
+#include "display.h"
+
+// The two pixel buffer objects, and which one the next frame goes into.
+static GLuint pbos[2];
+static int next_pbo = 0;
+
+// Whether PBOs are available; checked the first time display_resize() is
+// called.
+static bool use_pbo = false;
+static bool checked_pbo = false;
+
+// Client-memory pixels, used when PBOs are not available.
+static unsigned char* pixels = NULL;
+
+static int disp_width = 0;
+static int disp_height = 0;
+
+void display_resize(int width, int height) {
+    if (!checked_pbo) {
+        use_pbo = glutExtensionSupported("GL_ARB_pixel_buffer_object");
+        if (use_pbo) glGenBuffers(2, pbos);
+        checked_pbo = true;
+        debug("display_resize():  pixel buffer objects %s",
+                use_pbo ? "enabled" : "not supported");
+    }
+
+    disp_width = width;
+    disp_height = height;
+
+    if (!use_pbo) {
+        free(pixels);
+        pixels = malloc(4*width*height);
+    }
+}
+
+void display_frame(framebuffer_t* frame) {
+    glWindowPos2s(0, 0);
+
+    if (use_pbo) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[next_pbo]);
+
+        // Re-specify the buffer's storage before mapping it, so that the
+        // driver can hand us fresh memory instead of waiting for any
+        // upload still reading the old contents.
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, 4*disp_width*disp_height, NULL,
+                GL_STREAM_DRAW);
+        unsigned char* dst = glMapBuffer(GL_PIXEL_UNPACK_BUFFER,
+                GL_WRITE_ONLY);
+        if (dst != NULL) {
+            fb_to_rgba8(frame, dst, false);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+            // With a PBO bound, the last argument is an offset into it.
+            glDrawPixels(disp_width, disp_height, GL_RGBA, GL_UNSIGNED_BYTE,
+                    0);
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        next_pbo = 1 - next_pbo;
+    }
+    else {
+        fb_to_rgba8(frame, pixels, false);
+        glDrawPixels(disp_width, disp_height, GL_RGBA, GL_UNSIGNED_BYTE,
+                pixels);
+    }
+}
+
+void display_free() {
+    if (use_pbo) glDeleteBuffers(2, pbos);
+    use_pbo = false;
+    checked_pbo = false;
+    free(pixels);
+    pixels = NULL;
+}
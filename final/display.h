@@ -0,0 +1,35 @@
+/** @file display.h Getting rendered frames onto the screen.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include "framebuffer.h"
+
+/** Prepare to display frames of a given size.  Must be called with a
+ *  current GL context, and again whenever the window is resized.
+ *
+ *  @param width the width of the window in pixels.
+ *  @param height the height of the window in pixels.
+ */
+void display_resize(int width, int height);
+
+/** Draw a rendered frame into the current GL draw buffer.  The frame is
+ *  converted to 8-bit RGBA and, where pixel buffer objects are supported,
+ *  written into one of two PBOs that alternate between frames; the draw
+ *  then returns without waiting for the upload, so the next frame can be
+ *  traced while the driver copies this one.
+ *
+ *  @param frame the frame; it must be the size last passed to
+ *      <code>display_resize()</code>.
+ */
+void display_frame(framebuffer_t* frame);
+
+/** Release the display buffers.
+ */
+void display_free();
+
+#endif
@@ -10,26 +10,37 @@
  * ----CHANGES----
  *
  * Changes to this file from original HW2 Solution Ray Tracer:
- * Added the following new functions:
- * get_transparency()
- * refract()
- * reflect()
+ * The tracer itself (ray_trace(), get_transparency(), refract(), reflect()
+ * and the shading functions) moved to tracer.c, which keeps no global
+ * state; this file is the GLUT front end, and holds the scene, view and
+ * rendering options that it passes to render_frame().
  *
- * Slightly modified the following functions:
- * get_specular_refl() - added in_trans parameter.
- * ray_trace() - added in_trans parameter and modified shadows for transparent
- *               objects.
+ * Added the following new functions:
+ * handle_display() draws frames through display.c, which uploads them as
+ * 8-bit RGBA through pixel buffer objects.
+ * report_light_sampling()
+ * handle_idle() and update_scene() - animation, with bounding-box trees
+ *      refitted each frame and rebuilt when refitting has degraded them.
+ * handle_display() reports paging and frame time for out-of-core scenes
+ *      when OUT_OF_CORE is set.
+ * main() runs the render server in server.c instead of opening a window
+ *      when RENDER_SERVER is set.
+ * handle_display() writes the per-pixel cost profile in profile.c when
+ *      PROFILE_PIXELS is set.
+ * main() turns on the denoiser in denoise.c when DENOISE is set, and sets
+ *      the shadow rays for area lights from SHADOW_SAMPLES and
+ *      MAX_SHADOW_SAMPLES.
+ * main() turns off tile culling when NO_TILE_CULLING is set, and batches
+ *      secondary rays with ray_batch.c when RAY_BATCH is set.
  *
  */
 
-#include <assert.h>
-#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
-#ifndef NDEBUG
+#if !defined(NDEBUG) || defined(LIGHT_SAMPLE_REPORT) || \
+    defined(ANIMATE_FRAMES) || defined(OUT_OF_CORE)
 #include <stdarg.h>
 #include <time.h>
 #endif
@@ -49,21 +60,63 @@
 
 #include "surface.h"
 #include "surfaces_lights.h"
+#include "tracer.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "timing.h"
+#include "display.h"
+#include "ooc.h"
+#include "profile.h"
+#ifdef RENDER_SERVER
+#include "server.h"
+#endif
 
 #include "debug.h"
 
-#define max(a, b) a < b ? b : a
+// Rendering options.
+render_options_t options;
 
-#define EPSILON .001
+// Number of shadow rays to importance-sample per hit; if 0, every light
+// that can reach the hit point is shaded.  LIGHT_SAMPLES is intended to
+// be set at compile time, e.g. CPPFLAGS=-DLIGHT_SAMPLES=4.
+#ifndef LIGHT_SAMPLES
+#define LIGHT_SAMPLES 0
+#endif
+
+// Number of jittered viewing rays to average per pixel.  PIXEL_SAMPLES
+// is intended to be set at compile time, e.g. CPPFLAGS=-DPIXEL_SAMPLES=4.
+#ifndef PIXEL_SAMPLES
+#define PIXEL_SAMPLES 1
+#endif
 
-// Application data
-bool ambient_shading = true;
-bool transparency = true;
-bool spec_reflection = true;
+// Number of worker processes to farm each frame's tiles out to; if 0,
+// frames are rendered in this process.
+#ifndef TILE_WORKERS
+#define TILE_WORKERS 0
+#endif
+
+// Number of shadow rays to cast to each area light from a point, and the
+// most to cast when those disagree, in the penumbra.  Only the rays after
+// the first SHADOW_SAMPLES make up the penumbra estimate, so fewer than
+// 2*SHADOW_SAMPLES in all are raised to that.
+#ifndef SHADOW_SAMPLES
+#define SHADOW_SAMPLES 4
+#endif
+#ifndef MAX_SHADOW_SAMPLES
+#define MAX_SHADOW_SAMPLES 32
+#endif
+
+// Number of reflection and refraction rays to collect and sort before
+// tracing them; if 0, they are traced as they are spawned.
+#ifndef RAY_BATCH
+#define RAY_BATCH 0
+#endif
 
-bool lighting = true;
-bool lambertian_shading = true;
-bool blin_phong_shading = true;
+// Number of edge-aware denoising passes to run over each frame; if 0,
+// frames are not denoised.  5 passes suit 4 or so samples per pixel.
+#ifndef DENOISE
+#define DENOISE 0
+#endif
 
 // Window data.
 const int DEFAULT_WIN_WIDTH = 400;
@@ -72,53 +125,60 @@ int win_width;
 int win_height;
 
 // Viewing data.
-point3_t eye;
-point3_t look_at;
-vector3_t up_dir;
-
-// View-plane specification in camera frame basis.
-float view_plane_dist;
-float view_plane_width;
-float view_plane_height;
-
-vector3_t eye_frame_u, eye_frame_v, eye_frame_w;
-
-// Surface data.
-list356_t* surfaces = NULL;
-
-// Light data.
-list356_t* lights = NULL;
-color_t ambient_light = {.1f, .1f, .1f};
+view_t view;
+
+// Scene data.
+scene_t* scene = NULL;
+
+#ifdef ANIMATE_FRAMES
+// Animation data.  ANIMATE_FRAMES is intended to be set at compile time to
+// the number of frames in the animation.  Bounding-box trees are refitted
+// every frame, and rebuilt when refitting has raised their cost to more
+// than REBUILD_RATIO times their cost when built (so REBUILD_RATIO=0
+// rebuilds every frame).
+#ifndef REBUILD_RATIO
+#define REBUILD_RATIO 1.5
+#endif
+float rebuild_ratio = REBUILD_RATIO;
+int frame_number = 0;
+#endif
 
 // Callbacks.
 void handle_display(void);
 void handle_resize(int, int);
+#ifdef ANIMATE_FRAMES
+void handle_idle(void);
+#endif
 
 // Application functions.
-void win2world(int, int, vector3_t*);
-void compute_eye_frame_basis();
-color_t get_transparency(ray3_t* ray, hit_record_t* hit_rec, int depth,
-        bool in_trans);
-bool refract(ray3_t* ray, vector3_t* normal, float refr_index,
-        vector3_t* t_vec, bool in_trans);
-void reflect(ray3_t* i_ray, vector3_t* normal, vector3_t* r_vec);
-
-// Lighting functions.
-color_t get_specular_refl(ray3_t* ray, hit_record_t* hit_rec, int depth, bool
-        in_trans);
-float get_lambert_scale(vector3_t* light_dir, hit_record_t* hit_rec);
-float get_blinn_phong_scale(ray3_t* ray, vector3_t* light_dir, 
-        hit_record_t* hit_rec);
-void add_scaled_color(color_t* color, color_t* sfc_color, color_t*
-        light_color, float scale);
-
-// The in-memory copy of the framebuffer; allocated by handle_resize.
-GLfloat* fb;
+#ifdef ANIMATE_FRAMES
+void update_scene(float time);
+#endif
+
+// The in-memory framebuffer that frames are rendered into; allocated by
+// handle_resize.
+framebuffer_t* frame = NULL;
 
 void handle_exit();
 
 int main(int argc, char **argv) {
 
+    render_options_init(&options);
+    options.pixel_samples = PIXEL_SAMPLES;
+    options.light_samples = LIGHT_SAMPLES;
+    options.workers = TILE_WORKERS;
+    options.denoise_passes = DENOISE;
+    options.shadow_samples = SHADOW_SAMPLES;
+    options.max_shadow_samples = MAX_SHADOW_SAMPLES;
+#ifdef NO_TILE_CULLING
+    options.tile_culling = false;
+#endif
+    options.ray_batch_size = RAY_BATCH;
+
+#ifdef RENDER_SERVER
+    // Serve render jobs instead of opening a window.
+    return run_render_server(RENDER_SERVER, &options);
+#else
     // Initialize the drawing window.
     glutInitWindowSize(DEFAULT_WIN_WIDTH, DEFAULT_WIN_HEIGHT);
     glutInitWindowPosition(0, 0);
@@ -129,28 +189,33 @@ int main(int argc, char **argv) {
     glutCreateWindow("Ray tracer");
     glutReshapeFunc(handle_resize);
     glutDisplayFunc(handle_display);
+#ifdef ANIMATE_FRAMES
+    glutIdleFunc(handle_idle);
+#endif
 
     // Application initialization.
-    surfaces = get_surfaces();
-    set_view_data(&eye, &look_at, &up_dir);
-    set_view_plane(&view_plane_dist, &view_plane_width, &view_plane_height);
-    lights = get_lights();
-    compute_eye_frame_basis();
+    color_t ambient_light;
+    get_ambient_light(&ambient_light);
+    scene = make_scene(get_surfaces(), get_lights(), ambient_light);
+    set_view_data(&view.eye, &view.look_at, &view.up);
+    set_view_plane(&view.plane_dist, &view.plane_width, &view.plane_height);
 
     // Enter the main event loop.
     atexit(handle_exit);
     glutMainLoop();
 
     return EXIT_SUCCESS;
+#endif
 }
 
 void handle_exit() {
     debug("handle_exit()");
-    if (fb != NULL) free(fb);
+    fb_free(frame);
+    display_free();
 }
 
 /** Handle a resize event by recording the new width and height.
- *  
+ *
  *  @param width the new width of the window.
  *  @param height the new height of the window.
  */
@@ -160,524 +225,149 @@ void handle_resize(int width, int height) {
     win_width = width;
     win_height = height;
 
-    if (fb != NULL) free(fb);
+    fb_free(frame);
     debug("handle_resize():  allocating in-memory framebuffer");
-    fb = malloc(win_width*win_height*3*sizeof(GLfloat));
-    bzero(fb, (win_width*win_height*3)*sizeof(GLfloat));
+    frame = make_framebuffer(win_width, win_height);
+    display_resize(win_width, win_height);
 
 }
 
-/** Get the offset into the frame-buffer for a given pixel position.
- *  
- *  @param y the y-coordinate (row) of the pixel.
- *  @param x the x-coordinate (column) of the pixel.
- *  @param c the color component.
- *
- *  @return the value i such that fb+i is the framebuffer element to
- *      set for color c of pixel (x, y).
- */
-int fb_offset(int y, int x, int c) {
-    return y*(win_width*3) + x*3 + c;
-}
-
-/** Get the shade determined by a given ray.
- *  
- *  @param ray the ray to trace.
- *  @param t0 the start of the interval for which to get a shade.
- *  @param t1 the end of the interval for which to get a shade.
- *  @param depth the maximum number of times a reflect ray will be
- *      cast for objects with non-NULL reflective color.
- *  @param in_trans whether the ray is inside a transparent surface or not.
- * 
- *
- *  @return the color corresponding to the closest object hit by
- *      <code>r</code> in the interval <code>[t0, t1]</code>.
+#ifdef LIGHT_SAMPLE_REPORT
+/** Print the noise and cost of importance-sampled lighting for a range of
+ *  shadow-ray budgets.  Each budget's frame is compared with a frame that
+ *  shades every light that reaches each hit point.
  */
-color_t ray_trace(ray3_t ray, float t0, float t1, int depth, bool in_trans) {
-    assert(depth >= 0);
-
-    color_t color = {0.0, 0.0, 0.0};
-
-    if (depth == 0) return color;
-
-    hit_record_t hit_rec, closest_hit_rec;
-
-    // Get a hit record for the closest object that is hit.
-    bool hit_something = false;
-    list356_itr_t* s = lst_iterator(surfaces);
-    while (lst_has_next(s)) {
-        surface_t* sfc = lst_next(s);
-        if (sfc_hit(sfc, &ray, t0, t1, &hit_rec)) {
-            if (hit_rec.t < t1) {
-                hit_something = true;
-                memcpy(&closest_hit_rec, &hit_rec, 
-                        sizeof(hit_record_t));
-                t1 = hit_rec.t;
-            }
-            else assert("wrong");
+void report_light_sampling() {
+    framebuffer_t* ref = make_framebuffer(win_width, win_height);
+    framebuffer_t* buf = make_framebuffer(win_width, win_height);
+    int n = ref->tiles_x*ref->tiles_y*TILE_SIZE*TILE_SIZE;
+    render_options_t sampled = options;
+
+    sampled.light_samples = 0;
+    clock_t start_time = clock();
+    render_frame(scene, &view, ref, &sampled);
+    double ref_time = ((double)(clock()-start_time))/CLOCKS_PER_SEC;
+    fprintf(stderr, "light sampling: %d lights, all lights %f sec.\n",
+            scene->num_lights, ref_time);
+
+    for (int budget=1; budget<=64; budget*=2) {
+        sampled.light_samples = budget;
+        start_time = clock();
+        render_frame(scene, &view, buf, &sampled);
+        double time = ((double)(clock()-start_time))/CLOCKS_PER_SEC;
+
+        // Padding pixels are black in both buffers, so they add no error.
+        double err = 0.0;
+        for (int i=0; i<n; ++i) {
+            color_t* a = &buf->pixels[i];
+            color_t* b = &ref->pixels[i];
+            err += (a->red-b->red)*(a->red-b->red) +
+                (a->green-b->green)*(a->green-b->green) +
+                (a->blue-b->blue)*(a->blue-b->blue);
         }
+        fprintf(stderr, "light sampling: %2d rays/hit  rmse %f  %f sec.\n",
+                budget, sqrt(err/(3*win_width*win_height)), time);
     }
-    lst_iterator_free(s);
-
-    // If we hit something, color the pixel.
-    if (hit_something) {
-        surface_t* sfc = closest_hit_rec.sfc;
-
-        // Specular reflection.
-        if (spec_reflection) {
-          if (sfc->refl_color != NULL) {
-              color_t refl_color = get_specular_refl(&ray,
-                      &closest_hit_rec, depth, in_trans);
-              add_scaled_color(&color, sfc->refl_color, &refl_color, 1.0f);
-          }
-        }
-
-        // Tranparency
-        if (transparency) {
-          if (sfc->refr_index != -1) {
-              color_t trans_color = get_transparency(&ray, &closest_hit_rec,
-                      depth, !in_trans);
-              // Only add returned color, don't multiply by a surface_color.
-              color.red += (trans_color.red);
-              color.green += (trans_color.green);
-              color.blue += (trans_color.blue);
-          }
-        }
-
-        // Ambient shading.
-        if (ambient_shading) {
-          add_scaled_color(&color, sfc->ambient_color, &ambient_light, 1.0f);
-        }
-
-        // Lighting.
-        if (lighting) {
-          list356_itr_t* light_itr = lst_iterator(lights);
-          while (lst_has_next(light_itr)) {
-              light_t* light = lst_next(light_itr);
-              vector3_t light_dir;
-              pv_subtract(light->position, &(closest_hit_rec.hit_pt),
-                      &light_dir);
-              normalize(&light_dir);
-
-              // Check for global shadows.
-              bool do_lighting = true;
-
-              // Bool for if the shadow is caused by transparent surface.
-              bool trans_shadow = false;
-
-              ray3_t light_ray = {closest_hit_rec.hit_pt, light_dir};
-              float light_dist = dist(&closest_hit_rec.hit_pt,
-                      light->position);
-              s = lst_iterator(surfaces);
-              while (lst_has_next(s)) {
-                  surface_t* sfc = lst_next(s);
-                  if (sfc_hit(sfc, &light_ray, EPSILON, light_dist, &hit_rec)) {
-                      do_lighting = false;
-                      // If shadow is caused by transparent surface, we add
-                      // Lambertian shading only so our shadows are not opaque.
-                      if (hit_rec.sfc->refr_index != -1) trans_shadow = true;
-                      break;
-                  }
-              }
-              lst_iterator_free(s);
-              if (!do_lighting) {
-                  continue;
-              }
-
-              // Lambertian shading.
-              if (lambertian_shading) {
-                if (!trans_shadow) {
-                    float scale = get_lambert_scale(&light_dir, &closest_hit_rec);
-                    add_scaled_color(&color, sfc->diffuse_color, light->color,
-                            scale);
-                }
-              }
-
-            // Blin-Phong shading (if shadow is not caused by transparent
-            // surface).
-            if (blin_phong_shading) {
-              if (!trans_shadow) {
-                  float phong_scale = get_blinn_phong_scale(&ray, &light_dir,
-                          &closest_hit_rec);
-                  add_scaled_color(&color, sfc->spec_color, light->color, 
-                          phong_scale);
-              }
-            }
-        }
-
-        lst_iterator_free(light_itr);
-    }
-
-    }   // if (hit_something)
-    return color;
-}
 
-/** Get the shade from specular reflection.
- *  
- * @param ray the viewing ray.
- * @param hit_rec the hit record for the point being shaded.
- * @param depth the current ray-tracing recursion depth.
- * @param in_trans whether the ray is inside a transparent surface or not.
- *
- *  @return the color to add from ideal specular reflection of <code>ray</code>.
- */
-color_t get_specular_refl(ray3_t* ray, hit_record_t* hit_rec, int depth, bool
-        in_trans) {
-    ray3_t refl_ray;
-    refl_ray.base = hit_rec->hit_pt;
-    refl_ray.dir = hit_rec->normal;
-    multiply(&hit_rec->normal, 
-            2*dot(&ray->dir, &hit_rec->normal), 
-            &refl_ray.dir);
-    subtract(&ray->dir, &refl_ray.dir, &refl_ray.dir);
-    color_t refl_color = ray_trace(refl_ray, EPSILON, FLT_MAX, 
-            depth-1, in_trans);
-    return refl_color;
+    fb_free(buf);
+    fb_free(ref);
 }
+#endif
 
-/**
- * Get the color from reflection and refraction for transparent objects.
- *
- * @param ray the viewing ray
- * @param hit_rec the hit record for the point being colored.
- * @param depth the current ray-tracing recursion depth.
- * @param in_trans whether the ray is inside a transparent surface or not.
- *
- * @return the color to add from transparency of ray.
+#ifdef ANIMATE_FRAMES
+/** Idle callback; advance the animation by one frame, until the last
+ *  frame has been shown.
  */
-color_t get_transparency(ray3_t* ray, hit_record_t* hit_rec, int depth, bool
-        in_trans) {
-    //debug("get_transparency");
-
-    // Use notation from Shirley and Marschner:
-    // d - ray
-    // n - normal = closest_hit_rec->normal
-    // <i>n></i> - refractive index
-    // t - transformed ray direction
-
-    // Calculate reflected ray refl_ray: r = reflect(d,n).
-    vector3_t normal = hit_rec->normal;
-    vector3_t refl_vector;
-    reflect(ray, &normal, &refl_vector);
-    normalize(&refl_vector);
-    ray3_t refl_ray = { hit_rec->hit_pt, refl_vector };
-
-    // Store locally for cleaner code.
-    surface_t* sfc = hit_rec->sfc;
-    float index = sfc->refr_index;
-
-    // Variables populated in if/else blocks:
-    color_t trans_color;
-    color_t k;
-    float c;
-    vector3_t t_vec;
-
-    // Normalize ray_dir for dot product
-    vector3_t ray_dir = ray->dir;
-    normalize(&ray_dir);
-    if (dot(&ray_dir, &normal) < 0) {
-        // Calculate direction refracted (transformed) ray, t_vec; 
-        refract(ray, &normal, index, &t_vec, in_trans);
-        c = ( -1.0f * dot(&ray_dir, &normal));
-        k = (color_t) {1.0f, 1.0f, 1.0f};
-    } else {
-
-        // Intensity of light diminishes by the attenuation constant of the
-        // surface proportionally to the distance the ray of light travels
-        // through the surface. To calculate this distance that the ray of
-        // light spends in the surface we follow a procedure similar to the
-        // procedure of shadows. We Iterate through all surfaces looking for
-        // the closest hit object in the direction of the refracted ray. Then
-        // we take the distance between the first hit records hit_pt and the
-        // closest hit record's hit_pt which is on the closest object.
-
-        vector3_t dist_vec;
-        refract(ray, &normal, index, &dist_vec, in_trans);
-        ray3_t t_ray = {hit_rec->hit_pt, dist_vec};
-        hit_record_t t_hit_rec, t_closest_hit_rec;
-
-        // Get a hit record for the closest object that is hit in dir t_ray.
-        bool hit_something = false;
-        float t1 = FLT_MAX;
-        list356_itr_t* s = lst_iterator(surfaces);
-        while (lst_has_next(s)) {
-            surface_t* sfc = lst_next(s);
-            if (sfc_hit(sfc, &t_ray, EPSILON, t1, &t_hit_rec)) {
-                if (t_hit_rec.t < t1) {
-                    hit_something = true;
-                    memcpy(&t_closest_hit_rec, &t_hit_rec, 
-                            sizeof(hit_record_t));
-                    t1 = t_hit_rec.t;
-                }
-            }
-        }
-        lst_iterator_free(s);
-        float t = dist(&hit_rec->hit_pt, &t_closest_hit_rec.hit_pt);
-
-        // Calculate attenuation.
-        color_t* a = sfc->atten;
-        k = (color_t) {
-            exp(-1.0f * (a->red) * t),
-            exp(-1.0f * (a->green) * t),
-            exp(-1.0f * (a->blue) * t) };
-
-        vector3_t neg_normal; // neg_normal = -n
-        multiply(&normal, -1.0f, &neg_normal);
-        // inv_index = 1/n = 1/refr_index
-        float inv_index = 1.0f/index;
-        if (refract(ray, &neg_normal, inv_index, &t_vec, in_trans)) {
-            c = dot(&t_vec, &normal);
-        } else {
-            trans_color = ray_trace(refl_ray, EPSILON, FLT_MAX, depth-1,
-                    !in_trans);
-            trans_color.red = trans_color.red*k.red;
-            trans_color.green = trans_color.green*k.green;
-            trans_color.blue = trans_color.blue*k.blue;
-            //return (color_t) {1.0f, 1.0f, 0.0f};
-            return trans_color;
-        }
+void handle_idle() {
+    if (frame_number == ANIMATE_FRAMES-1) {
+        glutIdleFunc(NULL);
+        return;
     }
-
-    float R0 = (( (index - 1)*(index - 1) )/( (index + 1)*(index + 1) ));
-    float R = (R0 + (1 - R0)*((1 - c)*(1 - c)*(1 - c)*(1 - c)*(1 - c)));
-    color_t trans_color1, trans_color2;
-
-    // Recursively ray trace on the reflected ray and the refracted ray.
-    trans_color1 = ray_trace(refl_ray, EPSILON, FLT_MAX, depth-1, !in_trans);
-    ray3_t t_ray = {hit_rec->hit_pt, t_vec};
-    trans_color2 = ray_trace(t_ray, EPSILON, FLT_MAX, depth-1, !in_trans);
-
-    // Combine the reflected and refracted ray and return.
-    trans_color.red = k.red*( (R*trans_color1.red) + ((1.0f -
-                    R)*trans_color2.red));
-    trans_color.green = k.green*( (R*trans_color1.green) + ((1.0f -
-                    R)*trans_color2.green));
-    trans_color.blue = k.blue*( (R*trans_color1.blue) + ((1.0f -
-                    R)*trans_color2.blue));
-    return trans_color;
+    ++frame_number;
+    update_scene((float)frame_number/ANIMATE_FRAMES);
+    glutPostRedisplay();
 }
 
-/** Get the scale factor for Lambertian (diffuse) shading from a single
- *  light source.
- *  
- *  @param light_dir the direction to the light.
- *  @param hit_rec the hit record for the point being shaded.
+/** Move the scene and camera to a point in the animation, and bring the
+ *  top-level bounding-box trees up to date.  The time spent refitting and
+ *  rebuilding trees is reported for each frame.
  *
- *  @return the scale factor to use for Lambertian shading.
+ *  @param time the time in the animation, from 0 to 1.
  */
-float get_lambert_scale(vector3_t* light_dir, hit_record_t* hit_rec) {
-    return max(0.0f, dot(light_dir, &(hit_rec->normal)));
-}
+void update_scene(float time) {
+    animate_scene(time, &view.eye, &view.look_at);
 
-/** Get the scale factor for Blinn-Phong specular highlighting from a
- *  single light source.
- *
- *  @param ray the viewing ray.
- *  @param light_dir the direction to the light.
- *  @param hit_rec the hit record for the point being shaded.
- *
- *  @return the scale factor to use for Blinn-Phong shading.
- */
-float get_blinn_phong_scale(ray3_t* ray, vector3_t* light_dir, 
-        hit_record_t* hit_rec) {
-    vector3_t view, half_v;
-    multiply(&ray->dir, -1.0, &view);
-    normalize(&view);
-    add(&view, light_dir, &half_v);
-    normalize(&half_v);
-    float phong_scale = max(0, 
-            dot(&half_v, &hit_rec->normal));
-    phong_scale = pow(phong_scale, hit_rec->sfc->phong_exp);
-    return phong_scale;
-}
+    double refit_time = 0.0, rebuild_time = 0.0;
+    float worst_ratio = 0.0f;
+    int num_rebuilt = 0;
+    list356_itr_t* s = lst_iterator(scene->surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        if (!sfc_is_bbt(sfc)) continue;
+
+        clock_t start_time = clock();
+        float ratio = bbt_refit(sfc);
+        refit_time += ((double)(clock()-start_time))/CLOCKS_PER_SEC;
+        worst_ratio = ratio > worst_ratio ? ratio : worst_ratio;
+
+        if (ratio > rebuild_ratio) {
+            start_time = clock();
+            bbt_rebuild(sfc);
+            rebuild_time += ((double)(clock()-start_time))/CLOCKS_PER_SEC;
+            ++num_rebuilt;
+        }
+    }
+    lst_iterator_free(s);
 
-/** Add a scaled product of surface and light colors to a given color.
- *  Calling this function has the effect of executing
- *  <pre>
- *      color->C += (surface_color->C)*(light_color->C)*scale
- *  </pre>
- *  for each color component <code>C</code>.
- *  
- *  @param color the base color.
- *  @param sfc_color the surface color.
- *  @param light_color the light color.
- *  @param scale the amount to scale the additional color by.
- */
-void add_scaled_color(color_t* color, color_t* sfc_color, color_t* light_color,
-        float scale) {
-    color->red += (sfc_color->red)*(light_color->red)*scale;
-    color->green += (sfc_color->green)*(light_color->green)*scale;
-    color->blue += (sfc_color->blue)*(light_color->blue)*scale;
+    fprintf(stderr, "frame %3d: refit %.3f ms (cost x%.2f), "
+            "%d rebuilt in %.3f ms.\n", frame_number, 1000*refit_time,
+            worst_ratio, num_rebuilt, 1000*rebuild_time);
 }
+#endif
 
 /** Display callback; render the scene.
  */
 void handle_display() {
-    // The ray itself.
-    ray3_t ray;
-    ray.base = eye;
-
-    color_t color;
+#ifdef LIGHT_SAMPLE_REPORT
+    static bool reported = false;
+    if (!reported) {
+        report_light_sampling();
+        reported = true;
+    }
+#endif
 
 #ifndef NDEBUG
     clock_t start_time, end_time;
     start_time = clock();
 #endif
-    for (int x=0; x<win_width; ++x) {
-        for (int y=0; y<win_height; ++y) {
-            win2world(x, y, &ray.dir);
-            debug_c((x==400 && y==300),
-                "view ray = {(%f, %f, %f), (%f, %f, %f)}.\n",
-                eye.x, eye.y, eye.z, 
-                ray.dir.x, ray.dir.y, ray.dir.z);
-            //Start ray eye assuming we're not inside a transparent surface.
-            color = ray_trace(ray, 1.0 + EPSILON, FLT_MAX, 5, false);
-            *(fb+fb_offset(y, x, 0)) = color.red;
-            *(fb+fb_offset(y, x, 1)) = color.green;
-            *(fb+fb_offset(y, x, 2)) = color.blue;
-        }
-    }
+#ifdef OUT_OF_CORE
+    // Wall-clock time, since paging waits on the disk.
+    unsigned long page_ins, evictions;
+    size_t resident;
+    struct timespec frame_start;
+    ooc_stats(scene->surfaces, &page_ins, &evictions, &resident);
+    timer_start(&frame_start);
+#endif
+    render_frame(scene, &view, frame, &options);
+#ifdef PROFILE_PIXELS
+    profile_write(PROFILE_PIXELS, scene->surfaces);
+#endif
+#ifdef OUT_OF_CORE
+    double frame_time = seconds_since(&frame_start);
+    unsigned long frame_page_ins = page_ins, frame_evictions = evictions;
+    ooc_stats(scene->surfaces, &page_ins, &evictions, &resident);
+    fprintf(stderr, "out-of-core: %lu page-ins, %lu evictions, "
+            "%.1f MB resident, frame in %.3f s.\n",
+            page_ins - frame_page_ins, evictions - frame_evictions,
+            resident/1048576.0, frame_time);
+#endif
 #ifndef NDEBUG
     end_time = clock();
     debug("handle_display(): frame calculation time = %f sec.",
             ((double)(end_time-start_time))/CLOCKS_PER_SEC);
 #endif
 
-    // The following line throws a implicit declaration compiler warning: but
-    // it was in hw2bp1.c solution file so I will ignore it.
-    glWindowPos2s(0, 0);
-    glDrawPixels(win_width, win_height, GL_RGB, GL_FLOAT, fb);
+    display_frame(frame);
     glFlush();
     glutSwapBuffers();
 }
-
-/** Compute the eye frame basis from the eye point, look-at point,
- *  and up direction.  The basic algorithm:
- *  -# w <- normalized (eye - look_at)
- *  -# u <- normalized (up x w)
- *  -# v <- w x u.
- */
-void compute_eye_frame_basis() {
-    pv_subtract(&eye, &look_at, &eye_frame_w);
-    normalize(&eye_frame_w);
-
-    cross(&up_dir, &eye_frame_w, &eye_frame_u);
-    normalize(&eye_frame_u);
-
-    cross(&eye_frame_w, &eye_frame_u, &eye_frame_v);
-
-    debug("compute_eye_frame_basis():  eye_frame_u = (%f, %f, %f)",
-            eye_frame_u.x, eye_frame_u.y, eye_frame_u.z);
-    debug("compute_eye_frame_basis():  eye_frame_v = (%f, %f, %f)",
-            eye_frame_v.x, eye_frame_v.y, eye_frame_v.z);
-    debug("compute_eye_frame_basis():  eye_frame_w = (%f, %f, %f)",
-            eye_frame_w.x, eye_frame_w.y, eye_frame_w.z);
-}
-
-/** Compute the viewing ray direction in the world frame basis.
- *
- *  @param x the x-position on the window (in pixels), starting at the left.
- *  @param y the y-position on the window (in pixels), starting at the top.
- *  @param dir a vector3_t object that will be filled with the coordinates
- *      (in the world frame basis) for the direction of the viewing ray 
- *      through <code>(x, y)</code>.
- */
-void win2world(int x, int y, vector3_t* dir) {
-    // Compute coordinates in eye frame of corners of view plane.
-    float left = -view_plane_width/2.0f;
-    float bottom = -view_plane_height/2.0f;
-
-    // Compute vector from eye to window position in eye coordinates.
-    float u = left + (x+.5f)/win_width*view_plane_width;
-    float v = bottom + (y+.5f)/win_height*view_plane_height;
-    float w = -view_plane_dist;
-    debug_c((x == 400 && y == 300),
-            "win2world():  u, v, w, = %f, %f, %f", u, v, w);
-
-    // Transform vector to world coordinates.
-    dir->x = u*eye_frame_u.x + v*eye_frame_v.x + w*eye_frame_w.x;
-    dir->y = u*eye_frame_u.y + v*eye_frame_v.y + w*eye_frame_w.y;
-    dir->z = u*eye_frame_u.z + v*eye_frame_v.z + w*eye_frame_w.z;
-    debug_c((x==400 && y==300),
-        "win2world():  i, j, k = %f, %f, %f\n", dir->x, dir->y, dir->z);
-}
-
-/**
- * refract - Calculates the refracted ray and store it at t_ray. If there is
- * total internal reflection return false and do not store anything at t_ray,
- * otherwise return true.
- *
- * This assumes the other surface refr_index == 1.0 (like air) as we assume
- * all surfaces are surrounded by air. 
- *
- * @param ray - the ray that is hitting the surface
- * @param normal - the normal vector of the surface
- * @param refr_index - the refractive index of the surface
- * @param t_vec - location where to store the direction of transformed ray.
- */
-bool refract(ray3_t* ray, vector3_t* normal, float refr_index, vector3_t*
-        t_vec, bool in_trans) {
-    // Notation from Shirley and Marschner page 305.
-    // Calculate part 2 first, and check for total internal reflection.
-
-    vector3_t* d = &ray->dir;
-    vector3_t* n = normal;
-    normalize(d);
-    normalize(n);
-
-    float d_dot_n = dot(d, n);
-    float d_dot_n2 = d_dot_n * d_dot_n;
-
-    // Refraction index ratio:
-    float refr_ratio;
-    // Assume objects are surrounded by air with index 1.0. As we move between
-    // transparent and non transparent surfaces our ratio is either refr_index
-    // or 1/refr_index.
-    if (!in_trans) refr_ratio = refr_index;
-    else refr_ratio = 1.0f/refr_index;
-
-    //refr_ratio = 1.0f/refr_index;
-    float refr_ratio2 = refr_ratio * refr_ratio;
-
-    // Part 2: (1 - n^2(1 - d_dot_n^2)/1)
-    float under_sqrt = (1.0f - refr_ratio2*(1 - d_dot_n2));
-    if (under_sqrt < 0) {
-        // Total internal reflection.
-        return false;
-    }
-
-    vector3_t part2;
-    multiply(n, sqrt(under_sqrt), &part2);
-
-    // Part 1: n(d - n(d dot n)
-    vector3_t ndn, d_minus_ndn, part1;
-    // d - n(d (dot) n)
-    multiply(n, d_dot_n, &ndn);
-    subtract(d, &ndn, &d_minus_ndn);
-
-    multiply(&d_minus_ndn, refr_ratio, &part1);
-
-    // Store part1 - part2 at t_ray, return true.
-    subtract(&part1, &part2, t_vec);
-    normalize(t_vec);
-    return true;
-}
-
-/**
- * Calculate the direction of a reflected ray off of a surface.
- *
- * @param i_ray - the incoming incident ray.
- * @param normal - the normal vector of the surface.
- * @param r_vec - the vector to store the reflected ray's direction at.
- */
-void reflect(ray3_t* i_ray, vector3_t* normal, vector3_t* r_vec) {
-    // Let v = incident vector, n = normal vector
-    // Reflection vector = v - 2(v dot n)n
-    vector3_t v = i_ray->dir;
-    vector3_t tmp;
-    
-    // 2 * (v dot n) n
-    multiply(normal, (2.0f*dot(&v, normal)), &tmp);
-
-    subtract(&v, &tmp, r_vec);
-}
@@ -0,0 +1,172 @@
+/** Framebuffer functions.
+ *
+ *  @file framebuffer.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "debug.h"
+#include "framebuffer.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Quantization scale for fb_to_rgba8().  With SRGB_ENCODE, components are
+// quantized to 12 bits and then looked up in a table of sRGB values.
+#ifdef SRGB_ENCODE
+#define ENCODE_SCALE 4095.0f
+static unsigned char srgb_lut[4096];
+static bool srgb_lut_ready = false;
+#define ENCODE(q) (srgb_lut[q])
+#else
+#define ENCODE_SCALE 255.0f
+#define ENCODE(q) ((unsigned char)(q))
+#endif
+
+framebuffer_t* make_framebuffer(int width, int height) {
+    framebuffer_t* frame = MALLOC1(framebuffer_t);
+    frame->width = width;
+    frame->height = height;
+    frame->tiles_x = (width + TILE_SIZE - 1)/TILE_SIZE;
+    frame->tiles_y = (height + TILE_SIZE - 1)/TILE_SIZE;
+    frame->pixels = calloc(frame->tiles_x*frame->tiles_y*TILE_SIZE*TILE_SIZE,
+            sizeof(color_t));
+    debug("make_framebuffer():  %d x %d pixels, %d x %d tiles", width, height,
+            frame->tiles_x, frame->tiles_y);
+    return frame;
+}
+
+void fb_free(framebuffer_t* frame) {
+    if (frame == NULL) return;
+    free(frame->pixels);
+    free(frame);
+}
+
+#ifdef SRGB_ENCODE
+/** Fill the table mapping 12-bit linear values to 8-bit sRGB values.
+ */
+static void make_srgb_lut() {
+    for (int i=0; i<4096; ++i) {
+        float v = i/4095.0f;
+        float e = v <= .0031308f ? 12.92f*v : 1.055f*pow(v, 1/2.4f) - .055f;
+        srgb_lut[i] = (unsigned char)(e*255.0f + .5f);
+    }
+    srgb_lut_ready = true;
+}
+#endif
+
+/** Encode one component for fb_to_rgba8().
+ *
+ *  @param v the component value.
+ *
+ *  @return the 8-bit encoded value.
+ */
+static inline unsigned char encode(float v) {
+    // Written so that NaN clamps to 0, as _mm_max_ps() does.
+    v = v > 0.0f ? v : 0.0f;
+    v = min(v, 1.0f);
+    return ENCODE((int)(v*ENCODE_SCALE + .5f));
+}
+
+/** Encode a run of pixels for fb_to_rgba8().
+ *
+ *  @param in the pixels.
+ *  @param n the number of pixels.
+ *  @param out filled with <code>4*n</code> bytes of RGBA data.
+ */
+static void encode_run(color_t* in, int n, unsigned char* out) {
+    int i = 0;
+#ifdef __SSE2__
+    // Four pixels are twelve floats, i.e. three vectors.  Clamp, scale
+    // and convert all three, then spread the results out and add alpha.
+    float* f = (float*)in;
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 scale = _mm_set1_ps(ENCODE_SCALE);
+    __m128 half = _mm_set1_ps(.5f);
+    int q[12];
+    for (; i+4 <= n; i += 4) {
+        for (int k=0; k<3; ++k) {
+            __m128 v = _mm_loadu_ps(f + 3*i + 4*k);
+            v = _mm_min_ps(_mm_max_ps(v, zero), one);
+            v = _mm_add_ps(_mm_mul_ps(v, scale), half);
+            _mm_storeu_si128((__m128i*)(q + 4*k), _mm_cvttps_epi32(v));
+        }
+        unsigned char* o = out + 4*i;
+        for (int p=0; p<4; ++p) {
+            o[4*p] = ENCODE(q[3*p]);
+            o[4*p+1] = ENCODE(q[3*p+1]);
+            o[4*p+2] = ENCODE(q[3*p+2]);
+            o[4*p+3] = 255;
+        }
+    }
+#endif
+    for (; i<n; ++i) {
+        out[4*i] = encode(in[i].red);
+        out[4*i+1] = encode(in[i].green);
+        out[4*i+2] = encode(in[i].blue);
+        out[4*i+3] = 255;
+    }
+}
+
+void fb_to_rgba8(framebuffer_t* frame, unsigned char* rgba, bool top_down) {
+#ifdef SRGB_ENCODE
+    if (!srgb_lut_ready) make_srgb_lut();
+#endif
+    for (int ty=0; ty<frame->tiles_y; ++ty) {
+        int y0 = ty*TILE_SIZE;
+        int rows = min(TILE_SIZE, frame->height - y0);
+        for (int tx=0; tx<frame->tiles_x; ++tx) {
+            int x0 = tx*TILE_SIZE;
+            int cols = min(TILE_SIZE, frame->width - x0);
+            color_t* tile = fb_tile(frame, tx, ty);
+            for (int j=0; j<rows; ++j) {
+                int y = top_down ? frame->height - 1 - (y0+j) : y0+j;
+                encode_run(tile + j*TILE_SIZE, cols,
+                        rgba + 4*(y*frame->width + x0));
+            }
+        }
+    }
+}
+
+unsigned char* fb_to_ppm(framebuffer_t* frame, size_t* size) {
+    char header[64];
+    int header_len = sprintf(header, "P6\n%d %d\n255\n", frame->width,
+            frame->height);
+    size_t num_pixels = (size_t)frame->width*frame->height;
+    unsigned char* rgba = malloc(4*num_pixels);
+    fb_to_rgba8(frame, rgba, true);
+    unsigned char* ppm = malloc(header_len + 3*num_pixels);
+    memcpy(ppm, header, header_len);
+    for (size_t i=0; i<num_pixels; ++i) {
+        memcpy(ppm + header_len + 3*i, rgba + 4*i, 3);
+    }
+    free(rgba);
+    *size = header_len + 3*num_pixels;
+    return ppm;
+}
+
+bool framebuffer_write_ppm(framebuffer_t* frame, const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    size_t size;
+    unsigned char* ppm = fb_to_ppm(frame, &size);
+    bool ok = fwrite(ppm, 1, size, f) == size;
+    free(ppm);
+    if (fclose(f) != 0) ok = false;
+    if (!ok) perror(path);
+    return ok;
+}
@@ -0,0 +1,121 @@
+/** @file framebuffer.h A tiled, in-memory framebuffer.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "color.h"
+
+/** The width and height, in pixels, of a framebuffer tile.
+ */
+#define TILE_SIZE 16
+
+/** The type of a framebuffer.  The structure is exposed below.
+ */
+typedef struct _framebuffer_t framebuffer_t;
+
+/** A framebuffer divided into square tiles.  The pixels of each tile are
+ *  stored contiguously in row-major order, and the tiles themselves are
+ *  stored in row-major order, so rendering a tile at a time touches
+ *  memory sequentially.  Tiles on the right and top edges are padded out
+ *  to full size.
+ */
+struct _framebuffer_t {
+    /** The width of the image in pixels.
+     */
+    int width;
+    /** The height of the image in pixels.
+     */
+    int height;
+    /** The number of tiles across and up the image.
+     */
+    int tiles_x, tiles_y;
+    /** The pixels, tile by tile.
+     */
+    color_t* pixels;
+};
+
+/** Create a framebuffer with every pixel set to black.
+ *
+ *  @param width the width of the image in pixels.
+ *  @param height the height of the image in pixels.
+ *
+ *  @return the new framebuffer.
+ */
+framebuffer_t* make_framebuffer(int width, int height);
+
+/** Free a framebuffer.
+ *
+ *  @param frame the framebuffer.
+ */
+void fb_free(framebuffer_t* frame);
+
+/** Get the first pixel of a tile.  The pixel at column <i>i</i> and row
+ *  <i>j</i> of the tile is at offset <code>j*TILE_SIZE + i</code>.
+ *
+ *  @param frame the framebuffer.
+ *  @param tx the column of the tile.
+ *  @param ty the row of the tile.
+ *
+ *  @return a pointer to the first pixel of the tile.
+ */
+static inline color_t* fb_tile(framebuffer_t* frame, int tx, int ty) {
+    return frame->pixels + (ty*frame->tiles_x + tx)*TILE_SIZE*TILE_SIZE;
+}
+
+/** Get a single pixel of a framebuffer.  Prefer <code>fb_tile()</code>
+ *  when visiting many pixels.
+ *
+ *  @param frame the framebuffer.
+ *  @param x the column of the pixel, from the left.
+ *  @param y the row of the pixel, from the bottom.
+ *
+ *  @return a pointer to the pixel.
+ */
+static inline color_t* fb_pixel(framebuffer_t* frame, int x, int y) {
+    return fb_tile(frame, x/TILE_SIZE, y/TILE_SIZE) +
+        (y%TILE_SIZE)*TILE_SIZE + x%TILE_SIZE;
+}
+
+/** Clamp a framebuffer to [0, 1] and quantize it to 8 bits per component
+ *  in the packed RGBA layout, with alpha set to 255.  Colors are treated
+ *  as display values, as <code>glDrawPixels()</code> of the float buffer
+ *  always has; if <code>SRGB_ENCODE</code> is defined, they are instead
+ *  treated as linear and encoded with the sRGB transfer curve.
+ *
+ *  @param frame the framebuffer.
+ *  @param rgba the array to fill; it must have room for
+ *      <code>4*width*height</code> bytes.
+ *  @param top_down if <code>true</code>, the top row of the image is
+ *      stored first; otherwise the bottom row is.
+ */
+void fb_to_rgba8(framebuffer_t* frame, unsigned char* rgba, bool top_down);
+
+/** Encode a framebuffer as a binary PPM, top row first, with components
+ *  clamped and quantized as by <code>fb_to_rgba8()</code>.
+ *
+ *  @param frame the framebuffer.
+ *  @param size filled with the length of the PPM in bytes.
+ *
+ *  @return the PPM, which the caller must free.
+ */
+unsigned char* fb_to_ppm(framebuffer_t* frame, size_t* size);
+
+/** Write a framebuffer to a file as a binary PPM, as encoded by
+ *  <code>fb_to_ppm()</code>.
+ *
+ *  @param frame the framebuffer.
+ *  @param path the file to write.
+ *
+ *  @return <code>true</code> if the file was written; otherwise the
+ *      error is printed with <code>perror()</code>.
+ */
+bool framebuffer_write_ppm(framebuffer_t* frame, const char* path);
+
+#endif
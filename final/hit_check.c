@@ -0,0 +1,877 @@
+/** A differential test and benchmark of the accelerated intersection paths.
+ *
+ *  @file hit_check.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Fires random rays at generated scenes and finds the nearest hit of
+ *  each ray twice.  The brute-force way tests every surface in turn, as
+ *  ray_trace() does with the top-level list.  The accelerated way goes
+ *  through one of the paths the tracer uses: bounding-box trees (the
+ *  four-wide BVH at the root, and the binary nodes below it), sphere
+ *  packets, out-of-core pages, and instances.  Every path must find the
+ *  same nearest hit as brute force.  Instances place the scene with a
+ *  random scale, rotation and translation, and are checked against brute
+ *  force over the scene's geometry moved into the world by the same
+ *  transform: triangles by their vertices, spheres by their centers and
+ *  radii, and boxes as the triangles of their faces.  The scale is
+ *  uniform unless the scene is all triangles, since only triangles stay
+ *  triangles under any affine transform.  Where the two disagree only
+ *  because a ray grazes an edge, so that rounding decides, the ray is
+ *  counted as too close to call.  The rays/second of each path, and its
+ *  speedup over brute force, are reported.  Rays are also fired in
+ *  bundles, like the viewing rays of a tile, through random frustums;
+ *  each bundle searches the tree from the entry point its frustum gives,
+ *  or skips it if the frustum misses.  Before the scenes, the sphere test
+ *  itself is checked against roots found in double precision.  E.g.,
+ *
+ *      $ make hit_check && ./hit_check 100000 7
+ *
+ *  Usage:  hit_check [rays [seed]].  There are a million rays per scene
+ *  by default, which take a few minutes, nearly all of it brute force; a
+ *  tenth as many make a quick check.  Out-of-core pages go in $TMPDIR,
+ *  or /tmp.  The exit status is EXIT_FAILURE if any path missed or added
+ *  a hit.
+ *
+ *  Build with the same options as the tracer (e.g. -DBBT_BINARY,
+ *  -DBVH4_QUANTIZED, -mavx) to check the paths those options select, and
+ *  with a small OOC_PAGE_SURFACES to have out-of-core groups page.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list356.h"
+#include "geom356.h"
+
+#include "surface.h"
+#include "ooc.h"
+#include "sphere_group.h"
+#include "timing.h"
+
+// As in tracer.c.
+#define EPSILON .001
+
+// The scenes fill the cube [-SCENE_SIZE, SCENE_SIZE]^3; it is centered
+// on the origin, so many surfaces lie wholly at negative coordinates.
+#define SCENE_SIZE 10.0f
+
+// The number of surfaces in each scene.
+#define SCENE_SURFACES 2000
+
+// The number of mismatches printed for each path.
+#define MAX_REPORTED 5
+
+// Relative difference in hit time allowed between paths, for packets
+// whose intersection times are computed with SIMD instructions.
+#define T_TOLERANCE 1e-5f
+
+// The number of rays fired through each frustum, and the largest width
+// of a frustum, in radians.
+#define FRUSTUM_RAYS 64
+#define FRUSTUM_WIDTH .2f
+
+/** A ray to fire, with the interval to search.
+ */
+typedef struct _probe_t {
+    ray3_t ray;
+    float t0, t1;
+} probe_t;
+
+/** An accelerated path: a way to build top-level surfaces for a scene.
+ */
+typedef struct _path_t {
+    const char* name;
+    /** Build the path's surfaces.
+     *
+     *  @param surfaces the surfaces of the scene.
+     *
+     *  @return the top-level surfaces to test rays against, or
+     *      <code>NULL</code> if the path cannot be built.
+     */
+    list356_t* (*build)(list356_t* surfaces);
+    /** Whether hits report the surface that was hit, rather than one with
+     *  the same material.
+     */
+    bool same_sfc;
+    /** Whether the path places the scene with <code>xfrm</code>, so that
+     *  it is checked against the scene's geometry moved into the world.
+     */
+    bool transformed;
+} path_t;
+
+static color_t color = {.5f, .5f, .5f};
+
+// The transform that transformed paths place each scene with, in the form
+// taken by make_instance(); a new one is made for each scene.
+static float xfrm[16];
+
+static float rand_in(float lo, float hi) {
+    return lo + (hi-lo)*drand48();
+}
+
+static point3_t rand_point(float size) {
+    return (point3_t){rand_in(-size, size), rand_in(-size, size),
+        rand_in(-size, size)};
+}
+
+/** A uniformly distributed unit vector.
+ */
+static vector3_t rand_dir() {
+    float z = rand_in(-1, 1), a = rand_in(0, 2*M_PI);
+    float r = sqrt(1 - z*z);
+    return (vector3_t){r*cos(a), r*sin(a), z};
+}
+
+static void add_sphere(list356_t* surfaces, point3_t c, float r) {
+    lst_add(surfaces, make_sphere(c.x, c.y, c.z, r, &color, &color, &color,
+                10.0f));
+}
+
+static void add_triangle(list356_t* surfaces, point3_t a, float size) {
+    point3_t b = {a.x + rand_in(-size, size), a.y + rand_in(-size, size),
+        a.z + rand_in(-size, size)};
+    point3_t c = {a.x + rand_in(-size, size), a.y + rand_in(-size, size),
+        a.z + rand_in(-size, size)};
+    lst_add(surfaces, make_triangle(a, b, c, &color, &color, &color, 10.0f));
+}
+
+/** Make a random transform, of a scale, then a rotation, then a
+ *  translation, into <code>xfrm</code>.  The scene stays mostly where
+ *  the rays are fired.
+ *
+ *  @param uniform whether to scale by the same factor along every axis,
+ *      so that the transform is a similarity.
+ */
+static void rand_xfrm(bool uniform) {
+    // A random rotation, from a uniformly distributed unit quaternion.
+    float u1 = drand48(), u2 = rand_in(0, 2*M_PI), u3 = rand_in(0, 2*M_PI);
+    float w = sqrt(1 - u1)*sin(u2), x = sqrt(1 - u1)*cos(u2),
+          y = sqrt(u1)*sin(u3), z = sqrt(u1)*cos(u3);
+    float rot[3][3] = {
+        {1 - 2*(y*y + z*z), 2*(x*y - w*z), 2*(x*z + w*y)},
+        {2*(x*y + w*z), 1 - 2*(x*x + z*z), 2*(y*z - w*x)},
+        {2*(x*z - w*y), 2*(y*z + w*x), 1 - 2*(x*x + y*y)}
+    };
+    float scale[3] = {rand_in(.5f, 1.5f), rand_in(.5f, 1.5f),
+        rand_in(.5f, 1.5f)};
+    if (uniform) scale[1] = scale[2] = scale[0];
+    point3_t move = rand_point(2);
+    float t[3] = {move.x, move.y, move.z};
+    for (int c=0; c<3; ++c) {
+        for (int r=0; r<3; ++r) xfrm[4*c+r] = rot[r][c]*scale[c];
+        xfrm[4*c+3] = 0;
+        xfrm[12+c] = t[c];
+    }
+    xfrm[15] = 1;
+}
+
+//
+// SCENES.
+//
+
+static list356_t* make_spheres() {
+    list356_t* surfaces = make_list();
+    for (int i=0; i<SCENE_SURFACES; ++i) {
+        add_sphere(surfaces, rand_point(SCENE_SIZE), rand_in(.05f, .5f));
+    }
+    return surfaces;
+}
+
+static list356_t* make_triangles() {
+    list356_t* surfaces = make_list();
+    for (int i=0; i<SCENE_SURFACES; ++i) {
+        add_triangle(surfaces, rand_point(SCENE_SIZE), 1.0f);
+    }
+    return surfaces;
+}
+
+/** Clusters of spheres, triangles and boxes, with some long thin
+ *  triangles and axis-aligned ones (whose boxes are flat) across them.
+ */
+static list356_t* make_mixed() {
+    list356_t* surfaces = make_list();
+    int per_cluster = SCENE_SURFACES/20;
+    for (int k=0; k<20; ++k) {
+        point3_t center = rand_point(SCENE_SIZE - 2);
+        for (int i=0; i<per_cluster; ++i) {
+            point3_t q = rand_point(2);
+            point3_t p = {center.x + q.x, center.y + q.y, center.z + q.z};
+            switch (i%8) {
+                case 0:
+                    lst_add(surfaces, make_box(p,
+                                (point3_t){p.x + rand_in(.05f, .5f),
+                                p.y + rand_in(.05f, .5f),
+                                p.z + rand_in(.05f, .5f)},
+                                &color, &color, &color, 10.0f));
+                    break;
+                case 1:
+                    add_triangle(surfaces, p, SCENE_SIZE);
+                    break;
+                case 2: {
+                    // In the plane x = p.x.
+                    point3_t b = {p.x, p.y + 1, p.z}, c = {p.x, p.y, p.z + 1};
+                    lst_add(surfaces, make_triangle(p, b, c, &color, &color,
+                                &color, 10.0f));
+                    break;
+                }
+                case 3: case 4: case 5:
+                    add_sphere(surfaces, p, rand_in(.02f, .3f));
+                    break;
+                default:
+                    add_triangle(surfaces, p, .3f);
+            }
+        }
+    }
+    return surfaces;
+}
+
+//
+// PATHS.
+//
+
+static list356_t* one_surface(surface_t* sfc) {
+    if (sfc == NULL) return NULL;
+    list356_t* top = make_list();
+    lst_add(top, sfc);
+    return top;
+}
+
+static list356_t* build_bbt(list356_t* surfaces) {
+    return one_surface(make_bbt_node(surfaces));
+}
+
+/** The children of the root of a bounding-box tree; only the root is
+ *  traced through a four-wide BVH, so rays go through the binary nodes.
+ */
+static list356_t* build_bbt_binary(list356_t* surfaces) {
+    surface_t *left, *right;
+    bbt_children(make_bbt_node(surfaces), &left, &right);
+    list356_t* top = make_list();
+    if (left != NULL) lst_add(top, left);
+    if (right != NULL) lst_add(top, right);
+    return top;
+}
+
+static list356_t* build_sphere_group(list356_t* surfaces) {
+    return one_surface(make_sphere_group(surfaces));
+}
+
+static list356_t* build_ooc(list356_t* surfaces) {
+    const char* dir = getenv("TMPDIR");
+    return one_surface(make_ooc_group(surfaces, dir != NULL ? dir : "/tmp"));
+}
+
+static list356_t* build_instance(list356_t* surfaces) {
+    return one_surface(make_instance(make_bbt_node(surfaces), xfrm));
+}
+
+/** A surface of a scene moved into the world, and the surface of the
+ *  scene it was made from.
+ */
+typedef struct _world_sfc_t {
+    surface_t* world;
+    surface_t* sfc;
+} world_sfc_t;
+
+/** A scene moved into the world by <code>xfrm</code>, without instances:
+ *  the scene that transformed paths are checked against.
+ */
+typedef struct _world_t {
+    list356_t* surfaces;
+    /** The world surfaces and the surfaces they were made from, sorted by
+     *  world surface, and again by the surface made from.
+     */
+    world_sfc_t *by_world, *by_sfc;
+    int n;
+} world_t;
+
+/** Compare world surfaces by address, for qsort() and bsearch().
+ */
+static int world_cmp(const void* a, const void* b) {
+    surface_t* x = ((world_sfc_t*)a)->world;
+    surface_t* y = ((world_sfc_t*)b)->world;
+    return x < y ? -1 : x > y;
+}
+
+/** Compare world surfaces by the address of the surface they were made
+ *  from, for qsort() and bsearch().
+ */
+static int sfc_cmp(const void* a, const void* b) {
+    surface_t* x = ((world_sfc_t*)a)->sfc;
+    surface_t* y = ((world_sfc_t*)b)->sfc;
+    return x < y ? -1 : x > y;
+}
+
+/** Move a point with <code>xfrm</code>.
+ */
+static point3_t xfrm_point(point3_t p) {
+    return (point3_t){
+        xfrm[0]*p.x + xfrm[4]*p.y + xfrm[8]*p.z + xfrm[12],
+        xfrm[1]*p.x + xfrm[5]*p.y + xfrm[9]*p.z + xfrm[13],
+        xfrm[2]*p.x + xfrm[6]*p.y + xfrm[10]*p.z + xfrm[14]};
+}
+
+/** Add a world surface for a surface of a scene.
+ */
+static void add_world(world_t* world, surface_t* world_sfc,
+        surface_t* sfc) {
+    lst_add(world->surfaces, world_sfc);
+    world->by_world[world->n++] = (world_sfc_t){world_sfc, sfc};
+}
+
+/** Move a scene into the world by <code>xfrm</code>.  Spheres and boxes
+ *  are only moved right by a similarity.
+ *
+ *  @param surfaces the surfaces of the scene: spheres, triangles and
+ *      boxes.
+ *  @param world filled with the moved scene.
+ */
+static void make_world(list356_t* surfaces, world_t* world) {
+    // The faces of a box, as the corners of two triangles each, with bit
+    // 0 of a corner choosing the high x, bit 1 the high y and bit 2 the
+    // high z.
+    static const int faces[12][3] = {
+        {0, 2, 3}, {0, 3, 1}, {4, 5, 7}, {4, 7, 6},
+        {0, 1, 5}, {0, 5, 4}, {2, 6, 7}, {2, 7, 3},
+        {0, 4, 6}, {0, 6, 2}, {1, 3, 7}, {1, 7, 5}};
+    world->surfaces = make_list();
+    world->by_world = malloc(12*lst_size(surfaces)*sizeof(world_sfc_t));
+    world->n = 0;
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        point3_t p[8];
+        float r;
+        if (sfc_sphere_geometry(sfc, &p[0], &r)) {
+            // The columns of a similarity all have the scale as length.
+            float scale = sqrt(xfrm[0]*xfrm[0] + xfrm[1]*xfrm[1] +
+                    xfrm[2]*xfrm[2]);
+            p[0] = xfrm_point(p[0]);
+            add_world(world, make_sphere(p[0].x, p[0].y, p[0].z, scale*r,
+                        &color, &color, &color, 10.0f), sfc);
+        } else if (sfc_triangle_geometry(sfc, &p[0], &p[1], &p[2])) {
+            add_world(world, make_triangle(xfrm_point(p[0]),
+                        xfrm_point(p[1]), xfrm_point(p[2]), &color, &color,
+                        &color, 10.0f), sfc);
+        } else if (sfc_box_geometry(sfc, &p[0], &p[7])) {
+            point3_t lo = p[0], hi = p[7];
+            for (int k=0; k<8; ++k) {
+                p[k] = xfrm_point((point3_t){k & 1 ? hi.x : lo.x,
+                        k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z});
+            }
+            for (int f=0; f<12; ++f) {
+                add_world(world, make_triangle(p[faces[f][0]],
+                            p[faces[f][1]], p[faces[f][2]], &color, &color,
+                            &color, 10.0f), sfc);
+            }
+        }
+    }
+    lst_iterator_free(s);
+    world->by_sfc = malloc(world->n*sizeof(world_sfc_t));
+    memcpy(world->by_sfc, world->by_world, world->n*sizeof(world_sfc_t));
+    qsort(world->by_world, world->n, sizeof(world_sfc_t), world_cmp);
+    qsort(world->by_sfc, world->n, sizeof(world_sfc_t), sfc_cmp);
+}
+
+static void world_free(world_t* world) {
+    list356_itr_t* s = lst_iterator(world->surfaces);
+    while (lst_has_next(s)) sfc_free(lst_next(s));
+    lst_iterator_free(s);
+    lst_free(world->surfaces);
+    free(world->by_world);
+    free(world->by_sfc);
+}
+
+/** Determine whether a ray meets a world surface so close to an edge of
+ *  it, or for a sphere so close to tangent, that rounding in the world or
+ *  in the scene's frame may decide whether it hits.
+ *
+ *  @param sfc the world surface.
+ *  @param ray the ray.
+ *  @param t the time the ray meets <code>sfc</code>, or its plane.
+ */
+static bool grazes(surface_t* sfc, ray3_t* ray, float t) {
+    float margin = T_TOLERANCE*3*SCENE_SIZE;
+    point3_t v[3];
+    float r;
+    if (sfc_sphere_geometry(sfc, &v[0], &r)) {
+        vector3_t to_c, side;
+        pv_subtract(&v[0], &ray->base, &to_c);
+        cross(&to_c, &ray->dir, &side);
+        return fabsf(norm(&side)/norm(&ray->dir) - r) < margin;
+    }
+    if (!sfc_triangle_geometry(sfc, &v[0], &v[1], &v[2])) return false;
+    point3_t p = {ray->base.x + t*ray->dir.x, ray->base.y + t*ray->dir.y,
+        ray->base.z + t*ray->dir.z};
+    for (int k=0; k<3; ++k) {
+        vector3_t edge, to_p, side;
+        pv_subtract(&v[(k+1)%3], &v[k], &edge);
+        pv_subtract(&p, &v[k], &to_p);
+        cross(&edge, &to_p, &side);
+        if (norm(&side) < margin*norm(&edge)) return true;
+    }
+    return false;
+}
+
+/** Determine whether a ray meets any of the world surfaces made from a
+ *  surface of the scene too close to an edge for rounding to decide.
+ *
+ *  @param world the world.
+ *  @param sfc the surface of the scene.
+ *  @param ray the ray.
+ *  @param t the time the ray meets <code>sfc</code>.
+ */
+static bool grazes_any(world_t* world, surface_t* sfc, ray3_t* ray,
+        float t) {
+    world_sfc_t key = {NULL, sfc};
+    world_sfc_t* found = bsearch(&key, world->by_sfc, world->n,
+            sizeof(world_sfc_t), sfc_cmp);
+    if (found == NULL) return false;
+    while (found > world->by_sfc && found[-1].sfc == sfc) --found;
+    for (; found < world->by_sfc + world->n && found->sfc == sfc; ++found) {
+        if (grazes(found->world, ray, t)) return true;
+    }
+    return false;
+}
+
+/** Determine whether a ray hits any of the world surfaces made from a
+ *  surface of the scene in an interval.
+ *
+ *  @param world the world.
+ *  @param sfc the surface of the scene.
+ *  @param ray the ray.
+ *  @param t0 the start of the interval.
+ *  @param t1 the end of the interval.
+ */
+static bool hits_any(world_t* world, surface_t* sfc, ray3_t* ray,
+        float t0, float t1) {
+    world_sfc_t key = {NULL, sfc};
+    world_sfc_t* found = bsearch(&key, world->by_sfc, world->n,
+            sizeof(world_sfc_t), sfc_cmp);
+    if (found == NULL) return false;
+    while (found > world->by_sfc && found[-1].sfc == sfc) --found;
+    for (; found < world->by_sfc + world->n && found->sfc == sfc; ++found) {
+        hit_record_t rec;
+        if (sfc_hit(found->world, ray, t0, t1, &rec)) return true;
+    }
+    return false;
+}
+
+/** Determine whether a scene is all triangles.
+ */
+static bool all_triangles(list356_t* surfaces) {
+    bool all = true;
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (all && lst_has_next(s)) {
+        point3_t a, b, c;
+        all = sfc_triangle_geometry(lst_next(s), &a, &b, &c);
+    }
+    lst_iterator_free(s);
+    return all;
+}
+
+// Out-of-core groups free the scene's spheres and triangles, so they come
+// last.
+static path_t paths[] = {
+    {"bbt", build_bbt, true, false},
+    {"bbt binary", build_bbt_binary, true, false},
+    {"sphere group", build_sphere_group, true, false},
+    {"instance", build_instance, true, true},
+    {"out-of-core", build_ooc, false, false},
+};
+
+#define NUM_PATHS (int)(sizeof(paths)/sizeof(path_t))
+
+//
+// RAYS.
+//
+
+/** Make random rays at a scene.  They cycle through four kinds:
+ *  -# from anywhere near the scene, in any direction;
+ *  -# the same, ending at a random distance, like shadow rays;
+ *  -# from outside the scene, aimed into it, with unnormalized
+ *     directions, like viewing rays;
+ *  -# parallel to one or two axes, which slab tests divide by zero for.
+ */
+static probe_t* make_probes(int n) {
+    probe_t* probes = malloc(n*sizeof(probe_t));
+    for (int i=0; i<n; ++i) {
+        probe_t* p = &probes[i];
+        p->t0 = EPSILON;
+        p->t1 = FLT_MAX;
+        p->ray.base = rand_point(1.5f*SCENE_SIZE);
+        p->ray.dir = rand_dir();
+        switch (i%4) {
+            case 1:
+                p->t1 = rand_in(0, 2*SCENE_SIZE);
+                break;
+            case 2: {
+                vector3_t out = rand_dir();
+                multiply(&out, 3*SCENE_SIZE, &out);
+                p->ray.base = (point3_t){out.x, out.y, out.z};
+                point3_t target = rand_point(SCENE_SIZE);
+                pv_subtract(&target, &p->ray.base, &p->ray.dir);
+                multiply(&p->ray.dir, rand_in(.01f, 1), &p->ray.dir);
+                break;
+            }
+            case 3:
+                p->ray.dir.x = 0.0f;
+                if (drand48() < .5) p->ray.dir.y = 0.0f;
+                if (p->ray.dir.y == 0.0f && p->ray.dir.z == 0.0f) {
+                    p->ray.dir.z = 1.0f;
+                }
+                break;
+        }
+    }
+    return probes;
+}
+
+/** Find the nearest hit of a ray, testing each of a list of surfaces in
+ *  turn.
+ *
+ *  @param surfaces the surfaces.
+ *  @param p the ray.
+ *  @param rec filled with the nearest hit, if there is one.
+ *
+ *  @return <code>true</code> if the ray hits a surface.
+ */
+static bool nearest_hit(list356_t* surfaces, probe_t* p, hit_record_t* rec) {
+    float t1 = p->t1;
+    bool hit = false;
+    hit_record_t hit_rec;
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        if (sfc_hit(sfc, &p->ray, p->t0, t1, &hit_rec) && hit_rec.t < t1) {
+            *rec = hit_rec;
+            t1 = hit_rec.t;
+            hit = true;
+        }
+    }
+    lst_iterator_free(s);
+    return hit;
+}
+
+/** Find the nearest hit of each ray.
+ *
+ *  @return the time taken, in seconds.
+ */
+static double fire(list356_t* surfaces, probe_t* probes, int n,
+        bool* hits, hit_record_t* recs) {
+    struct timespec start;
+    timer_start(&start);
+    for (int i=0; i<n; ++i) {
+        hits[i] = nearest_hit(surfaces, &probes[i], &recs[i]);
+    }
+    return seconds_since(&start);
+}
+
+/** Determine whether two nearest hits are the same.  The hit times may
+ *  differ by <code>T_TOLERANCE</code> relative to the reference time,
+ *  plus <code>slack</code>.
+ */
+static bool same_hit(bool hit, hit_record_t* rec, bool ref_hit,
+        hit_record_t* ref, bool same_sfc, float slack) {
+    if (hit != ref_hit) return false;
+    if (!hit) return true;
+    if (fabsf(rec->t - ref->t) > T_TOLERANCE*fabsf(ref->t) + slack) {
+        return false;
+    }
+    if (same_sfc) return rec->sfc == ref->sfc;
+    return dot(&rec->normal, &ref->normal) > .999f;
+}
+
+/** Check the sphere test against roots found in double precision, for
+ *  spheres near and far, rays from inside them, and rays that pass just
+ *  inside or outside their rims.  Rays too close to tangent, or hits too
+ *  close to the ends of the interval, for float to decide are skipped.
+ *
+ *  @return the number of rays the sphere test got wrong.
+ */
+static int check_sphere_roots(int n) {
+    int mismatches = 0, skipped = 0, inside = 0;
+    for (int i=0; i<n; ++i) {
+        float size = i%2 == 0 ? SCENE_SIZE : 100*SCENE_SIZE;
+        point3_t c = rand_point(size);
+        float r = rand_in(.01f, 5);
+        surface_t* sfc = make_sphere(c.x, c.y, c.z, r, &color, &color,
+                &color, 10.0f);
+
+        probe_t p = {.t0 = EPSILON, .t1 = FLT_MAX};
+        vector3_t off = rand_dir();
+        if (i%3 == 0) {
+            // From inside, as a ray refracted into the sphere is.
+            multiply(&off, r*rand_in(0, .99f), &off);
+            p.ray.base = (point3_t){c.x + off.x, c.y + off.y, c.z + off.z};
+            p.ray.dir = rand_dir();
+            ++inside;
+        } else {
+            // From outside, aimed just inside or outside the rim.
+            p.ray.base = rand_point(size);
+            vector3_t to_c, side;
+            pv_subtract(&c, &p.ray.base, &to_c);
+            cross(&to_c, &off, &side);
+            normalize(&side);
+            multiply(&side, r*rand_in(.9f, 1.1f), &side);
+            point3_t target;
+            pv_add(&c, &side, &target);
+            pv_subtract(&target, &p.ray.base, &p.ray.dir);
+            multiply(&p.ray.dir, rand_in(.01f, 1), &p.ray.dir);
+        }
+        if (i%4 == 1) p.t1 = rand_in(0, 2*size);
+
+        double e[3] = {p.ray.base.x - c.x, p.ray.base.y - c.y,
+            p.ray.base.z - c.z};
+        double d[3] = {p.ray.dir.x, p.ray.dir.y, p.ray.dir.z};
+        double a = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+        double b = d[0]*e[0] + d[1]*e[1] + d[2]*e[2];
+        double cc = e[0]*e[0] + e[1]*e[1] + e[2]*e[2] - (double)r*r;
+        double discr = b*b - a*cc;
+        double t = -1.0;
+        if (discr >= 0) {
+            t = (-b - sqrt(discr))/a;
+            if (t < p.t0) t = (-b + sqrt(discr))/a;
+        }
+        bool ref_hit = t >= p.t0 && t <= p.t1;
+
+        // Within about float's rounding of tangent, or of an end of the
+        // interval, either answer is right.  The ray's line passes the
+        // center at distance l.
+        double dist = sqrt(cc + (double)r*r);
+        double l = sqrt(fmax(0, dist*dist - b*b/a));
+        bool unclear = fabs(l - r) < 1e-5*dist ||
+            fabs(t - p.t0) < 1e-4*fabs(t) + 1e-4 ||
+            fabs(t - p.t1) < 1e-4*fabs(t);
+        hit_record_t rec;
+        bool hit = sfc_hit(sfc, &p.ray, p.t0, p.t1, &rec);
+        sfc_free(sfc);
+        if (unclear) {
+            ++skipped;
+            continue;
+        }
+        if (hit == ref_hit && (!hit || fabs(rec.t - t) <= 1e-4*fabs(t))) {
+            continue;
+        }
+        if (mismatches++ < MAX_REPORTED) {
+            fprintf(stderr, "sphere roots: ray from (%g, %g, %g) dir "
+                    "(%g, %g, %g) [%g, %g] at sphere (%g, %g, %g) r=%g: "
+                    "double %s t=%.9g, float %s t=%.9g\n",
+                    p.ray.base.x, p.ray.base.y, p.ray.base.z, p.ray.dir.x,
+                    p.ray.dir.y, p.ray.dir.z, p.t0, p.t1, c.x, c.y, c.z, r,
+                    ref_hit ? "hit" : "missed", t, hit ? "hit" : "missed",
+                    rec.t);
+        }
+    }
+    printf("sphere roots: %d rays, %d from inside, %d too close to call: "
+            "%d mismatches\n", n, inside, skipped, mismatches);
+    return mismatches;
+}
+
+/** Check the entry points of random frustums into a bounding-box tree
+ *  against brute force, with rays fired through each frustum, and print
+ *  the results.
+ *
+ *  @return the number of rays on which the entry points disagreed.
+ */
+static int check_frustums(const char* name, list356_t* surfaces, int n) {
+    surface_t* root = make_bbt_node(surfaces);
+    int mismatches = 0, culled = 0, deep = 0;
+    for (int i=0; i<n; i+=FRUSTUM_RAYS) {
+        // A frustum from outside the scene, aimed at a point near it, so
+        // that some miss it and some only clip its edge, with corner
+        // directions spread about the axis.
+        vector3_t out = rand_dir();
+        multiply(&out, 3*SCENE_SIZE, &out);
+        point3_t apex = {out.x, out.y, out.z};
+        point3_t target = rand_point(1.5f*SCENE_SIZE);
+        vector3_t axis, u, v, dir[4];
+        pv_subtract(&target, &apex, &axis);
+        normalize(&axis);
+        vector3_t up = fabsf(axis.y) < .9f ? (vector3_t){0, 1, 0} :
+            (vector3_t){1, 0, 0};
+        cross(&axis, &up, &u);
+        normalize(&u);
+        cross(&axis, &u, &v);
+        float w = rand_in(.001f, FRUSTUM_WIDTH);
+        for (int k=0; k<4; ++k) {
+            float su = k == 1 || k == 2 ? w : -w, sv = k >= 2 ? w : -w;
+            dir[k] = (vector3_t){axis.x + su*u.x + sv*v.x,
+                axis.y + su*u.y + sv*v.y, axis.z + su*u.z + sv*v.z};
+        }
+        frustum_t frustum;
+        frustum_setup(&frustum, &apex, dir);
+        int entry = sfc_frustum_entry(root, &frustum);
+        if (entry < 0) ++culled;
+        if (entry > 0) ++deep;
+
+        for (int j=0; j<FRUSTUM_RAYS; ++j) {
+            // A ray through the frustum, interpolated between its corners.
+            float a = (float)drand48(), b = (float)drand48();
+            probe_t p = {.ray.base = apex, .t0 = EPSILON, .t1 = FLT_MAX};
+            vector3_t* d = &p.ray.dir;
+            *d = (vector3_t){0, 0, 0};
+            float weight[4] = {(1-a)*(1-b), a*(1-b), a*b, (1-a)*b};
+            for (int k=0; k<4; ++k) {
+                d->x += weight[k]*dir[k].x;
+                d->y += weight[k]*dir[k].y;
+                d->z += weight[k]*dir[k].z;
+            }
+            hit_record_t ref, rec;
+            bool ref_hit = nearest_hit(surfaces, &p, &ref);
+            bool hit = entry >= 0 &&
+                sfc_hit_entry(root, entry, &p.ray, p.t0, p.t1, &rec);
+            if (same_hit(hit, &rec, ref_hit, &ref, true, 0)) continue;
+            if (mismatches++ < MAX_REPORTED) {
+                fprintf(stderr, "%s, frustum: ray from (%g, %g, %g) dir "
+                        "(%g, %g, %g), entry %d: brute force %s t=%.9g, "
+                        "path %s t=%.9g\n", name, apex.x, apex.y, apex.z,
+                        d->x, d->y, d->z, entry, ref_hit ? "hit" : "missed",
+                        ref.t, hit ? "hit" : "missed", rec.t);
+            }
+        }
+    }
+    int frustums = (n + FRUSTUM_RAYS - 1)/FRUSTUM_RAYS;
+    printf("  %-14s %10d   %d frustums, %d culled, %d entered below the "
+            "root\n", "frustum", mismatches, frustums, culled, deep);
+    return mismatches;
+}
+
+/** Check every path against brute force on one scene, and print the
+ *  results.
+ *
+ *  @return the number of rays on which some path disagreed.
+ */
+static int check_scene(const char* name, list356_t* surfaces, int n) {
+    probe_t* probes = make_probes(n);
+    bool* ref_hits = malloc(n*sizeof(bool));
+    bool* hits = malloc(n*sizeof(bool));
+    hit_record_t* refs = malloc(n*sizeof(hit_record_t));
+    hit_record_t* recs = malloc(n*sizeof(hit_record_t));
+    bool* xfrm_hits = malloc(n*sizeof(bool));
+    hit_record_t* xfrm_refs = malloc(n*sizeof(hit_record_t));
+
+    double brute_time = fire(surfaces, probes, n, ref_hits, refs);
+    int num_hits = 0;
+    for (int i=0; i<n; ++i) num_hits += ref_hits[i];
+    printf("%s: %d surfaces, %d rays, %.1f%% hit\n", name,
+            lst_size(surfaces), n, 100.0*num_hits/n);
+    printf("  %-14s %10s %10s %10s\n", "path", "mismatches", "Mrays/s",
+            "speedup");
+    printf("  %-14s %10s %10.3f %10.1f\n", "brute force", "-",
+            n/brute_time/1e6, 1.0);
+
+    // Before the paths, since out-of-core groups free the surfaces.
+    int failures = check_frustums(name, surfaces, n);
+    // The hits on the world surfaces are reported as hits on the
+    // surfaces they were made from, as instances report them.
+    rand_xfrm(!all_triangles(surfaces));
+    world_t world;
+    make_world(surfaces, &world);
+    fire(world.surfaces, probes, n, xfrm_hits, xfrm_refs);
+    for (int i=0; i<n; ++i) {
+        if (!xfrm_hits[i]) continue;
+        world_sfc_t key = {xfrm_refs[i].sfc, NULL};
+        world_sfc_t* found = bsearch(&key, world.by_world, world.n,
+                sizeof(world_sfc_t), world_cmp);
+        xfrm_refs[i].sfc = found->sfc;
+    }
+    for (int k=0; k<NUM_PATHS; ++k) {
+        bool* ref_hit = paths[k].transformed ? xfrm_hits : ref_hits;
+        hit_record_t* ref = paths[k].transformed ? xfrm_refs : refs;
+        list356_t* top = paths[k].build(surfaces);
+        if (top == NULL) {
+            printf("  %-14s %10s\n", paths[k].name, "not built");
+            continue;
+        }
+        double time = fire(top, probes, n, hits, recs);
+
+        int mismatches = 0, unclear = 0;
+        for (int i=0; i<n; ++i) {
+            // Transformed paths round the ray into the scene's frame, and
+            // the reference rounds the geometry into the world's, so
+            // their times differ by rounding at the scene's size too, the
+            // more the more obliquely the ray meets the surface.  Rays
+            // that graze an edge may hit in one and not the other, and
+            // rays through a point where two surfaces cross may hit
+            // either.
+            ray3_t* ray = &probes[i].ray;
+            float slack = 0;
+            if (paths[k].transformed && ref_hit[i]) {
+                vector3_t normal = ref[i].normal;
+                normalize(&normal);
+                slack = T_TOLERANCE*3*SCENE_SIZE/
+                    fmaxf(fabsf(dot(&normal, &ray->dir)), 1e-6f);
+            }
+            if (same_hit(hits[i], &recs[i], ref_hit[i], &ref[i],
+                        paths[k].same_sfc, slack)) {
+                continue;
+            }
+            if (paths[k].transformed && ((ref_hit[i] &&
+                        grazes_any(&world, ref[i].sfc, ray, ref[i].t)) ||
+                    (hits[i] &&
+                        grazes_any(&world, recs[i].sfc, ray, recs[i].t)) ||
+                    (hits[i] && ref_hit[i] &&
+                        fabsf(recs[i].t - ref[i].t) <= slack &&
+                        hits_any(&world, recs[i].sfc, ray,
+                            ref[i].t - slack, ref[i].t + slack)))) {
+                ++unclear;
+                continue;
+            }
+            if (mismatches++ < MAX_REPORTED) {
+                probe_t* p = &probes[i];
+                fprintf(stderr, "%s, %s: ray %d from (%g, %g, %g) dir "
+                        "(%g, %g, %g) [%g, %g]: brute force %s t=%.9g, "
+                        "path %s t=%.9g\n", name, paths[k].name, i,
+                        p->ray.base.x, p->ray.base.y, p->ray.base.z,
+                        p->ray.dir.x, p->ray.dir.y, p->ray.dir.z, p->t0,
+                        p->t1, ref_hit[i] ? "hit" : "missed", ref[i].t,
+                        hits[i] ? "hit" : "missed", recs[i].t);
+            }
+        }
+        printf("  %-14s %10d %10.3f %10.1f", paths[k].name, mismatches,
+                n/time/1e6, brute_time/time);
+        if (paths[k].transformed) printf("   %d too close to call", unclear);
+        printf("\n");
+        failures += mismatches;
+        lst_free(top);
+    }
+
+    world_free(&world);
+    free(probes);
+    free(ref_hits);
+    free(hits);
+    free(refs);
+    free(recs);
+    free(xfrm_hits);
+    free(xfrm_refs);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    long seed = argc > 2 ? atol(argv[2]) : 1;
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [rays [seed]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    srand48(seed);
+
+    // The surfaces and accelerated structures are not freed; the scenes
+    // are small, and the program is done with them when it exits.
+    int failures = check_sphere_roots(n);
+    failures += check_scene("spheres", make_spheres(), n);
+    failures += check_scene("triangles", make_triangles(), n);
+    failures += check_scene("mixed", make_mixed(), n);
+
+    if (failures > 0) {
+        printf("FAILED: %d mismatched hits (seed %ld).\n", failures, seed);
+        return EXIT_FAILURE;
+    }
+    printf("All paths agree with brute force.\n");
+    return EXIT_SUCCESS;
+}
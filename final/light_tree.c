@@ -0,0 +1,227 @@
+/** Light tree functions.
+ *
+ *  @file light_tree.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  The light tree is a bounding-box tree over light positions, much like
+ *  the bounding-box tree over surfaces in surface.c.  Each node records
+ *  the total intensity of the lights below it and the largest range of
+ *  any of them, which bounds how much light the subtree can deliver to a
+ *  point.  That bound is used both to cull whole subtrees and, when
+ *  sampling, as the probability of descending into a subtree.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "light_tree.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+//
+// UTILITY FUNCTIONS.
+//
+
+/** Compute the smooth window (1 - (d/r)^2)^2 used for light falloff.
+ *
+ *  @param d the distance.
+ *  @param range the range; must be positive.
+ *
+ *  @return the falloff, which is 0 for d &ge; range.
+ */
+static float window(float d, float range) {
+    if (d >= range) return 0.0f;
+    float x = d/range;
+    float t = 1.0f - x*x;
+    return t*t;
+}
+
+/** Compute the distance from a point to the nearest point of a box.
+ *
+ *  @param bbox the box.
+ *  @param pt the point.
+ *
+ *  @return the distance, which is 0 if <code>pt</code> is in the box.
+ */
+static float bbox_dist(bbox_t* bbox, point3_t* pt) {
+    float dx = max(0.0f, max(bbox->left - pt->x, pt->x - bbox->right));
+    float dy = max(0.0f, max(bbox->bottom - pt->y, pt->y - bbox->top));
+    float dz = max(0.0f, max(bbox->near - pt->z, pt->z - bbox->far));
+    return sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+/** Upper bound on the contribution of the lights under a node at a point.
+ *
+ *  @param node the light tree node.
+ *  @param pt the point being shaded.
+ *
+ *  @return the bound.
+ */
+static float node_bound(light_node_t* node, point3_t* pt) {
+    if (node->max_range < 0) return node->power;
+    return node->power * window(bbox_dist(&node->bbox, pt), node->max_range);
+}
+
+static int cmp_x(const void* a, const void* b) {
+    float d = (*(light_t**)a)->position->x - (*(light_t**)b)->position->x;
+    return (d > 0) - (d < 0);
+}
+
+static int cmp_y(const void* a, const void* b) {
+    float d = (*(light_t**)a)->position->y - (*(light_t**)b)->position->y;
+    return (d > 0) - (d < 0);
+}
+
+static int cmp_z(const void* a, const void* b) {
+    float d = (*(light_t**)a)->position->z - (*(light_t**)b)->position->z;
+    return (d > 0) - (d < 0);
+}
+
+//
+// TREE CONSTRUCTION.
+//
+
+/** Build a light tree over an array of lights by splitting at the median
+ *  along the longest axis of the lights' bounding box.
+ *
+ *  Precondition: <code>n &ge; 1</code>.
+ *
+ *  @param lights the lights; this array is reordered.
+ *  @param n the number of lights.
+ *
+ *  @return the root of the tree.
+ */
+static light_node_t* make_light_tree_helper(light_t** lights, int n) {
+    assert(n >= 1);
+
+    light_node_t* node = MALLOC1(light_node_t);
+    node->light = NULL;
+    node->left = NULL;
+    node->right = NULL;
+
+    point3_t* p = lights[0]->position;
+    node->bbox = (bbox_t){p->x, p->x, p->y, p->y, p->z, p->z};
+    node->max_range = 0.0f;
+    node->power = 0.0f;
+    for (int i=0; i<n; ++i) {
+        light_t* l = lights[i];
+        p = l->position;
+        node->bbox.left = min(node->bbox.left, p->x);
+        node->bbox.right = max(node->bbox.right, p->x);
+        node->bbox.bottom = min(node->bbox.bottom, p->y);
+        node->bbox.top = max(node->bbox.top, p->y);
+        node->bbox.near = min(node->bbox.near, p->z);
+        node->bbox.far = max(node->bbox.far, p->z);
+
+        if (l->range <= 0 || node->max_range < 0) node->max_range = -1.0f;
+        else node->max_range = max(node->max_range, l->range);
+
+        node->power += max(l->color->red, max(l->color->green, l->color->blue));
+    }
+
+    if (n == 1) {
+        node->light = lights[0];
+        return node;
+    }
+
+    float dx = node->bbox.right - node->bbox.left;
+    float dy = node->bbox.top - node->bbox.bottom;
+    float dz = node->bbox.far - node->bbox.near;
+    if (dx >= dy && dx >= dz) qsort(lights, n, sizeof(light_t*), cmp_x);
+    else if (dy >= dz) qsort(lights, n, sizeof(light_t*), cmp_y);
+    else qsort(lights, n, sizeof(light_t*), cmp_z);
+
+    node->left = make_light_tree_helper(lights, n/2);
+    node->right = make_light_tree_helper(lights + n/2, n - n/2);
+    return node;
+}
+
+light_node_t* make_light_tree(list356_t* lights) {
+    int n = lst_size(lights);
+    if (n == 0) return NULL;
+
+    light_t** arr = malloc(n*sizeof(light_t*));
+    for (int i=0; i<n; ++i) arr[i] = lst_get(lights, i);
+
+    debug("make_light_tree():  building tree over %d lights", n);
+    light_node_t* root = make_light_tree_helper(arr, n);
+    free(arr);
+    return root;
+}
+
+void light_tree_free(light_node_t* node) {
+    if (node == NULL) return;
+    light_tree_free(node->left);
+    light_tree_free(node->right);
+    free(node);
+}
+
+//
+// QUERIES.
+//
+
+float light_falloff(light_t* light, float d) {
+    if (light->range <= 0) return 1.0f;
+    return window(d, light->range);
+}
+
+/** Recursive helper for light_tree_query().
+ *
+ *  @param node the subtree to search.
+ *  @param pt the point being shaded.
+ *  @param out the array of lights found so far.
+ *  @param n the number of lights already in <code>out</code>.
+ *
+ *  @return the number of lights in <code>out</code> after the search.
+ */
+static int light_tree_query_helper(light_node_t* node, point3_t* pt,
+        light_t** out, int n) {
+    if (node_bound(node, pt) < LIGHT_CUTOFF) return n;
+    if (node->light != NULL) {
+        out[n] = node->light;
+        return n+1;
+    }
+    n = light_tree_query_helper(node->left, pt, out, n);
+    return light_tree_query_helper(node->right, pt, out, n);
+}
+
+int light_tree_query(light_node_t* root, point3_t* pt, light_t** out) {
+    if (root == NULL) return 0;
+    return light_tree_query_helper(root, pt, out, 0);
+}
+
+light_t* light_tree_sample(light_node_t* root, point3_t* pt, float u,
+        float* pdf) {
+    *pdf = 1.0f;
+    if (root == NULL) return NULL;
+
+    light_node_t* node = root;
+    while (node->light == NULL) {
+        float wl = node_bound(node->left, pt);
+        float wr = node_bound(node->right, pt);
+        if (wl + wr <= 0) return NULL;
+
+        // Descend with probability proportional to each child's bound,
+        // and rescale u so that it is again uniform on [0, 1).
+        float pl = wl/(wl + wr);
+        if (u < pl) {
+            u = u/pl;
+            *pdf *= pl;
+            node = node->left;
+        } else {
+            u = (u - pl)/(1.0f - pl);
+            *pdf *= 1.0f - pl;
+            node = node->right;
+        }
+        u = min(u, 0.99999994f);
+    }
+
+    if (node_bound(node, pt) <= 0) return NULL;
+    return node->light;
+}
@@ -0,0 +1,102 @@
+/** @file light_tree.h Bounding-box tree over point lights, used to cull
+ *  lights that cannot reach a point and to importance-sample lights when
+ *  a scene has too many to test them all.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef LIGHT_TREE_H
+#define LIGHT_TREE_H
+
+#include <stdbool.h>
+
+#include "geom356.h"
+#include "list356.h"
+
+#include "surface.h"
+
+/** Contributions below this value (in color units, before the surface
+ *  colors are applied) are treated as zero when culling lights.
+ */
+#define LIGHT_CUTOFF (1.0f/512.0f)
+
+/** The type of a light tree node.  The structure is exposed below.
+ */
+typedef struct _light_node_t light_node_t;
+
+/** A node in the light tree.  Leaves hold a single light; interior nodes
+ *  always have two children.
+ */
+struct _light_node_t {
+    /** Box bounding the positions of all lights under this node.
+     */
+    bbox_t bbox;
+    /** The largest range of any light under this node, or
+     *  <code>-1</code> if any of them is unbounded.
+     */
+    float max_range;
+    /** Sum of the intensities of all lights under this node.
+     */
+    float power;
+    /** The light, if this node is a leaf; <code>NULL</code> otherwise.
+     */
+    light_t* light;
+    /** The children of an interior node.
+     */
+    light_node_t* left;
+    light_node_t* right;
+};
+
+/** Build a light tree from a list of lights.
+ *
+ *  @param lights a list of <code>light_t*</code>.
+ *
+ *  @return the root of the tree, or <code>NULL</code> if
+ *      <code>lights</code> is empty.
+ */
+light_node_t* make_light_tree(list356_t* lights);
+
+/** Free a light tree.  The lights themselves are not freed.
+ *
+ *  @param node the root of the tree.
+ */
+void light_tree_free(light_node_t* node);
+
+/** Get the scale factor that a light's range applies to its color at a
+ *  given distance.  Lights with no range are not attenuated.
+ *
+ *  @param light the light.
+ *  @param d the distance from the light.
+ *
+ *  @return a value in [0, 1].
+ */
+float light_falloff(light_t* light, float d);
+
+/** Find all lights that can make a visible contribution at a point.
+ *
+ *  @param root the root of the light tree.
+ *  @param pt the point being shaded.
+ *  @param out an array, with room for every light in the tree, that
+ *      will be filled with the lights that reach <code>pt</code>.
+ *
+ *  @return the number of lights stored in <code>out</code>.
+ */
+int light_tree_query(light_node_t* root, point3_t* pt, light_t** out);
+
+/** Choose one light at random, with probability roughly proportional to
+ *  its unoccluded contribution at a point.
+ *
+ *  @param root the root of the light tree.
+ *  @param pt the point being shaded.
+ *  @param u a uniform random number in [0, 1).
+ *  @param pdf filled with the probability with which the returned light
+ *      was chosen.
+ *
+ *  @return the chosen light, or <code>NULL</code> if no light can reach
+ *      <code>pt</code>.
+ */
+light_t* light_tree_sample(light_node_t* root, point3_t* pt, float u,
+        float* pdf);
+
+#endif
@@ -0,0 +1,890 @@
+/** Out-of-core group functions.
+ *
+ *  @file ooc.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  A group's spheres and triangles are split into pages: compact sets of
+ *  at most OOC_PAGE_SURFACES surfaces, split in half across their longest
+ *  axis until they are small enough.  A bounding-box subtree is built over
+ *  each page as it is split off, and written to the group's page file as
+ *  the geometry of its leaves followed by its flattened nodes, starting on
+ *  a page boundary of the file; then it is freed before the next is built,
+ *  so the whole tree is never in memory at once.  The file is named by a
+ *  hash of the surfaces and kept, so a later run over the same scene maps
+ *  it again instead of building it.  The file is mapped read-only; loading
+ *  a page makes its surfaces and links its nodes straight from the
+ *  mapping, then tells the kernel it may drop those file pages again, so
+ *  the only memory a page holds is its surfaces and tree.  A
+ *  least-recently-used list of each group's loaded pages keeps their total
+ *  under OOC_MEMORY megabytes.
+ *
+ *  A ray that reaches an evicted page loads it straight away, and the
+ *  least recently used pages are evicted to make room.  Batches of rays
+ *  are queued per page instead: ooc_ray_page() finds the page each ray
+ *  reaches first from the tree above the pages, without loading any, and
+ *  ray_batch_sort() puts the rays of each page together, so that the page
+ *  is loaded once for all of them rather than again after every eviction.
+ *
+ *  Paging is not thread-safe; rays are traced on one thread.
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "ooc.h"
+#include "profile.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+/** The largest number of leaves in a page.  OOC_PAGE_SURFACES can be set
+ *  at compile time.
+ */
+#ifndef OOC_PAGE_SURFACES
+#define OOC_PAGE_SURFACES 4096
+#endif
+
+/** The memory, in megabytes, that a group's loaded pages may use before
+ *  the least recently used are evicted.  OOC_MEMORY can be set at compile
+ *  time.
+ */
+#ifndef OOC_MEMORY
+#define OOC_MEMORY 256
+#endif
+
+/** The geometry and material of one sphere or triangle in the file.
+ */
+typedef struct _ooc_record_t {
+    /** Whether this is a triangle rather than a sphere.
+     */
+    int32_t is_triangle;
+    /** The index of the surface's material in its group.
+     */
+    int32_t material;
+    /** The center and radius of a sphere, or the vertices of a triangle.
+     */
+    float v[9];
+} ooc_record_t;
+
+/** The header of a page file, at the start of its first page.
+ */
+typedef struct _ooc_file_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_surfaces;
+    /** The hash of the surfaces' records, in the order of the list the
+     *  group was made from.
+     */
+    uint64_t hash;
+    /** The number of pages, and the offset of the table of them, which
+     *  ends the file.
+     */
+    uint32_t num_pages;
+    uint64_t table_offset;
+} ooc_file_header_t;
+
+/** An entry in the table of pages in a page file.
+ */
+typedef struct _ooc_file_page_t {
+    uint64_t offset;
+    int32_t num_surfaces, num_nodes;
+} ooc_file_page_t;
+
+static const char OOC_FILE_MAGIC[8] = "OOCPAGES";
+
+/** The version of the page file format, to change when the format does.
+ */
+#define OOC_FILE_VERSION 1
+
+/** A loaded surface and the index of its material, for looking up
+ *  materials by address.
+ */
+typedef struct _ooc_key_t {
+    surface_t* sfc;
+    int32_t material;
+} ooc_key_t;
+
+typedef struct _ooc_group_t ooc_group_t;
+
+/** A page: one subtree of a group's bounding-box tree.
+ */
+typedef struct _ooc_page_t {
+    /** The group the page belongs to.
+     */
+    ooc_group_t* group;
+    /** The number of the page, unique among all groups' pages, from 1.
+     */
+    uint32_t id;
+    /** The offset of the page in the file.
+     */
+    size_t offset;
+    /** The number of leaves and of BBT nodes in the subtree.
+     */
+    int num_surfaces, num_nodes;
+    /** The estimated memory the page uses when loaded.
+     */
+    size_t bytes;
+    /** The subtree, or <code>NULL</code> if the page is not loaded.
+     */
+    surface_t* tree;
+    /** The loaded surfaces, sorted by address.
+     */
+    ooc_key_t* keys;
+    /** The neighbors of the page in the list of loaded pages, which is
+     *  kept in order of use, most recent first.
+     */
+    struct _ooc_page_t *prev, *next;
+} ooc_page_t;
+
+struct _ooc_group_t {
+    /** The mapped file.
+     */
+    char* map;
+    size_t map_size;
+    /** One surface for each distinct material, given as the surface hit
+     *  in hit records.
+     */
+    surface_t** materials;
+    int num_materials, materials_capacity;
+    /** The loaded pages, most recently used first, and the estimated
+     *  memory they use.
+     */
+    ooc_page_t *lru_first, *lru_last;
+    size_t resident_bytes;
+    /** The number of pages loaded and evicted so far.
+     */
+    unsigned long page_ins, evictions;
+};
+
+static bool sfc_hit_ooc_page(surface_t* sfc, ray3_t* ray, float t0,
+        float t1, hit_record_t* hit);
+
+/** The number of pages set up so far, in all groups.
+ */
+static uint32_t num_page_ids = 0;
+
+/** The hit function of material surfaces, which are never hit.
+ */
+static bool sfc_hit_material(surface_t* sfc, ray3_t* ray, float t0,
+        float t1, hit_record_t* hit) {
+    return false;
+}
+
+/** Find the material of a surface in a group, adding it if it is new.
+ *
+ *  @param group the group.
+ *  @param sfc the surface.
+ *
+ *  @return the index of the material of <code>sfc</code>.
+ */
+static int material_index(ooc_group_t* group, surface_t* sfc) {
+    // Neighboring surfaces usually share a material, so search backwards.
+    for (int i=group->num_materials-1; i>=0; --i) {
+        surface_t* m = group->materials[i];
+        if (m->diffuse_color == sfc->diffuse_color &&
+                m->ambient_color == sfc->ambient_color &&
+                m->spec_color == sfc->spec_color &&
+                m->refl_color == sfc->refl_color &&
+                m->phong_exp == sfc->phong_exp &&
+                m->refr_index == sfc->refr_index &&
+                m->atten == sfc->atten) {
+            return i;
+        }
+    }
+
+    if (group->num_materials == group->materials_capacity) {
+        group->materials_capacity *= 2;
+        group->materials = realloc(group->materials,
+                group->materials_capacity*sizeof(surface_t*));
+    }
+    surface_t* m = MALLOC1(surface_t);
+    *m = *sfc;
+    m->data = NULL;
+    m->bbox = NULL;
+    m->hit_fn = sfc_hit_material;
+    group->materials[group->num_materials] = m;
+    return group->num_materials++;
+}
+
+/** Flatten a bounding-box tree, as for <code>make_bbt_from_nodes()</code>.
+ *
+ *  @param node the root of the tree.
+ *  @param nodes the array to write the nodes to.
+ *  @param num_nodes the number of nodes written so far; advanced past
+ *      the tree's nodes.
+ *  @param leaves the array to write the leaves to, in the order their
+ *      indices refer to.
+ *  @param num_leaves the number of leaves written so far; advanced
+ *      past the tree's leaves.
+ */
+static void flatten(surface_t* node, bbt_flat_node_t* nodes, int* num_nodes,
+        surface_t** leaves, int* num_leaves) {
+    bbt_flat_node_t* out = &nodes[(*num_nodes)++];
+    out->bbox = *(node->bbox);
+
+    surface_t* children[2];
+    int32_t* indices[2] = {&out->left, &out->right};
+    bbt_children(node, &children[0], &children[1]);
+    for (int k=0; k<2; ++k) {
+        surface_t* child = children[k];
+        if (child == NULL) {
+            *indices[k] = BBT_FLAT_NONE;
+        } else if (sfc_is_bbt(child)) {
+            *indices[k] = *num_nodes;
+            flatten(child, nodes, num_nodes, leaves, num_leaves);
+        } else {
+            leaves[*num_leaves] = child;
+            *indices[k] = -1 - (*num_leaves)++;
+        }
+    }
+}
+
+/** Estimate the memory a page uses when it is loaded: a surface, a
+ *  bounding box and some data for each leaf and each BBT node, plus the
+ *  nodes of the subtree's four-wide BVH.
+ *
+ *  @param num_surfaces the number of leaves.
+ *  @param num_nodes the number of BBT nodes.
+ *
+ *  @return the estimate, in bytes.
+ */
+static size_t page_bytes(int num_surfaces, int num_nodes) {
+    size_t sfc_bytes = sizeof(surface_t) + sizeof(bbox_t) + 48;
+    return num_surfaces*(sfc_bytes + sizeof(ooc_key_t)) +
+        num_nodes*(sfc_bytes + 64);
+}
+
+/** Make the record of a sphere or triangle, adding its material to the
+ *  group if it is new.
+ *
+ *  @param group the group.
+ *  @param sfc the sphere or triangle.
+ *  @param rec the record to fill in.
+ */
+static void make_record(ooc_group_t* group, surface_t* sfc,
+        ooc_record_t* rec) {
+    memset(rec, 0, sizeof(ooc_record_t));
+    point3_t p[3];
+    float r;
+    if (sfc_sphere_geometry(sfc, &p[0], &r)) {
+        rec->is_triangle = 0;
+        rec->v[3] = r;
+    } else {
+        sfc_triangle_geometry(sfc, &p[0], &p[1], &p[2]);
+        rec->is_triangle = 1;
+        for (int j=1; j<3; ++j) {
+            rec->v[3*j] = p[j].x;
+            rec->v[3*j+1] = p[j].y;
+            rec->v[3*j+2] = p[j].z;
+        }
+    }
+    rec->v[0] = p[0].x;
+    rec->v[1] = p[0].y;
+    rec->v[2] = p[0].z;
+    rec->material = material_index(group, sfc);
+}
+
+/** A paged surface and the coordinate of the center of its box along the
+ *  axis being split, for sorting.
+ */
+typedef struct _ooc_item_t {
+    float center;
+    surface_t* sfc;
+} ooc_item_t;
+
+/** Compare items by center, for qsort().
+ */
+static int item_cmp(const void* a, const void* b) {
+    float x = ((ooc_item_t*)a)->center, y = ((ooc_item_t*)b)->center;
+    return x < y ? -1 : x > y;
+}
+
+/** The state of a group's page file while it is written.
+ */
+typedef struct _ooc_writer_t {
+    ooc_group_t* group;
+    FILE* f;
+    /** The offset of the next page in the file; pages start on
+     *  boundaries of <code>align</code> bytes.
+     */
+    size_t offset, align;
+    /** The pages written so far.
+     */
+    ooc_file_page_t* pages;
+    int num_pages, pages_capacity;
+    /** Space for the nodes, leaves and records of one page.
+     */
+    bbt_flat_node_t* nodes;
+    surface_t** leaves;
+    ooc_record_t* records;
+    bool ok;
+} ooc_writer_t;
+
+/** Build the subtree of one page over some surfaces, write it to the
+ *  file, and free it again.
+ *
+ *  @param w the writer.
+ *  @param items the surfaces; at most OOC_PAGE_SURFACES.
+ *  @param n the number of surfaces.
+ */
+static void write_page(ooc_writer_t* w, ooc_item_t* items, int n) {
+    // The tree is only flattened, so it needs no wide BVH, and caching
+    // it would only duplicate the page file.
+    list356_t* list = make_list();
+    for (int i=0; i<n; ++i) lst_add(list, items[i].sfc);
+    surface_t* tree = make_bbt_node_binary(list);
+    lst_free(list);
+    int num_nodes = 0, num_leaves = 0;
+    flatten(tree, w->nodes, &num_nodes, w->leaves, &num_leaves);
+    bbt_free(tree);
+    for (int k=0; k<num_leaves; ++k) {
+        make_record(w->group, w->leaves[k], &w->records[k]);
+    }
+
+    if (w->num_pages == w->pages_capacity) {
+        w->pages_capacity *= 2;
+        w->pages = realloc(w->pages,
+                w->pages_capacity*sizeof(ooc_file_page_t));
+    }
+    w->pages[w->num_pages++] = (ooc_file_page_t){w->offset, num_leaves,
+        num_nodes};
+    w->ok = w->ok && fseek(w->f, w->offset, SEEK_SET) == 0 &&
+        fwrite(w->records, sizeof(ooc_record_t), num_leaves, w->f) ==
+            (size_t)num_leaves &&
+        fwrite(w->nodes, sizeof(bbt_flat_node_t), num_nodes, w->f) ==
+            (size_t)num_nodes;
+    size_t size = num_leaves*sizeof(ooc_record_t) +
+        num_nodes*sizeof(bbt_flat_node_t);
+    w->offset += (size + w->align - 1)/w->align*w->align;
+}
+
+/** Split surfaces into pages, and write each page as soon as it is small
+ *  enough.  Surfaces are split in half across the longest axis of the box
+ *  around their centers, so that each page covers a compact region; only
+ *  one page's subtree is in memory at a time.
+ *
+ *  @param w the writer.
+ *  @param items the surfaces.
+ *  @param n the number of surfaces.
+ */
+static void write_pages(ooc_writer_t* w, ooc_item_t* items, int n) {
+    if (!w->ok) return;
+    if (n <= OOC_PAGE_SURFACES) {
+        write_page(w, items, n);
+        return;
+    }
+
+    float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (int i=0; i<n; ++i) {
+        bbox_t* b = items[i].sfc->bbox;
+        float c[3] = {(b->left + b->right)/2, (b->bottom + b->top)/2,
+            (b->near + b->far)/2};
+        for (int a=0; a<3; ++a) {
+            if (c[a] < lo[a]) lo[a] = c[a];
+            if (c[a] > hi[a]) hi[a] = c[a];
+        }
+    }
+    int axis = 0;
+    for (int a=1; a<3; ++a) {
+        if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+    }
+    for (int i=0; i<n; ++i) {
+        bbox_t* b = items[i].sfc->bbox;
+        items[i].center = axis == 0 ? (b->left + b->right)/2 :
+            axis == 1 ? (b->bottom + b->top)/2 : (b->near + b->far)/2;
+    }
+    qsort(items, n, sizeof(ooc_item_t), item_cmp);
+    write_pages(w, items, n/2);
+    write_pages(w, items + n/2, n - n/2);
+}
+
+/** Write the page file of a group over some surfaces.  The file is
+ *  written under a temporary name and renamed to <code>path</code> once it
+ *  is complete, so that a file at <code>path</code> is always whole.
+ *
+ *  @param group the group.
+ *  @param items the surfaces.
+ *  @param n the number of surfaces.
+ *  @param hash the hash of the surfaces.
+ *  @param path the name of the file.
+ *
+ *  @return <code>true</code> if the file was written.
+ */
+static bool write_page_file(ooc_group_t* group, ooc_item_t* items, int n,
+        uint64_t hash, const char* path) {
+    char tmp_path[strlen(path) + 8];
+    sprintf(tmp_path, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    FILE* f = fd < 0 ? NULL : fdopen(fd, "w+b");
+    if (f == NULL) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    // The header goes on the first page of the file, and is written last.
+    size_t align = max(4096, sysconf(_SC_PAGESIZE));
+    ooc_writer_t w = {
+        .group = group,
+        .f = f,
+        .offset = align,
+        .align = align,
+        .pages = malloc(16*sizeof(ooc_file_page_t)),
+        .num_pages = 0,
+        .pages_capacity = 16,
+        .nodes = malloc(2*OOC_PAGE_SURFACES*sizeof(bbt_flat_node_t)),
+        .leaves = malloc(OOC_PAGE_SURFACES*sizeof(surface_t*)),
+        .records = malloc(OOC_PAGE_SURFACES*sizeof(ooc_record_t)),
+        .ok = true,
+    };
+    write_pages(&w, items, n);
+
+    ooc_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OOC_FILE_MAGIC, sizeof(header.magic));
+    header.version = OOC_FILE_VERSION;
+    header.hash = hash;
+    header.num_surfaces = n;
+    header.num_pages = w.num_pages;
+    header.table_offset = w.offset;
+    bool ok = w.ok && fseek(f, w.offset, SEEK_SET) == 0 &&
+        fwrite(w.pages, sizeof(ooc_file_page_t), w.num_pages, f) ==
+            (size_t)w.num_pages &&
+        fseek(f, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fclose(f) == 0 && ok && rename(tmp_path, path) == 0;
+    if (!ok) unlink(tmp_path);
+
+    free(w.pages);
+    free(w.nodes);
+    free(w.leaves);
+    free(w.records);
+    return ok;
+}
+
+/** Map a group's page file and set up its pages, if the file is a
+ *  complete one for the surfaces.
+ *
+ *  @param group the group.
+ *  @param path the name of the file.
+ *  @param hash the hash of the surfaces.
+ *  @param n the number of surfaces.
+ *
+ *  @return the pages, or <code>NULL</code> if the file could not be
+ *      mapped or is not for these surfaces.
+ */
+static ooc_page_t* map_page_file(ooc_group_t* group, const char* path,
+        uint64_t hash, int n, int* num_pages) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    ooc_file_header_t header;
+    bool valid = fread(&header, sizeof(header), 1, f) == 1 &&
+        memcmp(header.magic, OOC_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+        header.version == OOC_FILE_VERSION && header.hash == hash &&
+        header.num_surfaces == (uint32_t)n &&
+        fseek(f, 0, SEEK_END) == 0 &&
+        (size_t)ftell(f) == header.table_offset +
+            header.num_pages*sizeof(ooc_file_page_t);
+    if (valid) {
+        group->map_size = header.table_offset +
+            header.num_pages*sizeof(ooc_file_page_t);
+        group->map = mmap(NULL, group->map_size, PROT_READ, MAP_SHARED,
+                fileno(f), 0);
+        valid = group->map != MAP_FAILED;
+    }
+    fclose(f);
+    if (!valid) return NULL;
+
+    ooc_file_page_t* table =
+        (ooc_file_page_t*)(group->map + header.table_offset);
+    ooc_page_t* pages = malloc(header.num_pages*sizeof(ooc_page_t));
+    for (uint32_t i=0; i<header.num_pages; ++i) {
+        pages[i] = (ooc_page_t){
+            .group = group,
+            .id = ++num_page_ids,
+            .offset = table[i].offset,
+            .num_surfaces = table[i].num_surfaces,
+            .num_nodes = table[i].num_nodes,
+            .bytes = page_bytes(table[i].num_surfaces, table[i].num_nodes),
+        };
+    }
+    *num_pages = header.num_pages;
+    return pages;
+}
+
+surface_t* make_ooc_group(list356_t* surfaces, const char* dir) {
+    // Only spheres and triangles are paged.
+    list356_t* paged = make_list();
+    list356_t* kept = make_list();
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        point3_t p[3];
+        float r;
+        if (sfc_sphere_geometry(sfc, &p[0], &r) ||
+                sfc_triangle_geometry(sfc, &p[0], &p[1], &p[2])) {
+            lst_add(paged, sfc);
+        } else {
+            lst_add(kept, sfc);
+        }
+    }
+    lst_iterator_free(s);
+    int n = lst_size(paged);
+    if (n == 0) {
+        lst_free(paged);
+        lst_free(kept);
+        return make_bbt_node(surfaces);
+    }
+
+    ooc_group_t* group = MALLOC1(ooc_group_t);
+    group->num_materials = 0;
+    group->materials_capacity = 16;
+    group->materials =
+        malloc(group->materials_capacity*sizeof(surface_t*));
+    group->lru_first = group->lru_last = NULL;
+    group->resident_bytes = 0;
+    group->page_ins = group->evictions = 0;
+
+    // The materials are numbered, and the file named, in the order of the
+    // list, so a later run over the same surfaces finds the same file.
+    ooc_item_t* items = malloc(n*sizeof(ooc_item_t));
+    uint64_t hash = 14695981039346656037ULL;
+    s = lst_iterator(paged);
+    for (int i=0; i<n; ++i) {
+        items[i].sfc = lst_next(s);
+        ooc_record_t rec;
+        make_record(group, items[i].sfc, &rec);
+        unsigned char* bytes = (unsigned char*)&rec;
+        for (size_t k=0; k<sizeof(rec); ++k) {
+            hash = (hash ^ bytes[k])*1099511628211ULL;
+        }
+    }
+    lst_iterator_free(s);
+    hash ^= (uint64_t)n*OOC_PAGE_SURFACES;
+
+    char path[strlen(dir) + 32];
+    sprintf(path, "%s/ooc-%016llx.pages", dir, (unsigned long long)hash);
+    int num_pages = 0;
+    ooc_page_t* pages = map_page_file(group, path, hash, n, &num_pages);
+    if (pages == NULL && write_page_file(group, items, n, hash, path)) {
+        debug("make_ooc_group():  wrote %s", path);
+        pages = map_page_file(group, path, hash, n, &num_pages);
+    }
+    free(items);
+    if (pages == NULL) {
+        debug("make_ooc_group():  could not write %s", path);
+        for (int i=0; i<group->num_materials; ++i) {
+            free(group->materials[i]);
+        }
+        free(group->materials);
+        free(group);
+        lst_free(paged);
+        lst_free(kept);
+        return NULL;
+    }
+
+    debug("make_ooc_group():  %d surfaces in %d pages, %d materials, "
+            "%lu KB mapped from %s", n, num_pages, group->num_materials,
+            (unsigned long)(group->map_size/1024), path);
+
+    // Only the pages and the surfaces that are not paged stay in memory.
+    s = lst_iterator(paged);
+    while (lst_has_next(s)) sfc_free(lst_next(s));
+    lst_iterator_free(s);
+    lst_free(paged);
+
+    // The page surfaces take their boxes from the subtrees' roots.
+    for (int i=0; i<num_pages; ++i) {
+        surface_t* page_sfc = MALLOC1(surface_t);
+        memset(page_sfc, 0, sizeof(surface_t));
+        page_sfc->data = &pages[i];
+        page_sfc->hit_fn = sfc_hit_ooc_page;
+        page_sfc->refr_index = -1.0f;
+        page_sfc->bbox = MALLOC1(bbox_t);
+        bbt_flat_node_t* root = (bbt_flat_node_t*)(group->map +
+                pages[i].offset + pages[i].num_surfaces*sizeof(ooc_record_t));
+        *(page_sfc->bbox) = root->bbox;
+        lst_add(kept, page_sfc);
+    }
+    madvise(group->map, group->map_size, MADV_DONTNEED);
+
+    surface_t* group_sfc = make_bbt_node(kept);
+    lst_free(kept);
+    return group_sfc;
+}
+
+/** Take a page out of its group's list of loaded pages.
+ *
+ *  @param page the page.
+ */
+static void lru_remove(ooc_page_t* page) {
+    ooc_group_t* group = page->group;
+    if (page->prev != NULL) page->prev->next = page->next;
+    else group->lru_first = page->next;
+    if (page->next != NULL) page->next->prev = page->prev;
+    else group->lru_last = page->prev;
+    page->prev = page->next = NULL;
+}
+
+/** Put a page at the front of its group's list of loaded pages.
+ *
+ *  @param page the page.
+ */
+static void lru_push(ooc_page_t* page) {
+    ooc_group_t* group = page->group;
+    page->prev = NULL;
+    page->next = group->lru_first;
+    if (group->lru_first != NULL) group->lru_first->prev = page;
+    else group->lru_last = page;
+    group->lru_first = page;
+}
+
+/** Free the surfaces and tree of a loaded page.
+ *
+ *  @param page the page.
+ */
+static void evict(ooc_page_t* page) {
+    lru_remove(page);
+    bbt_free(page->tree);
+    for (int i=0; i<page->num_surfaces; ++i) sfc_free(page->keys[i].sfc);
+    free(page->keys);
+    page->tree = NULL;
+    page->keys = NULL;
+    page->group->resident_bytes -= page->bytes;
+    ++page->group->evictions;
+}
+
+/** Compare keys by surface address, for qsort() and bsearch().
+ */
+static int key_cmp(const void* a, const void* b) {
+    surface_t* x = ((ooc_key_t*)a)->sfc;
+    surface_t* y = ((ooc_key_t*)b)->sfc;
+    return x < y ? -1 : x > y;
+}
+
+/** Load a page, evicting others first if it would not fit.
+ *
+ *  @param page the page.
+ */
+static void page_in(ooc_page_t* page) {
+    ooc_group_t* group = page->group;
+    while (group->lru_last != NULL &&
+            group->resident_bytes + page->bytes > (size_t)OOC_MEMORY << 20) {
+        evict(group->lru_last);
+    }
+
+    char* base = group->map + page->offset;
+    ooc_record_t* records = (ooc_record_t*)base;
+    bbt_flat_node_t* nodes =
+        (bbt_flat_node_t*)(base + page->num_surfaces*sizeof(ooc_record_t));
+
+    surface_t** leaves = malloc(page->num_surfaces*sizeof(surface_t*));
+    page->keys = malloc(page->num_surfaces*sizeof(ooc_key_t));
+    for (int i=0; i<page->num_surfaces; ++i) {
+        float* v = records[i].v;
+        surface_t* m = group->materials[records[i].material];
+        surface_t* sfc;
+        if (records[i].is_triangle) {
+            sfc = make_triangle((point3_t){v[0], v[1], v[2]},
+                    (point3_t){v[3], v[4], v[5]},
+                    (point3_t){v[6], v[7], v[8]},
+                    m->diffuse_color, m->ambient_color, m->spec_color,
+                    m->phong_exp);
+        } else {
+            sfc = make_sphere(v[0], v[1], v[2], v[3], m->diffuse_color,
+                    m->ambient_color, m->spec_color, m->phong_exp);
+        }
+        sfc->refl_color = m->refl_color;
+        sfc->refr_index = m->refr_index;
+        sfc->atten = m->atten;
+        leaves[i] = sfc;
+        page->keys[i] = (ooc_key_t){sfc, records[i].material};
+    }
+    page->tree = make_bbt_from_nodes(nodes, page->num_nodes, leaves);
+    free(leaves);
+    qsort(page->keys, page->num_surfaces, sizeof(ooc_key_t), key_cmp);
+
+    // Everything has been copied out of the file, so its pages need not
+    // stay in memory.
+    madvise(base, page->num_surfaces*sizeof(ooc_record_t) +
+            page->num_nodes*sizeof(bbt_flat_node_t), MADV_DONTNEED);
+
+    lru_push(page);
+    group->resident_bytes += page->bytes;
+    ++group->page_ins;
+}
+
+/** Page-ray intersection function.  The page is loaded if it is not in
+ *  memory, and becomes the most recently used.
+ *
+ *  @param sfc the page surface.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param t1 the right endpoint of the ray.
+ *  @param hit the hit record to fill in if <code>ray</code> hits a
+ *      surface of the page.
+ *
+ *  @return <code>true</code> if <code>ray</code> intersects a surface of
+ *      the page in the interval [<code>t0</code>,<code>t1</code>],
+ *      <code>false</code> otherwise.
+ */
+static bool sfc_hit_ooc_page(surface_t* sfc, ray3_t* ray, float t0,
+        float t1, hit_record_t* hit) {
+    PROFILE_NODE("ooc page");
+    ooc_page_t* page = (ooc_page_t*)(sfc->data);
+    if (page->tree == NULL) {
+        page_in(page);
+    } else if (page != page->group->lru_first) {
+        lru_remove(page);
+        lru_push(page);
+    }
+
+    hit_record_t rec;
+    if (!sfc_hit(page->tree, ray, t0, t1, &rec)) return false;
+
+    // The hit surface goes away when the page is evicted, so report its
+    // material instead.
+    ooc_key_t key = {rec.sfc, 0};
+    ooc_key_t* found = bsearch(&key, page->keys, page->num_surfaces,
+            sizeof(ooc_key_t), key_cmp);
+    assert(found != NULL);
+    *hit = rec;
+    hit->sfc = page->group->materials[found->material];
+    hit->world_sfc = sfc;
+    return true;
+}
+
+/** Find the time a ray enters a box.
+ *
+ *  @param bbox the box.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param t1 the right endpoint of the ray.
+ *
+ *  @return the first time in [<code>t0</code>, <code>t1</code>] at which
+ *      <code>ray</code> is in <code>bbox</code>, or <code>INFINITY</code>
+ *      if there is none.
+ */
+static float box_entry(bbox_t* bbox, ray3_t* ray, float t0, float t1) {
+    float base[3] = {ray->base.x, ray->base.y, ray->base.z};
+    float dir[3] = {ray->dir.x, ray->dir.y, ray->dir.z};
+    float lo[3] = {bbox->left, bbox->bottom, bbox->near};
+    float hi[3] = {bbox->right, bbox->top, bbox->far};
+    for (int a=0; a<3; ++a) {
+        if (dir[a] == 0) {
+            if (base[a] < lo[a] || base[a] > hi[a]) return INFINITY;
+            continue;
+        }
+        float ta = (lo[a] - base[a])/dir[a], tb = (hi[a] - base[a])/dir[a];
+        if (ta > tb) {
+            float t = ta;
+            ta = tb;
+            tb = t;
+        }
+        if (ta > t0) t0 = ta;
+        if (tb < t1) t1 = tb;
+        if (t0 > t1) return INFINITY;
+    }
+    return t0;
+}
+
+/** Find the page under a surface whose box a ray enters first.  Only
+ *  bounding-box trees are searched, and only boxes the ray enters before
+ *  the best page found so far.
+ *
+ *  @param sfc the surface.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param best the page found so far, or <code>NULL</code>; updated.
+ *  @param best_t the time the ray enters the box of <code>*best</code>;
+ *      updated.
+ */
+static void find_ray_page(surface_t* sfc, ray3_t* ray, float t0,
+        ooc_page_t** best, float* best_t) {
+    if (sfc == NULL) return;
+    bool is_page = sfc->hit_fn == sfc_hit_ooc_page;
+    if (!is_page && !sfc_is_bbt(sfc)) return;
+    float t = box_entry(sfc->bbox, ray, t0, *best_t);
+    if (t == INFINITY || t >= *best_t) return;
+    if (is_page) {
+        *best = (ooc_page_t*)(sfc->data);
+        *best_t = t;
+    } else {
+        surface_t *left, *right;
+        bbt_children(sfc, &left, &right);
+        find_ray_page(left, ray, t0, best, best_t);
+        find_ray_page(right, ray, t0, best, best_t);
+    }
+}
+
+uint32_t ooc_ray_page(list356_t* surfaces, ray3_t* ray, float t0) {
+    ooc_page_t* best = NULL;
+    float best_t = INFINITY;
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (lst_has_next(s)) {
+        find_ray_page(lst_next(s), ray, t0, &best, &best_t);
+    }
+    lst_iterator_free(s);
+    return best != NULL ? best->id : 0;
+}
+
+/** Find the out-of-core groups that the pages under a surface belong
+ *  to, adding those not found yet.  Only bounding-box trees are searched;
+ *  the trees under pages are not.
+ *
+ *  @param sfc the surface.
+ *  @param groups the groups found so far.
+ *  @param num_groups the number of groups found so far.
+ *  @param capacity the space in <code>groups</code>.
+ */
+static void find_groups(surface_t* sfc, ooc_group_t*** groups,
+        int* num_groups, int* capacity) {
+    if (sfc == NULL) return;
+    if (sfc->hit_fn == sfc_hit_ooc_page) {
+        ooc_group_t* group = ((ooc_page_t*)(sfc->data))->group;
+        for (int i=0; i<*num_groups; ++i) {
+            if ((*groups)[i] == group) return;
+        }
+        if (*num_groups == *capacity) {
+            *capacity = *capacity > 0 ? 2*(*capacity) : 4;
+            *groups = realloc(*groups, *capacity*sizeof(ooc_group_t*));
+        }
+        (*groups)[(*num_groups)++] = group;
+    } else if (sfc_is_bbt(sfc)) {
+        surface_t *left, *right;
+        bbt_children(sfc, &left, &right);
+        find_groups(left, groups, num_groups, capacity);
+        find_groups(right, groups, num_groups, capacity);
+    }
+}
+
+void ooc_stats(list356_t* surfaces, unsigned long* page_ins,
+        unsigned long* evictions, size_t* resident) {
+    ooc_group_t** groups = NULL;
+    int num_groups = 0, capacity = 0;
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (lst_has_next(s)) {
+        find_groups(lst_next(s), &groups, &num_groups, &capacity);
+    }
+    lst_iterator_free(s);
+
+    *page_ins = *evictions = 0;
+    *resident = 0;
+    for (int i=0; i<num_groups; ++i) {
+        *page_ins += groups[i]->page_ins;
+        *evictions += groups[i]->evictions;
+        *resident += groups[i]->resident_bytes;
+    }
+    free(groups);
+}
@@ -0,0 +1,77 @@
+/** @file ooc.h Out-of-core groups of surfaces, whose geometry and
+ *  bounding-box subtrees are kept in a file and paged in on demand.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef OOC_H
+#define OOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "list356.h"
+
+#include "surface.h"
+
+/** Create an out-of-core group from a list of surfaces.  The spheres and
+ *  triangles are split into pages of at most <code>OOC_PAGE_SURFACES</code>
+ *  surfaces that lie close together.  A bounding-box subtree is built over
+ *  each page in turn and written, with the geometry of its surfaces, to a
+ *  page file that is mapped into memory.  The spheres and triangles
+ *  themselves are then freed; a page's surfaces are made again from the
+ *  file the first time a ray reaches its subtree, and freed again when
+ *  the group's pages in memory go over <code>OOC_MEMORY</code> megabytes,
+ *  least recently used first.  Each group keeps its own loaded pages, so
+ *  groups do not share any state.  Only the tree above the pages stays in
+ *  memory.
+ *
+ *  The page file is named by a hash of the surfaces and left in
+ *  <code>dir</code>, so that a later group over the same surfaces maps it
+ *  again instead of building it.
+ *
+ *  In hit records, <code>sfc</code> is a surface in memory that has the
+ *  hit surface's colors, and <code>world_sfc</code> is the page that was
+ *  hit, so both stay valid after the page is evicted.
+ *
+ *  @param surfaces a list of surfaces, as for <code>make_bbt_node()</code>.
+ *      The group takes over the spheres and triangles in the list and
+ *      frees them, so the caller must not use them afterwards; other
+ *      surfaces are kept in memory.  The list itself is not changed or
+ *      freed.
+ *  @param dir the directory to keep the page file in.
+ *
+ *  @return the group, or <code>NULL</code> if the page file could not
+ *      be written or mapped (in which case no surfaces have been freed).
+ */
+surface_t* make_ooc_group(list356_t* surfaces, const char* dir);
+
+/** Find the page of an out-of-core group that a ray reaches first,
+ *  without loading any page, so that rays can be queued per page.  The
+ *  page is the one whose box the ray enters first; trees are traced
+ *  nearest child first, so it is usually the first page the ray loads.
+ *
+ *  @param surfaces the surfaces, such as a scene's.  Out-of-core groups
+ *      among them, or in bounding-box trees among them, are searched.
+ *  @param ray the ray.
+ *  @param t0 the minimum time for which to consider the ray.
+ *
+ *  @return the number of the page, which is unique among all groups'
+ *      pages, or <code>0</code> if the ray reaches no page.
+ */
+uint32_t ooc_ray_page(list356_t* surfaces, ray3_t* ray, float t0);
+
+/** Get paging statistics, totalled over the out-of-core groups among
+ *  some surfaces, or in bounding-box trees among them.
+ *
+ *  @param surfaces the surfaces, such as a scene's.
+ *  @param page_ins filled with the number of pages loaded so far.
+ *  @param evictions filled with the number of pages evicted so far.
+ *  @param resident filled with the estimated bytes used by the pages in
+ *      memory.
+ */
+void ooc_stats(list356_t* surfaces, unsigned long* page_ins,
+        unsigned long* evictions, size_t* resident);
+
+#endif
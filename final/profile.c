@@ -0,0 +1,284 @@
+/** Profiling functions.
+ *
+ *  @file profile.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Everything here is compiled only when PROFILE_PIXELS is defined.
+ */
+
+#ifdef PROFILE_PIXELS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "framebuffer.h"
+#include "timing.h"
+
+/** The most top-level surfaces and kinds of hit test that are counted
+ *  separately.  Surfaces beyond the first MAX_SURFACES are counted
+ *  together.
+ */
+#define MAX_SURFACES 64
+#define MAX_TESTS 32
+
+/** The number of costliest pixels listed.
+ */
+#define NUM_HOTTEST 8
+
+/** Totals for a top-level surface.
+ */
+typedef struct _surface_totals_t {
+    surface_t* sfc;
+    /** The slot of the surface's own hit test, or -1 if not yet known.
+     */
+    int slot;
+    unsigned long tests, hits;
+    unsigned long nodes, prims;
+    double ns;
+} surface_totals_t;
+
+/** Totals for a kind of hit test.
+ */
+typedef struct _test_totals_t {
+    const char* name;
+    int kind;
+    unsigned long calls;
+} test_totals_t;
+
+__thread profile_counts_t profile_counts;
+
+static int width = 0, height = 0;
+static unsigned long *pixel_rays = NULL, *pixel_shadow_rays = NULL,
+       *pixel_nodes = NULL, *pixel_prims = NULL;
+static double* pixel_ns = NULL;
+static struct timespec pixel_start;
+
+static surface_totals_t surfaces[MAX_SURFACES + 1];
+static int num_surfaces = 0;
+static surface_totals_t* current_surface = NULL;
+
+static test_totals_t tests[MAX_TESTS];
+static int num_tests = 0;
+
+void profile_test(int* slot, int kind, const char* name) {
+    if (*slot < 0) {
+        if (num_tests == MAX_TESTS) return;
+        *slot = num_tests++;
+        tests[*slot] = (test_totals_t){name, kind, 0};
+    }
+    ++tests[*slot].calls;
+    if (kind == PROFILE_KIND_NODE) ++profile_counts.nodes;
+    else ++profile_counts.prims;
+
+    // The first test made for a top-level surface is the surface's own.
+    if (current_surface != NULL && current_surface->slot < 0) {
+        current_surface->slot = *slot;
+    }
+}
+
+void profile_frame_begin(int w, int h) {
+    if (w*h != width*height) {
+        free(pixel_rays);
+        free(pixel_shadow_rays);
+        free(pixel_nodes);
+        free(pixel_prims);
+        free(pixel_ns);
+        pixel_rays = malloc(w*h*sizeof(unsigned long));
+        pixel_shadow_rays = malloc(w*h*sizeof(unsigned long));
+        pixel_nodes = malloc(w*h*sizeof(unsigned long));
+        pixel_prims = malloc(w*h*sizeof(unsigned long));
+        pixel_ns = malloc(w*h*sizeof(double));
+    }
+    width = w;
+    height = h;
+    memset(pixel_rays, 0, w*h*sizeof(unsigned long));
+    memset(pixel_shadow_rays, 0, w*h*sizeof(unsigned long));
+    memset(pixel_nodes, 0, w*h*sizeof(unsigned long));
+    memset(pixel_prims, 0, w*h*sizeof(unsigned long));
+    memset(pixel_ns, 0, w*h*sizeof(double));
+
+    num_surfaces = 0;
+    surfaces[MAX_SURFACES] = (surface_totals_t){NULL, -1, 0, 0, 0, 0, 0.0};
+    for (int i=0; i<num_tests; ++i) tests[i].calls = 0;
+}
+
+void profile_pixel_begin() {
+    profile_counts = (profile_counts_t){0, 0, 0, 0};
+    timer_start(&pixel_start);
+}
+
+void profile_pixel_end(int x, int y) {
+    int i = y*width + x;
+    pixel_ns[i] = 1e9*seconds_since(&pixel_start);
+    pixel_rays[i] = profile_counts.rays;
+    pixel_shadow_rays[i] = profile_counts.shadow_rays;
+    pixel_nodes[i] = profile_counts.nodes;
+    pixel_prims[i] = profile_counts.prims;
+}
+
+bool profile_sfc_hit(surface_t* sfc, ray3_t* ray, float t0, float t1,
+        hit_record_t* rec) {
+    surface_totals_t* totals = NULL;
+    for (int i=0; i<num_surfaces && totals == NULL; ++i) {
+        if (surfaces[i].sfc == sfc) totals = surfaces + i;
+    }
+    if (totals == NULL && num_surfaces < MAX_SURFACES) {
+        totals = surfaces + num_surfaces++;
+        *totals = (surface_totals_t){sfc, -1, 0, 0, 0, 0, 0.0};
+    }
+    if (totals == NULL) totals = surfaces + MAX_SURFACES;
+
+    profile_counts_t before = profile_counts;
+    struct timespec start;
+    timer_start(&start);
+    current_surface = totals;
+    bool hit = sfc_hit(sfc, ray, t0, t1, rec);
+    current_surface = NULL;
+
+    totals->ns += 1e9*seconds_since(&start);
+    ++totals->tests;
+    if (hit) ++totals->hits;
+    totals->nodes += profile_counts.nodes - before.nodes;
+    totals->prims += profile_counts.prims - before.prims;
+    return hit;
+}
+
+/** Compare doubles, for <code>qsort()</code>.
+ */
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/** Write a heatmap of per-pixel values as a binary PPM, top row first.
+ *
+ *  @param report the file to describe the heatmap's scale in.
+ *  @param dir the directory to write to.
+ *  @param name the name of the heatmap.
+ *  @param values the per-pixel values, bottom row first.
+ */
+static void write_heatmap(FILE* report, const char* dir, const char* name,
+        double* values) {
+    int n = width*height;
+    double* sorted = malloc(n*sizeof(double));
+    memcpy(sorted, values, n*sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    double total = 0.0;
+    for (int i=0; i<n; ++i) total += sorted[i];
+    double scale = sorted[(int)(.995*(n-1))];
+    if (scale <= 0.0) scale = 1.0;
+    fprintf(report, "%-11s  mean %12.1f  p99.5 %12.1f  max %12.1f\n", name,
+            total/n, sorted[(int)(.995*(n-1))], sorted[n-1]);
+    free(sorted);
+
+    // Black, blue, red, yellow, white.
+    static const color_t ramp[5] = {
+        {0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1},
+    };
+    framebuffer_t* frame = make_framebuffer(width, height);
+    for (int y=0; y<height; ++y) {
+        for (int x=0; x<width; ++x) {
+            double v = 4*values[y*width + x]/scale;
+            if (v > 4) v = 4;
+            int k = v < 4 ? (int)v : 3;
+            float f0 = v - k;
+            color_t* pixel = fb_pixel(frame, x, y);
+            pixel->red = (1-f0)*ramp[k].red + f0*ramp[k+1].red;
+            pixel->green = (1-f0)*ramp[k].green + f0*ramp[k+1].green;
+            pixel->blue = (1-f0)*ramp[k].blue + f0*ramp[k+1].blue;
+        }
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/profile_%s.ppm", dir, name);
+    framebuffer_write_ppm(frame, path);
+    fb_free(frame);
+}
+
+void profile_write(const char* dir, list356_t* scene_surfaces) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/profile.txt", dir);
+    FILE* report = fopen(path, "w");
+    if (report == NULL) {
+        perror(path);
+        return;
+    }
+
+    // Per-pixel totals and heatmaps.
+    int n = width*height;
+    double* values = malloc(n*sizeof(double));
+    unsigned long* counts[4] = {pixel_rays, pixel_shadow_rays, pixel_nodes,
+        pixel_prims};
+    const char* names[4] = {"rays", "shadow_rays", "nodes", "prims"};
+    fprintf(report, "frame %dx%d, per pixel:\n", width, height);
+    for (int k=0; k<4; ++k) {
+        for (int i=0; i<n; ++i) values[i] = counts[k][i];
+        write_heatmap(report, dir, names[k], values);
+    }
+    for (int i=0; i<n; ++i) values[i] = pixel_ns[i]/1000;
+    write_heatmap(report, dir, "us", values);
+    free(values);
+
+    // The costliest pixels.
+    int hottest[NUM_HOTTEST], num_hottest = 0;
+    for (int i=0; i<n; ++i) {
+        if (num_hottest < NUM_HOTTEST) hottest[num_hottest++] = i;
+        else if (pixel_ns[i] > pixel_ns[hottest[NUM_HOTTEST-1]]) {
+            hottest[NUM_HOTTEST-1] = i;
+        }
+        else continue;
+        for (int j=num_hottest-1;
+                j > 0 && pixel_ns[hottest[j]] > pixel_ns[hottest[j-1]]; --j) {
+            int tmp = hottest[j];
+            hottest[j] = hottest[j-1];
+            hottest[j-1] = tmp;
+        }
+    }
+    fprintf(report, "\ncostliest pixels (x, y from the top):\n");
+    for (int k=0; k<num_hottest; ++k) {
+        int i = hottest[k];
+        fprintf(report, "(%4d, %4d)  %10.1f us  %6lu rays  %8lu nodes  "
+                "%8lu prims\n", i%width, height-1 - i/width,
+                pixel_ns[i]/1000, pixel_rays[i], pixel_nodes[i],
+                pixel_prims[i]);
+    }
+
+    // Surfaces, in the order of the scene.
+    fprintf(report, "\n%-4s %-14s %12s %12s %12s %12s %10s\n", "sfc", "test",
+            "tests", "hits", "nodes", "prims", "ms");
+    int index = 0;
+    list356_itr_t* s = lst_iterator(scene_surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        for (int i=0; i<num_surfaces; ++i) {
+            surface_totals_t* t = surfaces + i;
+            if (t->sfc != sfc) continue;
+            fprintf(report, "#%-3d %-14s %12lu %12lu %12lu %12lu %10.2f\n",
+                    index, t->slot >= 0 ? tests[t->slot].name : "-",
+                    t->tests, t->hits, t->nodes, t->prims, t->ns/1e6);
+        }
+        ++index;
+    }
+    lst_iterator_free(s);
+    if (surfaces[MAX_SURFACES].tests > 0) {
+        surface_totals_t* t = surfaces + MAX_SURFACES;
+        fprintf(report, "%-4s %-14s %12lu %12lu %12lu %12lu %10.2f\n",
+                "rest", "-", t->tests, t->hits, t->nodes, t->prims,
+                t->ns/1e6);
+    }
+
+    // Kinds of hit test.
+    fprintf(report, "\n%-18s %-5s %14s\n", "test", "kind", "calls");
+    for (int i=0; i<num_tests; ++i) {
+        fprintf(report, "%-18s %-5s %14lu\n", tests[i].name,
+                tests[i].kind == PROFILE_KIND_NODE ? "node" : "prim",
+                tests[i].calls);
+    }
+
+    fclose(report);
+    fprintf(stderr, "profile: wrote %s and heatmaps.\n", path);
+}
+
+#endif
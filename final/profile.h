@@ -0,0 +1,119 @@
+/** @file profile.h Per-pixel cost profiling: the rays, shadow rays,
+ *  bounding-volume nodes, primitive tests and time spent on each pixel,
+ *  written out as heatmap images, with totals for each top-level surface
+ *  and each kind of hit test.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Profiling is compiled in only when PROFILE_PIXELS is defined as the
+ *  directory to write the profile of each frame to, e.g.
+ *      $ CPPFLAGS=-DPROFILE_PIXELS='"/tmp"' make transcube
+ *  Otherwise the PROFILE_ macros below expand to nothing (and
+ *  <code>PROFILE_SFC_HIT()</code> to plain <code>sfc_hit()</code>).
+ *
+ *  The counters are per thread, and tiles rendered by worker processes
+ *  are not counted, so frames are rendered in one process while
+ *  profiling.  Times include the cost of the profiling itself.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "list356.h"
+
+#include "surface.h"
+
+#ifdef PROFILE_PIXELS
+
+/** The kinds of hit test.
+ */
+#define PROFILE_KIND_NODE 0
+#define PROFILE_KIND_PRIM 1
+
+/** The counts for the pixel being rendered.
+ */
+typedef struct _profile_counts_t {
+    unsigned long rays;
+    unsigned long shadow_rays;
+    unsigned long nodes;
+    unsigned long prims;
+} profile_counts_t;
+
+extern __thread profile_counts_t profile_counts;
+
+/** Count a hit test.
+ *
+ *  @param slot the test's slot in the table of kinds of hit test, or -1
+ *      if it has none yet; set the first time the test is counted.
+ *  @param kind <code>PROFILE_KIND_NODE</code> or
+ *      <code>PROFILE_KIND_PRIM</code>.
+ *  @param name the name of the test.
+ */
+void profile_test(int* slot, int kind, const char* name);
+
+/** Start profiling a frame, clearing the counts of the last one.
+ *
+ *  @param width the width of the frame in pixels.
+ *  @param height the height of the frame in pixels.
+ */
+void profile_frame_begin(int width, int height);
+
+/** Start counting a pixel.
+ */
+void profile_pixel_begin(void);
+
+/** Finish counting a pixel, and store its counts and time.
+ *
+ *  @param x the column of the pixel.
+ *  @param y the row of the pixel, from the bottom.
+ */
+void profile_pixel_end(int x, int y);
+
+/** <code>sfc_hit()</code> for a top-level surface, with the tests, time
+ *  and counts of the call added to the surface's totals.
+ */
+bool profile_sfc_hit(surface_t* sfc, ray3_t* ray, float t0, float t1,
+        hit_record_t* rec);
+
+/** Write the profile of the frame: heatmaps of rays, shadow rays, nodes,
+ *  primitive tests and time per pixel (<code>profile_rays.ppm</code>,
+ *  etc.), and <code>profile.txt</code>, with the totals for each surface
+ *  and each kind of hit test.  The heatmaps run from black through blue,
+ *  red and yellow to white, which is the 99.5th percentile of the frame.
+ *
+ *  @param dir the directory to write to.
+ *  @param surfaces the top-level surfaces of the scene, in the order to
+ *      list them.
+ */
+void profile_write(const char* dir, list356_t* surfaces);
+
+#define PROFILE_FRAME_BEGIN(width, height) profile_frame_begin(width, height)
+#define PROFILE_PIXEL_BEGIN() profile_pixel_begin()
+#define PROFILE_PIXEL_END(x, y) profile_pixel_end(x, y)
+#define PROFILE_RAY() (++profile_counts.rays)
+#define PROFILE_SHADOW_RAY() (++profile_counts.shadow_rays)
+#define PROFILE_TEST(kind, name) \
+    do { \
+        static int profile_slot = -1; \
+        profile_test(&profile_slot, kind, name); \
+    } while (0)
+#define PROFILE_NODE(name) PROFILE_TEST(PROFILE_KIND_NODE, name)
+#define PROFILE_PRIM(name) PROFILE_TEST(PROFILE_KIND_PRIM, name)
+#define PROFILE_SFC_HIT(sfc, ray, t0, t1, rec) \
+    profile_sfc_hit(sfc, ray, t0, t1, rec)
+
+#else
+
+#define PROFILE_FRAME_BEGIN(width, height)
+#define PROFILE_PIXEL_BEGIN()
+#define PROFILE_PIXEL_END(x, y)
+#define PROFILE_RAY()
+#define PROFILE_SHADOW_RAY()
+#define PROFILE_NODE(name)
+#define PROFILE_PRIM(name)
+#define PROFILE_SFC_HIT(sfc, ray, t0, t1, rec) sfc_hit(sfc, ray, t0, t1, rec)
+
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/** Ray batch functions.
+ *
+ *  @file ray_batch.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  A ray's sort key holds the octant of its direction in the top 3 bits,
+ *  and below them the 27-bit Morton code of the cell its origin is in:
+ *  the bits of the cell's x, y and z indices interleaved, so that cells
+ *  close along the curve are close in space.  The keys are sorted along
+ *  with the rays' indices by a least-significant-digit radix sort, 10
+ *  bits at a time, and the rays are then moved into that order.  If the
+ *  rays have pages, the sort goes on over their pages in place of the
+ *  keys, and since each pass is stable, rays with the same page stay in
+ *  the order of their keys.
+ */
+
+#include <float.h>
+#include <stdlib.h>
+
+#include "ray_batch.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+// The number of bits in a cell index along each axis.
+#define CELL_BITS 9
+
+// The bits sorted by each pass of the radix sort, and the number of
+// passes needed for the 3 + 3*CELL_BITS bits of a key.
+#define RADIX_BITS 10
+#define RADIX_PASSES 3
+
+ray_batch_t* make_ray_batch(void) {
+    ray_batch_t* batch = MALLOC1(ray_batch_t);
+    *batch = (ray_batch_t){NULL, 0, 0, NULL, NULL, NULL};
+    return batch;
+}
+
+void ray_batch_free(ray_batch_t* batch) {
+    if (batch == NULL) return;
+    free(batch->rays);
+    free(batch->scratch);
+    free(batch->keys);
+    free(batch->order);
+    free(batch);
+}
+
+void ray_batch_add(ray_batch_t* batch, ray3_t* ray, color_t* weight,
+        color_t* pixel, int depth, bool in_trans) {
+    if (batch->size == batch->capacity) {
+        int capacity = batch->capacity > 0 ? 2*batch->capacity : 1024;
+        batch->rays = realloc(batch->rays, capacity*sizeof(batched_ray_t));
+        batch->scratch = realloc(batch->scratch,
+                capacity*sizeof(batched_ray_t));
+        batch->keys = realloc(batch->keys, 2*capacity*sizeof(uint32_t));
+        batch->order = realloc(batch->order, 2*capacity*sizeof(uint32_t));
+        batch->capacity = capacity;
+    }
+    batch->rays[batch->size++] =
+        (batched_ray_t){*ray, *weight, pixel, depth, in_trans, 0};
+}
+
+/** Spread the low CELL_BITS bits of a cell index out to every third bit.
+ */
+static uint32_t spread_bits(uint32_t v) {
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/** Get the index of the cell a coordinate is in.
+ *
+ *  @param v the coordinate.
+ *  @param lo the low end of the grid along the axis.
+ *  @param scale the number of cells per unit along the axis.
+ */
+static uint32_t cell_index(float v, float lo, float scale) {
+    int i = (int)((v - lo)*scale);
+    if (i < 0) return 0;
+    if (i >= 1 << CELL_BITS) return (1 << CELL_BITS) - 1;
+    return i;
+}
+
+void ray_batch_sort(ray_batch_t* batch) {
+    int n = batch->size;
+    if (n < 2) return;
+
+    // The grid covers the box bounding the origins.
+    float lo[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float hi[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (int i=0; i<n; ++i) {
+        point3_t* p = &batch->rays[i].ray.base;
+        float v[3] = {p->x, p->y, p->z};
+        for (int a=0; a<3; ++a) {
+            if (v[a] < lo[a]) lo[a] = v[a];
+            if (v[a] > hi[a]) hi[a] = v[a];
+        }
+    }
+    uint32_t max_page = 0;
+    for (int i=0; i<n; ++i) {
+        if (batch->rays[i].page > max_page) max_page = batch->rays[i].page;
+    }
+    float scale[3];
+    for (int a=0; a<3; ++a) {
+        scale[a] = hi[a] > lo[a] ? (1 << CELL_BITS)/(hi[a] - lo[a]) : 0.0f;
+    }
+
+    uint32_t *keys = batch->keys, *order = batch->order;
+    for (int i=0; i<n; ++i) {
+        ray3_t* ray = &batch->rays[i].ray;
+        uint32_t octant = (ray->dir.x < 0) | (ray->dir.y < 0) << 1 |
+            (ray->dir.z < 0) << 2;
+        keys[i] = octant << 3*CELL_BITS |
+            spread_bits(cell_index(ray->base.x, lo[0], scale[0])) |
+            spread_bits(cell_index(ray->base.y, lo[1], scale[1])) << 1 |
+            spread_bits(cell_index(ray->base.z, lo[2], scale[2])) << 2;
+        order[i] = i;
+    }
+
+    // Each pass moves the keys and indices from one half of the arrays to
+    // the other, stably by one digit.
+    uint32_t *keys_out = keys + batch->capacity,
+             *order_out = order + batch->capacity;
+    for (int pass=0; pass<RADIX_PASSES || max_page > 0; ++pass) {
+        int shift = pass*RADIX_BITS;
+        if (pass >= RADIX_PASSES) {
+            // The keys are sorted; go on by page, a digit at a time.
+            if (pass == RADIX_PASSES) {
+                for (int i=0; i<n; ++i) {
+                    keys[i] = batch->rays[order[i]].page;
+                }
+            }
+            shift -= RADIX_PASSES*RADIX_BITS;
+            max_page >>= RADIX_BITS;
+        }
+        int count[1 << RADIX_BITS] = {0};
+        for (int i=0; i<n; ++i) {
+            ++count[(keys[i] >> shift) & ((1 << RADIX_BITS) - 1)];
+        }
+        int start = 0;
+        for (int d=0; d<1 << RADIX_BITS; ++d) {
+            int c = count[d];
+            count[d] = start;
+            start += c;
+        }
+        for (int i=0; i<n; ++i) {
+            int j = count[(keys[i] >> shift) & ((1 << RADIX_BITS) - 1)]++;
+            keys_out[j] = keys[i];
+            order_out[j] = order[i];
+        }
+        uint32_t* t;
+        t = keys; keys = keys_out; keys_out = t;
+        t = order; order = order_out; order_out = t;
+    }
+
+    for (int i=0; i<n; ++i) batch->scratch[i] = batch->rays[order[i]];
+    batched_ray_t* t = batch->rays;
+    batch->rays = batch->scratch;
+    batch->scratch = t;
+}
@@ -0,0 +1,100 @@
+/** @file ray_batch.h Batches of secondary rays, sorted for coherence.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Traced one at a time in pixel order, the reflection and refraction
+ *  rays of neighboring pixels are interleaved: a pixel over glass sends
+ *  out a reflected ray and a refracted ray heading in very different
+ *  directions, and the next pixel does the same.  Rays collected in a
+ *  batch instead can be sorted so that rays heading the same way from
+ *  nearby points are traced one after another, and so meet the same
+ *  bounding-box nodes and primitives while they are still in the cache.
+ */
+
+#ifndef RAY_BATCH_H
+#define RAY_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "color.h"
+
+#include "geom356.h"
+
+/** A ray waiting in a batch to be traced.
+ */
+typedef struct _batched_ray_t {
+    ray3_t ray;
+    /** The factor to scale the color the ray sees by, before adding it to
+     *  its pixel.
+     */
+    color_t weight;
+    /** The pixel the ray contributes to.
+     */
+    color_t* pixel;
+    /** The ray-tracing depth left to the ray, and whether it is inside a
+     *  transparent surface.
+     */
+    int depth;
+    bool in_trans;
+    /** The out-of-core page the ray reaches first, as found by
+     *  <code>ooc_ray_page()</code>, or 0.  It is 0 when the ray is added,
+     *  and may be set before the batch is sorted.
+     */
+    uint32_t page;
+} batched_ray_t;
+
+/** The type of a batch of rays.  The structure is exposed below.
+ */
+typedef struct _ray_batch_t ray_batch_t;
+
+struct _ray_batch_t {
+    /** The rays, and the number of them.
+     */
+    batched_ray_t* rays;
+    int size;
+    /** Space for <code>capacity</code> rays in <code>rays</code> and
+     *  <code>scratch</code>, and twice that in <code>keys</code> and
+     *  <code>order</code>; the last three are used by
+     *  <code>ray_batch_sort()</code>.
+     */
+    int capacity;
+    batched_ray_t* scratch;
+    uint32_t *keys, *order;
+};
+
+/** Create an empty batch.
+ */
+ray_batch_t* make_ray_batch(void);
+
+/** Free a batch.
+ *
+ *  @param batch the batch.
+ */
+void ray_batch_free(ray_batch_t* batch);
+
+/** Add a ray to a batch.
+ *
+ *  @param batch the batch.
+ *  @param ray the ray.
+ *  @param weight the factor to scale the color the ray sees by.
+ *  @param pixel the pixel the ray contributes to.
+ *  @param depth the ray-tracing depth left to the ray.
+ *  @param in_trans whether the ray is inside a transparent surface.
+ */
+void ray_batch_add(ray_batch_t* batch, ray3_t* ray, color_t* weight,
+        color_t* pixel, int depth, bool in_trans);
+
+/** Sort the rays of a batch by their page, then by the octant of their
+ *  direction, and within each octant along a Morton (Z-order) curve
+ *  through a 512x512x512 grid of cells over the box bounding their
+ *  origins.  The keys are sorted with a three-pass radix sort, and a pass
+ *  more for every 10 bits of the largest page, so sorting takes time
+ *  linear in the size of the batch.
+ *
+ *  @param batch the batch.
+ */
+void ray_batch_sort(ray_batch_t* batch);
+
+#endif
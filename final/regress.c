@@ -0,0 +1,417 @@
+/** A golden-image regression test with a performance budget.
+ *
+ *  @file regress.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Renders each case below without a window, and compares the image with
+ *  the golden image golden/<case>.ppm.  Pixels may differ by a little,
+ *  and edges may move by a pixel, without failing the case; see
+ *  compare().  The image fails if more than a few pixels changed, or if
+ *  the mean difference is over MEAN_TOLERANCE.
+ *
+ *  The cost of each case is also reported with its budget in
+ *  golden/budget.txt.  If a slowdown is given with -s, the case fails
+ *  when its cost is more than that percentage over budget; otherwise
+ *  only the images are checked, since timing on a shared or busy machine
+ *  is too noisy for a default check.  The cost is the fastest of
+ *  REGRESS_RUNS renders over the fastest run of a fixed loop of
+ *  arithmetic, timed between renders.  Measuring in those units keeps a
+ *  machine that is busy, or changing its clock speed, from failing the
+ *  budgets, and lets budgets carry over roughly between machines.  E.g.,
+ *
+ *      $ make regress && ./regress           # check every image
+ *      $ ./regress -s 10 chess boards        # check two, allowing 10%
+ *      $ ./regress -u                        # record goldens and budgets
+ *
+ *  Usage:  regress [-u] [-s percent] [-d dir] [case...].  Budgets still
+ *  depend somewhat on the machine and the build; after checking the
+ *  images, record them again with -u where the budgets are checked.  The
+ *  goldens are for the default build; options that change the scenes
+ *  (LIGHT_GRID, PIXEL_SAMPLES, ...) will fail them.
+ *  When a case's image fails, the render is written to
+ *  $TMPDIR/regress_<case>.ppm (or /tmp) for inspection.  The exit status
+ *  is EXIT_FAILURE if any case failed.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "list356.h"
+#include "geom356.h"
+
+#include "surfaces_lights.h"
+#include "tracer.h"
+#include "framebuffer.h"
+#include "timing.h"
+
+// The size of the rendered images.
+#define REGRESS_WIDTH 320
+#define REGRESS_HEIGHT 240
+
+// The number of times each case is rendered; the fastest is timed.
+#define REGRESS_RUNS 7
+
+// The number of iterations of the reference loop; about as long as
+// rendering a case.
+#define REFERENCE_ITERATIONS 3000000
+
+// The difference, out of 255, at which a pixel counts as changed.
+#define PIXEL_TOLERANCE 8.0f
+
+// The fraction of pixels that may change before an image fails.
+#define CHANGED_FRACTION .001
+
+// The mean difference, out of 255, at which an image fails even if few
+// pixels changed, e.g. when the whole image has become a little darker.
+#define MEAN_TOLERANCE 1.0
+
+// The most cases in the budget file.
+#define MAX_CASES 64
+
+/** A case: a scene, rendered with some of the shading terms, and with
+ *  the given number of worker processes, size of ray batches and tile
+ *  culling; see render_options_t.
+ */
+typedef struct _regress_case_t {
+    const char* name;
+    const char* scene;
+    bool ambient, lambert, phong, reflection, transparency;
+    int workers, ray_batch_size;
+    bool tile_culling;
+} regress_case_t;
+
+// The cases follow the reference renders in images/, and then render some
+// of them again in other ways, which should not change the images.
+static regress_case_t cases[] = {
+    {"3spheres", "sphere3", true, true, true, true, true, 0, 0, true},
+    {"3spheres-lambertian-only", "sphere3", false, true, false, false,
+        false, 0, 0, true},
+    {"3spheres-blinn-phong-only", "sphere3", false, false, true, false,
+        false, 0, 0, true},
+    {"3spheres-no-lighting", "sphere3", true, false, false, false, false,
+        0, 0, true},
+    {"cube-trans", "transcube", true, true, true, true, true, 0, 0, true},
+    {"rg", "rg", true, true, true, true, true, 0, 0, true},
+    {"spheres", "spheres", true, true, true, true, true, 0, 0, true},
+    {"chess", "chess", true, true, true, true, true, 0, 0, true},
+    {"boards", "boards", true, true, true, true, true, 0, 0, true},
+    {"walls", "walls", true, true, true, true, true, 0, 0, true},
+    {"sphere-glass", "sphere", true, true, true, true, true, 0, 0, true},
+    {"chess-workers", "chess", true, true, true, true, true, 2, 0, true},
+    {"cube-trans-ray-batch", "transcube", true, true, true, true, true, 0,
+        4096, true},
+    {"walls-no-tile-culling", "walls", true, true, true, true, true, 0, 0,
+        false},
+};
+
+#define NUM_CASES (int)(sizeof(cases)/sizeof(regress_case_t))
+
+/** The cost budgets of the cases.
+ */
+static struct {
+    char name[64];
+    double seconds;
+} budgets[MAX_CASES];
+static int num_budgets = 0;
+
+/** Read the budget file, if there is one.
+ */
+static void read_budgets(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return;
+    char line[256];
+    while (num_budgets < MAX_CASES && fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", budgets[num_budgets].name,
+                    &budgets[num_budgets].seconds) == 2) {
+            ++num_budgets;
+        }
+    }
+    fclose(f);
+}
+
+/** Get the budget of a case, adding it if it has none.
+ *
+ *  @return a pointer to the case's budget, which is 0 if it has none.
+ */
+static double* find_budget(const char* name) {
+    for (int i=0; i<num_budgets; ++i) {
+        if (strcmp(budgets[i].name, name) == 0) return &budgets[i].seconds;
+    }
+    if (num_budgets == MAX_CASES) {
+        static double none;
+        none = 0.0;
+        return &none;
+    }
+    snprintf(budgets[num_budgets].name, sizeof(budgets[0].name), "%s", name);
+    budgets[num_budgets].seconds = 0.0;
+    return &budgets[num_budgets++].seconds;
+}
+
+static bool write_budgets(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "# Cost of each case at %dx%d: its fastest render over the "
+            "fastest\n# reference loop; see regress.c.\n", REGRESS_WIDTH,
+            REGRESS_HEIGHT);
+    for (int i=0; i<num_budgets; ++i) {
+        fprintf(f, "%s %.4f\n", budgets[i].name, budgets[i].seconds);
+    }
+    fclose(f);
+    return true;
+}
+
+/** Read a binary PPM with 8-bit components.
+ *
+ *  @return the pixels, top row first, or <code>NULL</code> if the file
+ *      cannot be read or is not <code>width</code> by <code>height</code>.
+ */
+static unsigned char* read_ppm(const char* path, int width, int height) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    int w, h, maxval;
+    unsigned char* rgb = NULL;
+    if (fscanf(f, "P6 %d %d %d", &w, &h, &maxval) == 3 && w == width &&
+            h == height && maxval == 255 && fgetc(f) != EOF) {
+        rgb = malloc(3*(size_t)width*height);
+        if (fread(rgb, 3, (size_t)width*height, f) != (size_t)width*height) {
+            free(rgb);
+            rgb = NULL;
+        }
+    }
+    fclose(f);
+    return rgb;
+}
+
+/** Get the difference between two pixels, out of 255.  Channels are
+ *  weighted by how bright they look, as for luma, so changes in blue
+ *  count for less than changes in green.
+ */
+static float pixel_diff(const unsigned char* a, const unsigned char* b) {
+    float dr = a[0] - b[0], dg = a[1] - b[1], db = a[2] - b[2];
+    return sqrtf(.299f*dr*dr + .587f*dg*dg + .114f*db*db);
+}
+
+/** Compare a render with its golden image.  A pixel has changed if it
+ *  differs by more than PIXEL_TOLERANCE from the golden pixel and from
+ *  each of its neighbors, so that edges that move by a pixel (e.g.
+ *  because the compiler rounded differently) do not count.
+ *
+ *  @param rgba the render, as from <code>fb_to_rgba8()</code>, top row
+ *      first.
+ *  @param golden the golden image.
+ *  @param mean filled with the mean difference of the pixels.
+ *
+ *  @return the number of changed pixels.
+ */
+static int compare(unsigned char* rgba, unsigned char* golden, int width,
+        int height, double* mean) {
+    int changed = 0;
+    double total = 0.0;
+    for (int y=0; y<height; ++y) {
+        for (int x=0; x<width; ++x) {
+            unsigned char* p = rgba + 4*(y*width + x);
+            float diff = pixel_diff(p, golden + 3*(y*width + x));
+            total += diff;
+            if (diff <= PIXEL_TOLERANCE) continue;
+
+            bool matched = false;
+            for (int j=y-1; j<=y+1 && !matched; ++j) {
+                for (int i=x-1; i<=x+1 && !matched; ++i) {
+                    if (i < 0 || i >= width || j < 0 || j >= height) continue;
+                    matched = pixel_diff(p, golden + 3*(j*width + i)) <=
+                        PIXEL_TOLERANCE;
+                }
+            }
+            if (!matched) ++changed;
+        }
+    }
+    *mean = total/(width*height);
+    return changed;
+}
+
+// Keeps the reference loop from being optimized away.
+static volatile double reference_sink;
+
+/** Time the reference loop: a fixed amount of integer and floating-point
+ *  arithmetic, that render times are measured in units of.
+ *
+ *  @return the time taken, in seconds.
+ */
+static double time_reference() {
+    struct timespec start;
+    timer_start(&start);
+    unsigned int state = 1;
+    double sum = 0.0;
+    for (int i=0; i<REFERENCE_ITERATIONS; ++i) {
+        state = state*1103515245u + 12345u;
+        sum += sqrt((double)(state >> 8));
+    }
+    reference_sink = sum;
+    return seconds_since(&start);
+}
+
+/** Render a case, REGRESS_RUNS times, timing the reference loop before
+ *  each render.
+ *
+ *  @param c the case.
+ *  @param frame filled with the image.
+ *
+ *  @return the cost of the case: the fastest render time over the fastest
+ *      time of the reference loop, or a negative number if
+ *      the case's scene is unknown.
+ */
+static double render_case(regress_case_t* c, framebuffer_t* frame) {
+    view_t view;
+    set_view_data(&view.eye, &view.look_at, &view.up);
+    set_view_plane(&view.plane_dist, &view.plane_width, &view.plane_height);
+    list356_t* surfaces = get_scene_surfaces(c->scene, &view.eye,
+            &view.look_at);
+    if (surfaces == NULL) return -1.0;
+    color_t ambient_light;
+    get_ambient_light(&ambient_light);
+    scene_t* scene = make_scene(surfaces, get_lights(), ambient_light);
+
+    render_options_t options;
+    render_options_init(&options);
+    options.ambient_shading = c->ambient;
+    options.lambertian_shading = c->lambert;
+    options.blinn_phong_shading = c->phong;
+    options.spec_reflection = c->reflection;
+    options.transparency = c->transparency;
+    options.workers = c->workers;
+    options.ray_batch_size = c->ray_batch_size;
+    options.tile_culling = c->tile_culling;
+
+    double best = INFINITY, best_reference = INFINITY;
+    for (int run=0; run<REGRESS_RUNS; ++run) {
+        best_reference = fmin(best_reference, time_reference());
+        srand48(0);
+        struct timespec start;
+        timer_start(&start);
+        render_frame(scene, &view, frame, &options);
+        best = fmin(best, seconds_since(&start));
+    }
+
+    scene_free(scene);
+    return best/best_reference;
+}
+
+int main(int argc, char **argv) {
+    bool update = false;
+    bool check_cost = false;
+    double slowdown = 0.0;
+    const char* dir = "golden";
+    int opt;
+    while ((opt = getopt(argc, argv, "us:d:")) != -1) {
+        switch (opt) {
+            case 'u': update = true; break;
+            case 's':
+                check_cost = true;
+                slowdown = atof(optarg);
+                break;
+            case 'd': dir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-u] [-s percent] [-d dir] "
+                        "[case...]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    const char* tmp = getenv("TMPDIR");
+    if (tmp == NULL) tmp = "/tmp";
+
+    char budget_path[1024];
+    snprintf(budget_path, sizeof(budget_path), "%s/budget.txt", dir);
+    read_budgets(budget_path);
+
+    framebuffer_t* frame = make_framebuffer(REGRESS_WIDTH, REGRESS_HEIGHT);
+    unsigned char* rgba = malloc(4*REGRESS_WIDTH*REGRESS_HEIGHT);
+    int failures = 0, checked = 0;
+    printf("%-26s %8s %8s %9s %9s %8s  %s\n", "case", "changed", "mean",
+            "cost", "budget", "slower", "result");
+    for (int k=0; k<NUM_CASES; ++k) {
+        regress_case_t* c = &cases[k];
+        bool wanted = optind == argc;
+        for (int i=optind; i<argc; ++i) {
+            wanted = wanted || strcmp(argv[i], c->name) == 0;
+        }
+        if (!wanted) continue;
+        ++checked;
+
+        double cost = render_case(c, frame);
+        if (cost < 0) {
+            printf("%-26s unknown scene %s\n", c->name, c->scene);
+            ++failures;
+            continue;
+        }
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s.ppm", dir, c->name);
+        double* budget = find_budget(c->name);
+
+        if (update) {
+            bool ok = framebuffer_write_ppm(frame, path);
+            *budget = cost;
+            printf("%-26s %8s %8s %9.4f %9s %8s  %s\n", c->name, "-", "-",
+                    cost, "-", "-", ok ? "recorded" : "FAILED");
+            failures += !ok;
+            continue;
+        }
+
+        unsigned char* golden = read_ppm(path, REGRESS_WIDTH,
+                REGRESS_HEIGHT);
+        if (golden == NULL) {
+            printf("%-26s no golden image %s\n", c->name, path);
+            ++failures;
+            continue;
+        }
+        fb_to_rgba8(frame, rgba, true);
+        double mean;
+        int changed = compare(rgba, golden, REGRESS_WIDTH, REGRESS_HEIGHT,
+                &mean);
+        free(golden);
+        bool image_ok = changed <= CHANGED_FRACTION*REGRESS_WIDTH*
+            REGRESS_HEIGHT && mean <= MEAN_TOLERANCE;
+        double slower = *budget > 0 ? 100*(cost / *budget - 1) : 0.0;
+        bool cost_ok = !check_cost || slower <= slowdown;
+
+        const char* result = image_ok && cost_ok ? "ok" :
+            !image_ok && !cost_ok ? "FAILED image, cost" :
+            !image_ok ? "FAILED image" : "FAILED cost";
+        printf("%-26s %8d %8.3f %9.4f %9.4f %7.1f%%  %s\n", c->name, changed,
+                mean, cost, *budget, slower, result);
+        if (!image_ok) {
+            snprintf(path, sizeof(path), "%s/regress_%s.ppm", tmp, c->name);
+            if (framebuffer_write_ppm(frame, path)) {
+                printf("%-26s render written to %s\n", "", path);
+            }
+        }
+        failures += !(image_ok && cost_ok);
+    }
+    free(rgba);
+    fb_free(frame);
+
+    if (checked == 0) {
+        fprintf(stderr, "%s: no such case.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (update) {
+        return write_budgets(budget_path) && failures == 0 ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (failures > 0) {
+        printf("FAILED: %d of %d cases.\n", failures, checked);
+        return EXIT_FAILURE;
+    }
+    printf("All %d cases match their golden images%s.\n", checked,
+            check_cost ? " within budget" : "");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+/** A client for the render server.
+ *
+ *  @file render_client.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Sends one job to a render server and writes the image it returns to
+ *  standard output.  E.g.,
+ *
+ *      $ ./render_client /tmp/render.sock "scene=chess samples=4" > chess.ppm
+ *
+ *  See server.h for the fields of a job.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s socket job\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    FILE* server = fdopen(fd, "r+");
+    fprintf(server, "%s\n", argv[2]);
+    fflush(server);
+
+    char status[1024];
+    if (fgets(status, sizeof(status), server) == NULL) {
+        fprintf(stderr, "%s: no reply.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned long size;
+    if (sscanf(status, "OK %lu", &size) != 1) {
+        fprintf(stderr, "%s: %s", argv[0], status);
+        return EXIT_FAILURE;
+    }
+
+    char buf[65536];
+    while (size > 0) {
+        size_t n = fread(buf, 1, size < sizeof(buf) ? size : sizeof(buf),
+                server);
+        if (n == 0) {
+            fprintf(stderr, "%s: short reply.\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        fwrite(buf, 1, n, stdout);
+        size -= n;
+    }
+
+    fclose(server);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,463 @@
+/** Render server functions.
+ *
+ *  @file server.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  The server is a single-threaded poll() loop.  Each client has a queue
+ *  of job lines and a buffer of reply bytes; sockets are non-blocking, so
+ *  a slow reader only holds up its own replies.  Between polls, one job
+ *  is taken from the next client in turn that has one queued, so clients
+ *  share the tracer fairly whatever the length of their queues.  A client
+ *  with MAX_PENDING reply bytes unsent is skipped, and not read from,
+ *  until it reads them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "surfaces_lights.h"
+#include "server.h"
+#include "timing.h"
+
+/** The most clients that can be connected at once.
+ */
+#define MAX_CLIENTS 64
+
+/** The longest job line, and the most jobs a client can have queued.
+ *  A client that sends more is not read from until its queue drains.
+ */
+#define MAX_LINE 1024
+#define MAX_QUEUED 16
+
+/** The most reply bytes a client can have unsent before its jobs are
+ *  held back.  A client that sends jobs and never reads the replies
+ *  would otherwise make the server keep every image it has rendered.
+ *  One reply may take a client past this; it then gets no more until
+ *  it has read back below it.
+ */
+#define MAX_PENDING (16 << 20)
+
+/** A scene that has been built.
+ */
+typedef struct _cached_scene_t {
+    char name[32];
+    scene_t* scene;
+    /** The scene's own viewpoint and look-at point.
+     */
+    point3_t eye, look_at;
+    struct _cached_scene_t* next;
+} cached_scene_t;
+
+/** A connected client.
+ */
+typedef struct _client_t {
+    int fd;
+    /** Bytes read that do not yet make a whole line.
+     */
+    char in[MAX_LINE];
+    size_t in_len;
+    /** Whether the rest of a line too long to queue is being skipped.
+     */
+    bool skipping;
+    /** Queued job lines, in a ring.
+     */
+    char* jobs[MAX_QUEUED];
+    int first_job, num_jobs;
+    /** Reply bytes not yet written.
+     */
+    char* out;
+    size_t out_len, out_sent, out_capacity;
+} client_t;
+
+static cached_scene_t* scenes = NULL;
+static client_t* clients[MAX_CLIENTS];
+static int num_clients = 0;
+
+/** Find a scene, building it if this is the first job that names it.
+ *
+ *  @param name the name of the scene.
+ *
+ *  @return the scene, or <code>NULL</code> if there is no such scene.
+ */
+static cached_scene_t* find_scene(const char* name) {
+    for (cached_scene_t* scene = scenes; scene != NULL; scene = scene->next) {
+        if (strcmp(scene->name, name) == 0) return scene;
+    }
+    if (strlen(name) >= sizeof(scenes->name)) return NULL;
+
+    cached_scene_t* scene = malloc(sizeof(cached_scene_t));
+    list356_t* surfaces = get_scene_surfaces(name, &scene->eye,
+            &scene->look_at);
+    if (surfaces == NULL) {
+        free(scene);
+        return NULL;
+    }
+    color_t ambient_light;
+    get_ambient_light(&ambient_light);
+    scene->scene = make_scene(surfaces, get_lights(), ambient_light);
+    strcpy(scene->name, name);
+    scene->next = scenes;
+    scenes = scene;
+    return scene;
+}
+
+/** Determine whether a client has too many reply bytes unsent to be
+ *  given more jobs or read from.
+ *
+ *  @param client the client.
+ */
+static bool backed_up(client_t* client) {
+    return client->out_len - client->out_sent >= MAX_PENDING;
+}
+
+/** Add bytes to a client's reply buffer.  Bytes already sent are dropped
+ *  first, so the buffer only grows with the bytes still to send.
+ *
+ *  @param client the client.
+ *  @param data the bytes.
+ *  @param n the number of bytes.
+ */
+static void reply(client_t* client, const void* data, size_t n) {
+    if (client->out_sent > 0) {
+        client->out_len -= client->out_sent;
+        memmove(client->out, client->out + client->out_sent,
+                client->out_len);
+        client->out_sent = 0;
+    }
+    if (client->out_len + n > client->out_capacity) {
+        client->out_capacity = 2*(client->out_len + n);
+        client->out = realloc(client->out, client->out_capacity);
+    }
+    memcpy(client->out + client->out_len, data, n);
+    client->out_len += n;
+}
+
+/** Reply to a client with an error.
+ *
+ *  @param client the client.
+ *  @param message the error message.
+ */
+static void reply_error(client_t* client, const char* message) {
+    char line[MAX_LINE + 64];
+    int n = snprintf(line, sizeof(line), "ERROR %s\n", message);
+    if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    reply(client, line, n);
+}
+
+/** Parse three comma-separated coordinates.
+ *
+ *  @param s the text.
+ *  @param p filled with the point.
+ *
+ *  @return <code>true</code> if <code>s</code> is three numbers.
+ */
+static bool parse_point(const char* s, point3_t* p) {
+    char end;
+    return sscanf(s, "%f,%f,%f%c", &p->x, &p->y, &p->z, &end) == 3;
+}
+
+/** Parse a comma-separated list of shading terms.
+ *
+ *  @param s the text.
+ *  @param options the options whose shading terms are turned on if they
+ *      are in the list, and off otherwise.
+ *
+ *  @return <code>true</code> if every term in <code>s</code> is known.
+ */
+static bool parse_shading(char* s, render_options_t* options) {
+    bool* terms[] = {
+        &options->ambient_shading, &options->lambertian_shading,
+        &options->blinn_phong_shading, &options->spec_reflection,
+        &options->transparency,
+    };
+    static const char* names[] = {
+        "ambient", "lambert", "phong", "reflection", "transparency",
+    };
+    const int num_terms = sizeof(names)/sizeof(names[0]);
+
+    for (int i=0; i<num_terms; ++i) *terms[i] = false;
+    char* save;
+    for (char* t = strtok_r(s, ",", &save); t != NULL;
+            t = strtok_r(NULL, ",", &save)) {
+        if (strcmp(t, "none") == 0) continue;
+        bool all = strcmp(t, "all") == 0, known = all;
+        for (int i=0; i<num_terms; ++i) {
+            if (all || strcmp(names[i], t) == 0) *terms[i] = known = true;
+        }
+        if (!known) return false;
+    }
+    return true;
+}
+
+/** Run one job and queue its reply.
+ *
+ *  @param client the client that sent the job.
+ *  @param line the job line; it is modified.
+ *  @param defaults the options that the job starts from.
+ */
+static void run_job(client_t* client, char* line,
+        render_options_t* defaults) {
+    render_options_t options = *defaults;
+    view_t view;
+    set_view_data(&view.eye, &view.look_at, &view.up);
+    set_view_plane(&view.plane_dist, &view.plane_width, &view.plane_height);
+    int width = 400, height = 300;
+    const char* scene_name = NULL;
+    bool have_eye = false, have_look_at = false;
+
+    char* save;
+    for (char* field = strtok_r(line, " \t\r", &save); field != NULL;
+            field = strtok_r(NULL, " \t\r", &save)) {
+        char* value = strchr(field, '=');
+        if (value == NULL) {
+            reply_error(client, "fields must be key=value");
+            return;
+        }
+        *value++ = '\0';
+
+        bool ok = true;
+        if (strcmp(field, "scene") == 0) scene_name = value;
+        else if (strcmp(field, "width") == 0) {
+            width = atoi(value);
+            ok = width > 0 && width <= 8192;
+        }
+        else if (strcmp(field, "height") == 0) {
+            height = atoi(value);
+            ok = height > 0 && height <= 8192;
+        }
+        else if (strcmp(field, "samples") == 0) {
+            options.pixel_samples = atoi(value);
+            ok = options.pixel_samples > 0 && options.pixel_samples <= 1024;
+        }
+        else if (strcmp(field, "denoise") == 0) {
+            options.denoise_passes = atoi(value);
+            ok = options.denoise_passes >= 0 && options.denoise_passes <= 8;
+        }
+        else if (strcmp(field, "eye") == 0) {
+            ok = have_eye = parse_point(value, &view.eye);
+        }
+        else if (strcmp(field, "look_at") == 0) {
+            ok = have_look_at = parse_point(value, &view.look_at);
+        }
+        else if (strcmp(field, "shading") == 0) {
+            ok = parse_shading(value, &options);
+        }
+        else ok = false;
+
+        if (!ok) {
+            char message[MAX_LINE];
+            snprintf(message, sizeof(message), "bad field %s", field);
+            reply_error(client, message);
+            return;
+        }
+    }
+
+    if (scene_name == NULL) {
+        reply_error(client, "no scene");
+        return;
+    }
+    cached_scene_t* scene = find_scene(scene_name);
+    if (scene == NULL) {
+        reply_error(client, "unknown scene");
+        return;
+    }
+    if (!have_eye) view.eye = scene->eye;
+    if (!have_look_at) view.look_at = scene->look_at;
+
+    struct timespec start;
+    timer_start(&start);
+    framebuffer_t* frame = make_framebuffer(width, height);
+    render_frame(scene->scene, &view, frame, &options);
+    fprintf(stderr, "render server: %s %dx%d in %.3f s.\n", scene->name,
+            width, height, seconds_since(&start));
+
+    size_t size;
+    unsigned char* ppm = fb_to_ppm(frame, &size);
+    fb_free(frame);
+    char status[32];
+    int status_len = sprintf(status, "OK %lu\n", (unsigned long)size);
+    reply(client, status, status_len);
+    reply(client, ppm, size);
+    free(ppm);
+}
+
+/** Disconnect a client and drop its queued jobs.
+ *
+ *  @param i the client's index in <code>clients</code>.
+ */
+static void drop_client(int i) {
+    client_t* client = clients[i];
+    close(client->fd);
+    for (int k=0; k<client->num_jobs; ++k) {
+        free(client->jobs[(client->first_job + k)%MAX_QUEUED]);
+    }
+    free(client->out);
+    free(client);
+    clients[i] = clients[--num_clients];
+}
+
+/** Queue each whole line read from a client as a job, while there is
+ *  room in its queue.  Lines left over are queued as jobs are taken, even
+ *  if the client sends nothing more.
+ *
+ *  @param client the client.
+ */
+static void queue_lines(client_t* client) {
+    char* start = client->in;
+    char* newline;
+    if (client->skipping) {
+        newline = memchr(start, '\n', client->in_len);
+        if (newline == NULL) {
+            client->in_len = 0;
+            return;
+        }
+        start = newline + 1;
+        client->skipping = false;
+    }
+    while (client->num_jobs < MAX_QUEUED &&
+            (newline = memchr(start, '\n',
+                client->in + client->in_len - start)) != NULL) {
+        *newline = '\0';
+        int k = (client->first_job + client->num_jobs++)%MAX_QUEUED;
+        client->jobs[k] = strdup(start);
+        start = newline + 1;
+    }
+    client->in_len -= start - client->in;
+    memmove(client->in, start, client->in_len);
+
+    // A line too long for the buffer can never be completed.  A full
+    // buffer of whole lines is only waiting for room in the queue.
+    if (client->in_len == MAX_LINE &&
+            memchr(client->in, '\n', client->in_len) == NULL) {
+        reply_error(client, "line too long");
+        client->in_len = 0;
+        client->skipping = true;
+    }
+}
+
+/** Read from a client, queueing each whole line as a job.
+ *
+ *  @param client the client.
+ *
+ *  @return <code>false</code> if the client has hung up.
+ */
+static bool read_client(client_t* client) {
+    // The buffer is full of lines waiting for room in the queue.
+    if (client->in_len == MAX_LINE) return true;
+
+    ssize_t n = read(client->fd, client->in + client->in_len,
+            MAX_LINE - client->in_len);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        return false;
+    }
+    if (n < 0) return true;
+    client->in_len += n;
+    queue_lines(client);
+    return true;
+}
+
+int run_render_server(const char* path, render_options_t* defaults) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "render server: socket path too long.\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (listen_fd < 0 ||
+            bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, MAX_CLIENTS) != 0) {
+        perror("render server");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "render server: listening on %s.\n", path);
+
+    // The client to look at first for the next job.
+    int next = 0;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    while (true) {
+        bool have_jobs = false;
+        fds[0] = (struct pollfd){listen_fd,
+            num_clients < MAX_CLIENTS ? POLLIN : 0, 0};
+        for (int i=0; i<num_clients; ++i) {
+            client_t* client = clients[i];
+            bool held = backed_up(client);
+            have_jobs = have_jobs || (client->num_jobs > 0 && !held);
+            short events = 0;
+            if (client->num_jobs < MAX_QUEUED && client->in_len < MAX_LINE &&
+                    !held) {
+                events |= POLLIN;
+            }
+            if (client->out_sent < client->out_len) events |= POLLOUT;
+            fds[i+1] = (struct pollfd){client->fd, events, 0};
+        }
+
+        // Only wait when there is nothing to render.
+        int polled = num_clients;
+        if (poll(fds, polled + 1, have_jobs ? 0 : -1) < 0 &&
+                errno != EINTR) {
+            perror("render server");
+            return EXIT_FAILURE;
+        }
+
+        // Serve existing clients from the last to the first, so that
+        // dropping one does not move any that are yet to be served.
+        for (int i=polled-1; i>=0; --i) {
+            client_t* client = clients[i];
+            short revents = fds[i+1].revents;
+            bool ok = true;
+            if (revents & POLLOUT) {
+                ssize_t n = send(client->fd, client->out + client->out_sent,
+                        client->out_len - client->out_sent, MSG_NOSIGNAL);
+                if (n > 0) client->out_sent += n;
+                else if (errno != EAGAIN && errno != EINTR) ok = false;
+                if (client->out_sent == client->out_len) {
+                    client->out_sent = client->out_len = 0;
+                }
+            }
+            if (ok && (revents & (POLLIN | POLLHUP))) {
+                ok = read_client(client);
+            }
+            if (!ok || (revents & (POLLERR | POLLNVAL))) drop_client(i);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                client_t* client = calloc(1, sizeof(client_t));
+                client->fd = fd;
+                clients[num_clients++] = client;
+            }
+        }
+
+        // Run one job, from the next client in turn that has one and is
+        // keeping up with its replies.
+        for (int k=0; k<num_clients; ++k) {
+            int i = (next + k)%num_clients;
+            client_t* client = clients[i];
+            if (client->num_jobs == 0 || backed_up(client)) continue;
+            char* line = client->jobs[client->first_job];
+            client->first_job = (client->first_job + 1)%MAX_QUEUED;
+            --client->num_jobs;
+            run_job(client, line, defaults);
+            free(line);
+            queue_lines(client);
+            next = i + 1;
+            break;
+        }
+    }
+}
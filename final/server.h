@@ -0,0 +1,54 @@
+/** @file server.h A render server that takes jobs from clients over a
+ *  UNIX domain socket and keeps its scenes built between them.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Each job is one line of text, of space-separated key=value fields:
+ *
+ *      scene=chess width=400 height=300 eye=4,-4,7 look_at=4,4,1
+ *      samples=1 denoise=0
+ *      shading=ambient,lambert,phong,reflection,transparency
+ *
+ *  Only <code>scene</code> is required.  <code>eye</code> and
+ *  <code>look_at</code> default to the scene's own; <code>width</code>
+ *  and <code>height</code> to 400 and 300; <code>samples</code>, the
+ *  number of jittered rays per pixel, to the server's default (1 unless
+ *  PIXEL_SAMPLES is set); <code>denoise</code>, the number of denoising
+ *  passes, to the server's default (0 unless DENOISE is set); and
+ *  <code>shading</code>, the
+ *  list of shading terms to turn on, to all of them (<code>none</code>
+ *  turns them all off).  The reply is a line <code>OK n</code> followed
+ *  by an n-byte binary PPM image, or a line <code>ERROR message</code>.
+ *  A client may send several jobs without waiting; replies come back in
+ *  order.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "tracer.h"
+
+/** Run a render server until it is killed.  Clients are served in turn,
+ *  one job at a time, so a client with many queued jobs cannot hold up
+ *  the others.  Scenes are built the first time a job names them and kept
+ *  for later jobs.
+ *
+ *  Jobs are rendered in the same thread as the poll loop, so while a
+ *  frame renders (or a scene is built) no client is read from or sent
+ *  to: every client waits out each job in turn, and a large frame delays
+ *  the replies of all of them.  Render with worker processes (see
+ *  <code>render_options_t</code>) to shorten that wait.  A client that
+ *  leaves many reply bytes unread is not given more jobs, and is not
+ *  read from, until it catches up.
+ *
+ *  @param path the path of the socket to listen on.  An existing socket
+ *      there is replaced.
+ *  @param defaults the options that jobs start from.
+ *
+ *  @return <code>EXIT_FAILURE</code> if the socket could not be set up;
+ *      otherwise the server does not return.
+ */
+int run_render_server(const char* path, render_options_t* defaults);
+
+#endif
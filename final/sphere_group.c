@@ -0,0 +1,325 @@
+/** Sphere group functions.
+ *
+ *  @file sphere_group.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  A scene made of many small spheres spends most of its time in leaf
+ *  tests: one indirect call and one scalar quadratic per sphere.  Here
+ *  a bounding-box tree is built over the spheres and cut into the largest
+ *  subtrees that fit in a packet, so that each packet holds spheres that
+ *  are close together.  A packet stores its centers and squared radii
+ *  coordinate by coordinate, so the quadratic for all of its spheres is
+ *  solved with a handful of vector instructions: eight lanes wide with
+ *  -mavx, four with SSE, and one sphere at a time otherwise.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "debug.h"
+#include "sphere_group.h"
+#include "profile.h"
+
+#define MALLOC1(t) (t *)(malloc(sizeof(t)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// Vector operations on PACKET_LANES spheres at a time.
+#if defined __AVX__
+#define PACKET_LANES 8
+typedef __m256 vec_t;
+#define vset1 _mm256_set1_ps
+#define vload _mm256_loadu_ps
+#define vstore _mm256_storeu_ps
+#define vadd _mm256_add_ps
+#define vsub _mm256_sub_ps
+#define vmul _mm256_mul_ps
+#define vdiv _mm256_div_ps
+#define vsqrt _mm256_sqrt_ps
+#define vmax _mm256_max_ps
+#define vand _mm256_and_ps
+#define vandnot _mm256_andnot_ps
+#define vor _mm256_or_ps
+#define vlt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define vgt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#elif defined __SSE__
+#define PACKET_LANES 4
+typedef __m128 vec_t;
+#define vset1 _mm_set1_ps
+#define vload _mm_loadu_ps
+#define vstore _mm_storeu_ps
+#define vadd _mm_add_ps
+#define vsub _mm_sub_ps
+#define vmul _mm_mul_ps
+#define vdiv _mm_div_ps
+#define vsqrt _mm_sqrt_ps
+#define vmax _mm_max_ps
+#define vand _mm_and_ps
+#define vandnot _mm_andnot_ps
+#define vor _mm_or_ps
+#define vlt(a, b) _mm_cmplt_ps(a, b)
+#define vgt(a, b) _mm_cmpgt_ps(a, b)
+#endif
+
+/** A packet of spheres.  Unused slots have a squared radius of
+ *  <code>-INFINITY</code>, which no ray hits.
+ */
+typedef struct _sphere_packet_t {
+    /** The centers and squared radii, one array per coordinate.
+     */
+    float x[SPHERE_PACKET_SIZE];
+    float y[SPHERE_PACKET_SIZE];
+    float z[SPHERE_PACKET_SIZE];
+    float r2[SPHERE_PACKET_SIZE];
+    /** The spheres themselves, for hit records.
+     */
+    surface_t* spheres[SPHERE_PACKET_SIZE];
+} sphere_packet_t;
+
+/** Compute the hit times of a ray with every sphere in a packet, in the
+ *  same way as <code>sfc_hit()</code> does for a single sphere: the near
+ *  root is taken, or the far one if the near one is before
+ *  <code>t0</code>.
+ *
+ *  @param p the packet.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param t1 the right endpoint of the ray.
+ *  @param t filled with the hit time for each sphere, or
+ *      <code>INFINITY</code> for a sphere that the ray does not hit in
+ *      [<code>t0</code>, <code>t1</code>].
+ */
+static void packet_times(sphere_packet_t* p, ray3_t* ray, float t0,
+        float t1, float* t) {
+    float dx = ray->dir.x, dy = ray->dir.y, dz = ray->dir.z;
+    float d2 = dx*dx + dy*dy + dz*dz;
+#ifdef PACKET_LANES
+    vec_t ex = vset1(ray->base.x), ey = vset1(ray->base.y),
+          ez = vset1(ray->base.z);
+    vec_t vdx = vset1(dx), vdy = vset1(dy), vdz = vset1(dz);
+    vec_t vd2 = vset1(d2), vt0 = vset1(t0), vt1 = vset1(t1);
+    vec_t zero = vset1(0.0f), inf = vset1(INFINITY);
+    for (int i=0; i<SPHERE_PACKET_SIZE; i+=PACKET_LANES) {
+        vec_t ox = vsub(ex, vload(&p->x[i]));
+        vec_t oy = vsub(ey, vload(&p->y[i]));
+        vec_t oz = vsub(ez, vload(&p->z[i]));
+        vec_t b = vadd(vadd(vmul(vdx, ox), vmul(vdy, oy)), vmul(vdz, oz));
+        vec_t s = vdiv(b, vd2);
+        vec_t lx = vsub(ox, vmul(s, vdx));
+        vec_t ly = vsub(oy, vmul(s, vdy));
+        vec_t lz = vsub(oz, vmul(s, vdz));
+        vec_t l2 = vadd(vadd(vmul(lx, lx), vmul(ly, ly)), vmul(lz, lz));
+        vec_t discr = vmul(vd2, vsub(vload(&p->r2[i]), l2));
+
+        vec_t root = vsqrt(vmax(discr, zero));
+        vec_t minus_b = vsub(zero, b);
+        vec_t tn = vdiv(vsub(minus_b, root), vd2);
+        vec_t tf = vdiv(vadd(minus_b, root), vd2);
+        vec_t use_far = vlt(tn, vt0);
+        vec_t ti = vor(vand(use_far, tf), vandnot(use_far, tn));
+
+        vec_t miss = vor(vlt(discr, zero), vor(vlt(ti, vt0), vgt(ti, vt1)));
+        vstore(&t[i], vor(vand(miss, inf), vandnot(miss, ti)));
+    }
+#else
+    for (int i=0; i<SPHERE_PACKET_SIZE; ++i) {
+        float ox = ray->base.x - p->x[i];
+        float oy = ray->base.y - p->y[i];
+        float oz = ray->base.z - p->z[i];
+        float b = dx*ox + dy*oy + dz*oz;
+        float s = b/d2;
+        float lx = ox - s*dx, ly = oy - s*dy, lz = oz - s*dz;
+        float discr = d2*(p->r2[i] - (lx*lx + ly*ly + lz*lz));
+        t[i] = INFINITY;
+        if (discr < 0) continue;
+
+        float root = sqrtf(discr);
+        float ti = (-b - root)/d2;
+        if (ti < t0) ti = (-b + root)/d2;
+        if (ti >= t0 && ti <= t1) t[i] = ti;
+    }
+#endif
+}
+
+/** Packet-ray intersection function.
+ *
+ *  @param sfc the packet surface.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param t1 the right endpoint of the ray.
+ *  @param hit the hit record to fill in for the nearest sphere that
+ *      <code>ray</code> hits.
+ *
+ *  @return <code>true</code> if <code>ray</code> intersects a sphere of
+ *      the packet in the interval [<code>t0</code>,<code>t1</code>],
+ *      <code>false</code> otherwise.
+ */
+static bool sfc_hit_sphere_packet(surface_t* sfc, ray3_t* ray, float t0,
+        float t1, hit_record_t* hit) {
+    PROFILE_PRIM("sphere packet");
+    sphere_packet_t* p = (sphere_packet_t*)(sfc->data);
+    float t[SPHERE_PACKET_SIZE];
+    packet_times(p, ray, t0, t1, t);
+
+    int nearest = -1;
+    float nearest_t = INFINITY;
+    for (int i=0; i<SPHERE_PACKET_SIZE; ++i) {
+        if (t[i] < nearest_t) {
+            nearest_t = t[i];
+            nearest = i;
+        }
+    }
+    if (nearest < 0) return false;
+
+    hit->sfc = p->spheres[nearest];
+    hit->world_sfc = p->spheres[nearest];
+    hit->t = nearest_t;
+
+    vector3_t ray_vec = ray->dir;
+    multiply(&ray_vec, nearest_t, &ray_vec);
+    pv_add(&ray->base, &ray_vec, &(hit->hit_pt));
+
+    // Surface normal.
+    point3_t ctr = {p->x[nearest], p->y[nearest], p->z[nearest]};
+    pv_subtract(&(hit->hit_pt), &ctr, &(hit->normal));
+    normalize(&(hit->normal));
+    return true;
+}
+
+/** Fill a packet with the leaves of a bounding-box tree.
+ *
+ *  @param node a node of the tree, or a sphere, or <code>NULL</code>.
+ *  @param p the packet.
+ *  @param n the number of spheres in the packet so far; advanced past
+ *      the spheres added.
+ *  @param bbox the packet's box, grown to include the spheres added.
+ */
+static void fill_packet(surface_t* node, sphere_packet_t* p, int* n,
+        bbox_t* bbox) {
+    if (node == NULL) return;
+    if (sfc_is_bbt(node)) {
+        surface_t *left, *right;
+        bbt_children(node, &left, &right);
+        fill_packet(left, p, n, bbox);
+        fill_packet(right, p, n, bbox);
+        return;
+    }
+
+    point3_t c;
+    float r;
+    sfc_sphere_geometry(node, &c, &r);
+    p->x[*n] = c.x;
+    p->y[*n] = c.y;
+    p->z[*n] = c.z;
+    p->r2[*n] = r*r;
+    p->spheres[*n] = node;
+    ++*n;
+
+    bbox_t* b = node->bbox;
+    bbox->left = min(bbox->left, b->left);
+    bbox->right = max(bbox->right, b->right);
+    bbox->bottom = min(bbox->bottom, b->bottom);
+    bbox->top = max(bbox->top, b->top);
+    bbox->near = min(bbox->near, b->near);
+    bbox->far = max(bbox->far, b->far);
+}
+
+/** Make a packet surface from the spheres of a bounding-box tree, or keep
+ *  a lone sphere as it is.
+ *
+ *  @param node a node of a tree of at most <code>SPHERE_PACKET_SIZE</code>
+ *      spheres, or a sphere.
+ *  @param leaves the list to add the packet or sphere to.
+ */
+static void add_packet(surface_t* node, list356_t* leaves) {
+    if (!sfc_is_bbt(node)) {
+        lst_add(leaves, node);
+        return;
+    }
+
+    sphere_packet_t* p = MALLOC1(sphere_packet_t);
+    for (int k=0; k<SPHERE_PACKET_SIZE; ++k) {
+        p->x[k] = p->y[k] = p->z[k] = 0.0f;
+        p->r2[k] = -INFINITY;
+        p->spheres[k] = NULL;
+    }
+
+    surface_t* sfc = MALLOC1(surface_t);
+    memset(sfc, 0, sizeof(surface_t));
+    sfc->data = p;
+    sfc->hit_fn = sfc_hit_sphere_packet;
+    sfc->refr_index = -1.0f;
+    sfc->bbox = MALLOC1(bbox_t);
+    *(sfc->bbox) = (bbox_t){.left = INFINITY, .right = -INFINITY,
+        .bottom = INFINITY, .top = -INFINITY,
+        .near = INFINITY, .far = -INFINITY};
+    int n = 0;
+    fill_packet(node, p, &n, sfc->bbox);
+    lst_add(leaves, sfc);
+}
+
+/** Cut a bounding-box tree of spheres into packets: the largest subtrees
+ *  with at most <code>SPHERE_PACKET_SIZE</code> spheres.
+ *
+ *  @param node a node of the tree, or a sphere, or <code>NULL</code>.
+ *  @param leaves the list to add the packets to.
+ *
+ *  @return the number of spheres at or below <code>node</code>, if they
+ *      fit in one packet and so are left for the caller to pack, or
+ *      <code>-1</code> if they have been packed.
+ */
+static int pack(surface_t* node, list356_t* leaves) {
+    if (node == NULL) return 0;
+    if (!sfc_is_bbt(node)) return 1;
+
+    surface_t *left, *right;
+    bbt_children(node, &left, &right);
+    int l = pack(left, leaves);
+    int r = pack(right, leaves);
+    if (l >= 0 && r >= 0 && l + r <= SPHERE_PACKET_SIZE) return l + r;
+
+    if (l > 0) add_packet(left, leaves);
+    if (r > 0) add_packet(right, leaves);
+    return -1;
+}
+
+surface_t* make_sphere_group(list356_t* surfaces) {
+    list356_t* spheres = make_list();
+    list356_t* leaves = make_list();
+    list356_itr_t* s = lst_iterator(surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        point3_t c;
+        float r;
+        if (sfc_sphere_geometry(sfc, &c, &r)) lst_add(spheres, sfc);
+        else lst_add(leaves, sfc);
+    }
+    lst_iterator_free(s);
+    if (lst_size(spheres) < 2) {
+        lst_free(spheres);
+        lst_free(leaves);
+        return make_bbt_node(surfaces);
+    }
+
+    // Only the packets are kept from the tree over the spheres.
+    surface_t* tree = make_bbt_node(spheres);
+    if (pack(tree, leaves) > 0) add_packet(tree, leaves);
+    debug("make_sphere_group():  %d spheres in %d packets and spheres",
+            lst_size(spheres),
+            lst_size(leaves) - (lst_size(surfaces) - lst_size(spheres)));
+    bbt_free(tree);
+    lst_free(spheres);
+
+    surface_t* group = make_bbt_node(leaves);
+    lst_free(leaves);
+    return group;
+}
@@ -0,0 +1,36 @@
+/** @file sphere_group.h Groups of spheres stored as arrays of centers and
+ *  radii, intersected several at a time with SIMD instructions.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#ifndef SPHERE_GROUP_H
+#define SPHERE_GROUP_H
+
+#include "list356.h"
+
+#include "surface.h"
+
+/** The number of spheres in a packet.
+ */
+#define SPHERE_PACKET_SIZE 8
+
+/** Create a group from a list of surfaces, packing its spheres into
+ *  packets of <code>SPHERE_PACKET_SIZE</code> neighbors.  Each packet is
+ *  a single surface that tests a ray against all of its spheres at once
+ *  (eight per AVX instruction, or four per SSE instruction) and reports
+ *  the nearest hit.  A bounding-box tree is built over the packets and
+ *  the other surfaces in the list.
+ *
+ *  Hit records name the sphere that was hit, so the spheres keep their
+ *  colors; they must not be freed while the group is in use.
+ *
+ *  @param surfaces a list of surfaces, as for <code>make_bbt_node()</code>.
+ *      The list itself is not freed.
+ *
+ *  @return the root of the bounding-box tree.
+ */
+surface_t* make_sphere_group(list356_t* surfaces);
+
+#endif
@@ -16,8 +16,27 @@
  * Define  the following functions:
  *  sfc_hit_bbt() function
  *  make_bbt_node() function
- *  make_bbt_node_helper() function
- *  mid_point() function
+ *  bbt_build() and bbt_split() functions, which replace
+ *      make_bbt_node_helper()
+ *  make_light() function, and make_rect_light() and make_sphere_light()
+ *      for area lights
+ *  make_instance() and sfc_hit_instance() functions
+ *  instance_set_xfrm() function
+ *  bbt_refit(), bbt_rebuild() and sfc_is_bbt() functions
+ *  bbt_cache_load() and bbt_cache_save() functions
+ *  bbt_children() function; sfc_hit_bbt() traces roots through a
+ *      four-wide BVH from bvh4.c
+ *  make_bbt_from_nodes(), bbt_link() and bbt_free() functions
+ *  sfc_sphere_geometry(), sfc_triangle_geometry(), sfc_box_geometry() and
+ *      sfc_free() functions
+ *  make_box() and sfc_hit_box() functions
+ *  sfc_hit_sphere() returns the far root for rays from inside, and
+ *      computes the discriminant without cancellation
+ *  hit_bbox() only reports boxes that the ray meets in [t0, t1], and
+ *      make_triangle() bounds triangles at negative coordinates tightly
+ *  frustum_setup(), bbox_in_frustum(), sfc_frustum_entry() and
+ *      sfc_hit_entry() functions, for starting the rays of a tile deep in
+ *      a bounding-box tree
  *
  */
 
@@ -30,11 +49,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef BBT_CACHE
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "debug.h"
 #include "surface.h"
+#include "bvh4.h"
+#include "profile.h"
+#include "timing.h"
 
 #define MALLOC1(t) (t *)(malloc(sizeof(t)))
-#define RAND(MIN, MAX) (int) (rand() % (MAX - MIN + 1)) + MIN
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
@@ -79,8 +108,36 @@ typedef struct _bbt_node_data_t {
     /** The right child of the node.
      */
     surface_t* right;
+    /** The cost of the tree when it was built, for comparison with its
+     *  cost after refitting.  Only set for the root of a tree.
+     */
+    float build_cost;
+    /** The four-wide BVH that rays are traced through in place of the
+     *  binary tree.  Only set for the root of a tree.
+     */
+    bvh4_t* wide;
+    /** Whether the node is the root of a tree, as returned by
+     *  <code>make_bbt_node()</code>.  A root may be a leaf of another
+     *  tree, which must then leave its nodes alone.
+     */
+    bool root;
 } bbt_node_data;
 
+/** The type of an instance surface.  An instance is a shared prototype
+ *  surface placed in the world by an affine transform.
+ */
+typedef struct _instance_data_t {
+    /** The instanced surface.
+     */
+    surface_t* prototype;
+    /** The transform from the prototype frame to the world frame, as a
+     *  3x4 matrix in row-major order.
+     */
+    float xfrm[12];
+    /** The inverse of <code>xfrm</code>, in the same form.
+     */
+    float inv[12];
+} instance_data_t;
 
 /** Set standard surface data for a surface.  This function sets
  *  <code>refl_color</code> and <code>atten</code> to <code>NULL</code>
@@ -98,6 +155,22 @@ static void set_sfc_data(surface_t* surface, void* data,
         bool (*hit_fn)(surface_t*, ray3_t*, float, float, hit_record_t*),
         color_t* diff, color_t* amb, color_t* spec, float phong_exp);
 
+/** Box-ray intersection function.  The box is the surface's bounding box.
+ *
+ *  @param sfc the box surface.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param t1 the right endpoint of the ray.
+ *  @param hit the hit record to fill in if <code>ray</code> hits
+ *      <code>sfc</code>.
+ *
+ *  @return <code>true</code> if <code>ray</code> intersects
+ *      <code>sfc</code> in the interval [<code>t0</code>,<code>t1</code>],
+ *      <code>false</code> otherwise.
+ */
+static bool sfc_hit_box(surface_t* sfc, ray3_t* ray, float t0, float t1,
+        hit_record_t* hit);
+
 /** Sphere-ray intersection function.
  *  
  *  @param sfc the sphere surface.
@@ -185,9 +258,28 @@ static bool sfc_hit_plane(surface_t* sfc, ray3_t* ray, float t0,
  */
 static bool hit_bbox(bbox_t* bbox, ray3_t* ray, float t0, float t1);
 
+/** Instance-ray intersection function.
+ *  
+ *  @param sfc the instance surface.
+ *  @param ray the ray.
+ *  @param t0 the left endpoint of the ray.
+ *  @param t1 the right endpoint of the ray.
+ *  @param hit the hit record to fill in if <code>ray</code> hits
+ *      <code>sfc</code>.
+ *
+ *  @return <code>true</code> if <code>ray</code> intersects 
+ *      <code>sfc</code> in the interval [<code>t0</code>,<code>t1</code>],
+ *      <code>false</code> otherwise.  If there is an intersection,
+ *      <code>hit</code> will be populated with data describing the
+ *      intersection point; otherwise <code>hit</code> will be unmodified.
+ */
+static bool sfc_hit_instance(surface_t* sfc, ray3_t* ray, float t0,
+        float t1, hit_record_t* hit);
+
 // BBT Node functions declarations.
-surface_t* make_bbt_node_helper(list356_t* surfaces, int axis);
-float mid_point(bbox_t* bbox, int axis);
+static float bbt_cost(surface_t* node);
+static float bbox_area(bbox_t* bbox);
+static void bbox_include(bbox_t* bbox, bbox_t* other);
 
 //
 // UTILITY FUNCTIONS.
@@ -218,35 +310,6 @@ static float min4(float v, float a, float b, float c) {
 static float max4(float v, float a, float b, float c) {
     return max(v, max(a, max(b, c)));
 }
-/**
- * Calculate and return the center of a bounding box along a given axis.
- *
- * @param box the bbox of which to calculate center value.
- * @param axis the axis along which to calculate center.
- */
-float mid_point(bbox_t* bbox, int axis) {
-    float a, b;
-    switch (axis) {
-        case (X_AXIS):
-            a = bbox->left;
-            b = bbox->right;
-            break;
-        case (Y_AXIS):
-            a = bbox->bottom;
-            b = bbox->top;
-            break;
-        case (Z_AXIS):
-            a = bbox->near;
-            b = bbox->far;
-            break;
-        default:
-            assert(0);
-    }
-    float dist = b - a;
-    float result = (a + (dist)/2.0f);
-    return result;
-}
-
 surface_t* make_sphere(float x, float y, float z, float radius, 
         color_t* diffuse_color, color_t* ambient_color, color_t* spec_color,
         float phong_exp) {
@@ -297,11 +360,11 @@ surface_t* make_triangle(point3_t a, point3_t b, point3_t c,
     // axis planes).
     surface->bbox = MALLOC1(bbox_t);
     surface->bbox->left = min4(FLT_MAX, a.x, b.x, c.x);
-    surface->bbox->right = max4(FLT_MIN, a.x, b.x, c.x);
+    surface->bbox->right = max4(-FLT_MAX, a.x, b.x, c.x);
     surface->bbox->bottom = min4(FLT_MAX, a.y, b.y, c.y);
-    surface->bbox->top = max4(FLT_MIN, a.y, b.y, c.y);
+    surface->bbox->top = max4(-FLT_MAX, a.y, b.y, c.y);
     surface->bbox->near = min4(FLT_MAX, a.z, b.z, c.z);
-    surface->bbox->far = max4(FLT_MIN, a.z, b.z, c.z);
+    surface->bbox->far = max4(-FLT_MAX, a.z, b.z, c.z);
 
     set_sfc_data(surface, data, sfc_hit_tri,
             diffuse_color, ambient_color, spec_color, phong_exp);
@@ -334,6 +397,182 @@ surface_t* make_plane(point3_t a, point3_t b, point3_t c,
     return surface;
 }
 
+/** Apply a 3x4 row-major affine transform to a point.
+ *
+ *  @param m the transform.
+ *  @param p the point.
+ *  @param out filled with the transformed point; may be <code>p</code>.
+ */
+static void xfrm_point(float* m, point3_t* p, point3_t* out) {
+    point3_t q = *p;
+    out->x = m[0]*q.x + m[1]*q.y + m[2]*q.z + m[3];
+    out->y = m[4]*q.x + m[5]*q.y + m[6]*q.z + m[7];
+    out->z = m[8]*q.x + m[9]*q.y + m[10]*q.z + m[11];
+}
+
+/** Apply the linear part of a 3x4 row-major affine transform to a vector.
+ *
+ *  @param m the transform.
+ *  @param v the vector.
+ *  @param out filled with the transformed vector; may be <code>v</code>.
+ */
+static void xfrm_vector(float* m, vector3_t* v, vector3_t* out) {
+    vector3_t u = *v;
+    out->x = m[0]*u.x + m[1]*u.y + m[2]*u.z;
+    out->y = m[4]*u.x + m[5]*u.y + m[6]*u.z;
+    out->z = m[8]*u.x + m[9]*u.y + m[10]*u.z;
+}
+
+surface_t* make_instance(surface_t* prototype, float* xfrm) {
+    assert(prototype->bbox != NULL);
+
+    instance_data_t* data = MALLOC1(instance_data_t);
+    data->prototype = prototype;
+
+    surface_t* surface = MALLOC1(surface_t);
+    surface->bbox = MALLOC1(bbox_t);
+    set_sfc_data(surface, data, sfc_hit_instance, NULL, NULL, NULL, 0);
+    instance_set_xfrm(surface, xfrm);
+    return surface;
+}
+
+void instance_set_xfrm(surface_t* instance, float* xfrm) {
+    instance_data_t* data = (instance_data_t*)(instance->data);
+
+    // Convert from OpenGL's column-major 4x4 form.
+    float* m = data->xfrm;
+    for (int r=0; r<3; ++r) {
+        for (int c=0; c<4; ++c) m[4*r+c] = xfrm[4*c+r];
+    }
+
+    // Invert the linear part by cofactors; the inverse translation is
+    // then -(inverse linear part)*(translation).
+    float det = m[0]*(m[5]*m[10] - m[6]*m[9])
+        - m[1]*(m[4]*m[10] - m[6]*m[8])
+        + m[2]*(m[4]*m[9] - m[5]*m[8]);
+    assert(det != 0);
+    float* inv = data->inv;
+    inv[0] = (m[5]*m[10] - m[6]*m[9])/det;
+    inv[1] = (m[2]*m[9] - m[1]*m[10])/det;
+    inv[2] = (m[1]*m[6] - m[2]*m[5])/det;
+    inv[4] = (m[6]*m[8] - m[4]*m[10])/det;
+    inv[5] = (m[0]*m[10] - m[2]*m[8])/det;
+    inv[6] = (m[2]*m[4] - m[0]*m[6])/det;
+    inv[8] = (m[4]*m[9] - m[5]*m[8])/det;
+    inv[9] = (m[1]*m[8] - m[0]*m[9])/det;
+    inv[10] = (m[0]*m[5] - m[1]*m[4])/det;
+    inv[3] = -(inv[0]*m[3] + inv[1]*m[7] + inv[2]*m[11]);
+    inv[7] = -(inv[4]*m[3] + inv[5]*m[7] + inv[6]*m[11]);
+    inv[11] = -(inv[8]*m[3] + inv[9]*m[7] + inv[10]*m[11]);
+
+    // The world bounding box bounds the transformed corners of the
+    // prototype's bounding box.
+    bbox_t* b = data->prototype->bbox;
+    bbox_t* box = instance->bbox;
+    for (int i=0; i<8; ++i) {
+        point3_t corner = {
+            (i & 1) ? b->right : b->left,
+            (i & 2) ? b->top : b->bottom,
+            (i & 4) ? b->far : b->near
+        };
+        xfrm_point(m, &corner, &corner);
+        if (i == 0) {
+            *box = (bbox_t){corner.x, corner.x, corner.y, corner.y,
+                corner.z, corner.z};
+        } else {
+            box->left = min(box->left, corner.x);
+            box->right = max(box->right, corner.x);
+            box->bottom = min(box->bottom, corner.y);
+            box->top = max(box->top, corner.y);
+            box->near = min(box->near, corner.z);
+            box->far = max(box->far, corner.z);
+        }
+    }
+}
+
+bool sfc_sphere_geometry(surface_t* sfc, point3_t* center, float* radius) {
+    if (sfc->hit_fn != sfc_hit_sphere) return false;
+    sphere_data_t* data = (sphere_data_t*)(sfc->data);
+    *center = data->center;
+    *radius = data->radius;
+    return true;
+}
+
+bool sfc_triangle_geometry(surface_t* sfc, point3_t* a, point3_t* b,
+        point3_t* c) {
+    if (sfc->hit_fn != sfc_hit_tri) return false;
+    triangle_data_t* data = (triangle_data_t*)(sfc->data);
+    *a = data->a;
+    *b = data->b;
+    *c = data->c;
+    return true;
+}
+
+bool sfc_box_geometry(surface_t* sfc, point3_t* lo, point3_t* hi) {
+    if (sfc->hit_fn != sfc_hit_box) return false;
+    *lo = (point3_t){sfc->bbox->left, sfc->bbox->bottom, sfc->bbox->near};
+    *hi = (point3_t){sfc->bbox->right, sfc->bbox->top, sfc->bbox->far};
+    return true;
+}
+
+void sfc_free(surface_t* sfc) {
+    assert(!sfc_is_bbt(sfc));
+    free(sfc->data);
+    free(sfc->bbox);
+    free(sfc);
+}
+
+light_t* make_light(float x, float y, float z, color_t color, float range) {
+    light_t* light = MALLOC1(light_t);
+    light->position = MALLOC1(point3_t);
+    *(light->position) = (point3_t){x, y, z};
+    light->color = MALLOC1(color_t);
+    *(light->color) = color;
+    light->range = range;
+    light->index = -1;
+    light->shape = LIGHT_POINT;
+    light->edge_u = light->edge_v = (vector3_t){0.0f, 0.0f, 0.0f};
+    light->radius = 0.0f;
+    return light;
+}
+
+light_t* make_rect_light(point3_t center, vector3_t edge_u, vector3_t edge_v,
+        color_t color, float range) {
+    light_t* light = make_light(center.x, center.y, center.z, color, range);
+    light->shape = LIGHT_RECT;
+    light->edge_u = edge_u;
+    light->edge_v = edge_v;
+    return light;
+}
+
+light_t* make_sphere_light(point3_t center, float radius, color_t color,
+        float range) {
+    light_t* light = make_light(center.x, center.y, center.z, color, range);
+    light->shape = LIGHT_SPHERE;
+    light->radius = radius;
+    return light;
+}
+
+surface_t* make_box(point3_t lo, point3_t hi,
+        color_t* diffuse_color, color_t* ambient_color, color_t* spec_color,
+        float phong_exp) {
+
+    // The box is its own bounding box, so it needs no other data.
+    surface_t* surface = MALLOC1(surface_t);
+    surface->bbox = MALLOC1(bbox_t);
+    surface->bbox->left = lo.x;
+    surface->bbox->right = hi.x;
+    surface->bbox->bottom = lo.y;
+    surface->bbox->top = hi.y;
+    surface->bbox->near = lo.z;
+    surface->bbox->far = hi.z;
+
+    set_sfc_data(surface, NULL, sfc_hit_box,
+            diffuse_color, ambient_color, spec_color, phong_exp);
+
+    return surface;
+}
+
 static void set_sfc_data(surface_t* surface, void* data,
         bool (*hit_fn)(surface_t*, ray3_t*, float, float, hit_record_t*),
         color_t* diff, color_t* amb, color_t* spec, float phong_exp) {
@@ -354,6 +593,7 @@ static void set_sfc_data(surface_t* surface, void* data,
 
 static bool sfc_hit_sphere(surface_t* sfc, ray3_t* ray, float t0,
         float t1, hit_record_t* hit) {
+    PROFILE_PRIM("sphere");
 
     // It is faster to check the discriminant than the bounding box,
     // so we don't bother with the latter.
@@ -368,37 +608,42 @@ static bool sfc_hit_sphere(surface_t* sfc, ray3_t* ray, float t0,
 
     vector3_t e_minus_ctr;
     pv_subtract(e, &ctr, &e_minus_ctr);
-    float e_minus_ctr2 = dot(&e_minus_ctr, &e_minus_ctr);
     float d2 = dot(d, d);
 
-    // Compute the discriminant first.
+    // Compute the discriminant first, as d2*(r^2 - |l|^2), where l runs
+    // from the center to the nearest point of the ray's line.  The usual
+    // b^2 - d2*(|e-c|^2 - r^2) cancels badly for spheres far from e, and
+    // then grazing rays hit spheres they pass by.
     float b = dot(d, &e_minus_ctr);
-    float discr = 
-        b*b - d2*(e_minus_ctr2 - radius*radius);
+    float s = b/d2;
+    float lx = e_minus_ctr.x - s*d->x;
+    float ly = e_minus_ctr.y - s*d->y;
+    float lz = e_minus_ctr.z - s*d->z;
+    float discr = d2*(radius*radius - (lx*lx + ly*ly + lz*lz));
 
     // Compute hit position if discr. is >= 0, and also compute
     // the surface normal.
     if (discr < 0) return false;
-    else {
-        hit->sfc = sfc;
-
-        // Hit position.
-        float num = min(-b - sqrt(discr), -b + sqrt(discr));
-        float t = num/d2;
-
-        if (t < t0 || t > t1) return false;
-
-        hit->t = t;
-
-        vector3_t ray_vec = *d;
-        multiply(&ray_vec, hit->t, &ray_vec);
-        pv_add(e, &ray_vec, &(hit->hit_pt));
 
-        // Surface normal.
-        pv_subtract(&(hit->hit_pt), &ctr, &(hit->normal));
-        normalize(&(hit->normal));
-        return true;
-    }
+    // The near root, or the far one for a ray that starts inside the
+    // sphere (e.g., one refracted into it).
+    float root = sqrt(discr);
+    float t = (-b - root)/d2;
+    if (t < t0) t = (-b + root)/d2;
+    if (t < t0 || t > t1) return false;
+
+    hit->sfc = sfc;
+    hit->world_sfc = sfc;
+    hit->t = t;
+
+    vector3_t ray_vec = *d;
+    multiply(&ray_vec, hit->t, &ray_vec);
+    pv_add(e, &ray_vec, &(hit->hit_pt));
+
+    // Surface normal.
+    pv_subtract(&(hit->hit_pt), &ctr, &(hit->normal));
+    normalize(&(hit->normal));
+    return true;
 }
 
 static bool sfc_hit_planar(bool is_triangle, 
@@ -453,12 +698,14 @@ static bool sfc_hit_planar(bool is_triangle,
 
 static bool sfc_hit_tri(surface_t* sfc, ray3_t* ray, float t0, float t1,
         hit_record_t* hit) {
+    PROFILE_PRIM("triangle");
     if (hit_bbox(sfc->bbox, ray, t0, t1)) {
         triangle_data_t* tdata = (triangle_data_t*)(sfc->data);
         if (sfc_hit_planar(true, &tdata->a, &tdata->b, &tdata->c, 
                     &tdata->normal,
                 ray, t0, t1, hit)) {
             hit->sfc = sfc;
+            hit->world_sfc = sfc;
             return true;
         }
     }
@@ -466,16 +713,79 @@ static bool sfc_hit_tri(surface_t* sfc, ray3_t* ray, float t0, float t1,
     return false;
 }
 
+static bool sfc_hit_box(surface_t* sfc, ray3_t* ray, float t0, float t1,
+        hit_record_t* hit) {
+    PROFILE_PRIM("box");
+    bbox_t* box = sfc->bbox;
+    float lo[3] = {box->left, box->bottom, box->near};
+    float hi[3] = {box->right, box->top, box->far};
+    float e[3] = {ray->base.x, ray->base.y, ray->base.z};
+    float d[3] = {ray->dir.x, ray->dir.y, ray->dir.z};
+
+    // Intersect the ray with each pair of slab planes, keeping the last
+    // plane the ray enters the box by and the first it leaves by.
+    float t_in = -INFINITY, t_out = INFINITY;
+    int in_axis = 0, out_axis = 0;
+    for (int k=0; k<3; ++k) {
+        float a = 1.0f/d[k];
+        float t_near = ((a >= 0 ? lo[k] : hi[k]) - e[k])*a;
+        float t_far = ((a >= 0 ? hi[k] : lo[k]) - e[k])*a;
+        if (t_near > t_in) {
+            t_in = t_near;
+            in_axis = k;
+        }
+        if (t_far < t_out) {
+            t_out = t_far;
+            out_axis = k;
+        }
+    }
+    if (t_in > t_out) return false;
+
+    // A ray from outside hits the face it enters by; a ray from inside
+    // (e.g., refracted into the box) hits the face it leaves by.
+    int axis;
+    float side;
+    if (t_in > t0 && t_in <= t1) {
+        hit->t = t_in;
+        axis = in_axis;
+        side = d[axis] > 0 ? -1.0f : 1.0f;
+    }
+    else if (t_out > t0 && t_out <= t1) {
+        hit->t = t_out;
+        axis = out_axis;
+        side = d[axis] > 0 ? 1.0f : -1.0f;
+    }
+    else return false;
+
+    // Put the hit point exactly on the face, so that rays leaving it
+    // start on the right side.
+    float p[3], n[3] = {0, 0, 0};
+    for (int k=0; k<3; ++k) p[k] = e[k] + hit->t*d[k];
+    p[axis] = side > 0 ? hi[axis] : lo[axis];
+    n[axis] = side;
+    hit->hit_pt = (point3_t){p[0], p[1], p[2]};
+    hit->normal = (vector3_t){n[0], n[1], n[2]};
+    hit->sfc = sfc;
+    hit->world_sfc = sfc;
+    return true;
+}
+
 bool sfc_hit_bbt(surface_t* sfc, ray3_t* ray, float t0, float t1,
         hit_record_t* rec) {
+    PROFILE_NODE("bbt node");
     if (hit_bbox(sfc->bbox, ray, t0, t1)) {
 
         hit_record_t lrec, rrec;
         
+        // Roots are traced through their wide BVH.
+        bbt_node_data* ndata = (bbt_node_data*)(sfc->data);
+        if (ndata->wide != NULL) {
+            return bvh4_hit(ndata->wide, ray, t0, t1, rec);
+        }
+
         // If node is a bbt_node surface then recursively call hit() on its
         // children. Check if it's a bbt_node surface by comparing it's hit_fn.
         // Recursive case, call hit() on left and right children.
-        bbt_node_data* ndata = (bbt_node_data*)(sfc->data);
         surface_t* lchild = ndata->left;
         surface_t* rchild = ndata->right;
 
@@ -504,8 +814,36 @@ bool sfc_hit_bbt(surface_t* sfc, ray3_t* ray, float t0, float t1,
     }
 }
 
+static bool sfc_hit_instance(surface_t* sfc, ray3_t* ray, float t0,
+        float t1, hit_record_t* hit) {
+    PROFILE_NODE("instance");
+    instance_data_t* idata = (instance_data_t*)(sfc->data);
+
+    // Transform the ray into the prototype's frame.  The direction is not
+    // normalized, so intersection times are the same in both frames.
+    ray3_t obj_ray;
+    xfrm_point(idata->inv, &ray->base, &obj_ray.base);
+    xfrm_vector(idata->inv, &ray->dir, &obj_ray.dir);
+
+    if (!sfc_hit(idata->prototype, &obj_ray, t0, t1, hit)) return false;
+
+    // Transform the hit point back to the world frame, and the normal by
+    // the inverse transpose.
+    xfrm_point(idata->xfrm, &hit->hit_pt, &hit->hit_pt);
+    vector3_t n = hit->normal;
+    float* inv = idata->inv;
+    hit->normal.x = inv[0]*n.x + inv[4]*n.y + inv[8]*n.z;
+    hit->normal.y = inv[1]*n.x + inv[5]*n.y + inv[9]*n.z;
+    hit->normal.z = inv[2]*n.x + inv[6]*n.y + inv[10]*n.z;
+    normalize(&hit->normal);
+
+    hit->world_sfc = sfc;
+    return true;
+}
+
 static bool sfc_hit_plane(surface_t* sfc, ray3_t* ray, float t0, float t1,
         hit_record_t* hit) {
+    PROFILE_PRIM("plane");
 
     // We don't check the bounding box, because planar surfaces do not
     // have bounding boxes!
@@ -513,16 +851,91 @@ static bool sfc_hit_plane(surface_t* sfc, ray3_t* ray, float t0, float t1,
     if (sfc_hit_planar(false, &pdata->a, &pdata->b, &pdata->c, 
             &pdata->normal, ray, t0, t1, hit)) {
         hit->sfc = sfc;
+        hit->world_sfc = sfc;
         return true;
     }
     else return false;
 }
 
+#ifndef NDEBUG
+__thread unsigned long sfc_hit_count = 0;
+#endif
+
 bool sfc_hit(surface_t* sfc, ray3_t* ray, float t0, float t1,
         hit_record_t* hit) {
+#ifndef NDEBUG
+    ++sfc_hit_count;
+#endif
     return sfc->hit_fn(sfc, ray, t0, t1, hit);
 }
 
+//
+// FRUSTUM FUNCTIONS.
+//
+
+void frustum_setup(frustum_t* frustum, point3_t* apex, vector3_t dir[4]) {
+    frustum->apex = *apex;
+    vector3_t center = {0.0f, 0.0f, 0.0f};
+    for (int i=0; i<4; ++i) {
+        frustum->dir[i] = dir[i];
+        add(&center, &dir[i], &center);
+    }
+    for (int i=0; i<4; ++i) {
+        vector3_t* n = &frustum->normal[i];
+        cross(&dir[i], &dir[(i+1)%4], n);
+        if (dot(n, &center) < 0) multiply(n, -1.0f, n);
+    }
+}
+
+bool bbox_in_frustum(bbox_t* bbox, frustum_t* frustum) {
+    // The box is outside if its corner farthest along the inward normal
+    // of some side is outside that side.
+    for (int i=0; i<4; ++i) {
+        vector3_t* n = &frustum->normal[i];
+        point3_t p = {n->x >= 0 ? bbox->right : bbox->left,
+            n->y >= 0 ? bbox->top : bbox->bottom,
+            n->z >= 0 ? bbox->far : bbox->near};
+        vector3_t v;
+        pv_subtract(&p, &frustum->apex, &v);
+        if (dot(n, &v) < 0) return false;
+    }
+    return true;
+}
+
+int sfc_frustum_entry(surface_t* sfc, frustum_t* frustum) {
+    // A plane has no box, but the rays miss it if none of the edges of
+    // the frustum head towards it.
+    if (sfc->hit_fn == sfc_hit_plane) {
+        plane_data_t* data = (plane_data_t*)(sfc->data);
+        vector3_t to_apex;
+        pv_subtract(&frustum->apex, &data->a, &to_apex);
+        float side = dot(&data->normal, &to_apex);
+        for (int i=0; i<4; ++i) {
+            if (side == 0 || dot(&data->normal, &frustum->dir[i])*side < 0) {
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    if (sfc->bbox == NULL) return 0;
+    if (!bbox_in_frustum(sfc->bbox, frustum)) return -1;
+    if (!sfc_is_bbt(sfc)) return 0;
+    bbt_node_data* ndata = (bbt_node_data*)(sfc->data);
+    if (ndata->wide == NULL) return 0;
+    return bvh4_frustum_entry(ndata->wide, frustum);
+}
+
+bool sfc_hit_entry(surface_t* sfc, int entry, ray3_t* ray, float t0,
+        float t1, hit_record_t* rec) {
+    if (entry == 0) return sfc_hit(sfc, ray, t0, t1, rec);
+#ifndef NDEBUG
+    ++sfc_hit_count;
+#endif
+    bbt_node_data* ndata = (bbt_node_data*)(sfc->data);
+    return bvh4_hit_from(ndata->wide, entry, ray, t0, t1, rec);
+}
+
 //
 // BOUNDING BOX FUNCIONS.
 //
@@ -551,147 +964,839 @@ static bool hit_bbox(bbox_t* bbox, ray3_t* ray, float t0, float t1) {
     tzmin = ((az >= 0 ? bbox->near : bbox->far) - e.z)*az;
     tzmax = ((az >= 0 ? bbox->far : bbox->near) - e.z)*az;
 
+    // The slabs overlap, and the overlap meets [t0, t1].
     return (txmin <= tymax) && (txmax >= tymin) &&
         (txmin <= tzmax) && (txmax >= tzmin) &&
-        (tymin <= tzmax) && (tymax >= tzmin);
+        (tymin <= tzmax) && (tymax >= tzmin) &&
+        (txmin <= t1) && (tymin <= t1) && (tzmin <= t1) &&
+        (txmax >= t0) && (tymax >= t0) && (tzmax >= t0);
 
 }
 
-/** Create a bounding-box tree node from a list of surfaces.  Any
- *  compound surface (like a BBT node) will <i>not</i> be broken into
- *  its component surfaces.
+// Bounding-box tree construction.  The surfaces are copied into an array
+// and partitioned in place, at the split that minimizes the surface area
+// heuristic over bins of their centroids.  When compiled with -fopenmp,
+// large subtrees are built by parallel tasks, and large ranges are bounded
+// and binned in parallel chunks, so the top levels of the tree (where
+// there are few subtrees to go around) use every thread too.
+#ifdef _OPENMP
+#define OMP(directive) _Pragma(#directive)
+#else
+#define OMP(directive)
+#endif
+
+/** The number of bins centroids are sorted into when choosing a split.
+ */
+#define BBT_BINS 16
+
+/** Ranges of fewer surfaces than this are bounded and binned serially,
+ *  and their subtrees are built by the calling task.
+ */
+#define BBT_GRAIN 4096
+
+/** The maximum number of chunks a range is bounded or binned in.
+ */
+#define BBT_MAX_CHUNKS 64
+
+/** A surface to be placed in a bounding-box tree, with its centroid.
+ */
+typedef struct _bbt_item_t {
+    surface_t* sfc;
+    float center[3];
+} bbt_item_t;
+
+/** A bin of centroids, with the bounding box of their surfaces.
+ */
+typedef struct _bbt_bin_t {
+    int count;
+    bbox_t bbox;
+} bbt_bin_t;
+
+/** A bounding box that bounds nothing.
+ */
+static const bbox_t EMPTY_BBOX = {
+    FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX
+};
+
+/** Get the bin a centroid falls in.
  *
- *  @param surfaces a list of surfaces.  Each surface in
- *      <code>surfaces</code> must have a non-<code>NULL</code>
- *      bounding box and must not be transparent.
+ *  @param c the centroid's coordinate along the binning axis.
+ *  @param base the least centroid coordinate along the axis.
+ *  @param scale the number of bins per unit along the axis.
+ *
+ *  @return the index of the bin.
  */
-surface_t* make_bbt_node(list356_t* surfaces) {
-    debug("Constructing Bounding-box tree.");
-    // Call the helper function starting along x axis.
-    return make_bbt_node_helper(surfaces, X_AXIS);
+static inline int bbt_bin_index(float c, float base, float scale) {
+    int b = (int)((c - base)*scale);
+    return max(0, min(b, BBT_BINS-1));
 }
 
-/**
- * Create a bounding-box tree node from a list of surfaces. Any compound
- * surface (like a BBT node) will <i>not</i> be broken into its component
- * surfaces.  This is a helper function for make_bbt_node(), that incorporates
- * the use of an axis parameter. All leaves will have bbox==NULL, so you can
- * test leaves by checking if they have a bbox.
+/** Bound the surfaces and centroids of a range of items.
  *
- * Precondition: the list of surfaces is non-empty.
+ *  @param items the first item.
+ *  @param n the number of items.
+ *  @param bbox filled with the bounding box of the surfaces.
+ *  @param cbox filled with the bounding box of the centroids.
+ */
+static void bbt_bound_range(bbt_item_t* items, int n, bbox_t* bbox,
+        bbox_t* cbox) {
+    *bbox = EMPTY_BBOX;
+    *cbox = EMPTY_BBOX;
+    for (int i=0; i<n; ++i) {
+        float* c = items[i].center;
+        bbox_include(bbox, items[i].sfc->bbox);
+        bbox_include(cbox, &(bbox_t){c[0], c[0], c[1], c[1], c[2], c[2]});
+    }
+}
+
+/** Bound the surfaces and centroids of a range of items, in parallel
+ *  chunks if the range is large.
  *
- *  @param surfaces a list of surfaces.  Each surface in
- *      <code>surfaces</code> must have a non-<code>NULL</code>
- *      bounding box and must not be transparent.
- *  @param axis the axis to divide the bounding box. The axes are defined by an
- *      integer with x=0, y=1, z=2.
+ *  @param items the first item.
+ *  @param n the number of items.
+ *  @param bbox filled with the bounding box of the surfaces.
+ *  @param cbox filled with the bounding box of the centroids.
  */
-surface_t* make_bbt_node_helper(list356_t* surfaces, int axis) {
-    // Create a bounding box node that bounds everything in surfaces.
+static void bbt_bound(bbt_item_t* items, int n, bbox_t* bbox, bbox_t* cbox) {
+    int chunks = min(n/BBT_GRAIN, BBT_MAX_CHUNKS);
+    if (chunks <= 1) {
+        bbt_bound_range(items, n, bbox, cbox);
+        return;
+    }
+
+    bbox_t boxes[BBT_MAX_CHUNKS], cboxes[BBT_MAX_CHUNKS];
+    for (int k=0; k<chunks; ++k) {
+        int lo = (long)n*k/chunks;
+        int hi = (long)n*(k+1)/chunks;
+        OMP(omp task shared(boxes, cboxes))
+        bbt_bound_range(items+lo, hi-lo, &boxes[k], &cboxes[k]);
+    }
+    OMP(omp taskwait)
+
+    *bbox = EMPTY_BBOX;
+    *cbox = EMPTY_BBOX;
+    for (int k=0; k<chunks; ++k) {
+        bbox_include(bbox, &boxes[k]);
+        bbox_include(cbox, &cboxes[k]);
+    }
+}
+
+/** Sort the centroids of a range of items into bins.
+ *
+ *  @param items the first item.
+ *  @param n the number of items.
+ *  @param axis the axis to bin along.
+ *  @param base the least centroid coordinate along <code>axis</code>.
+ *  @param scale the number of bins per unit along <code>axis</code>.
+ *  @param bins filled with <code>BBT_BINS</code> bins.
+ */
+static void bbt_bin_range(bbt_item_t* items, int n, int axis, float base,
+        float scale, bbt_bin_t* bins) {
+    for (int b=0; b<BBT_BINS; ++b) {
+        bins[b].count = 0;
+        bins[b].bbox = EMPTY_BBOX;
+    }
+    for (int i=0; i<n; ++i) {
+        int b = bbt_bin_index(items[i].center[axis], base, scale);
+        ++bins[b].count;
+        bbox_include(&bins[b].bbox, items[i].sfc->bbox);
+    }
+}
+
+/** Sort the centroids of a range of items into bins, in parallel chunks
+ *  if the range is large.
+ *
+ *  @param items the first item.
+ *  @param n the number of items.
+ *  @param axis the axis to bin along.
+ *  @param base the least centroid coordinate along <code>axis</code>.
+ *  @param scale the number of bins per unit along <code>axis</code>.
+ *  @param bins filled with <code>BBT_BINS</code> bins.
+ */
+static void bbt_bin(bbt_item_t* items, int n, int axis, float base,
+        float scale, bbt_bin_t* bins) {
+    int chunks = min(n/BBT_GRAIN, BBT_MAX_CHUNKS);
+    if (chunks <= 1) {
+        bbt_bin_range(items, n, axis, base, scale, bins);
+        return;
+    }
+
+    bbt_bin_t chunk_bins[BBT_MAX_CHUNKS][BBT_BINS];
+    for (int k=0; k<chunks; ++k) {
+        int lo = (long)n*k/chunks;
+        int hi = (long)n*(k+1)/chunks;
+        OMP(omp task shared(chunk_bins))
+        bbt_bin_range(items+lo, hi-lo, axis, base, scale, chunk_bins[k]);
+    }
+    OMP(omp taskwait)
+
+    for (int b=0; b<BBT_BINS; ++b) {
+        bins[b] = chunk_bins[0][b];
+        for (int k=1; k<chunks; ++k) {
+            bins[b].count += chunk_bins[k][b].count;
+            bbox_include(&bins[b].bbox, &chunk_bins[k][b].bbox);
+        }
+    }
+}
+
+/** Partition a range of items between two subtrees.  The items are split
+ *  along the axis of greatest centroid extent, at the bin boundary that
+ *  minimizes the surface area heuristic; if the centroids all coincide,
+ *  the range is split in half.
+ *
+ *  @param items the first item; the range is reordered so that the first
+ *      subtree's items come first.
+ *  @param n the number of items, at least 2.
+ *  @param cbox the bounding box of the items' centroids.
+ *
+ *  @return the number of items in the first subtree.
+ */
+static int bbt_split(bbt_item_t* items, int n, bbox_t* cbox) {
+    float base[3] = {cbox->left, cbox->bottom, cbox->near};
+    float extent[3] = {cbox->right - cbox->left, cbox->top - cbox->bottom,
+        cbox->far - cbox->near};
+    int axis = X_AXIS;
+    if (extent[Y_AXIS] > extent[axis]) axis = Y_AXIS;
+    if (extent[Z_AXIS] > extent[axis]) axis = Z_AXIS;
+    if (extent[axis] <= 0) return n/2;
+
+    float scale = BBT_BINS/extent[axis];
+    bbt_bin_t bins[BBT_BINS];
+    bbt_bin(items, n, axis, base[axis], scale, bins);
+
+    // The cost of splitting before bin b is the number of surfaces on
+    // each side times the area of their bounding box, summed.  Sweep
+    // from the right for the right-hand costs, then from the left.
+    float right_cost[BBT_BINS];
+    bbox_t box = EMPTY_BBOX;
+    int count = 0;
+    for (int b=BBT_BINS-1; b>0; --b) {
+        bbox_include(&box, &bins[b].bbox);
+        count += bins[b].count;
+        right_cost[b] = count > 0 ? count*bbox_area(&box) : 0.0f;
+    }
+
+    int best = 0;
+    float best_cost = FLT_MAX;
+    box = EMPTY_BBOX;
+    count = 0;
+    for (int b=1; b<BBT_BINS; ++b) {
+        bbox_include(&box, &bins[b-1].bbox);
+        count += bins[b-1].count;
+        if (count == 0 || count == n) continue;
+        float cost = count*bbox_area(&box) + right_cost[b];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best = b;
+        }
+    }
+    if (best == 0) return n/2;
+
+    int i = 0, j = n-1;
+    while (i <= j) {
+        if (bbt_bin_index(items[i].center[axis], base[axis], scale) < best) {
+            ++i;
+        } else {
+            bbt_item_t tmp = items[i];
+            items[i] = items[j];
+            items[j--] = tmp;
+        }
+    }
+    return i;
+}
+
+/** Build a bounding-box tree over a range of items.  A node has one or
+ *  two surfaces as children, or two subtrees.
+ *
+ *  @param items the first item; the range is reordered.
+ *  @param n the number of items, at least 1.
+ *
+ *  @return the root of the tree.
+ */
+static surface_t* bbt_build(bbt_item_t* items, int n) {
     surface_t* node = MALLOC1(surface_t);
     node->bbox = MALLOC1(bbox_t);
-
-    // Allocate bbt_node data;
     bbt_node_data* data = MALLOC1(bbt_node_data);
     data->left = NULL;
     data->right = NULL;
+    data->build_cost = 0.0f;
+    data->wide = NULL;
+    data->root = false;
+    set_sfc_data(node, data, sfc_hit_bbt, NULL, NULL, NULL, 0);
+
+    bbox_t cbox;
+    bbt_bound(items, n, node->bbox, &cbox);
+
+    if (n <= 2) {
+        data->left = items[0].sfc;
+        if (n == 2) data->right = items[1].sfc;
+        return node;
+    }
 
-    // Set the bounding box of node. Find least/greatest x, y, and z edges.
-    // This will setup correct bbox regardless of the number of surfaces, so we
-    // do it first.
-    list356_itr_t* s = lst_iterator(surfaces);
-    bool first_sfc = true;
-    while (lst_has_next(s)) {
-        surface_t* sfc = lst_next(s);
-        // If first iteration, set bbox bounds to first object.
-        if (first_sfc == true) {
-            node->bbox->left= sfc->bbox->left;
-            node->bbox->right = sfc->bbox->right;
-            node->bbox->bottom = sfc->bbox->bottom;
-            node->bbox->top = sfc->bbox->top;
-            node->bbox->near = sfc->bbox->near;
-            node->bbox->far = sfc->bbox->far;
-            first_sfc = false;
-        } else {
-            // Get min's and max'es from all surfaces in list and set bbox.
-            node->bbox->left = min(sfc->bbox->left, node->bbox->left);
-            node->bbox->right = max(sfc->bbox->right, node->bbox->right);
-            node->bbox->bottom = min(sfc->bbox->bottom, node->bbox->bottom);
-            node->bbox->top = max(sfc->bbox->top, node->bbox->top);
-            node->bbox->near = min(sfc->bbox->near, node->bbox->near);
-            node->bbox->far = max(sfc->bbox->far, node->bbox->far);
+    int split = bbt_split(items, n, &cbox);
+    OMP(omp task if(split >= BBT_GRAIN))
+    data->left = bbt_build(items, split);
+    data->right = bbt_build(items+split, n-split);
+    OMP(omp taskwait)
+    return node;
+}
+
+/** Create the nodes of a flattened bounding-box tree and link them up.
+ *
+ *  @param nodes the nodes.
+ *  @param num_nodes the number of nodes, at least 1.
+ *  @param leaves the surfaces the nodes' leaf indices refer to.
+ *
+ *  @return the root of the tree.  Its build cost and wide BVH are not
+ *      set.
+ */
+static surface_t* bbt_link(bbt_flat_node_t* nodes, int num_nodes,
+        surface_t** leaves) {
+    // Allocate the nodes in preorder, as building does, so that
+    // traversal visits memory in the same order; then link them.
+    surface_t** made = malloc(num_nodes*sizeof(surface_t*));
+    for (int i=0; i<num_nodes; ++i) {
+        made[i] = MALLOC1(surface_t);
+        made[i]->bbox = MALLOC1(bbox_t);
+        *(made[i]->bbox) = nodes[i].bbox;
+        bbt_node_data* data = MALLOC1(bbt_node_data);
+        data->build_cost = 0.0f;
+        data->wide = NULL;
+        data->root = false;
+        set_sfc_data(made[i], data, sfc_hit_bbt, NULL, NULL, NULL, 0);
+    }
+    for (int i=0; i<num_nodes; ++i) {
+        int32_t children[2] = {nodes[i].left, nodes[i].right};
+        surface_t* linked[2];
+        for (int k=0; k<2; ++k) {
+            int32_t c = children[k];
+            if (c == BBT_FLAT_NONE) linked[k] = NULL;
+            else if (c >= 0) linked[k] = made[c];
+            else linked[k] = leaves[-1-c];
         }
+        bbt_node_data* data = (bbt_node_data*)(made[i]->data);
+        data->left = linked[0];
+        data->right = linked[1];
     }
-    lst_iterator_free(s);
-
-    // Build subnodes.
-    // Handles base cases length of surfaces is 1 or 2.
-    int length = lst_size(surfaces);
+    surface_t* root = made[0];
+    free(made);
+    return root;
+}
 
-    if (length == 0) {
-        debug("Length zero list of surfaces. Client misuse of function.");
-        assert(0);
-    } else if (length == 1) {
-        data->left = lst_get(surfaces, 0);
+#ifdef BBT_CACHE
+// Bounding-box tree cache.  A tree depends only on the bounding boxes of
+// its surfaces and their order, so it is saved in a file named by a hash
+// of them, in the directory BBT_CACHE.  Later runs that build a tree over
+// the same boxes map the file and link up its nodes instead of building.
 
-        if (data->left->hit_fn == NULL) assert(0);
+/** The version of the cache file format.
+ */
+#define BBT_CACHE_VERSION 1
 
-        data->right = NULL;
-    } else if (length == 2) {
-        data->left = lst_get(surfaces, 0);
+/** The header of a cache file.  It is followed by the tree's nodes, with
+ *  leaf indices into the list given to <code>make_bbt_node()</code>.
+ */
+typedef struct _bbt_cache_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_surfaces;
+    uint64_t hash;
+    uint32_t num_nodes;
+    uint32_t reserved;
+} bbt_cache_header_t;
+
+/** A surface and its index in the list given to
+ *  <code>make_bbt_node()</code>, for looking up indices by address.
+ */
+typedef struct _bbt_cache_key_t {
+    surface_t* sfc;
+    int32_t index;
+} bbt_cache_key_t;
 
-        if (data->left->hit_fn == NULL) assert(0);
+static const char BBT_CACHE_MAGIC[8] = "BBTCACHE";
 
-        data->right = lst_get(surfaces, 1);
+/** Compute the 64-bit FNV-1a hash of the bounding boxes of a list of
+ *  surfaces.
+ *
+ *  @param items the surfaces, in list order.
+ *  @param n the number of surfaces.
+ *
+ *  @return the hash.
+ */
+static uint64_t bbt_hash(bbt_item_t* items, int n) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i=0; i<n; ++i) {
+        unsigned char* bytes = (unsigned char*)(items[i].sfc->bbox);
+        for (size_t k=0; k<sizeof(bbox_t); ++k) {
+            hash = (hash ^ bytes[k])*1099511628211ULL;
+        }
+    }
+    return hash ^ (uint64_t)n;
+}
 
-        if (data->right->hit_fn == NULL) assert(0);
-    } else {
-        // Recursive case.
+/** Compare cache keys by surface address, for qsort() and bsearch().
+ */
+static int bbt_cache_key_cmp(const void* a, const void* b) {
+    surface_t* x = ((bbt_cache_key_t*)a)->sfc;
+    surface_t* y = ((bbt_cache_key_t*)b)->sfc;
+    return x < y ? -1 : x > y;
+}
 
-        // Get midpoint of bbox along axis.
-        float mid = mid_point(node->bbox, axis);
+/** Find a surface among the surfaces of a tree.
+ *
+ *  @param sfc the surface.
+ *  @param keys the surfaces of the tree, sorted by address.
+ *  @param n the number of surfaces.
+ *
+ *  @return the key of <code>sfc</code>, or <code>NULL</code> if it is not
+ *      one of the surfaces.
+ */
+static bbt_cache_key_t* bbt_cache_find(surface_t* sfc,
+        bbt_cache_key_t* keys, int n) {
+    bbt_cache_key_t key = {sfc, 0};
+    return bsearch(&key, keys, n, sizeof(key), bbt_cache_key_cmp);
+}
 
+/** Convert a child of a tree node to a cache-file child index.  A child
+ *  that is one of the tree's surfaces is a leaf, even if it is the root of
+ *  a tree of its own.
+ *
+ *  @param child the child.
+ *  @param index the index <code>child</code> gets if it is a node.
+ *  @param keys the surfaces of the tree, sorted by address.
+ *  @param n the number of surfaces.
+ *
+ *  @return the child index.
+ */
+static int32_t bbt_cache_child(surface_t* child, int index,
+        bbt_cache_key_t* keys, int n) {
+    if (child == NULL) return BBT_FLAT_NONE;
+    bbt_cache_key_t* found = bbt_cache_find(child, keys, n);
+    if (found != NULL) return -1 - found->index;
+    assert(sfc_is_bbt(child));
+    return index;
+}
 
-        // Iterate through surfaces again, creating two sublists
-        list356_t* left_sublist = make_list();
-        list356_t* right_sublist = make_list();
-        // Use same iterator as above, but reset it.
-        s = lst_iterator(surfaces);
-        while (lst_has_next(s)) {
-            surface_t* curr_sfc = lst_next(s);
+/** Write the nodes of a tree to an array in preorder.
+ *
+ *  @param node the root of the tree.
+ *  @param nodes the array.
+ *  @param next the index of the next free element of
+ *      <code>nodes</code>; advanced past the tree's nodes.
+ *  @param keys the surfaces of the tree, sorted by address.
+ *  @param n the number of surfaces.
+ */
+static void bbt_cache_fill(surface_t* node, bbt_flat_node_t* nodes,
+        int* next, bbt_cache_key_t* keys, int n) {
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    bbt_flat_node_t* out = &nodes[(*next)++];
+    out->bbox = *(node->bbox);
+
+    out->left = bbt_cache_child(data->left, *next, keys, n);
+    if (out->left >= 0) bbt_cache_fill(data->left, nodes, next, keys, n);
+    out->right = bbt_cache_child(data->right, *next, keys, n);
+    if (out->right >= 0) bbt_cache_fill(data->right, nodes, next, keys, n);
+}
 
-            // If center of curr_sfc.bbox <= mid place in left sublist;
-            // otherwise place in right.
-            float curr_center = mid_point(curr_sfc->bbox, axis);
+/** Count the nodes of a tree, not counting the nodes of trees that are
+ *  among its surfaces.
+ *
+ *  @param node a node of the tree, or a leaf, or <code>NULL</code>.
+ *  @param keys the surfaces of the tree, sorted by address.
+ *  @param n the number of surfaces.
+ *
+ *  @return the number of BBT nodes at and below <code>node</code>.
+ */
+static int bbt_count(surface_t* node, bbt_cache_key_t* keys, int n) {
+    if (node == NULL || !sfc_is_bbt(node) ||
+            bbt_cache_find(node, keys, n) != NULL) {
+        return 0;
+    }
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    return 1 + bbt_count(data->left, keys, n) +
+        bbt_count(data->right, keys, n);
+}
 
-            // Jitter curr_center by (-.01, .01) to avoid having all surfaces
-            // end up in one sublist multiple times.
+/** Save a tree to a cache file.  The file is written under a temporary
+ *  name and then renamed, so concurrent runs never see a partial file.
+ *  Failures are not fatal; the tree just is not cached.
+ *
+ *  @param path the name of the cache file.
+ *  @param hash the hash of the tree's surfaces.
+ *  @param node the root of the tree.
+ *  @param keys the surfaces of the tree, sorted by address.
+ *  @param n the number of surfaces.
+ */
+static void bbt_cache_save(char* path, uint64_t hash, surface_t* node,
+        bbt_cache_key_t* keys, int n) {
+    bbt_cache_header_t header;
+    memcpy(header.magic, BBT_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BBT_CACHE_VERSION;
+    header.num_surfaces = n;
+    header.hash = hash;
+    header.num_nodes = bbt_count(node, keys, n);
+    header.reserved = 0;
+
+    bbt_flat_node_t* nodes =
+        malloc(header.num_nodes*sizeof(bbt_flat_node_t));
+    int next = 0;
+    bbt_cache_fill(node, nodes, &next, keys, n);
+
+    char tmp_path[strlen(path) + 32];
+    sprintf(tmp_path, "%s.%ld.tmp", path, (long)getpid());
+    FILE* f = fopen(tmp_path, "wb");
+    bool ok = f != NULL &&
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(nodes, sizeof(bbt_flat_node_t), header.num_nodes, f) ==
+            header.num_nodes;
+    if (f != NULL) ok = (fclose(f) == 0) && ok;
+    if (ok) ok = rename(tmp_path, path) == 0;
+    if (ok) {
+        debug("bbt_cache_save():  wrote %d nodes to %s", next, path);
+    } else {
+        remove(tmp_path);
+        debug("bbt_cache_save():  could not write %s", path);
+    }
+    free(nodes);
+}
 
-            float jitter = (RAND(-100, 100))/10000.0f;
-            curr_center += jitter;
-            if (curr_center <= mid) {
-                lst_add(left_sublist, curr_sfc);
-            } else {
-                lst_add(right_sublist, curr_sfc);
-            }
+/** Load a tree from a cache file.
+ *
+ *  @param path the name of the cache file.
+ *  @param hash the hash of the surfaces the tree must be over.
+ *  @param items the surfaces, in the order given to
+ *      <code>make_bbt_node()</code>.
+ *  @param n the number of surfaces.
+ *
+ *  @return the root of the tree, or <code>NULL</code> if the file is
+ *      missing or is not a valid tree over these surfaces.
+ */
+static surface_t* bbt_cache_load(char* path, uint64_t hash,
+        bbt_item_t* items, int n) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+            st.st_size < (off_t)sizeof(bbt_cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    bbt_cache_header_t* header = map;
+    bbt_flat_node_t* nodes = (bbt_flat_node_t*)(header + 1);
+    int num_nodes = header->num_nodes;
+    bool valid = memcmp(header->magic, BBT_CACHE_MAGIC, 8) == 0 &&
+        header->version == BBT_CACHE_VERSION &&
+        header->hash == hash && header->num_surfaces == (uint32_t)n &&
+        num_nodes > 0 &&
+        st.st_size == (off_t)(sizeof(bbt_cache_header_t) +
+                num_nodes*sizeof(bbt_flat_node_t));
+
+    // Children must come after their parents and surfaces must be in
+    // range, so a damaged file cannot make a cycle or a wild pointer.
+    for (int i=0; valid && i<num_nodes; ++i) {
+        int32_t children[2] = {nodes[i].left, nodes[i].right};
+        for (int k=0; k<2; ++k) {
+            int32_t c = children[k];
+            if (c == BBT_FLAT_NONE) continue;
+            if (c >= 0) valid = c > i && c < num_nodes;
+            else valid = -1-c < n;
+            if (!valid) break;
         }
-        lst_iterator_free(s);
+    }
+    if (!valid) {
+        munmap(map, st.st_size);
+        debug("bbt_cache_load():  %s does not match; rebuilding", path);
+        return NULL;
+    }
 
-        // Set left and right children to be bbt_node's created off
-        // left/right_sublist.
-        if (lst_size(left_sublist) >= 1) {
-            data->left = make_bbt_node_helper(left_sublist, ((axis + 1) % 3));
-        } else {
-            data->left = NULL;
-        }
+    surface_t** leaves = malloc(n*sizeof(surface_t*));
+    for (int i=0; i<n; ++i) leaves[i] = items[i].sfc;
+    surface_t* root = bbt_link(nodes, num_nodes, leaves);
+    free(leaves);
+    munmap(map, st.st_size);
+    debug("bbt_cache_load():  read %d nodes from %s", num_nodes, path);
+    return root;
+}
+#endif
 
-        if (lst_size(right_sublist) >= 1) {
-            data->right = make_bbt_node_helper(right_sublist, ((axis + 1) % 3));
-        } else {
-            data->right = NULL;
-        }
+/** Build a bounding-box tree over an array of surfaces, in parallel when
+ *  compiled with OpenMP.
+ *
+ *  @param items the surfaces; the array is reordered.
+ *  @param n the number of surfaces, at least 1.
+ *
+ *  @return the root of the tree.
+ */
+static surface_t* bbt_build_root(bbt_item_t* items, int n) {
+    surface_t* node;
+    OMP(omp parallel if(n >= BBT_GRAIN))
+    OMP(omp single)
+    node = bbt_build(items, n);
+    return node;
+}
+
+#ifdef BBT_CACHE
+/** Load a bounding-box tree over an array of surfaces from the cache, or
+ *  build it and save it to the cache.
+ *
+ *  @param items the surfaces; the array is reordered.
+ *  @param n the number of surfaces, at least 1.
+ *
+ *  @return the root of the tree.
+ */
+static surface_t* bbt_cache_build(bbt_item_t* items, int n) {
+    uint64_t hash = bbt_hash(items, n);
+    char path[strlen(BBT_CACHE) + 32];
+    sprintf(path, "%s/bbt-%016llx.cache", BBT_CACHE,
+            (unsigned long long)hash);
+    surface_t* node = bbt_cache_load(path, hash, items, n);
+    if (node != NULL) return node;
+
+    // Building reorders the items, so index them first.
+    bbt_cache_key_t* keys = malloc(n*sizeof(bbt_cache_key_t));
+    for (int i=0; i<n; ++i) keys[i] = (bbt_cache_key_t){items[i].sfc, i};
+    qsort(keys, n, sizeof(bbt_cache_key_t), bbt_cache_key_cmp);
+    node = bbt_build_root(items, n);
+    bbt_cache_save(path, hash, node, keys, n);
+    free(keys);
+    return node;
+}
+#endif
+
+/** Create a bounding-box tree from a list of surfaces.
+ *
+ *  @param surfaces a list of surfaces, as for <code>make_bbt_node()</code>.
+ *  @param use_cache whether to use the on-disk cache, if it is enabled.
+ *  @param use_wide whether to trace the tree through a four-wide BVH,
+ *      unless BBT_BINARY is defined.
+ *
+ *  @return the root of the tree.
+ */
+static surface_t* bbt_make(list356_t* surfaces, bool use_cache,
+        bool use_wide) {
+#ifndef NDEBUG
+    struct timespec start_time;
+    timer_start(&start_time);
+#endif
+
+    int n = lst_size(surfaces);
+    assert(n > 0);
+    bbt_item_t* items = malloc(n*sizeof(bbt_item_t));
+    list356_itr_t* s = lst_iterator(surfaces);
+    for (int i=0; i<n; ++i) {
+        surface_t* sfc = lst_next(s);
+        assert(sfc->hit_fn != NULL && sfc->bbox != NULL);
+        items[i].sfc = sfc;
+        items[i].center[X_AXIS] = (sfc->bbox->left + sfc->bbox->right)/2;
+        items[i].center[Y_AXIS] = (sfc->bbox->bottom + sfc->bbox->top)/2;
+        items[i].center[Z_AXIS] = (sfc->bbox->near + sfc->bbox->far)/2;
     }
-    set_sfc_data(node, data, sfc_hit_bbt,
-            NULL, NULL, NULL, 0);
+    lst_iterator_free(s);
+
+    surface_t* node = NULL;
+#ifdef BBT_CACHE
+    if (use_cache) node = bbt_cache_build(items, n);
+#endif
+    if (node == NULL) node = bbt_build_root(items, n);
+    free(items);
+
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    data->root = true;
+    data->build_cost = bbt_cost(node);
+#ifndef BBT_BINARY
+    if (use_wide) data->wide = make_bvh4(node);
+#endif
+#ifndef NDEBUG
+    debug("make_bbt_node():  %d surfaces in %f sec.", n,
+            seconds_since(&start_time));
+#endif
     return node;
 }
+
+/** Create a bounding-box tree node from a list of surfaces.  Any
+ *  compound surface (like a BBT node) will <i>not</i> be broken into
+ *  its component surfaces.
+ *
+ *  @param surfaces a list of surfaces.  Each surface in
+ *      <code>surfaces</code> must have a non-<code>NULL</code>
+ *      bounding box and must not be transparent.
+ */
+surface_t* make_bbt_node(list356_t* surfaces) {
+    debug("Constructing Bounding-box tree.");
+    return bbt_make(surfaces, true, true);
+}
+
+surface_t* make_bbt_node_binary(list356_t* surfaces) {
+    return bbt_make(surfaces, false, false);
+}
+
+surface_t* make_bbt_from_nodes(bbt_flat_node_t* nodes, int num_nodes,
+        surface_t** leaves) {
+    surface_t* node = bbt_link(nodes, num_nodes, leaves);
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    data->root = true;
+    data->build_cost = bbt_cost(node);
+#ifndef BBT_BINARY
+    data->wide = make_bvh4(node);
+#endif
+    return node;
+}
+
+bool sfc_is_bbt(surface_t* sfc) {
+    return sfc->hit_fn == sfc_hit_bbt;
+}
+
+void bbt_children(surface_t* node, surface_t** left, surface_t** right) {
+    assert(sfc_is_bbt(node));
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    *left = data->left;
+    *right = data->right;
+}
+
+/** Compute the surface area of a bounding box.
+ *
+ *  @param bbox the bounding box.
+ *
+ *  @return the surface area of <code>bbox</code>.
+ */
+static float bbox_area(bbox_t* bbox) {
+    float dx = bbox->right - bbox->left;
+    float dy = bbox->top - bbox->bottom;
+    float dz = bbox->far - bbox->near;
+    return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+/** Grow a bounding box to contain another.
+ *
+ *  @param bbox the bounding box to grow.
+ *  @param other the bounding box to contain.
+ */
+static void bbox_include(bbox_t* bbox, bbox_t* other) {
+    bbox->left = min(bbox->left, other->left);
+    bbox->right = max(bbox->right, other->right);
+    bbox->bottom = min(bbox->bottom, other->bottom);
+    bbox->top = max(bbox->top, other->top);
+    bbox->near = min(bbox->near, other->near);
+    bbox->far = max(bbox->far, other->far);
+}
+
+/** Compute the total surface area of the node boxes of a bounding-box
+ *  tree.
+ *
+ *  @param node a node of the tree, or a leaf, or <code>NULL</code>.
+ *
+ *  @return the total surface area of the boxes of <code>node</code> and
+ *      the BBT nodes below it.
+ */
+static float bbt_area(surface_t* node) {
+    if (node == NULL || !sfc_is_bbt(node)) return 0.0f;
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    return bbox_area(node->bbox) + bbt_area(data->left) +
+        bbt_area(data->right);
+}
+
+/** Compute the cost of a bounding-box tree.  A ray that hits the root's
+ *  box hits each node's box with probability roughly proportional to the
+ *  node's surface area, so the total area relative to the root's is the
+ *  expected number of node boxes such a ray hits.
+ *
+ *  @param node the root of the tree.
+ *
+ *  @return the cost of the tree.
+ */
+static float bbt_cost(surface_t* node) {
+    float root_area = bbox_area(node->bbox);
+    return root_area > 0 ? bbt_area(node)/root_area : 0.0f;
+}
+
+/** Determine whether a surface is the root of a bounding-box tree.
+ *
+ *  @param sfc the surface.
+ *
+ *  @return <code>true</code> if <code>sfc</code> was returned by
+ *      <code>make_bbt_node()</code> or <code>make_bbt_from_nodes()</code>.
+ */
+static bool bbt_is_root(surface_t* sfc) {
+    return sfc_is_bbt(sfc) && ((bbt_node_data*)(sfc->data))->root;
+}
+
+/** Recompute the boxes of a bounding-box tree bottom-up.  Trees that are
+ *  leaves of the tree are refitted whole, wide BVH and all.
+ *
+ *  @param node a node of the tree.
+ */
+static void bbt_refit_helper(surface_t* node) {
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    surface_t* children[2] = {data->left, data->right};
+    *(node->bbox) = EMPTY_BBOX;
+    for (int i=0; i<2; ++i) {
+        surface_t* child = children[i];
+        if (child == NULL) continue;
+        if (bbt_is_root(child)) bbt_refit(child);
+        else if (sfc_is_bbt(child)) bbt_refit_helper(child);
+        bbox_include(node->bbox, child->bbox);
+    }
+}
+
+float bbt_refit(surface_t* node) {
+    assert(sfc_is_bbt(node));
+    bbt_refit_helper(node);
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    if (data->wide != NULL) bvh4_refit(data->wide);
+    return data->build_cost > 0 ? bbt_cost(node)/data->build_cost : 1.0f;
+}
+
+/** Add the leaves of a bounding-box tree to a list and free its nodes.
+ *  Trees that are leaves of the tree are added whole.
+ *
+ *  @param node a node of the tree, or a leaf, or <code>NULL</code>.
+ *  @param leaves the list to add the leaves to.
+ */
+static void bbt_take_leaves(surface_t* node, list356_t* leaves) {
+    if (node == NULL) return;
+    if (!sfc_is_bbt(node) || bbt_is_root(node)) {
+        lst_add(leaves, node);
+        return;
+    }
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    bbt_take_leaves(data->left, leaves);
+    bbt_take_leaves(data->right, leaves);
+    free(data);
+    free(node->bbox);
+    free(node);
+}
+
+void bbt_free(surface_t* node) {
+    assert(sfc_is_bbt(node));
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    bvh4_free(data->wide);
+    list356_t* leaves = make_list();
+    bbt_take_leaves(data->left, leaves);
+    bbt_take_leaves(data->right, leaves);
+    lst_free(leaves);
+    free(data);
+    free(node->bbox);
+    free(node);
+}
+
+void bbt_rebuild(surface_t* node) {
+    assert(sfc_is_bbt(node));
+    bbt_node_data* data = (bbt_node_data*)(node->data);
+    list356_t* leaves = make_list();
+    bbt_take_leaves(data->left, leaves);
+    bbt_take_leaves(data->right, leaves);
+
+    // Build a new tree, then move its root into the old root.  Trees
+    // rebuilt while animating are not worth caching.
+    surface_t* tree = bbt_make(leaves, false, true);
+    lst_free(leaves);
+    bvh4_free(data->wide);
+    free(data);
+    free(node->bbox);
+    *node = *tree;
+    free(tree);
+}
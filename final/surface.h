@@ -7,6 +7,7 @@
 #define SURFACE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "color.h"
 
@@ -21,11 +22,15 @@ typedef struct _hit_record_t hit_record_t ;
  */
 typedef struct _bbox_t bbox_t ;
 
+/** The type of a frustum.  This structure is exposed below.
+ */
+typedef struct _frustum_t frustum_t ;
+
 /** The type of a surface.  This structure is exposed below.
  */
 typedef struct _surface_t surface_t ;
 
-/** The type of a point light source.  The structure is exposed below.
+/** The type of a light source.  The structure is exposed below.
  */
 typedef struct _light_t light_t ;
 
@@ -53,6 +58,24 @@ struct _bbox_t {
     float far ;
 } ;
 
+/** The rays from a point through the convex quadrilateral spanned by four
+ *  directions, such as the viewing rays through a tile of the window.
+ *  The frustum has no near or far plane.
+ */
+struct _frustum_t {
+    /** The point the rays start from.
+     */
+    point3_t apex ;
+    /** The directions of the edges of the frustum, in order around it.
+     */
+    vector3_t dir[4] ;
+    /** The normals of the sides of the frustum, pointing inwards; side
+     *  <code>i</code> is spanned by <code>dir[i]</code> and
+     *  <code>dir[(i+1)%4]</code>.
+     */
+    vector3_t normal[4] ;
+} ;
+
 /** The surface structure.  We expose its definition so as to make direct
  *  access to the components simpler.
  */
@@ -118,7 +141,16 @@ struct _surface_t {
     color_t*        atten ;
 } ;
 
-/** The structure representing a point light source.
+/** The shapes of light source.  Area lights cast soft shadows; the tracer
+ *  samples points on them for shadow rays.
+ */
+#define LIGHT_POINT 0
+#define LIGHT_RECT 1
+#define LIGHT_SPHERE 2
+
+/** The structure representing a light source.  Shading is computed from
+ *  the light's position, which is the center of an area light; only the
+ *  shadows come from the whole of the light.
  */
 struct _light_t {
     /** The position of the light.
@@ -127,6 +159,26 @@ struct _light_t {
     /** The color of the light.
      */
     color_t* color ;
+    /** The distance beyond which the light has no effect.  The light's
+     *  color falls off smoothly to zero at this distance.  If
+     *  <code>&le;0</code>, the light reaches everywhere unattenuated.
+     */
+    float range ;
+    /** The position of this light in the list of lights given to the
+     *  ray tracer; used to index per-light caches.
+     */
+    int index ;
+    /** The shape of the light: <code>LIGHT_POINT</code>,
+     *  <code>LIGHT_RECT</code> or <code>LIGHT_SPHERE</code>.
+     */
+    int shape ;
+    /** For a rectangular light, the two edges of the rectangle, which is
+     *  centered on <code>position</code>.
+     */
+    vector3_t edge_u, edge_v ;
+    /** For a spherical light, its radius.
+     */
+    float radius ;
 } ;
 
 /** The hit-record structure containing data about the intersection between
@@ -136,6 +188,12 @@ struct _hit_record_t {
     /** The surface that was hit.
      */
     surface_t*  sfc ;
+    /** The surface that was hit, as placed in the world.  This is
+     *  <code>sfc</code> unless <code>sfc</code> is part of an instanced
+     *  prototype, in which case it is the instance.  Only
+     *  <code>world_sfc</code> can be tested against world-frame rays.
+     */
+    surface_t*  world_sfc ;
     /** The time the ray hits <code>sfc</code>; i.e., if the ray has
      *  the form e + sd for s &ge; 0, then the intersection point is
      *  e + td.
@@ -210,6 +268,139 @@ surface_t* make_triangle(point3_t a, point3_t b, point3_t c,
 surface_t* make_plane(point3_t a, point3_t b, point3_t c,
         color_t* diff, color_t* amb, color_t* spec, float phong_exp) ;
 
+/** Create an axis-aligned box surface.  The specular reflection color is
+ *  set to NULL; only if this is changed explicitly will specular
+ *  reflections be calculated from this surface.  Surface normals point
+ *  out of the box.  A ray that starts inside the box hits the face it
+ *  leaves by, so a transparent box takes one intersection test per
+ *  segment of a refracted ray.
+ *
+ *  @param lo the corner of the box with the smallest coordinates.
+ *  @param hi the corner of the box with the largest coordinates.
+ *  @param diff the diffuse color of the box.
+ *  @param amb the ambient color of the box.
+ *  @param spec the specular color of the box.
+ *  @param phong_exp the Phong exponent of the box.
+ *
+ *  @return a <code>surface_t*</code> representing the box specified
+ *      by the above data.
+ */
+surface_t* make_box(point3_t lo, point3_t hi,
+        color_t* diff, color_t* amb, color_t* spec, float phong_exp) ;
+
+/** Create an instance of a surface.  The instance shares the prototype
+ *  surface (typically a bounding-box tree node) and places it in the world
+ *  with an affine transform; rays are transformed into the prototype's
+ *  frame when testing for intersections.  Any number of instances may share
+ *  a prototype.  Colors and other surface data come from the prototype's
+ *  component surfaces.
+ *
+ *  @param prototype the surface to instance.  It must have a
+ *      non-<code>NULL</code> bounding box.
+ *  @param xfrm the transform from the prototype's frame to the world
+ *      frame, as a 4x4 matrix in column-major order (the order used by
+ *      OpenGL).  The bottom row must be (0, 0, 0, 1) and the upper-left
+ *      3x3 block must be invertible.
+ *
+ *  @return a <code>surface_t*</code> representing the instance.
+ */
+surface_t* make_instance(surface_t* prototype, float* xfrm) ;
+
+/** Move an instance created by <code>make_instance()</code>.  Any
+ *  bounding-box tree containing the instance must then be refitted or
+ *  rebuilt.
+ *
+ *  @param instance the instance.
+ *  @param xfrm the new transform, in the form taken by
+ *      <code>make_instance()</code>.
+ */
+void instance_set_xfrm(surface_t* instance, float* xfrm) ;
+
+/** Get the geometry of a sphere.
+ *
+ *  @param sfc a surface.
+ *  @param center filled with the center, if <code>sfc</code> is a sphere.
+ *  @param radius filled with the radius, if <code>sfc</code> is a sphere.
+ *
+ *  @return <code>true</code> if <code>sfc</code> was created by
+ *      <code>make_sphere()</code>.
+ */
+bool sfc_sphere_geometry(surface_t* sfc, point3_t* center, float* radius) ;
+
+/** Get the geometry of a triangle.
+ *
+ *  @param sfc a surface.
+ *  @param a filled with the first vertex, if <code>sfc</code> is a
+ *      triangle.
+ *  @param b filled with the second vertex, likewise.
+ *  @param c filled with the third vertex, likewise.
+ *
+ *  @return <code>true</code> if <code>sfc</code> was created by
+ *      <code>make_triangle()</code>.
+ */
+bool sfc_triangle_geometry(surface_t* sfc, point3_t* a, point3_t* b,
+        point3_t* c) ;
+
+/** Get the geometry of a box.
+ *
+ *  @param sfc a surface.
+ *  @param lo filled with the low corner, if <code>sfc</code> is a box.
+ *  @param hi filled with the high corner, likewise.
+ *
+ *  @return <code>true</code> if <code>sfc</code> was created by
+ *      <code>make_box()</code>.
+ */
+bool sfc_box_geometry(surface_t* sfc, point3_t* lo, point3_t* hi) ;
+
+/** Free a surface created by <code>make_sphere()</code>,
+ *  <code>make_triangle()</code>, <code>make_plane()</code>,
+ *  <code>make_box()</code> or <code>make_instance()</code>.  Its colors
+ *  and, for an instance, its prototype are not freed.
+ *
+ *  @param sfc the surface.
+ */
+void sfc_free(surface_t* sfc) ;
+
+/** Create a point light source.
+ *
+ *  @param x the x-coordinate of the light.
+ *  @param y the y-coordinate of the light.
+ *  @param z the z-coordinate of the light.
+ *  @param color the color of the light.
+ *  @param range the distance beyond which the light has no effect, or
+ *      <code>0</code> for a light that is not attenuated.
+ *
+ *  @return a <code>light_t*</code> representing the light.
+ */
+light_t* make_light(float x, float y, float z, color_t color, float range) ;
+
+/** Create a rectangular area light, lit on both sides.
+ *
+ *  @param center the center of the rectangle.
+ *  @param edge_u one edge of the rectangle.
+ *  @param edge_v the other edge of the rectangle.
+ *  @param color the color of the light.
+ *  @param range the distance from the center beyond which the light has
+ *      no effect, or <code>0</code> for a light that is not attenuated.
+ *
+ *  @return a <code>light_t*</code> representing the light.
+ */
+light_t* make_rect_light(point3_t center, vector3_t edge_u, vector3_t edge_v,
+        color_t color, float range) ;
+
+/** Create a spherical area light.
+ *
+ *  @param center the center of the sphere.
+ *  @param radius the radius of the sphere.
+ *  @param color the color of the light.
+ *  @param range the distance from the center beyond which the light has
+ *      no effect, or <code>0</code> for a light that is not attenuated.
+ *
+ *  @return a <code>light_t*</code> representing the light.
+ */
+light_t* make_sphere_light(point3_t center, float radius, color_t color,
+        float range) ;
+
 /* We are not doing triangulated surfaces right now.
  * DO NOT IMPLEMENT THIS FUNCTION.
 surface_t* make_poly_surface(point3_t* vertices, int num_vertices,
@@ -220,7 +411,10 @@ surface_t* make_poly_surface(point3_t* vertices, int num_vertices,
 
 /** Create a bounding-box tree node from a list of surfaces.  Any
  *  compound surface (like a BBT node) will <i>not</i> be broken into
- *  its component surfaces.
+ *  its component surfaces.  If <code>BBT_CACHE</code> is defined as the
+ *  name of a directory, the tree is saved there, named by a hash of the
+ *  surfaces' bounding boxes, and later calls with the same boxes in the
+ *  same order load it rather than building it.
  *
  *  @param surfaces a list of surfaces.  Each surface in
  *      <code>surfaces</code> must have a non-<code>NULL</code>
@@ -228,6 +422,99 @@ surface_t* make_poly_surface(point3_t* vertices, int num_vertices,
  */
 surface_t* make_bbt_node(list356_t* surfaces) ;
 
+/** Create a bounding-box tree as <code>make_bbt_node()</code> does, but
+ *  with no four-wide BVH and without the on-disk cache, for trees that
+ *  are flattened or walked rather than traced.  Rays traced through the
+ *  tree take the binary nodes.
+ *
+ *  @param surfaces a list of surfaces, as for <code>make_bbt_node()</code>.
+ *
+ *  @return the root of the tree.
+ */
+surface_t* make_bbt_node_binary(list356_t* surfaces) ;
+
+/** The child index of a missing child in a flattened bounding-box tree.
+ */
+#define BBT_FLAT_NONE INT32_MIN
+
+/** A node of a flattened bounding-box tree.  Nodes are stored in
+ *  preorder, so a node's children always come after it.  A child index
+ *  <i>i</i> &ge; 0 is the node at index <i>i</i>; <i>i</i> &lt; 0 other
+ *  than <code>BBT_FLAT_NONE</code> is leaf -1-<i>i</i>.
+ */
+typedef struct _bbt_flat_node_t {
+    bbox_t bbox ;
+    int32_t left, right ;
+} bbt_flat_node_t ;
+
+/** Create a bounding-box tree from flattened nodes, e.g. ones saved from
+ *  an earlier build, without building it again.
+ *
+ *  @param nodes the nodes.  They are not validated.
+ *  @param num_nodes the number of nodes, at least 1.
+ *  @param leaves the surfaces the nodes' leaf indices refer to.
+ *
+ *  @return the root of the tree, as if returned by
+ *      <code>make_bbt_node()</code>.
+ */
+surface_t* make_bbt_from_nodes(bbt_flat_node_t* nodes, int num_nodes,
+        surface_t** leaves) ;
+
+/** Free the nodes of a bounding-box tree.  The leaves are not freed,
+ *  nor are trees that are leaves of the tree.
+ *
+ *  @param node the root of the tree, as returned by
+ *      <code>make_bbt_node()</code>.
+ */
+void bbt_free(surface_t* node) ;
+
+/** Refit a bounding-box tree to surfaces that have moved since it was
+ *  built.  The boxes of the tree's nodes are recomputed bottom-up from the
+ *  current bounding boxes of its leaves; the structure of the tree is left
+ *  alone, so its quality degrades as the leaves move away from where they
+ *  were when the tree was built.  Trees that are leaves of the tree are
+ *  refitted first, as by this function.  The root's four-wide BVH is
+ *  refitted in place along with it.
+ *
+ *  @param node the root of the tree, as returned by
+ *      <code>make_bbt_node()</code>.
+ *
+ *  @return the ratio of the refitted tree's cost (the total surface area
+ *      of its node boxes relative to the root's) to its cost when it was
+ *      built.  A full rebuild is usually worthwhile once this is well
+ *      above 1.
+ */
+float bbt_refit(surface_t* node) ;
+
+/** Rebuild a bounding-box tree from scratch over its current leaves.  The
+ *  root keeps its address, so references to the tree stay valid.  Trees
+ *  that are leaves of the tree stay whole, and become leaves of the new
+ *  tree.
+ *
+ *  @param node the root of the tree, as returned by
+ *      <code>make_bbt_node()</code>.
+ */
+void bbt_rebuild(surface_t* node) ;
+
+/** Determine whether a surface is a bounding-box tree node.
+ *
+ *  @param sfc the surface.
+ *
+ *  @return <code>true</code> if <code>sfc</code> was created by
+ *      <code>make_bbt_node()</code>.
+ */
+bool sfc_is_bbt(surface_t* sfc) ;
+
+/** Get the children of a bounding-box tree node.  Each child is another
+ *  BBT node, a surface from the list the tree was made from, or
+ *  <code>NULL</code>; at least one is not <code>NULL</code>.
+ *
+ *  @param node the node.
+ *  @param left filled with the left child.
+ *  @param right filled with the right child.
+ */
+void bbt_children(surface_t* node, surface_t** left, surface_t** right) ;
+
 /** Determine whether a ray hits a surface in a specified interval;
  *  if so, fill in a hit-record with information about the intersection.
  *
@@ -246,5 +533,63 @@ surface_t* make_bbt_node(list356_t* surfaces) ;
 bool sfc_hit(surface_t* sfc, ray3_t* ray, float t0, float t1, 
         hit_record_t* rec) ;
 
+/** Set up a frustum from its apex and edge directions, computing the
+ *  normals of its sides.
+ *
+ *  @param frustum the frustum to fill in.
+ *  @param apex the point the rays start from.
+ *  @param dir the directions of the edges, in order around the frustum.
+ */
+void frustum_setup(frustum_t* frustum, point3_t* apex, vector3_t dir[4]) ;
+
+/** Determine whether a box may meet a frustum.  The test is conservative:
+ *  some boxes near the edges of the frustum pass without meeting it.
+ *
+ *  @param bbox the box.
+ *  @param frustum the frustum.
+ *
+ *  @return <code>false</code> if no ray in <code>frustum</code> can pass
+ *      through <code>bbox</code>.
+ */
+bool bbox_in_frustum(bbox_t* bbox, frustum_t* frustum) ;
+
+/** Find where to start searching a surface for the closest hit of rays
+ *  inside a frustum.  For the root of a bounding-box tree, this is the
+ *  deepest node of its wide BVH that holds every leaf the frustum may
+ *  meet.
+ *
+ *  @param sfc the surface.
+ *  @param frustum the frustum.
+ *
+ *  @return <code>-1</code> if no ray in <code>frustum</code> can hit
+ *      <code>sfc</code>, <code>0</code> to search all of it, or
+ *      another entry point to pass to <code>sfc_hit_entry()</code>.
+ */
+int sfc_frustum_entry(surface_t* sfc, frustum_t* frustum) ;
+
+/** <code>sfc_hit()</code> for a ray inside a frustum, starting from an
+ *  entry point found for the frustum by <code>sfc_frustum_entry()</code>.
+ *
+ *  @param sfc the surface.
+ *  @param entry the entry point, which is not <code>-1</code>.
+ *  @param ray the ray, which is inside the frustum.
+ *  @param t0 the minimum time for which to consider intersections valid.
+ *  @param t1 the maximum time for which to consider intersections valid.
+ *  @param rec filled in as by <code>sfc_hit()</code>.
+ *
+ *  @return <code>true</code> if <code>ray</code> intersects this surface
+ *      in the interval [t0, t1], <code>false</code> otherwise.
+ */
+bool sfc_hit_entry(surface_t* sfc, int entry, ray3_t* ray, float t0,
+        float t1, hit_record_t* rec) ;
+
+#ifndef NDEBUG
+/** The number of calls to <code>sfc_hit()</code> made by the calling
+ *  thread, including those made while descending bounding-box trees.
+ *  Only available in debug builds.
+ */
+extern __thread unsigned long sfc_hit_count ;
+#endif
+
 
 #endif
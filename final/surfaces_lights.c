@@ -2,7 +2,10 @@
  *
  */
 
+#include <math.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef __MACOSX__
 #include <OpenGL/gl.h>
@@ -19,6 +22,7 @@
 #include "debug.h"
 #include "color.h"
 #include "surface.h"
+#include "tracer.h"
 
 // Camera frame data.
 point3_t eye_position = {4.0f, -4.0f, 7.0f} ;
@@ -45,16 +49,12 @@ color_t PURPLE = {.5f, .2f, .5f} ;
 color_t GOLD = {255.0f/255, 215.0f/255, 0.0f} ;
 color_t GREENISH = {1, .70f, 1} ;
 
-void rg(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
-    //update eye and look_at positions
-    point3_t eye_position = {4.0f, -4.0f, 8.0f} ;
-    point3_t look_at_point = {4.0f, 4.0f, 1.0f} ;
-    *eye = eye_position;
-    *look_at = look_at_point;
-
-    // Chess board.
-    list356_t* board_surfaces = make_list() ;
-
+/** Add the triangles of an 8x8 chess board, with its top at z=1 and its
+ *  bottom at z=-1, to a list of surfaces.
+ *
+ *  @param board_surfaces the list to add the triangles to.
+ */
+static void add_board(list356_t* board_surfaces) {
     // All the vertices.
     point3_t vertices[85] ;
     for (int x=0; x<9; ++x) {
@@ -120,6 +120,38 @@ void rg(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
                     vertices[indices[3*i+2]],
                     &LIGHT_GREY, &LIGHT_GREY, &WHITE, 10.0f)) ;
     }
+}
+
+/** Add spheres standing in for the chess pieces of add_board() to a list
+ *  of surfaces.
+ *
+ *  @param board_surfaces the list to add the spheres to.
+ */
+static void add_pieces(list356_t* board_surfaces) {
+    // "Pieces"
+    for (int c=0; c<8; ++c) {
+        for (int r=0; r<2; ++r) {
+            surface_t* s = make_sphere(c+.5, r+.5, 1.375+.01, .375,
+                    &BLACK, &BLACK, &WHITE, 100.0f) ;
+            lst_add(board_surfaces, s) ;
+        }
+        for (int r=6; r<8; ++r) {
+            lst_add(board_surfaces, make_sphere(c+.5, r+.5, 1.25, .25,
+                        &WHITE, &WHITE, &WHITE, 100.0f)) ;
+        }
+    }
+}
+
+void rg(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
+    //update eye and look_at positions
+    point3_t eye_position = {4.0f, -4.0f, 8.0f} ;
+    point3_t look_at_point = {4.0f, 4.0f, 1.0f} ;
+    *eye = eye_position;
+    *look_at = look_at_point;
+
+    // Chess board.
+    list356_t* board_surfaces = make_list() ;
+    add_board(board_surfaces) ;
 
     //// "Pieces"
     //for (int c=0; c<8; ++c) {
@@ -171,7 +203,7 @@ void rg(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
     add_sphere(7,3);
     add_sphere(7,4);
 
-    lst_add(surfaces, make_bbt_node(board_surfaces)) ;
+    lst_add(surfaces, make_bvh(board_surfaces)) ;
     lst_free(board_surfaces) ;
 }
 void chess(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
@@ -183,88 +215,83 @@ void chess(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
 
     // Chess board.
     list356_t* board_surfaces = make_list() ;
+    add_board(board_surfaces) ;
+    add_pieces(board_surfaces) ;
 
-    // All the vertices.
-    point3_t vertices[85] ;
-    for (int x=0; x<9; ++x) {
-        for (int y=0; y<9; ++y) {
-            vertices[9*y+x] = (point3_t){x, y, 1} ;
-        }
-    }
-    vertices[81] = (point3_t){0, 0, -1} ;
-    vertices[82] = (point3_t){8, 0, -1} ;
-    vertices[83] = (point3_t){0, 8, -1} ;
-    vertices[84] = (point3_t){8, 8, -1} ;
-
-    int indices[138*3] ;
-    int offset = 0 ;
-
-    // Top of chess board.
-    for (int x=0; x<8; ++x) {
-        for (int y=0; y<8; ++y) {
-            indices[offset++] = 9*y+x ;
-            indices[offset++] = 9*y+x+1 ;
-            indices[offset++] = 9*(y+1)+x+1 ;
-            indices[offset++] = 9*y+x ;
-            indices[offset++] = 9*(y+1)+x+1 ;
-            indices[offset++] = 9*(y+1)+x ;
-        }
-    }
-    int top_offset = offset ;
-
-    // Sides and bottom.
-    indices[offset++] = 81 ; indices[offset++] = 82; indices[offset++] = 8 ;
-    indices[offset++] = 81 ; indices[offset++] = 8; indices[offset++] = 0 ;
+    lst_add(surfaces, make_bvh(board_surfaces)) ;
+    lst_free(board_surfaces) ;
+}
 
-    indices[offset++] = 8 ; indices[offset++] = 82 ; indices[offset++] = 84 ;
-    indices[offset++] = 8 ; indices[offset++] = 84 ; indices[offset++] = 80 ;
+#ifndef BOARD_COPIES
+#define BOARD_COPIES 2
+#endif
 
-    indices[offset++] = 72 ; indices[offset++] = 80 ; indices[offset++] = 84 ;
-    indices[offset++] = 72 ; indices[offset++ ] = 84 ; indices[offset++] = 83 ;
+// The copies of the chess set placed by boards(), which animate_scene()
+// moves.
+static surface_t* board_copies[BOARD_COPIES][BOARD_COPIES] ;
+static bool have_board_copies = false ;
 
-    indices[offset++] = 0 ; indices[offset++] = 72 ; indices[offset++] = 83 ;
-    indices[offset++] = 0 ; indices[offset++] = 83 ; indices[offset++] = 81 ;
+/** Compute the transform that places one copy of the chess set in
+ *  boards().  Each copy is scaled to fit one cell of the grid and turned a
+ *  quarter turn from the previous one, about its own center.  Over an
+ *  animation, alternate rows slide in opposite directions across the
+ *  table and back in from the other side, and every copy spins once.
+ *
+ *  @param i the column of the copy's cell.
+ *  @param j the row of the copy's cell.
+ *  @param time the time in the animation, from 0 to 1.
+ *  @param xfrm filled with the transform, in the form taken by
+ *      <code>make_instance()</code>.
+ */
+static void board_copy_xfrm(int i, int j, float time, float* xfrm) {
+    float size = 1.0f/BOARD_COPIES ;
+    float a = (i + j*BOARD_COPIES)*M_PI/2 + 2*M_PI*time ;
+    float c = size*cos(a) ;
+    float s = size*sin(a) ;
+    float slide = (j%2 == 0 ? 8.0f : -8.0f)*time ;
+    float cx = fmod(8.0f*size*(i+.5f) + slide + 8.0f, 8.0f) ;
+    float cy = 8.0f*size*(j+.5f) ;
+    float m[16] = {
+        c, s, 0, 0,
+        -s, c, 0, 0,
+        0, 0, size, 0,
+        cx - 4*c + 4*s, cy - 4*s - 4*c, 0, 1
+    } ;
+    for (int k=0; k<16; ++k) xfrm[k] = m[k] ;
+}
 
-    indices[offset++] = 81 ; indices[offset++] = 83 ; indices[offset++] =84 ;
-    indices[offset++] = 81 ; indices[offset++] = 84 ; indices[offset++] = 82 ;
-    debug("get_surfaces():  final offset = %d", offset) ;
+/** Copies of the chess set from chess(), arranged in a grid on the table.
+ *  The board and pieces are built into a single bounding-box tree that is
+ *  shared by every copy, so the build time and memory do not grow with the
+ *  number of copies.  BOARD_COPIES is intended to be a preprocessor macro
+ *  giving the number of rows and columns of copies.
+ */
+void boards(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
+    //update eye and look_at positions
+    point3_t eye_position = {4.0f, -4.0f, 7.0f} ;
+    point3_t look_at_point = {4.0f, 4.0f, 1.0f} ;
+    *eye = eye_position;
+    *look_at = look_at_point;
 
-    // Top as triangles.
-    for (int i=0; i<top_offset/3; ++i) {
-        int c = (i/2)%8 ;
-        int r = (i/2)/8 ;
-        int j = r+c ;
-        color_t* color = j%2 == 0 ? &RED : &BLACK ;
-        lst_add(board_surfaces, make_triangle(
-                    vertices[indices[3*i]],
-                    vertices[indices[3*i+1]],
-                    vertices[indices[3*i+2]],
-                    color, color, &WHITE, 10.0f)) ;
-    }
-    // Sides and bottom at triangles.
-    for (int i=top_offset/3; i<offset/3; ++i) {
-        lst_add(board_surfaces, make_triangle(
-                    vertices[indices[3*i]],
-                    vertices[indices[3*i+1]],
-                    vertices[indices[3*i+2]],
-                    &LIGHT_GREY, &LIGHT_GREY, &WHITE, 10.0f)) ;
-    }
+    // One chess set.
+    list356_t* board_surfaces = make_list() ;
+    add_board(board_surfaces) ;
+    add_pieces(board_surfaces) ;
+    surface_t* set = make_bvh(board_surfaces) ;
+    lst_free(board_surfaces) ;
 
-    // "Pieces"
-    for (int c=0; c<8; ++c) {
-        for (int r=0; r<2; ++r) {
-            surface_t* s = make_sphere(c+.5, r+.5, 1.375+.01, .375,
-                    &BLACK, &BLACK, &WHITE, 100.0f) ;
-            lst_add(board_surfaces, s) ;
-        }
-        for (int r=6; r<8; ++r) {
-            lst_add(board_surfaces, make_sphere(c+.5, r+.5, 1.25, .25,
-                        &WHITE, &WHITE, &WHITE, 100.0f)) ;
+    list356_t* copies = make_list() ;
+    for (int i=0; i<BOARD_COPIES; ++i) {
+        for (int j=0; j<BOARD_COPIES; ++j) {
+            float xfrm[16] ;
+            board_copy_xfrm(i, j, 0.0f, xfrm) ;
+            board_copies[i][j] = make_instance(set, xfrm) ;
+            lst_add(copies, board_copies[i][j]) ;
         }
     }
-
-    lst_add(surfaces, make_bbt_node(board_surfaces)) ;
-    lst_free(board_surfaces) ;
+    have_board_copies = true ;
+    lst_add(surfaces, make_bbt_node(copies)) ;
+    lst_free(copies) ;
 }
 
 void cube(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
@@ -316,20 +343,12 @@ void cube(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
                 &PURPLE, &PURPLE, &WHITE, 100.0f)) ;
 
     // Transparent cube.
-    point3_t cube_vertices[] = {
-            {4, 0, 3}, {5, 0, 3}, {4, 1, 3}, {5, 1, 3},
-            {4, 0, 1.01}, {5, 0, 1.01}, {4, 1, 1.01}, {5, 1, 1.01},
-    } ;
-    for (int i=0; i<offset/3; ++i) {
-        surface_t* t = make_triangle(
-                    cube_vertices[indices[3*i]],
-                    cube_vertices[indices[3*i+1]],
-                    cube_vertices[indices[3*i+2]],
-                    &BLACK, &BLACK, &WHITE, 10.0f) ;
-        t->refr_index = 1.1f ;
-        t->atten = &GREENISH ;
-        lst_add(surfaces, t) ;
-    }
+    surface_t* glass = make_box(
+                (point3_t){4, 0, 1.01}, (point3_t){5, 1, 3},
+                &BLACK, &BLACK, &WHITE, 10.0f) ;
+    glass->refr_index = 1.1f ;
+    glass->atten = &GREENISH ;
+    lst_add(surfaces, glass) ;
 
     list356_itr_t* itr = lst_iterator(table_surfaces) ;
     while (lst_has_next(itr)) lst_add(surfaces, lst_next(itr)) ;
@@ -489,8 +508,53 @@ void spheres(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
     plane->refl_color = &DARK_GREY;
     lst_add(surfaces, plane);
     */
-    lst_add(surfaces, make_bbt_node(bbt_surfaces));
+    lst_add(surfaces, make_bvh(bbt_surfaces));
+
+}
 
+#ifndef CLOUD_SPHERES
+#define CLOUD_SPHERES 1000000
+#endif
+
+/** A pseudo-random number generator for cloud(), so that the cloud is the
+ *  same on every run and every platform.
+ *
+ *  @param state the generator's state, advanced by one step.
+ *
+ *  @return a number in [0, 1).
+ */
+static float cloud_random(unsigned int* state) {
+    *state = *state*1664525u + 1013904223u ;
+    return (*state >> 8)/16777216.0f ;
+}
+
+/** A cloud of small spheres over the table, for testing scenes with more
+ *  geometry than fits in memory.  CLOUD_SPHERES is intended to be a
+ *  preprocessor macro giving the number of spheres.
+ */
+void cloud(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
+    //update eye and look_at positions
+    point3_t eye_position = {4.0f, -4.0f, 7.0f} ;
+    point3_t look_at_point = {4.0f, 4.0f, 1.0f} ;
+    *eye = eye_position;
+    *look_at = look_at_point;
+
+    color_t* colors[] = {&RED, &GREEN, &BLUE, &GOLD} ;
+    list356_t* cloud_surfaces = make_list() ;
+    unsigned int state = 1 ;
+    for (int i=0; i<CLOUD_SPHERES; ++i) {
+        float x = 8.0f*cloud_random(&state) ;
+        float y = 8.0f*cloud_random(&state) ;
+        float z = -1.0f + 4.0f*cloud_random(&state) ;
+        float r = .01f + .02f*cloud_random(&state) ;
+        color_t* c = colors[i%4] ;
+        surface_t* s = make_sphere(x, y, z, r, c, c, &WHITE, 100.0f) ;
+        if (i%4 == 3) s->refl_color = &LIGHT_GREY ;
+        lst_add(cloud_surfaces, s) ;
+    }
+
+    lst_add(surfaces, make_bvh(cloud_surfaces)) ;
+    lst_free(cloud_surfaces) ;
 }
 
 void walls(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
@@ -594,20 +658,12 @@ void transcube(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
                 &PURPLE, &PURPLE, &WHITE, 100.0f)) ;
 
     // Transparent cube.
-    point3_t cube_vertices[] = {
-            {4, 0, 3}, {5, 0, 3}, {4, 1, 3}, {5, 1, 3},
-            {4, 0, 1.01}, {5, 0, 1.01}, {4, 1, 1.01}, {5, 1, 1.01},
-    } ;
-    for (int i=0; i<offset/3; ++i) {
-        surface_t* t = make_triangle(
-                    cube_vertices[indices[3*i]],
-                    cube_vertices[indices[3*i+1]],
-                    cube_vertices[indices[3*i+2]],
-                    &BLACK, &BLACK, &WHITE, 10.0f) ;
-        t->refr_index = 1.1f ;
-        t->atten = &GREENISH ;
-        lst_add(surfaces, t) ;
-    }
+    surface_t* glass = make_box(
+                (point3_t){4, 0, 1.01}, (point3_t){5, 1, 3},
+                &BLACK, &BLACK, &WHITE, 10.0f) ;
+    glass->refr_index = 1.1f ;
+    glass->atten = &GREENISH ;
+    lst_add(surfaces, glass) ;
 
     list356_itr_t* itr = lst_iterator(table_surfaces) ;
     while (lst_has_next(itr)) lst_add(surfaces, lst_next(itr)) ;
@@ -624,9 +680,18 @@ void transcube(list356_t* surfaces, point3_t* eye, point3_t* look_at) {
 }
 
 
-/** Create a list of surfaces.
+/** Create the list of surfaces for a scene: a plane at z=-1, and the
+ *  surfaces added by a scene function.
+ *
+ *  @param add the scene function, e.g. <code>chess</code>.
+ *  @param eye passed to <code>add</code>.
+ *  @param look_at passed to <code>add</code>.
+ *
+ *  @return the list of surfaces.
  */
-list356_t* get_surfaces() {
+static list356_t* build_scene(
+        void (*add)(list356_t*, point3_t*, point3_t*),
+        point3_t* eye, point3_t* look_at) {
 
     list356_t* surfaces = make_list() ;
 
@@ -639,13 +704,39 @@ list356_t* get_surfaces() {
     plane->refl_color = &LIGHT_GREY ;
     lst_add(surfaces, plane) ;
 
+    add(surfaces, eye, look_at) ;
+
+    return surfaces ;
+}
+
+/** Create a list of surfaces.
+ */
+list356_t* get_surfaces() {
     // MORE is intended to be preprocessor macro, so that it's meaning
     // can be changed at compile time.  E.g., one compile line might be
     //      $ CPPFLAGS=-DMORE=chess make final
-    MORE(surfaces, &eye_position, &look_at_point) ;
-
-    return surfaces ;
+    return build_scene(MORE, &eye_position, &look_at_point) ;
+}
 
+// The scenes that get_scene_surfaces() knows by name.
+static struct {
+    const char* name ;
+    void (*add)(list356_t*, point3_t*, point3_t*) ;
+} scenes[] = {
+    {"rg", rg}, {"chess", chess}, {"boards", boards}, {"cube", cube},
+    {"sphere3", sphere3}, {"sphere", sphere}, {"spheres", spheres},
+    {"cloud", cloud}, {"walls", walls}, {"transcube", transcube},
+} ;
+
+list356_t* get_scene_surfaces(const char* name, point3_t* eye,
+        point3_t* look_at) {
+    for (size_t i=0; i<sizeof(scenes)/sizeof(scenes[0]); ++i) {
+        if (strcmp(scenes[i].name, name) != 0) continue;
+        *eye = (point3_t){4.0f, -4.0f, 7.0f} ;
+        *look_at = (point3_t){4.0f, 4.0f, 1.0f} ;
+        return build_scene(scenes[i].add, eye, look_at) ;
+    }
+    return NULL ;
 }
 
 /** Create a list of lights.
@@ -653,19 +744,39 @@ list356_t* get_surfaces() {
 list356_t* get_lights() {
     list356_t* lights = make_list() ;
 
-    light_t* l = malloc(sizeof(light_t)) ;
-    l->position = malloc(sizeof(point3_t)) ;
-    *(l->position) = (point3_t){50.0f, 1.0f, 100.0f} ;
-    l->color = malloc(sizeof(color_t)) ;
-    *(l->color) = (color_t){1.0f, 1.0f, 1.0f} ;
-    lst_add(lights, l) ;
+    // AREA_LIGHTS is intended to be a preprocessor macro that replaces the
+    // two lights with area lights of the same color, a sphere and a square
+    // facing down, which cast soft shadows.  E.g.,
+    //      $ CPPFLAGS=-DAREA_LIGHTS make chess
+#ifdef AREA_LIGHTS
+    lst_add(lights, make_sphere_light((point3_t){50.0f, 1.0f, 100.0f}, 8.0f,
+                (color_t){1.0f, 1.0f, 1.0f}, 0.0f)) ;
+    lst_add(lights, make_rect_light((point3_t){4.0f, 12.0f, 20.0f},
+                (vector3_t){6.0f, 0.0f, 0.0f}, (vector3_t){0.0f, 6.0f, 0.0f},
+                (color_t){.2f, .2f, .2f}, 0.0f)) ;
+#else
+    lst_add(lights, make_light(50.0f, 1.0f, 100.0f,
+                (color_t){1.0f, 1.0f, 1.0f}, 0.0f)) ;
+    lst_add(lights, make_light(4.0f, 12.0f, 20.0f,
+                (color_t){.2f, .2f, .2f}, 0.0f)) ;
+#endif
 
-    light_t* l2 = malloc(sizeof(light_t)) ;
-    l2->position = malloc(sizeof(point3_t)) ;
-    *(l2->position) = (point3_t){4.0f, 12.0f, 20.0f} ;
-    l2->color = malloc(sizeof(color_t)) ;
-    *(l2->color) = (color_t){.2f, .2f, .2f} ;
-    lst_add(lights, l2) ;
+    // LIGHT_GRID is intended to be a preprocessor macro giving the number
+    // of rows and columns in a grid of small, dim lights hung over the
+    // table.  E.g., 
+    //      $ CPPFLAGS=-DLIGHT_GRID=16 make chess
+    // adds 256 lights.
+#ifdef LIGHT_GRID
+    for (int i=0; i<LIGHT_GRID; ++i) {
+        for (int j=0; j<LIGHT_GRID; ++j) {
+            float x = -4.0f + 16.0f*(i+.5f)/LIGHT_GRID ;
+            float y = -4.0f + 16.0f*(j+.5f)/LIGHT_GRID ;
+            color_t c = {(i%3 == 0) ? .3f : .1f, (j%3 == 0) ? .3f : .1f,
+                ((i+j)%3 == 0) ? .3f : .1f} ;
+            lst_add(lights, make_light(x, y, 4.0f, c, 6.0f)) ;
+        }
+    }
+#endif
 
     return lights ;
 }
@@ -685,3 +796,24 @@ void set_view_plane(float* dist, float* width, float* height) {
     *width = view_plane_width ;
     *height = view_plane_height ;
 }
+
+void animate_scene(float time, point3_t* eye, point3_t* look_at) {
+    // Swing the eye from side to side about the look-at point.
+    float a = M_PI/8*sin(2*M_PI*time) ;
+    float x = eye_position.x - look_at_point.x ;
+    float y = eye_position.y - look_at_point.y ;
+    eye->x = look_at_point.x + x*cos(a) - y*sin(a) ;
+    eye->y = look_at_point.y + x*sin(a) + y*cos(a) ;
+    eye->z = eye_position.z ;
+    *look_at = look_at_point ;
+
+    if (have_board_copies) {
+        for (int i=0; i<BOARD_COPIES; ++i) {
+            for (int j=0; j<BOARD_COPIES; ++j) {
+                float xfrm[16] ;
+                board_copy_xfrm(i, j, time, xfrm) ;
+                instance_set_xfrm(board_copies[i][j], xfrm) ;
+            }
+        }
+    }
+}
@@ -16,6 +16,20 @@
  */
 list356_t* get_surfaces() ;
 
+/** Get the list of surfaces for a scene given by name, as for
+ *  <code>get_surfaces()</code> with <code>MORE</code> set to that name.
+ *  Each call builds the scene again.
+ *
+ *  @param name the name of the scene, e.g. <code>"chess"</code>.
+ *  @param eye filled with the scene's viewpoint.
+ *  @param look_at filled with the scene's look-at point.
+ *
+ *  @return the list of surfaces, or <code>NULL</code> if there is no
+ *      scene called <code>name</code>.
+ */
+list356_t* get_scene_surfaces(const char* name, point3_t* eye,
+        point3_t* look_at) ;
+
 /** Get a list of lights.  Each element of the list will be of type
  *  <code>light_t*</code>.
  *
@@ -56,4 +70,16 @@ void set_view_data(point3_t* eye, point3_t* look_at, vector3_t* up) ;
  */
 void set_view_plane(float* dist, float* width, float* height) ;
 
+/** Move the scene to a point in an animation.  The eye swings from side
+ *  to side about the look-at point, and scenes with moving surfaces move
+ *  them.  Any bounding-box trees containing moving surfaces must then be
+ *  refitted or rebuilt.
+ *
+ *  @param time the time in the animation, from 0 at the start to 1 at the
+ *      end; the animation loops, so 1 is the same as 0.
+ *  @param eye filled with the viewpoint at <code>time</code>.
+ *  @param look_at filled with the look-at point at <code>time</code>.
+ */
+void animate_scene(float time, point3_t* eye, point3_t* look_at) ;
+
 #endif
@@ -0,0 +1,307 @@
+/** Tile farm functions.
+ *
+ *  @file tile_farm.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "tile_farm.h"
+
+#include "debug.h"
+
+/** The number of tiles each worker is sent ahead of those it has returned.
+ */
+#define TILES_AHEAD 2
+
+/** The bytes of colors in a tile.
+ */
+#define TILE_BYTES (TILE_SIZE*TILE_SIZE*sizeof(color_t))
+
+/** A worker, as seen by the coordinator.
+ */
+typedef struct _worker_t {
+    pid_t pid;
+    /** The coordinator's end of the worker's socket, or -1 once the
+     *  worker has died.
+     */
+    int fd;
+    /** The worker's run of tiles not yet sent, from <code>next</code> up
+     *  to but not including <code>end</code>.
+     */
+    int next, end;
+    /** The tiles sent to the worker and not yet returned.
+     */
+    int sent[TILES_AHEAD];
+    int num_sent;
+} worker_t;
+
+/** Read exactly <code>n</code> bytes.
+ *
+ *  @return <code>false</code> if the other end hung up first.
+ */
+static bool read_all(int fd, void* buf, size_t n) {
+    while (n > 0) {
+        ssize_t r = read(fd, buf, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        buf = (char*)buf + r;
+        n -= r;
+    }
+    return true;
+}
+
+/** Write exactly <code>n</code> bytes.
+ *
+ *  @return <code>false</code> if the other end has hung up.
+ */
+static bool write_all(int fd, const void* buf, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(fd, buf, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        buf = (const char*)buf + w;
+        n -= w;
+    }
+    return true;
+}
+
+/** Render a tile, seeding the random numbers with its index.
+ */
+static void render_seeded(framebuffer_t* frame, int tile,
+        tile_renderer_t render_tile, void* data) {
+    srand48(tile);
+    render_tile(data, frame, tile%frame->tiles_x, tile/frame->tiles_x);
+}
+
+/** Serve tiles to the coordinator until it closes the socket, then exit.
+ */
+static void run_worker(int fd, framebuffer_t* frame,
+        tile_renderer_t render_tile, void* data) {
+    int tile;
+    while (read_all(fd, &tile, sizeof(tile))) {
+        render_seeded(frame, tile, render_tile, data);
+        color_t* pixels = fb_tile(frame, tile%frame->tiles_x,
+                tile/frame->tiles_x);
+        if (!write_all(fd, &tile, sizeof(tile)) ||
+                !write_all(fd, pixels, TILE_BYTES)) {
+            break;
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/** Take the next tile for a worker: from its own run if any is left,
+ *  otherwise from the tiles of dead workers, otherwise from the end of
+ *  the longest run left.
+ *
+ *  @return the tile, or -1 if every tile has been taken.
+ */
+static int take_tile(worker_t* workers, int num_workers, worker_t* w,
+        int* orphans, int* num_orphans) {
+    if (w->next < w->end) return w->next++;
+    if (*num_orphans > 0) return orphans[--*num_orphans];
+
+    worker_t* victim = NULL;
+    for (int i=0; i<num_workers; ++i) {
+        worker_t* v = workers + i;
+        if (v->next < v->end &&
+                (victim == NULL || v->end - v->next > victim->end - victim->next)) {
+            victim = v;
+        }
+    }
+    return victim == NULL ? -1 : --victim->end;
+}
+
+/** Send a worker tiles until it is <code>TILES_AHEAD</code> ahead or
+ *  every tile has been taken.
+ *
+ *  @return <code>false</code> if the worker has hung up.
+ */
+static bool feed_worker(worker_t* workers, int num_workers, worker_t* w,
+        int* orphans, int* num_orphans) {
+    while (w->num_sent < TILES_AHEAD) {
+        int tile = take_tile(workers, num_workers, w, orphans, num_orphans);
+        if (tile < 0) return true;
+        w->sent[w->num_sent++] = tile;
+        if (!write_all(w->fd, &tile, sizeof(tile))) return false;
+    }
+    return true;
+}
+
+/** Reap a dead worker and hand back the tiles it had not returned.
+ */
+static void drop_worker(worker_t* w, int* orphans, int* num_orphans) {
+    fprintf(stderr, "tile farm: worker %d died with %d tiles; "
+            "reassigning them.\n", (int)w->pid, w->num_sent + w->end - w->next);
+    close(w->fd);
+    w->fd = -1;
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, NULL, 0);
+    for (int k=0; k<w->num_sent; ++k) orphans[(*num_orphans)++] = w->sent[k];
+    w->num_sent = 0;
+    // The rest of its run is left to be stolen.
+}
+
+/** Feed every live worker that has room, dropping any that have hung up.
+ *  A worker is otherwise only fed when it returns a tile, so without this
+ *  the workers left idle when another dies would never be sent its tiles.
+ *  If tiles of dead workers are still left over, every live worker is
+ *  full, so they are rendered here rather than waiting.
+ *
+ *  @param num_alive the number of live workers, decremented for each one
+ *      dropped.
+ *
+ *  @return the number of tiles rendered here.
+ */
+static int feed_workers(framebuffer_t* frame, worker_t* workers,
+        int num_workers, int* orphans, int* num_orphans, int* num_alive,
+        tile_renderer_t render_tile, void* data) {
+    bool dropped = true;
+    while (dropped) {
+        dropped = false;
+        for (int i=0; i<num_workers; ++i) {
+            worker_t* w = workers + i;
+            if (w->fd < 0 || w->num_sent == TILES_AHEAD) continue;
+            if (!feed_worker(workers, num_workers, w, orphans, num_orphans)) {
+                drop_worker(w, orphans, num_orphans);
+                --*num_alive;
+                dropped = true;
+            }
+        }
+    }
+
+    int num_done = 0;
+    if (*num_alive == 0) return num_done;
+    while (*num_orphans > 0) {
+        render_seeded(frame, orphans[--*num_orphans], render_tile, data);
+        ++num_done;
+    }
+    return num_done;
+}
+
+void farm_frame(framebuffer_t* frame, int num_workers,
+        tile_renderer_t render_tile, void* data) {
+    int num_tiles = frame->tiles_x*frame->tiles_y;
+    worker_t* workers = calloc(num_workers, sizeof(worker_t));
+    int* orphans = malloc(num_tiles*sizeof(int));
+    int num_orphans = 0;
+
+    // Output buffered before the fork would be written by every worker.
+    fflush(stdout);
+    fflush(stderr);
+
+    int num_alive = 0;
+    for (int i=0; i<num_workers; ++i) {
+        worker_t* w = workers + i;
+        w->next = (long)num_tiles*i/num_workers;
+        w->end = (long)num_tiles*(i+1)/num_workers;
+        w->fd = -1;
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            perror("tile farm");
+            continue;
+        }
+        w->pid = fork();
+        if (w->pid == 0) {
+            close(fds[0]);
+            // Close the coordinator's ends of earlier workers' sockets,
+            // so that they see the coordinator hang up.
+            for (int k=0; k<i; ++k) if (workers[k].fd >= 0) close(workers[k].fd);
+            run_worker(fds[1], frame, render_tile, data);
+        }
+        close(fds[1]);
+        if (w->pid < 0) {
+            perror("tile farm");
+            close(fds[0]);
+            continue;
+        }
+        w->fd = fds[0];
+        ++num_alive;
+    }
+
+    int num_done = feed_workers(frame, workers, num_workers, orphans,
+            &num_orphans, &num_alive, render_tile, data);
+
+    struct pollfd* fds = malloc(num_workers*sizeof(struct pollfd));
+    while (num_alive > 0 && num_done < num_tiles) {
+        for (int i=0; i<num_workers; ++i) {
+            fds[i] = (struct pollfd){workers[i].fd, POLLIN, 0};
+        }
+        if (poll(fds, num_workers, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("tile farm");
+            for (int i=0; i<num_workers; ++i) {
+                if (workers[i].fd >= 0) {
+                    drop_worker(workers + i, orphans, &num_orphans);
+                }
+            }
+            break;
+        }
+
+        bool dropped = false;
+        for (int i=0; i<num_workers; ++i) {
+            worker_t* w = workers + i;
+            if (w->fd < 0 || fds[i].revents == 0) continue;
+
+            // A worker sends a whole tile once it starts, so read it all.
+            int tile;
+            bool ok = read_all(w->fd, &tile, sizeof(tile)) &&
+                w->num_sent > 0 && tile == w->sent[0] &&
+                read_all(w->fd, fb_tile(frame, tile%frame->tiles_x,
+                            tile/frame->tiles_x), TILE_BYTES);
+            if (ok) {
+                ++num_done;
+                memmove(w->sent, w->sent + 1, --w->num_sent*sizeof(int));
+                ok = feed_worker(workers, num_workers, w, orphans,
+                        &num_orphans);
+            }
+            if (!ok) {
+                drop_worker(w, orphans, &num_orphans);
+                --num_alive;
+                dropped = true;
+            }
+        }
+        if (dropped) {
+            num_done += feed_workers(frame, workers, num_workers, orphans,
+                    &num_orphans, &num_alive, render_tile, data);
+        }
+    }
+    free(fds);
+
+    // Render whatever the workers could not.
+    if (num_done < num_tiles) {
+        fprintf(stderr, "tile farm: no workers left; rendering %d tiles "
+                "here.\n", num_tiles - num_done);
+        worker_t self = {0, -1, 0, 0, {0}, 0};
+        int tile;
+        while ((tile = take_tile(workers, num_workers, &self, orphans,
+                        &num_orphans)) >= 0) {
+            render_seeded(frame, tile, render_tile, data);
+        }
+    }
+
+    // Closing the sockets tells the workers to exit.
+    for (int i=0; i<num_workers; ++i) {
+        worker_t* w = workers + i;
+        if (w->fd < 0) continue;
+        close(w->fd);
+        waitpid(w->pid, NULL, 0);
+    }
+    debug("farm_frame(): %d tiles from %d workers.", num_done, num_workers);
+
+    free(orphans);
+    free(workers);
+}
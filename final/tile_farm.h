@@ -0,0 +1,46 @@
+/** @file tile_farm.h Rendering a frame by farming its tiles out to worker
+ *  processes.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  The coordinator and each worker talk over a stream socket.  The
+ *  coordinator sends a tile's index as an <code>int</code>; the worker
+ *  renders the tile and sends back the index followed by the tile's
+ *  <code>TILE_SIZE*TILE_SIZE</code> colors.  A worker exits when its
+ *  socket is closed.
+ */
+
+#ifndef TILE_FARM_H
+#define TILE_FARM_H
+
+#include "framebuffer.h"
+
+/** A function that renders tile (<code>tx</code>, <code>ty</code>) of a
+ *  framebuffer, given the data passed to <code>farm_frame()</code>.
+ */
+typedef void (*tile_renderer_t)(void* data, framebuffer_t* frame, int tx,
+        int ty);
+
+/** Render a frame with worker processes forked for it, so that they
+ *  share the scene and camera as they are when it is called.
+ *
+ *  The tiles are first divided into one run of neighbors per worker.  A
+ *  worker that finishes its run steals tiles from the end of the longest
+ *  run that is left.  Each worker is kept two tiles ahead, so it is
+ *  never idle while the coordinator reads its last tile.  If a worker
+ *  dies, the tiles it had not returned are handed to the others (or
+ *  rendered by the coordinator if none of them has room), and if every
+ *  worker dies the coordinator renders what is left itself.
+ *
+ *  @param frame the framebuffer to fill.
+ *  @param num_workers the number of worker processes.
+ *  @param render_tile the function that renders a tile.  In a worker,
+ *      <code>srand48()</code> is seeded with the tile's index first, so a
+ *      tile renders the same whichever worker renders it.
+ *  @param data passed to <code>render_tile</code>.
+ */
+void farm_frame(framebuffer_t* frame, int num_workers,
+        tile_renderer_t render_tile, void* data);
+
+#endif
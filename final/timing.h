@@ -0,0 +1,36 @@
+/** @file timing.h Wall-clock timing, for reports and budgets.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  Times are taken from the monotonic clock, so that they count time
+ *  spent waiting (e.g. on the disk, or for worker processes) and are not
+ *  thrown off by changes to the time of day.
+ */
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <time.h>
+
+/** Start timing something.
+ *
+ *  @param start filled with the current time.
+ */
+static inline void timer_start(struct timespec* start) {
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/** Get the seconds since a time.
+ *
+ *  @param start a time filled in by <code>timer_start()</code>.
+ *
+ *  @return the seconds since <code>start</code>.
+ */
+static inline double seconds_since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+#endif
@@ -0,0 +1,1196 @@
+/** Ray tracer functions.
+ *
+ *  @file tracer.c
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ * ----CHANGES----
+ *
+ * The tracer was split out of final.c, so that it can be built as a
+ * library without GLUT.  What was global state there is now kept in the
+ * scene, view and options passed to render_frame(), and in a trace_t made
+ * for each frame.
+ *
+ * Changes from the original HW2 Solution Ray Tracer:
+ * Added the following new functions:
+ * get_transparency()
+ * refract()
+ * reflect()
+ * shade_from_light() - lighting from one light, split out of ray_trace().
+ *      Shadows from area lights are scaled by light_visibility().
+ * is_shadowed() - shadow test with a per-light occluder cache.
+ * render_frame() - the trace loop, split out of handle_display().  Renders
+ *      tile by tile into the framebuffer in framebuffer.c, or farms the
+ *      tiles out to worker processes with tile_farm.c.
+ * render_tile() - traces one tile, with rows of viewing rays from
+ *      camera_row().  Viewing rays only search the surfaces the tile's
+ *      frustum reaches, from the entry points found by tile_entries().
+ * tile_closest_hit()
+ * defer_ray() and trace_batch() - secondary rays deferred to a batch and
+ *      traced a generation at a time, sorted with ray_batch.c, when
+ *      ray_batch_size is set.  With OUT_OF_CORE, the rays are queued by
+ *      the page they reach first.
+ * pixel_color()
+ * make_bvh() - bounding-box trees with sphere packets, or out-of-core
+ *      groups.
+ * render_frame() and render_tile() count the rays, hit tests and time for
+ *      each pixel with profile.c when PROFILE_PIXELS is set.
+ * closest_hit() - the closest-hit search, split out of ray_trace().
+ * primary_hits() - fills the g-buffer that render_frame() denoises the
+ *      frame with, using denoise.c, when denoise_passes is set.
+ * material_id()
+ * light_visibility() - the fraction of an area light that a point sees,
+ *      from shadow rays to its edge, and to points over it only where
+ *      those disagree.
+ * area_light_point()
+ *
+ * Slightly modified the following functions:
+ * get_specular_refl() - added in_trans parameter.  Defers the reflected
+ *               ray when secondary rays are batched.
+ * get_transparency() - attenuates by the length of the ray inside the solid,
+ *               rather than searching the scene along the refracted ray.
+ *               Defers its rays when secondary rays are batched.
+ * view_camera() - was win2world(); sets up the camera in camera.c.
+ * ray_trace() - added in_trans parameter and modified shadows for transparent
+ *               objects.  Lights are culled with a light tree, or
+ *               importance-sampled when light_samples is set.
+ *
+ */
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef NDEBUG
+#include <time.h>
+#endif
+
+#include "tracer.h"
+#include "ooc.h"
+#include "sphere_group.h"
+#include "tile_farm.h"
+#include "profile.h"
+#include "denoise.h"
+#include "ray_batch.h"
+
+#include "debug.h"
+
+#define max(a, b) a < b ? b : a
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define EPSILON .001
+
+// Used to add an unscaled color with add_scaled_color().
+static const color_t WHITE_COLOR = {1.0f, 1.0f, 1.0f};
+
+/** The state of the frame being rendered.
+ */
+typedef struct _trace_t {
+    scene_t* scene;
+    render_options_t* options;
+    /** Pixel-step vectors for generating viewing rays.
+     */
+    camera_t camera;
+    /** Shadow occluder cache.  For each light, the last surface that
+     *  blocked a shadow ray to it.  Neighboring pixels are usually
+     *  shadowed by the same surface, so it is tested before the full
+     *  search.
+     */
+    surface_t** occluders;
+    /** The top-level surfaces that the viewing rays of the tile being
+     *  rendered may hit, each with the entry point to search it from; see
+     *  tile_entries().  If tile_culling is off, num_tile_surfaces is -1.
+     */
+    surface_t** tile_surfaces;
+    int* tile_entries;
+    int num_tile_surfaces;
+    /** When secondary rays are batched, the batch that reflection and
+     *  refraction rays are deferred to, and a spare for trace_batch() to
+     *  swap in; otherwise batch is NULL.  pixel and weight are those of
+     *  the ray being traced, which the rays deferred from it inherit.
+     *  If flush_tiles is set, each tile's rays are traced before the
+     *  tile is finished.
+     */
+    ray_batch_t* batch;
+    ray_batch_t* spare_batch;
+    color_t* pixel;
+    color_t weight;
+    bool flush_tiles;
+#ifndef NDEBUG
+    /** Shadow-ray statistics.
+     */
+    unsigned long shadow_rays;
+    unsigned long occluder_cache_hits;
+    unsigned long shadow_hit_tests;
+    /** Tile-culling statistics: the tiles that see no surface, and the
+     *  surfaces searched from below their root.
+     */
+    unsigned long empty_tiles;
+    unsigned long deep_entries;
+    /** Secondary-ray batching statistics.
+     */
+    unsigned long batched_rays;
+    unsigned long batches;
+#endif
+} trace_t;
+
+static color_t ray_trace(trace_t* tr, ray3_t ray, float t0, float t1,
+        int depth, bool in_trans);
+static bool closest_hit(scene_t* scene, ray3_t* ray, float t0, float t1,
+        hit_record_t* closest_hit_rec);
+static bool tile_closest_hit(trace_t* tr, ray3_t* ray, float t0, float t1,
+        hit_record_t* closest_hit_rec);
+static void shade_from_light(trace_t* tr, ray3_t* ray, hit_record_t* hit_rec,
+        light_t* light, float scale, color_t* color);
+static bool is_shadowed(trace_t* tr, ray3_t* light_ray, float light_dist,
+        light_t* light);
+static float light_visibility(trace_t* tr, point3_t* pt, light_t* light);
+static void area_light_point(light_t* light, point3_t* pt, float a, float b,
+        point3_t* out);
+static void defer_ray(trace_t* tr, ray3_t* ray, int depth, bool in_trans,
+        color_t* scale);
+static color_t get_specular_refl(trace_t* tr, ray3_t* ray,
+        hit_record_t* hit_rec, int depth, bool in_trans);
+static color_t get_transparency(trace_t* tr, ray3_t* ray,
+        hit_record_t* hit_rec, int depth, bool in_trans);
+static bool refract(ray3_t* ray, vector3_t* normal, float refr_index,
+        vector3_t* t_vec, bool in_trans);
+static void reflect(ray3_t* i_ray, vector3_t* normal, vector3_t* r_vec);
+static float get_lambert_scale(vector3_t* light_dir, hit_record_t* hit_rec);
+static float get_blinn_phong_scale(ray3_t* ray, vector3_t* light_dir,
+        hit_record_t* hit_rec);
+static void add_scaled_color(color_t* color, const color_t* sfc_color,
+        const color_t* light_color, float scale);
+
+scene_t* make_scene(list356_t* surfaces, list356_t* lights,
+        color_t ambient_light) {
+    scene_t* scene = malloc(sizeof(scene_t));
+    scene->surfaces = surfaces;
+    scene->lights = lights;
+    scene->light_tree = make_light_tree(lights);
+    scene->num_lights = lst_size(lights);
+    for (int i=0; i<scene->num_lights; ++i) {
+        ((light_t*)lst_get(lights, i))->index = i;
+    }
+    scene->ambient_light = ambient_light;
+    return scene;
+}
+
+void scene_free(scene_t* scene) {
+    light_tree_free(scene->light_tree);
+    free(scene);
+}
+
+surface_t* make_bvh(list356_t* surfaces) {
+#ifdef OUT_OF_CORE
+    surface_t* group = make_ooc_group(surfaces, OUT_OF_CORE);
+    if (group != NULL) return group;
+#endif
+    return make_sphere_group(surfaces);
+}
+
+void render_options_init(render_options_t* options) {
+    *options = (render_options_t){
+        .ambient_shading = true,
+        .lambertian_shading = true,
+        .blinn_phong_shading = true,
+        .spec_reflection = true,
+        .transparency = true,
+        .pixel_samples = 1,
+        .light_samples = 0,
+        .max_depth = 5,
+        .workers = 0,
+        .denoise_passes = 0,
+        .shadow_samples = 4,
+        .max_shadow_samples = 32,
+        .tile_culling = true,
+        .ray_batch_size = 0,
+    };
+}
+
+/** Set up a camera for a view.  The camera frame basis is computed from
+ *  the eye point, look-at point, and up direction.  The basic algorithm:
+ *  -# w <- normalized (eye - look_at)
+ *  -# u <- normalized (up x w)
+ *  -# v <- w x u.
+ */
+void view_camera(view_t* view, int width, int height, camera_t* cam) {
+    vector3_t u, v, w;
+    pv_subtract(&view->eye, &view->look_at, &w);
+    normalize(&w);
+
+    cross(&view->up, &w, &u);
+    normalize(&u);
+
+    cross(&w, &u, &v);
+
+    camera_setup(cam, &view->eye, &u, &v, &w, view->plane_dist,
+            view->plane_width, view->plane_height, width, height);
+}
+
+/** Get the shade determined by a given ray.
+ *
+ *  @param tr the frame being rendered.
+ *  @param ray the ray to trace.
+ *  @param t0 the start of the interval for which to get a shade.
+ *  @param t1 the end of the interval for which to get a shade.
+ *  @param depth the maximum number of times a reflect ray will be
+ *      cast for objects with non-NULL reflective color.
+ *  @param in_trans whether the ray is inside a transparent surface or not.
+ *
+ *
+ *  @return the color corresponding to the closest object hit by
+ *      <code>r</code> in the interval <code>[t0, t1]</code>.
+ */
+static color_t ray_trace(trace_t* tr, ray3_t ray, float t0, float t1,
+        int depth, bool in_trans) {
+    assert(depth >= 0);
+
+    scene_t* scene = tr->scene;
+    render_options_t* options = tr->options;
+    color_t color = {0.0, 0.0, 0.0};
+
+    if (depth == 0) return color;
+    PROFILE_RAY();
+
+    hit_record_t closest_hit_rec;
+
+    // Viewing rays, which alone have the full depth, only need to search
+    // what the tile's frustum reaches.
+    bool hit_something = depth == options->max_depth &&
+        tr->num_tile_surfaces >= 0 ?
+        tile_closest_hit(tr, &ray, t0, t1, &closest_hit_rec) :
+        closest_hit(scene, &ray, t0, t1, &closest_hit_rec);
+
+    // If we hit something, color the pixel.
+    if (hit_something) {
+        surface_t* sfc = closest_hit_rec.sfc;
+
+        // Specular reflection.
+        if (options->spec_reflection) {
+          if (sfc->refl_color != NULL) {
+              color_t refl_color = get_specular_refl(tr, &ray,
+                      &closest_hit_rec, depth, in_trans);
+              add_scaled_color(&color, sfc->refl_color, &refl_color, 1.0f);
+          }
+        }
+
+        // Tranparency
+        if (options->transparency) {
+          if (sfc->refr_index != -1) {
+              color_t trans_color = get_transparency(tr, &ray,
+                      &closest_hit_rec, depth, !in_trans);
+              // Only add returned color, don't multiply by a surface_color.
+              color.red += (trans_color.red);
+              color.green += (trans_color.green);
+              color.blue += (trans_color.blue);
+          }
+        }
+
+        // Ambient shading.
+        if (options->ambient_shading) {
+          add_scaled_color(&color, sfc->ambient_color, &scene->ambient_light,
+                  1.0f);
+        }
+
+        // Lighting.
+        bool lighting = options->lambertian_shading ||
+            options->blinn_phong_shading;
+        int light_samples = options->light_samples;
+        if (lighting && light_samples > 0) {
+          // Importance-sample a fixed budget of lights from the light tree
+          // and weight each by the inverse of its probability.
+          for (int i=0; i<light_samples; ++i) {
+              float pdf;
+              light_t* light = light_tree_sample(scene->light_tree,
+                      &closest_hit_rec.hit_pt, drand48(), &pdf);
+              if (light == NULL) continue;
+              shade_from_light(tr, &ray, &closest_hit_rec, light,
+                      1.0f/(light_samples*pdf), &color);
+          }
+        } else if (lighting && scene->num_lights > 0) {
+          // Only lights that can reach the hit point are shaded.  A scene
+          // with no lights is skipped, as a zero-length array is not C.
+          light_t* visible[scene->num_lights];
+          int num_visible = light_tree_query(scene->light_tree,
+                  &closest_hit_rec.hit_pt, visible);
+          for (int i=0; i<num_visible; ++i) {
+              shade_from_light(tr, &ray, &closest_hit_rec, visible[i], 1.0f,
+                      &color);
+          }
+        }
+
+    }   // if (hit_something)
+    return color;
+}
+
+/** Find the closest surface that a ray hits.
+ *
+ *  @param scene the scene.
+ *  @param ray the ray.
+ *  @param t0 the start of the interval to search.
+ *  @param t1 the end of the interval to search.
+ *  @param closest_hit_rec the hit record to fill in with the closest hit.
+ *
+ *  @return <code>true</code> if <code>ray</code> hits a surface in
+ *      <code>[t0, t1]</code>, <code>false</code> otherwise.
+ */
+static bool closest_hit(scene_t* scene, ray3_t* ray, float t0, float t1,
+        hit_record_t* closest_hit_rec) {
+    hit_record_t hit_rec;
+    bool hit_something = false;
+    list356_itr_t* s = lst_iterator(scene->surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        if (PROFILE_SFC_HIT(sfc, ray, t0, t1, &hit_rec)) {
+            if (hit_rec.t < t1) {
+                hit_something = true;
+                memcpy(closest_hit_rec, &hit_rec, sizeof(hit_record_t));
+                t1 = hit_rec.t;
+            }
+            else assert("wrong");
+        }
+    }
+    lst_iterator_free(s);
+    return hit_something;
+}
+
+/** Find the closest surface that a viewing ray of the tile being rendered
+ *  hits, searching only the surfaces its frustum reaches, from their
+ *  entry points.
+ *
+ *  @param tr the frame being rendered.
+ *  @param ray the ray, which is inside the tile's frustum.
+ *  @param t0 the start of the interval to search.
+ *  @param t1 the end of the interval to search.
+ *  @param closest_hit_rec the hit record to fill in with the closest hit.
+ *
+ *  @return <code>true</code> if <code>ray</code> hits a surface in
+ *      <code>[t0, t1]</code>, <code>false</code> otherwise.
+ */
+static bool tile_closest_hit(trace_t* tr, ray3_t* ray, float t0, float t1,
+        hit_record_t* closest_hit_rec) {
+    hit_record_t hit_rec;
+    bool hit_something = false;
+    for (int i=0; i<tr->num_tile_surfaces; ++i) {
+        surface_t* sfc = tr->tile_surfaces[i];
+        bool hit = tr->tile_entries[i] == 0 ?
+            PROFILE_SFC_HIT(sfc, ray, t0, t1, &hit_rec) :
+            sfc_hit_entry(sfc, tr->tile_entries[i], ray, t0, t1, &hit_rec);
+        if (hit && hit_rec.t < t1) {
+            hit_something = true;
+            memcpy(closest_hit_rec, &hit_rec, sizeof(hit_record_t));
+            t1 = hit_rec.t;
+        }
+    }
+    return hit_something;
+}
+
+/** Add the Lambertian and Blinn-Phong shading from a single light to a
+ *  color, unless the light is shadowed.
+ *
+ *  @param tr the frame being rendered.
+ *  @param ray the viewing ray.
+ *  @param hit_rec the hit record for the point being shaded.
+ *  @param light the light.
+ *  @param scale the amount to scale the light's contribution by.
+ *  @param color the color to add the shading to.
+ */
+static void shade_from_light(trace_t* tr, ray3_t* ray, hit_record_t* hit_rec,
+        light_t* light, float scale, color_t* color) {
+    surface_t* sfc = hit_rec->sfc;
+
+    vector3_t light_dir;
+    pv_subtract(light->position, &(hit_rec->hit_pt), &light_dir);
+    normalize(&light_dir);
+
+    float light_dist = dist(&hit_rec->hit_pt, light->position);
+    scale *= light_falloff(light, light_dist);
+    if (scale <= 0) return;
+
+    // Check for global shadows, starting with the last surface that
+    // shadowed this light.
+    if (light->shape == LIGHT_POINT) {
+        ray3_t light_ray = {hit_rec->hit_pt, light_dir};
+        if (is_shadowed(tr, &light_ray, light_dist, light)) return;
+    } else {
+        scale *= light_visibility(tr, &hit_rec->hit_pt, light);
+        if (scale <= 0) return;
+    }
+
+    // Lambertian shading.
+    if (tr->options->lambertian_shading) {
+        float lambert_scale = get_lambert_scale(&light_dir, hit_rec);
+        add_scaled_color(color, sfc->diffuse_color, light->color,
+                scale*lambert_scale);
+    }
+
+    // Blin-Phong shading.
+    if (tr->options->blinn_phong_shading) {
+        float phong_scale = get_blinn_phong_scale(ray, &light_dir, hit_rec);
+        add_scaled_color(color, sfc->spec_color, light->color,
+                scale*phong_scale);
+    }
+}
+
+/** Determine whether a shadow ray is blocked before reaching its light.
+ *  The light's entry in the occluder cache is tested first and updated
+ *  with the blocking surface whenever a full search is needed.
+ *
+ *  @param tr the frame being rendered.
+ *  @param light_ray the shadow ray, from the point being shaded toward
+ *      the light.
+ *  @param light_dist the distance to the light.
+ *  @param light the light.
+ *
+ *  @return <code>true</code> if some surface blocks
+ *      <code>light_ray</code> in the interval [EPSILON, light_dist].
+ */
+static bool is_shadowed(trace_t* tr, ray3_t* light_ray, float light_dist,
+        light_t* light) {
+    hit_record_t shadow_rec;
+#ifndef NDEBUG
+    unsigned long start_count = sfc_hit_count;
+    ++tr->shadow_rays;
+#endif
+    PROFILE_RAY();
+    PROFILE_SHADOW_RAY();
+
+    surface_t* occluder = tr->occluders[light->index];
+    if (occluder != NULL &&
+            sfc_hit(occluder, light_ray, EPSILON, light_dist, &shadow_rec)) {
+#ifndef NDEBUG
+        ++tr->occluder_cache_hits;
+        tr->shadow_hit_tests += sfc_hit_count - start_count;
+#endif
+        return true;
+    }
+
+    bool shadowed = false;
+    list356_itr_t* s = lst_iterator(tr->scene->surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        if (sfc != occluder && PROFILE_SFC_HIT(sfc, light_ray, EPSILON,
+                    light_dist, &shadow_rec)) {
+            // Remember the primitive itself rather than the BBT node
+            // that contains it (or the instance, for instanced
+            // primitives, which cannot be tested against world rays).
+            tr->occluders[light->index] = shadow_rec.world_sfc;
+            shadowed = true;
+            break;
+        }
+    }
+    lst_iterator_free(s);
+
+#ifndef NDEBUG
+    tr->shadow_hit_tests += sfc_hit_count - start_count;
+#endif
+    return shadowed;
+}
+
+/** Get the radical inverse of an integer: its digits in a base, reflected
+ *  about the point.  The inverses of 1, 2, 3, ... in bases 2 and 3 are
+ *  the Halton points, which cover the unit square evenly however many of
+ *  them are taken.
+ *
+ *  @param i the integer.
+ *  @param base the base.
+ *
+ *  @return the radical inverse of <code>i</code>, in [0, 1).
+ */
+static float radical_inverse(int i, int base) {
+    float inv_base = 1.0f/base, f = inv_base, r = 0.0f;
+    for (; i > 0; i /= base, f *= inv_base) r += f*(i % base);
+    return r;
+}
+
+/** Get the fraction of an area light that a point sees.  Shadow rays are
+ *  first cast to shadow_samples points spaced around the edge of the
+ *  light; if they all agree, the point is taken to be fully lit or fully
+ *  shadowed, and that is the answer.  Otherwise the point is in the
+ *  penumbra, and the fraction is found from rays to points spread over
+ *  the whole light, up to max_shadow_samples rays in all, and at least as
+ *  many as there were edge rays; the edge rays see only the rim of the
+ *  light, so they are not part of the fraction.  The points over the
+ *  light are Halton points, which stay spread out however many are
+ *  taken.  Both sets are offset at random for each point being
+ *  shaded, so that neighboring pixels use different ones.
+ *
+ *  @param tr the frame being rendered.
+ *  @param pt the point being shaded.
+ *  @param light the light.
+ *
+ *  @return the fraction of the light that <code>pt</code> sees.
+ */
+static float light_visibility(trace_t* tr, point3_t* pt, light_t* light) {
+    int first = tr->options->shadow_samples > 0 ?
+        tr->options->shadow_samples : 1;
+    // The edge rays only decide whether the point is in the penumbra; the
+    // estimate there comes from the rays after them, so there are at
+    // least as many of those.
+    int most = tr->options->max_shadow_samples > 2*first ?
+        tr->options->max_shadow_samples : 2*first;
+    float du = drand48(), dv = drand48();
+
+    int lit = 0;
+    for (int n=0; n<most; ++n) {
+        if (n == first) {
+            if (lit == 0 || lit == first) return lit > 0 ? 1.0f : 0.0f;
+            lit = 0;
+        }
+
+        float a, b;
+        if (n < first) {
+            // Around the edge: a rim of a sphere, the sides of a
+            // rectangle in turn.
+            float t = (n + du)/first;
+            if (light->shape == LIGHT_SPHERE) {
+                a = 1.0f;
+                b = t;
+            } else {
+                int side = (int)(4*t);
+                float f = 4*t - side;
+                a = side == 0 ? f : side == 1 ? 1.0f : side == 2 ? 1-f : 0.0f;
+                b = side == 0 ? 0.0f : side == 1 ? f : side == 2 ? 1.0f : 1-f;
+            }
+        } else {
+            a = radical_inverse(n-first+1, 2) + du;
+            b = radical_inverse(n-first+1, 3) + dv;
+            a = a < 1.0f ? a : a - 1.0f;
+            b = b < 1.0f ? b : b - 1.0f;
+        }
+        point3_t light_pt;
+        area_light_point(light, pt, a, b, &light_pt);
+
+        ray3_t light_ray = {*pt, {0.0f, 0.0f, 0.0f}};
+        pv_subtract(&light_pt, pt, &light_ray.dir);
+        float light_dist = norm(&light_ray.dir);
+        normalize(&light_ray.dir);
+        if (!is_shadowed(tr, &light_ray, light_dist, light)) ++lit;
+    }
+    return (float)lit/(most - first);
+}
+
+/** Get a point on an area light.  Points on a spherical light are taken
+ *  from the disk of the sphere that faces the point being shaded.
+ *
+ *  @param light the light.
+ *  @param pt the point being shaded.
+ *  @param a the first coordinate of the point on the light, in [0, 1].
+ *  @param b the second coordinate of the point on the light, in [0, 1].
+ *  @param out filled with the point on the light.
+ */
+static void area_light_point(light_t* light, point3_t* pt, float a, float b,
+        point3_t* out) {
+    vector3_t u, v;
+    if (light->shape == LIGHT_RECT) {
+        multiply(&light->edge_u, a - .5f, &u);
+        multiply(&light->edge_v, b - .5f, &v);
+    } else {
+        // An orthonormal basis for the plane facing the point.
+        vector3_t w, axis = {1.0f, 0.0f, 0.0f};
+        pv_subtract(pt, light->position, &w);
+        normalize(&w);
+        if (fabsf(w.x) > .9f) axis = (vector3_t){0.0f, 1.0f, 0.0f};
+        cross(&axis, &w, &u);
+        normalize(&u);
+        cross(&w, &u, &v);
+
+        float r = light->radius*sqrtf(a), theta = 2*M_PI*b;
+        multiply(&u, r*cosf(theta), &u);
+        multiply(&v, r*sinf(theta), &v);
+    }
+    add(&u, &v, &u);
+    pv_add(light->position, &u, out);
+}
+
+/** Get the shade from specular reflection.
+ *
+ * @param tr the frame being rendered.
+ * @param ray the viewing ray.
+ * @param hit_rec the hit record for the point being shaded.
+ * @param depth the current ray-tracing recursion depth.
+ * @param in_trans whether the ray is inside a transparent surface or not.
+ *
+ *  @return the color to add from ideal specular reflection of <code>ray</code>.
+ */
+static color_t get_specular_refl(trace_t* tr, ray3_t* ray,
+        hit_record_t* hit_rec, int depth, bool in_trans) {
+    ray3_t refl_ray;
+    refl_ray.base = hit_rec->hit_pt;
+    refl_ray.dir = hit_rec->normal;
+    multiply(&hit_rec->normal,
+            2*dot(&ray->dir, &hit_rec->normal),
+            &refl_ray.dir);
+    subtract(&ray->dir, &refl_ray.dir, &refl_ray.dir);
+    if (tr->batch != NULL) {
+        defer_ray(tr, &refl_ray, depth-1, in_trans, hit_rec->sfc->refl_color);
+        return (color_t){0.0f, 0.0f, 0.0f};
+    }
+    color_t refl_color = ray_trace(tr, refl_ray, EPSILON, FLT_MAX,
+            depth-1, in_trans);
+    return refl_color;
+}
+
+/**
+ * Get the color from reflection and refraction for transparent objects.
+ *
+ * @param tr the frame being rendered.
+ * @param ray the viewing ray
+ * @param hit_rec the hit record for the point being colored.
+ * @param depth the current ray-tracing recursion depth.
+ * @param in_trans whether the ray is inside a transparent surface or not.
+ *
+ * @return the color to add from transparency of ray.
+ */
+static color_t get_transparency(trace_t* tr, ray3_t* ray,
+        hit_record_t* hit_rec, int depth, bool in_trans) {
+    // Use notation from Shirley and Marschner:
+    // d - ray
+    // n - normal = closest_hit_rec->normal
+    // <i>n></i> - refractive index
+    // t - transformed ray direction
+
+    // Calculate reflected ray refl_ray: r = reflect(d,n).
+    vector3_t normal = hit_rec->normal;
+    vector3_t refl_vector;
+    reflect(ray, &normal, &refl_vector);
+    normalize(&refl_vector);
+    ray3_t refl_ray = { hit_rec->hit_pt, refl_vector };
+
+    // Store locally for cleaner code.
+    surface_t* sfc = hit_rec->sfc;
+    float index = sfc->refr_index;
+
+    // Variables populated in if/else blocks:
+    color_t trans_color;
+    color_t k;
+    float c;
+    vector3_t t_vec;
+
+    // Normalize ray_dir for dot product
+    vector3_t ray_dir = ray->dir;
+    normalize(&ray_dir);
+    if (dot(&ray_dir, &normal) < 0) {
+        // Calculate direction refracted (transformed) ray, t_vec;
+        refract(ray, &normal, index, &t_vec, in_trans);
+        c = ( -1.0f * dot(&ray_dir, &normal));
+        k = (color_t) {1.0f, 1.0f, 1.0f};
+    } else {
+
+        // Intensity of light diminishes by the attenuation constant of the
+        // surface proportionally to the distance the ray of light travels
+        // through the surface.  Every ray inside a transparent solid starts
+        // on its surface (where it was refracted or reflected in), so that
+        // distance is just the length of the ray up to the hit on the far
+        // side; no search of the scene along the refracted ray is needed.
+        float t = dist(&ray->base, &hit_rec->hit_pt);
+
+        // Calculate attenuation.
+        color_t* a = sfc->atten;
+        k = (color_t) {
+            exp(-1.0f * (a->red) * t),
+            exp(-1.0f * (a->green) * t),
+            exp(-1.0f * (a->blue) * t) };
+
+        vector3_t neg_normal; // neg_normal = -n
+        multiply(&normal, -1.0f, &neg_normal);
+        // inv_index = 1/n = 1/refr_index
+        float inv_index = 1.0f/index;
+        if (refract(ray, &neg_normal, inv_index, &t_vec, in_trans)) {
+            c = dot(&t_vec, &normal);
+        } else if (tr->batch != NULL) {
+            defer_ray(tr, &refl_ray, depth-1, !in_trans, &k);
+            return (color_t){0.0f, 0.0f, 0.0f};
+        } else {
+            trans_color = ray_trace(tr, refl_ray, EPSILON, FLT_MAX, depth-1,
+                    !in_trans);
+            trans_color.red = trans_color.red*k.red;
+            trans_color.green = trans_color.green*k.green;
+            trans_color.blue = trans_color.blue*k.blue;
+            return trans_color;
+        }
+    }
+
+    float R0 = (( (index - 1)*(index - 1) )/( (index + 1)*(index + 1) ));
+    float R = (R0 + (1 - R0)*((1 - c)*(1 - c)*(1 - c)*(1 - c)*(1 - c)));
+    color_t trans_color1, trans_color2;
+    ray3_t t_ray = {hit_rec->hit_pt, t_vec};
+
+    if (tr->batch != NULL) {
+        color_t refl_scale = {k.red*R, k.green*R, k.blue*R};
+        color_t t_scale = {k.red*(1.0f - R), k.green*(1.0f - R),
+            k.blue*(1.0f - R)};
+        defer_ray(tr, &refl_ray, depth-1, !in_trans, &refl_scale);
+        defer_ray(tr, &t_ray, depth-1, !in_trans, &t_scale);
+        return (color_t){0.0f, 0.0f, 0.0f};
+    }
+
+    // Recursively ray trace on the reflected ray and the refracted ray.
+    trans_color1 = ray_trace(tr, refl_ray, EPSILON, FLT_MAX, depth-1,
+            !in_trans);
+    trans_color2 = ray_trace(tr, t_ray, EPSILON, FLT_MAX, depth-1,
+            !in_trans);
+
+    // Combine the reflected and refracted ray and return.
+    trans_color.red = k.red*( (R*trans_color1.red) + ((1.0f -
+                    R)*trans_color2.red));
+    trans_color.green = k.green*( (R*trans_color1.green) + ((1.0f -
+                    R)*trans_color2.green));
+    trans_color.blue = k.blue*( (R*trans_color1.blue) + ((1.0f -
+                    R)*trans_color2.blue));
+    return trans_color;
+}
+
+/** Defer a secondary ray of the ray being traced to the batch, to be
+ *  traced later by trace_batch().
+ *
+ *  @param tr the frame being rendered.
+ *  @param ray the secondary ray.
+ *  @param depth the ray-tracing depth left to the secondary ray.
+ *  @param in_trans whether the secondary ray is inside a transparent
+ *      surface.
+ *  @param scale the factor that the color the secondary ray sees is
+ *      scaled by in the color of the ray being traced.
+ */
+static void defer_ray(trace_t* tr, ray3_t* ray, int depth, bool in_trans,
+        color_t* scale) {
+    // ray_trace() would see nothing.
+    if (depth == 0) return;
+    color_t weight = {tr->weight.red*scale->red,
+        tr->weight.green*scale->green, tr->weight.blue*scale->blue};
+    ray_batch_add(tr->batch, ray, &weight, tr->pixel, depth, in_trans);
+}
+
+/** Trace the secondary rays in the batch, and those they spawn, adding
+ *  their colors to their pixels.  The rays are traced a generation at a
+ *  time, each sorted by ray_batch_sort() first, so that rays heading the
+ *  same way from nearby points are traced together.  With OUT_OF_CORE,
+ *  the rays that reach the same out-of-core page first are traced
+ *  together, so the page is loaded once for all of them.
+ *
+ *  @param tr the frame being rendered.
+ */
+static void trace_batch(trace_t* tr) {
+    while (tr->batch->size > 0) {
+        ray_batch_t* batch = tr->batch;
+#ifdef OUT_OF_CORE
+        for (int i=0; i<batch->size; ++i) {
+            batch->rays[i].page = ooc_ray_page(tr->scene->surfaces,
+                    &batch->rays[i].ray, EPSILON);
+        }
+#endif
+        ray_batch_sort(batch);
+#ifndef NDEBUG
+        tr->batched_rays += batch->size;
+        ++tr->batches;
+#endif
+
+        // The rays spawned by this generation go to the spare batch.
+        tr->batch = tr->spare_batch;
+        for (int i=0; i<batch->size; ++i) {
+            batched_ray_t* r = &batch->rays[i];
+            tr->pixel = r->pixel;
+            tr->weight = r->weight;
+            color_t c = ray_trace(tr, r->ray, EPSILON, FLT_MAX, r->depth,
+                    r->in_trans);
+            add_scaled_color(r->pixel, &r->weight, &c, 1.0f);
+        }
+        batch->size = 0;
+        tr->spare_batch = batch;
+    }
+}
+
+/** Get the scale factor for Lambertian (diffuse) shading from a single
+ *  light source.
+ *
+ *  @param light_dir the direction to the light.
+ *  @param hit_rec the hit record for the point being shaded.
+ *
+ *  @return the scale factor to use for Lambertian shading.
+ */
+static float get_lambert_scale(vector3_t* light_dir, hit_record_t* hit_rec) {
+    return max(0.0f, dot(light_dir, &(hit_rec->normal)));
+}
+
+/** Get the scale factor for Blinn-Phong specular highlighting from a
+ *  single light source.
+ *
+ *  @param ray the viewing ray.
+ *  @param light_dir the direction to the light.
+ *  @param hit_rec the hit record for the point being shaded.
+ *
+ *  @return the scale factor to use for Blinn-Phong shading.
+ */
+static float get_blinn_phong_scale(ray3_t* ray, vector3_t* light_dir,
+        hit_record_t* hit_rec) {
+    vector3_t view, half_v;
+    multiply(&ray->dir, -1.0, &view);
+    normalize(&view);
+    add(&view, light_dir, &half_v);
+    normalize(&half_v);
+    float phong_scale = max(0,
+            dot(&half_v, &hit_rec->normal));
+    phong_scale = pow(phong_scale, hit_rec->sfc->phong_exp);
+    return phong_scale;
+}
+
+/** Add a scaled product of surface and light colors to a given color.
+ *  Calling this function has the effect of executing
+ *  <pre>
+ *      color->C += (surface_color->C)*(light_color->C)*scale
+ *  </pre>
+ *  for each color component <code>C</code>.
+ *
+ *  @param color the base color.
+ *  @param sfc_color the surface color.
+ *  @param light_color the light color.
+ *  @param scale the amount to scale the additional color by.
+ */
+static void add_scaled_color(color_t* color, const color_t* sfc_color,
+        const color_t* light_color, float scale) {
+    color->red += (sfc_color->red)*(light_color->red)*scale;
+    color->green += (sfc_color->green)*(light_color->green)*scale;
+    color->blue += (sfc_color->blue)*(light_color->blue)*scale;
+}
+
+/** Get the color of a pixel.
+ *
+ *  @param tr the frame being rendered.
+ *  @param x the column of the pixel.
+ *  @param y the row of the pixel.
+ *  @param dir the direction of the viewing ray through the center of the
+ *      pixel.
+ *
+ *  @return the color of the pixel.
+ */
+static color_t pixel_color(trace_t* tr, int x, int y, vector3_t* dir) {
+    ray3_t ray = {tr->camera.eye, *dir};
+    int pixel_samples = tr->options->pixel_samples;
+    int depth = tr->options->max_depth;
+    float w = pixel_samples <= 1 ? 1.0f : 1.0f/pixel_samples;
+    tr->weight = (color_t){w, w, w};
+
+    //Start ray eye assuming we're not inside a transparent surface.
+    if (pixel_samples <= 1) return ray_trace(tr, ray, 1.0 + EPSILON, FLT_MAX,
+            depth, false);
+
+    // Average rays through jittered positions in the pixel.
+    color_t color = {0.0f, 0.0f, 0.0f};
+    for (int i=0; i<pixel_samples; ++i) {
+        camera_dir(&tr->camera, x + drand48(), y + drand48(), &ray.dir);
+        color_t c = ray_trace(tr, ray, 1.0 + EPSILON, FLT_MAX, depth, false);
+        add_scaled_color(&color, &WHITE_COLOR, &c, 1.0f/pixel_samples);
+    }
+    return color;
+}
+
+/** Find the top-level surfaces that the viewing rays of a tile may hit,
+ *  and where to start searching each, from the frustum of rays through
+ *  the tile.  The frustum takes in half a pixel more on each side than
+ *  the tile, so rounding cannot leave out a surface that a jittered ray
+ *  hits.
+ *
+ *  @param tr the frame being rendered.
+ *  @param x0 the first column of the tile.
+ *  @param y0 the first row of the tile.
+ *  @param cols the number of columns in the tile.
+ *  @param rows the number of rows in the tile.
+ */
+static void tile_entries(trace_t* tr, int x0, int y0, int cols, int rows) {
+    vector3_t dir[4];
+    camera_dir(&tr->camera, x0 - .5f, y0 - .5f, &dir[0]);
+    camera_dir(&tr->camera, x0 + cols + .5f, y0 - .5f, &dir[1]);
+    camera_dir(&tr->camera, x0 + cols + .5f, y0 + rows + .5f, &dir[2]);
+    camera_dir(&tr->camera, x0 - .5f, y0 + rows + .5f, &dir[3]);
+    frustum_t frustum;
+    frustum_setup(&frustum, &tr->camera.eye, dir);
+
+    tr->num_tile_surfaces = 0;
+    list356_itr_t* s = lst_iterator(tr->scene->surfaces);
+    while (lst_has_next(s)) {
+        surface_t* sfc = lst_next(s);
+        int entry = sfc_frustum_entry(sfc, &frustum);
+        if (entry < 0) continue;
+        tr->tile_surfaces[tr->num_tile_surfaces] = sfc;
+        tr->tile_entries[tr->num_tile_surfaces++] = entry;
+#ifndef NDEBUG
+        if (entry > 0) ++tr->deep_entries;
+#endif
+    }
+    lst_iterator_free(s);
+#ifndef NDEBUG
+    if (tr->num_tile_surfaces == 0) ++tr->empty_tiles;
+#endif
+}
+
+/** Trace a view ray through every pixel of a tile and store the colors in
+ *  the framebuffer.
+ *
+ *  @param data the frame being rendered, a <code>trace_t</code>.
+ *  @param frame the framebuffer.
+ *  @param tx the column of the tile.
+ *  @param ty the row of the tile.
+ */
+static void render_tile(void* data, framebuffer_t* frame, int tx, int ty) {
+    trace_t* tr = data;
+    int x0 = tx*TILE_SIZE, y0 = ty*TILE_SIZE;
+    int cols = min(TILE_SIZE, frame->width - x0);
+    int rows = min(TILE_SIZE, frame->height - y0);
+    color_t* tile = fb_tile(frame, tx, ty);
+    if (tr->options->tile_culling) tile_entries(tr, x0, y0, cols, rows);
+
+    // Directions for one row of the tile.
+    float dx[TILE_SIZE], dy[TILE_SIZE], dz[TILE_SIZE];
+
+    for (int j=0; j<rows; ++j) {
+        camera_row(&tr->camera, y0+j, x0, cols, dx, dy, dz);
+        color_t* pixel = tile + j*TILE_SIZE;
+        for (int i=0; i<cols; ++i) {
+            vector3_t dir = {dx[i], dy[i], dz[i]};
+            PROFILE_PIXEL_BEGIN();
+            tr->pixel = &pixel[i];
+            pixel[i] = pixel_color(tr, x0+i, y0+j, &dir);
+            PROFILE_PIXEL_END(x0+i, y0+j);
+        }
+    }
+
+    // The secondary rays deferred from the tile's pixels.
+    if (tr->batch != NULL && (tr->flush_tiles ||
+                tr->batch->size >= tr->options->ray_batch_size)) {
+        trace_batch(tr);
+    }
+}
+
+/** Hash a value into a material id.
+ *
+ *  @param h the hash so far.
+ *  @param data the value.
+ *  @param size the size of the value in bytes.
+ *
+ *  @return the new hash.
+ */
+static uint32_t hash_bytes(uint32_t h, const void* data, size_t size) {
+    const unsigned char* p = data;
+    for (size_t i=0; i<size; ++i) h = (h ^ p[i])*16777619u;
+    return h;
+}
+
+/** Get the material id of a surface for the g-buffer: a hash of the
+ *  colors and coefficients that shade it, so that surfaces that look
+ *  alike, such as the triangles of one mesh, share an id.
+ *
+ *  @param sfc the surface.
+ *
+ *  @return the id, below 2<sup>24</sup>.
+ */
+static float material_id(surface_t* sfc) {
+    static const color_t none = {-1.0f, -1.0f, -1.0f};
+    const color_t* colors[] = {sfc->diffuse_color, sfc->ambient_color,
+        sfc->spec_color, sfc->refl_color, sfc->atten};
+    uint32_t h = 2166136261u;
+    for (size_t i=0; i<sizeof(colors)/sizeof(colors[0]); ++i) {
+        h = hash_bytes(h, colors[i] != NULL ? colors[i] : &none,
+                sizeof(color_t));
+    }
+    h = hash_bytes(h, &sfc->phong_exp, sizeof(float));
+    h = hash_bytes(h, &sfc->refr_index, sizeof(float));
+    return (float)(h & 0xffffff);
+}
+
+/** Trace a view ray through the center of every pixel and record the
+ *  first surface it hits in a g-buffer.
+ *
+ *  @param tr the frame being rendered.
+ *  @param g the g-buffer, the size of the frame.
+ */
+static void primary_hits(trace_t* tr, gbuffer_t* g) {
+    float dx[TILE_SIZE], dy[TILE_SIZE], dz[TILE_SIZE];
+    ray3_t ray = {tr->camera.eye, {0.0f, 0.0f, 0.0f}};
+    hit_record_t rec;
+
+    for (int y=0; y<g->height; ++y) {
+        for (int x0=0; x0<g->width; x0+=TILE_SIZE) {
+            int cols = min(TILE_SIZE, g->width - x0);
+            camera_row(&tr->camera, y, x0, cols, dx, dy, dz);
+            for (int i=0; i<cols; ++i) {
+                ray.dir = (vector3_t){dx[i], dy[i], dz[i]};
+                if (!closest_hit(tr->scene, &ray, 1.0 + EPSILON, FLT_MAX,
+                            &rec)) continue;
+                size_t p = (size_t)y*g->width + x0 + i;
+                normalize(&rec.normal);
+                g->normal_x[p] = rec.normal.x;
+                g->normal_y[p] = rec.normal.y;
+                g->normal_z[p] = rec.normal.z;
+                g->depth[p] = rec.t;
+                g->id[p] = material_id(rec.sfc);
+            }
+        }
+    }
+}
+
+/** Trace a view ray through every pixel and store the colors in a
+ *  framebuffer.  Pixels are visited a tile at a time, in the order they
+ *  are stored, or the tiles are farmed out to worker processes.  If
+ *  denoise_passes is set, the first surface seen through each pixel is
+ *  then found again for the denoiser, in this process.
+ */
+void render_frame(scene_t* scene, view_t* view, framebuffer_t* frame,
+        render_options_t* options) {
+    trace_t tr = {
+        .scene = scene,
+        .options = options,
+        .occluders = calloc(scene->num_lights + 1, sizeof(surface_t*)),
+        .tile_surfaces = malloc((lst_size(scene->surfaces) + 1)*
+                sizeof(surface_t*)),
+        .tile_entries = malloc((lst_size(scene->surfaces) + 1)*sizeof(int)),
+        .num_tile_surfaces = -1,
+    };
+    view_camera(view, frame->width, frame->height, &tr.camera);
+
+    vector3_t dir;
+    camera_dir(&tr.camera, frame->width/2.0f, frame->height/2.0f, &dir);
+    debug("render_frame(): center view ray = {(%f, %f, %f), (%f, %f, %f)}.",
+            view->eye.x, view->eye.y, view->eye.z, dir.x, dir.y, dir.z);
+
+    int workers = options->workers;
+    bool batching = options->ray_batch_size > 0;
+#ifdef PROFILE_PIXELS
+    // Counts made in worker processes would be lost, as would the counts
+    // of rays traced after their pixel is finished.
+    workers = 0;
+    batching = false;
+#endif
+    PROFILE_FRAME_BEGIN(frame->width, frame->height);
+
+    // A worker sends each tile back as soon as it is rendered, so its
+    // batches cannot span tiles.
+    if (batching) {
+        tr.batch = make_ray_batch();
+        tr.spare_batch = make_ray_batch();
+        tr.flush_tiles = workers > 0;
+    }
+
+    if (workers > 0) {
+        farm_frame(frame, workers, render_tile, &tr);
+    } else {
+        for (int ty=0; ty<frame->tiles_y; ++ty) {
+            for (int tx=0; tx<frame->tiles_x; ++tx) {
+                render_tile(&tr, frame, tx, ty);
+            }
+        }
+        if (batching) trace_batch(&tr);
+    }
+
+    if (options->denoise_passes > 0) {
+#ifndef NDEBUG
+        clock_t start_time = clock();
+#endif
+        gbuffer_t* g = make_gbuffer(frame->width, frame->height);
+        primary_hits(&tr, g);
+        denoise_frame(frame, g, options->denoise_passes);
+        gbuffer_free(g);
+#ifndef NDEBUG
+        debug("render_frame(): denoised in %f sec.",
+                ((double)(clock()-start_time))/CLOCKS_PER_SEC);
+#endif
+    }
+
+    debug("render_frame(): %lu of %d tiles see no surface, %lu surfaces "
+            "searched from below their root.", tr.empty_tiles,
+            frame->tiles_x*frame->tiles_y, tr.deep_entries);
+    debug("render_frame(): %lu shadow rays (%.2f per pixel), %lu occluder "
+            "cache hits (%.1f%%), %lu shadow hit tests.", tr.shadow_rays,
+            (double)tr.shadow_rays/(frame->width*frame->height),
+            tr.occluder_cache_hits, tr.shadow_rays ?
+            100.0*tr.occluder_cache_hits/tr.shadow_rays : 0.0,
+            tr.shadow_hit_tests);
+    debug("render_frame(): %lu secondary rays traced in %lu sorted batches.",
+            tr.batched_rays, tr.batches);
+    free(tr.occluders);
+    free(tr.tile_surfaces);
+    free(tr.tile_entries);
+    ray_batch_free(tr.batch);
+    ray_batch_free(tr.spare_batch);
+}
+
+/**
+ * refract - Calculates the refracted ray and store it at t_ray. If there is
+ * total internal reflection return false and do not store anything at t_ray,
+ * otherwise return true.
+ *
+ * This assumes the other surface refr_index == 1.0 (like air) as we assume
+ * all surfaces are surrounded by air.
+ *
+ * @param ray - the ray that is hitting the surface
+ * @param normal - the normal vector of the surface
+ * @param refr_index - the refractive index of the surface
+ * @param t_vec - location where to store the direction of transformed ray.
+ */
+static bool refract(ray3_t* ray, vector3_t* normal, float refr_index,
+        vector3_t* t_vec, bool in_trans) {
+    // Notation from Shirley and Marschner page 305.
+    // Calculate part 2 first, and check for total internal reflection.
+
+    vector3_t* d = &ray->dir;
+    vector3_t* n = normal;
+    normalize(d);
+    normalize(n);
+
+    float d_dot_n = dot(d, n);
+    float d_dot_n2 = d_dot_n * d_dot_n;
+
+    // Refraction index ratio:
+    float refr_ratio;
+    // Assume objects are surrounded by air with index 1.0. As we move between
+    // transparent and non transparent surfaces our ratio is either refr_index
+    // or 1/refr_index.
+    if (!in_trans) refr_ratio = refr_index;
+    else refr_ratio = 1.0f/refr_index;
+
+    float refr_ratio2 = refr_ratio * refr_ratio;
+
+    // Part 2: (1 - n^2(1 - d_dot_n^2)/1)
+    float under_sqrt = (1.0f - refr_ratio2*(1 - d_dot_n2));
+    if (under_sqrt < 0) {
+        // Total internal reflection.
+        return false;
+    }
+
+    vector3_t part2;
+    multiply(n, sqrt(under_sqrt), &part2);
+
+    // Part 1: n(d - n(d dot n)
+    vector3_t ndn, d_minus_ndn, part1;
+    // d - n(d (dot) n)
+    multiply(n, d_dot_n, &ndn);
+    subtract(d, &ndn, &d_minus_ndn);
+
+    multiply(&d_minus_ndn, refr_ratio, &part1);
+
+    // Store part1 - part2 at t_ray, return true.
+    subtract(&part1, &part2, t_vec);
+    normalize(t_vec);
+    return true;
+}
+
+/**
+ * Calculate the direction of a reflected ray off of a surface.
+ *
+ * @param i_ray - the incoming incident ray.
+ * @param normal - the normal vector of the surface.
+ * @param r_vec - the vector to store the reflected ray's direction at.
+ */
+static void reflect(ray3_t* i_ray, vector3_t* normal, vector3_t* r_vec) {
+    // Let v = incident vector, n = normal vector
+    // Reflection vector = v - 2(v dot n)n
+    vector3_t v = i_ray->dir;
+    vector3_t tmp;
+
+    // 2 * (v dot n) n
+    multiply(normal, (2.0f*dot(&v, normal)), &tmp);
+
+    subtract(&v, &tmp, r_vec);
+}
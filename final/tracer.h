@@ -0,0 +1,170 @@
+/** @file tracer.h The ray tracer: scenes, bounding-volume hierarchies and
+ *  rendering into a framebuffer, with no window system or GL.
+ *
+ *  Evan Carmi (WesID: 807136)
+ *  ecarmi@wesleyan.edu
+ *
+ *  The tracer keeps no state of its own between calls; everything a frame
+ *  needs is in the scene, view and options passed to
+ *  <code>render_frame()</code>.  It is built into
+ *  <code>libtracer.a</code> for programs other than the ray tracer's own
+ *  front ends.
+ *
+ *  Besides the front ends in this directory, hw2/2b's hw2bp1 renders its
+ *  scene with the tracer; its own <code>ray_color()</code> and surface
+ *  types are kept, as handed in, in hw2/2b/solution.
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <stdbool.h>
+
+#include "list356.h"
+#include "geom356.h"
+
+#include "color.h"
+#include "surface.h"
+#include "light_tree.h"
+#include "camera.h"
+#include "framebuffer.h"
+
+/** A scene: surfaces, and lights to shade them with.
+ */
+typedef struct _scene_t {
+    /** The surfaces.  Each is hit-tested against every ray, so large
+     *  groups should be made into one surface with <code>make_bvh()</code>.
+     */
+    list356_t* surfaces;
+    /** The lights, with a light tree over them.
+     */
+    list356_t* lights;
+    light_node_t* light_tree;
+    int num_lights;
+    /** The color of the ambient light.
+     */
+    color_t ambient_light;
+} scene_t;
+
+/** A view of a scene.
+ */
+typedef struct _view_t {
+    /** The viewpoint, look-at point and world-frame up direction.
+     */
+    point3_t eye, look_at;
+    vector3_t up;
+    /** The distance from the viewpoint to the view plane, and the width
+     *  and height of the view plane.
+     */
+    float plane_dist, plane_width, plane_height;
+} view_t;
+
+/** Options for rendering a frame.
+ */
+typedef struct _render_options_t {
+    /** The shading terms to use.
+     */
+    bool ambient_shading;
+    bool lambertian_shading;
+    bool blinn_phong_shading;
+    bool spec_reflection;
+    bool transparency;
+    /** The number of jittered viewing rays to average per pixel.
+     */
+    int pixel_samples;
+    /** The number of shadow rays to importance-sample per hit; if 0,
+     *  every light that can reach the hit point is shaded.
+     */
+    int light_samples;
+    /** The most rays traced along any path from the eye.
+     */
+    int max_depth;
+    /** The number of worker processes to farm tiles out to; if 0, the
+     *  frame is rendered in this process.
+     */
+    int workers;
+    /** The number of passes of the edge-aware denoiser in denoise.c to
+     *  run over the frame; if 0, the frame is not denoised.
+     */
+    int denoise_passes;
+    /** The number of shadow rays cast to each area light from a point
+     *  being shaded; if they disagree, the point is in the light's
+     *  penumbra, and more are cast, up to max_shadow_samples in all but
+     *  at least shadow_samples more.  Point lights take one shadow ray.
+     */
+    int shadow_samples;
+    int max_shadow_samples;
+    /** Whether to test each tile's frustum of viewing rays against the
+     *  scene first, so that its viewing rays skip the surfaces it cannot
+     *  reach, and start deep in the bounding-box trees of the rest.
+     */
+    bool tile_culling;
+    /** The number of reflection and refraction rays to collect before
+     *  sorting them by direction and origin and tracing them; see
+     *  ray_batch.h.  If 0, they are traced as they are spawned, depth
+     *  first in pixel order.  With worker processes, each tile's rays
+     *  are traced before the tile is sent back, however few.
+     */
+    int ray_batch_size;
+} render_options_t;
+
+/** Create a scene and build a light tree over its lights.  The index of
+ *  each light is set to its position in <code>lights</code>.
+ *
+ *  @param surfaces the surfaces of the scene.
+ *  @param lights the lights of the scene.
+ *  @param ambient_light the color of the ambient light.
+ *
+ *  @return the new scene.  The lists are not copied.
+ */
+scene_t* make_scene(list356_t* surfaces, list356_t* lights,
+        color_t ambient_light);
+
+/** Free a scene and its light tree.  The surfaces and lights are not
+ *  freed.
+ *
+ *  @param scene the scene.
+ */
+void scene_free(scene_t* scene);
+
+/** Make a group of surfaces into one surface: a bounding-box tree over
+ *  the surfaces, with spheres packed into SIMD packets, or, if OUT_OF_CORE
+ *  is defined as the name of a directory, an out-of-core group whose
+ *  pages are kept in a page file there, reused by later runs.  E.g.,
+ *      $ CPPFLAGS=-DOUT_OF_CORE='"/tmp"' make cloud
+ *
+ *  @param surfaces the surfaces of the group.  The list is not freed.
+ *
+ *  @return the surface for the group.
+ */
+surface_t* make_bvh(list356_t* surfaces);
+
+/** Set options to their defaults: every shading term, one viewing ray
+ *  per pixel, every light shaded, a depth of 5, no workers, no
+ *  denoising, 4 to 32 shadow rays per area light, tile culling, and
+ *  secondary rays traced as they are spawned.
+ *
+ *  @param options the options to set.
+ */
+void render_options_init(render_options_t* options);
+
+/** Set up a camera for a view of a framebuffer.
+ *
+ *  @param view the view.
+ *  @param width the width of the framebuffer in pixels.
+ *  @param height the height of the framebuffer in pixels.
+ *  @param cam the camera to fill in.
+ */
+void view_camera(view_t* view, int width, int height, camera_t* cam);
+
+/** Render a view of a scene into a framebuffer.
+ *
+ *  @param scene the scene.
+ *  @param view the view.
+ *  @param frame the framebuffer to fill.
+ *  @param options the rendering options.
+ */
+void render_frame(scene_t* scene, view_t* view, framebuffer_t* frame,
+        render_options_t* options);
+
+#endif
@@ -70,12 +70,8 @@ list356_t* get_surfaces() {
  */
 list356_t* get_lights() {
     list356_t* lights = make_list() ;
-    light_t* l = malloc(sizeof(light_t)) ;
-    l->position = malloc(sizeof(point3_t)) ;
-    *(l->position) = (point3_t){50.0f, 50.0f, -50.0f} ;
-    l->color = malloc(sizeof(color_t)) ;
-    *(l->color) = (color_t){.75f, .75f, .75f} ;
-    lst_add(lights, l) ;
+    lst_add(lights, make_light(50.0f, 50.0f, -50.0f,
+                (color_t){.75f, .75f, .75f}, 0.0f)) ;
 
     return lights ;
 }